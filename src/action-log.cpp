@@ -47,12 +47,15 @@ CREATE TABLE ActionLog (                                                \n\
     file_ctime  TIMESTAMP,                                              \n\
     file_chmod  INTEGER,                                                \n\
     file_seg_num INTEGER, /* NULL if action is \"delete\" */            \n\
+    file_seg_size INTEGER, /* NULL if not known */                      \n\
+    file_chunked INTEGER, /* NULL if segments carry file content */     \n\
+    file_manifest_hash BLOB, /* NULL if the manifest is not published */ \n\
+    file_digest_segments INTEGER, /* NULL if segments are signed */     \n\
                                                                         \n\
     parent_device_name BLOB,                                            \n\
     parent_seq_no      INTEGER,                                         \n\
                                                                         \n\
     action_name	     TEXT,                                              \n\
-    action_content_object BLOB,                                         \n\
                                                                         \n\
     PRIMARY KEY (device_name, seq_no)                                   \n\
 );                                                                      \n\
@@ -61,28 +64,55 @@ CREATE INDEX ActionLog_filename_version ON ActionLog (filename,version);
 CREATE INDEX ActionLog_parent ON ActionLog (parent_device_name, parent_seq_no);   \n\
 CREATE INDEX ActionLog_action_name ON ActionLog (action_name);          \n\
 CREATE INDEX ActionLog_filename_version_hash ON ActionLog (filename,version,file_hash); \n\
-                                                                        \n\
-CREATE TRIGGER ActionLogInsert_trigger                                  \n\
-    AFTER INSERT ON ActionLog                                           \n\
-    FOR EACH ROW                                                        \n\
-    WHEN (SELECT device_name                                            \n\
-            FROM ActionLog                                              \n\
-            WHERE filename=NEW.filename AND                             \n\
-                  version > NEW.version) IS NULL AND                    \n\
-         (SELECT device_name                                            \n\
-            FROM ActionLog                                              \n\
-            WHERE filename=NEW.filename AND                             \n\
-                  version = NEW.version AND                             \n\
-                  device_name > NEW.device_name) IS NULL                \n\
-    BEGIN                                                               \n\
-        SELECT apply_action (NEW.device_name, NEW.seq_no,               \
-                             NEW.action,NEW.filename,NEW.version,NEW.file_hash,     \
-                             strftime('%s', NEW.file_atime),strftime('%s', NEW.file_mtime),strftime('%s', NEW.file_ctime), \
-                             NEW.file_chmod, NEW.file_seg_num);         \n\
-                             /* function that applies action and adds record the FileState */ \n\
-    END;                                                                \n\
 ";
 
+// Changes after the initial schema (applied to existing databases as well)
+const std::string UPGRADE_DATABASE = "\
+CREATE INDEX IF NOT EXISTS ActionLog_directory ON ActionLog (directory); \n\
+DROP TRIGGER IF EXISTS ActionLogInsert_trigger;                          \n\
+                                                                         \n\
+/* only the highest pruned seq_no was recorded, which also covered never known actions */ \n\
+DROP TABLE IF EXISTS ActionLogPruned;                                    \n\
+                                                                         \n\
+CREATE TABLE IF NOT EXISTS ActionLogGone (                               \n\
+    device_name BLOB NOT NULL,                                           \n\
+    seq_no      INTEGER NOT NULL,                                        \n\
+                                                                         \n\
+    PRIMARY KEY (device_name, seq_no)                                    \n\
+) WITHOUT ROWID;                                                         \n\
+                                                                         \n\
+CREATE TABLE IF NOT EXISTS ActionContent (                               \n\
+    device_name BLOB NOT NULL,                                           \n\
+    seq_no      INTEGER NOT NULL,                                        \n\
+                                                                         \n\
+    action_content_object BLOB NOT NULL,                                 \n\
+                                                                         \n\
+    PRIMARY KEY (device_name, seq_no)                                    \n\
+);                                                                       \n\
+";
+
+// Signed actions used to be stored in ActionLog.action_content_object.  Moving them to
+// ActionContent keeps ActionLog rows small for history queries.  Runs once, for databases
+// created with the column (schema version 0).
+const std::string MOVE_ACTION_CONTENT = "\
+BEGIN TRANSACTION;                                                       \n\
+INSERT OR IGNORE INTO ActionContent (device_name, seq_no, action_content_object) \n\
+    SELECT device_name, seq_no, action_content_object FROM ActionLog     \n\
+        WHERE action_content_object IS NOT NULL;                         \n\
+UPDATE ActionLog SET action_content_object=NULL                          \n\
+    WHERE action_content_object IS NOT NULL;                             \n\
+COMMIT;                                                                  \n\
+";
+
+// Maximum number of files in the in-memory index of latest versions
+const size_t LATEST_VERSIONS_LIMIT = 100000;
+
+// Version recorded in PRAGMA user_version after the one-time migrations have been applied
+const int SCHEMA_VERSION = 1;
+
+const int ActionLog::PRUNE_INTERVAL = 600;
+const int ActionLog::PRUNE_BATCH = 100;
+
 // static void
 // xTrace(void*, const char* q)
 // {
@@ -100,37 +130,71 @@ ActionLog::ActionLog(Face& face, const boost::filesystem::path& path, SyncLogPtr
   , m_appName(appName)
   , m_onFileAddedOrChanged(onFileAddedOrChanged)
   , m_onFileRemoved(onFileRemoved)
+  , m_pruneCursor(0)
+  , m_scheduler(face.getIoService())
+  , m_pruneEvent(m_scheduler)
 {
   sqlite3_exec(m_db, "PRAGMA foreign_keys = OFF", NULL, NULL, NULL);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
 
   sqlite3_exec(m_db, INIT_DATABASE.c_str(), NULL, NULL, NULL);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
-
-  int res =
-    sqlite3_create_function(m_db, "apply_action", -1, SQLITE_ANY, reinterpret_cast<void*>(this),
-                            ActionLog::apply_action_xFun, 0, 0);
-  if (res != SQLITE_OK) {
-    BOOST_THROW_EXCEPTION(Error("Cannot create function ``apply_action''"));
+  sqlite3_exec(m_db, UPGRADE_DATABASE.c_str(), NULL, NULL, NULL);
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  // columns added after the initial schema
+  addColumn("ActionLog", "file_seg_size", "INTEGER");
+  addColumn("ActionLog", "file_chunked", "INTEGER");
+  addColumn("ActionLog", "file_manifest_hash", "BLOB");
+  addColumn("ActionLog", "file_digest_segments", "INTEGER");
+  if (getSchemaVersion() < SCHEMA_VERSION) {
+    migrateActionContent();
   }
+  clearStatementCache();
 
   m_fileState = make_shared<FileState>(path);
+
+  // Local actions and FileState changes are committed in one transaction.  Only action-log.db
+  // is synced on commit; file-state.db is brought up to date by recover() if it has lost the
+  // latest commits.  sync-log.db is written only by SyncLog, whose local seq_no is restored
+  // from ActionLog the same way.
+  m_fileState->attachTo(*this, "FileStateDb");
+  if (getStorageProfile().synchronous > StorageProfile::SYNCHRONOUS_NORMAL) {
+    sqlite3_exec(m_db, "PRAGMA FileStateDb.synchronous = NORMAL;", NULL, NULL, NULL);
+  }
+
+  recover();
+
+  schedulePrune(time::seconds(PRUNE_INTERVAL));
 }
 
-std::tuple<sqlite3_int64 /*version*/, BufferPtr /*device name*/, sqlite3_int64 /*seq_no*/>
-ActionLog::GetLatestActionForFile(const std::string& filename)
+void
+ActionLog::migrateActionContent()
 {
-  // check if something already exists
-  sqlite3_stmt* stmt;
-  int res = sqlite3_prepare_v2(m_db, "SELECT version,device_name,seq_no,action "
-                                     "FROM ActionLog "
-                                     "WHERE filename=? ORDER BY version DESC LIMIT 1",
-                               -1, &stmt, 0);
+  if (hasColumn("ActionLog", "action_content_object")) {
+    if (sqlite3_exec(m_db, MOVE_ACTION_CONTENT.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+      _LOG_ERROR("Cannot move action content: " << sqlite3_errmsg(m_db));
+      sqlite3_exec(m_db, "ROLLBACK", NULL, NULL, NULL);
+      return; // retried on the next start
+    }
+    int nMoved = sqlite3_changes(m_db);
+    _LOG_DEBUG("Moved content of " << nMoved << " actions to ActionContent");
 
-  if (res != SQLITE_OK) {
-    BOOST_THROW_EXCEPTION(Error("Some error with GetExistingRecord"));
+    // SQLite does not shrink the file by itself, give the space of the moved content back
+    if (nMoved > 0 && sqlite3_exec(m_db, "VACUUM", NULL, NULL, NULL) != SQLITE_OK) {
+      _LOG_ERROR("Cannot vacuum the database: " << sqlite3_errmsg(m_db));
+    }
   }
 
+  setSchemaVersion(SCHEMA_VERSION);
+}
+
+std::tuple<sqlite3_int64 /*version*/, BufferPtr /*device name*/, sqlite3_int64 /*seq_no*/>
+ActionLog::GetLatestActionForFile(const std::string& filename)
+{
+  // check if something already exists
+  Statement stmt(*this, "SELECT version,device_name,seq_no,action "
+                        "FROM ActionLog "
+                        "WHERE filename=? ORDER BY version DESC LIMIT 1");
   sqlite3_int64 version = -1;
   BufferPtr parent_device_name;
   sqlite3_int64 parent_seq_no = -1;
@@ -146,17 +210,17 @@ ActionLog::GetLatestActionForFile(const std::string& filename)
       parent_seq_no = sqlite3_column_int64(stmt, 2);
     }
   }
-
-  sqlite3_finalize(stmt);
   return std::make_tuple(version, parent_device_name, parent_seq_no);
 }
 
 // local add action. remote action is extracted from content object
 ActionItemPtr
 ActionLog::AddLocalActionUpdate(const std::string& filename, const Buffer& hash, time_t wtime,
-                                int mode, int seg_num)
+                                int mode, int seg_num, int seg_size /*=0*/,
+                                bool chunked /*=false*/, ConstBufferPtr manifest_hash /*=nullptr*/,
+                                bool digest_segments /*=false*/)
 {
-  sqlite3_exec(m_db, "BEGIN TRANSACTION;", 0, 0, 0);
+  beginTransaction();
 
   Block device_name = m_syncLog->GetLocalName().wireEncode();
 
@@ -170,25 +234,17 @@ ActionLog::AddLocalActionUpdate(const std::string& filename, const Buffer& hash,
   tie(version, parent_device_name, parent_seq_no) = GetLatestActionForFile(filename);
   version++;
 
-  sqlite3_stmt* stmt;
-  int res =
-    sqlite3_prepare_v2(m_db,
-                       "INSERT INTO ActionLog "
-                       "(device_name, seq_no, action, filename, version, action_timestamp, "
-                       "file_hash, file_atime, file_mtime, file_ctime, file_chmod, file_seg_num, "
-                       "parent_device_name, parent_seq_no, "
-                       "action_name, action_content_object) "
-                       "VALUES (?, ?, ?, ?, ?, datetime(?, 'unixepoch'),"
-                       "        ?, datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?,?, "
-                       "        ?, ?, "
-                       "        ?, ?);",
-                       -1, &stmt, 0);
-
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
-
-  if (res != SQLITE_OK) {
-    BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
-  }
+  Statement stmt(*this, "INSERT INTO ActionLog "
+                        "(device_name, seq_no, action, filename, version, action_timestamp, "
+                        "file_hash, file_atime, file_mtime, file_ctime, file_chmod, file_seg_num, "
+                        "parent_device_name, parent_seq_no, "
+                        "action_name, file_seg_size, file_chunked, "
+                        "file_manifest_hash, file_digest_segments) "
+                        "VALUES (?, ?, ?, ?, ?, datetime(?, 'unixepoch'),"
+                        "        ?, datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?,?, "
+                        "        ?, ?, "
+                        "        ?, ?, ?, "
+                        "        ?, ?);");
 
   sqlite3_bind_blob(stmt, 1, device_name.wire(), device_name.size(), SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 2, seq_no);
@@ -210,6 +266,19 @@ ActionLog::AddLocalActionUpdate(const std::string& filename, const Buffer& hash,
     sqlite3_bind_int64(stmt, 14, parent_seq_no);
   }
 
+  if (seg_size > 0) {
+    sqlite3_bind_int(stmt, 16, seg_size);
+  }
+  if (chunked) {
+    sqlite3_bind_int(stmt, 17, 1);
+  }
+  if (manifest_hash != nullptr) {
+    sqlite3_bind_blob(stmt, 18, manifest_hash->buf(), manifest_hash->size(), SQLITE_STATIC);
+  }
+  if (digest_segments) {
+    sqlite3_bind_int(stmt, 19, 1);
+  }
+
   ActionItemPtr item = make_shared<ActionItem>();
   item->set_action(ActionItem::UPDATE);
   item->set_filename(filename);
@@ -221,6 +290,18 @@ ActionLog::AddLocalActionUpdate(const std::string& filename, const Buffer& hash,
   // item->set_ctime(ctime);
   item->set_mode(mode);
   item->set_seg_num(seg_num);
+  if (seg_size > 0) {
+    item->set_seg_size(seg_size);
+  }
+  if (chunked) {
+    item->set_chunked(true);
+  }
+  if (manifest_hash != nullptr) {
+    item->set_manifest_hash(manifest_hash->buf(), manifest_hash->size());
+  }
+  if (digest_segments) {
+    item->set_digest_segments(true);
+  }
 
   if (parent_device_name && parent_seq_no > 0) {
     // cout << Name(*parent_device_name) << endl;
@@ -251,32 +332,28 @@ ActionLog::AddLocalActionUpdate(const std::string& filename, const Buffer& hash,
 
   sqlite3_bind_blob(stmt, 15, actionName.wireEncode().wire(), actionName.wireEncode().size(),
                     SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 16, actionData->wireEncode().wire(), actionData->wireEncode().size(),
-                    SQLITE_STATIC);
 
-  sqlite3_step(stmt);
+  if (sqlite3_step(stmt) == SQLITE_DONE) {
+    sqlite3_int64 actionId = sqlite3_last_insert_rowid(m_db);
+    saveActionData(device_name, seq_no, *actionData);
+    applyAction(Buffer(device_name.wire(), device_name.size()), seq_no, *item, actionId);
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
+    // set complete for local file
+    m_fileState->SetFileComplete(filename);
+  }
 
-  sqlite3_finalize(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
   // I had a problem including directory_name assignment as part of the initial insert.
-  sqlite3_prepare_v2(m_db,
-                     "UPDATE ActionLog SET directory=directory_name(filename) WHERE device_name=? AND seq_no=?",
-                     -1, &stmt, 0);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  Statement updateStmt(*this, "UPDATE ActionLog SET directory=directory_name(filename) "
+                              "WHERE device_name=? AND seq_no=?");
 
-  sqlite3_bind_blob(stmt, 1, device_name.wire(), device_name.size(), SQLITE_STATIC);
-  sqlite3_bind_int64(stmt, 2, seq_no);
-  sqlite3_step(stmt);
+  sqlite3_bind_blob(updateStmt, 1, device_name.wire(), device_name.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(updateStmt, 2, seq_no);
+  sqlite3_step(updateStmt);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
-  sqlite3_finalize(stmt);
-
-  sqlite3_exec(m_db, "END TRANSACTION;", 0, 0, 0);
-
-  // set complete for local file
-  m_fileState->SetFileComplete(filename);
+  commitTransaction();
 
   return item;
 }
@@ -293,7 +370,7 @@ ActionLog::AddLocalActionDelete(const std::string& filename)
 {
   _LOG_DEBUG("Adding local action DELETE");
 
-  sqlite3_exec(m_db, "BEGIN TRANSACTION;", 0, 0, 0);
+  beginTransaction();
 
   const Block device_name = m_syncLog->GetLocalName().wireEncode();
   sqlite3_int64 version;
@@ -308,32 +385,22 @@ ActionLog::AddLocalActionDelete(const std::string& filename)
     _LOG_DEBUG("Nothing to delete... [" << filename << "]");
 
     // just in case, remove data from FileState
-    sqlite3_stmt* stmt;
-    sqlite3_prepare_v2(m_db, "DELETE FROM FileState WHERE filename = ? ", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, filename.c_str(), filename.size(), SQLITE_STATIC); // file
-
-    sqlite3_step(stmt);
-
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-
-    sqlite3_finalize(stmt);
+    m_fileState->DeleteFile(filename);
 
-    sqlite3_exec(m_db, "END TRANSACTION;", 0, 0, 0);
+    commitTransaction();
     return ActionItemPtr();
   }
   version++;
 
   sqlite3_int64 seq_no = m_syncLog->GetNextLocalSeqNo();
 
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "INSERT INTO ActionLog "
-                           "(device_name, seq_no, action, filename, version, action_timestamp, "
-                           "parent_device_name, parent_seq_no, "
-                           "action_name, action_content_object) "
-                           "VALUES(?, ?, ?, ?, ?, datetime(?, 'unixepoch'),"
-                           "        ?, ?,"
-                           "        ?, ?)",
-                     -1, &stmt, 0);
+  Statement stmt(*this, "INSERT INTO ActionLog "
+                        "(device_name, seq_no, action, filename, version, action_timestamp, "
+                        "parent_device_name, parent_seq_no, "
+                        "action_name) "
+                        "VALUES(?, ?, ?, ?, ?, datetime(?, 'unixepoch'),"
+                        "        ?, ?,"
+                        "        ?)");
 
   sqlite3_bind_blob(stmt, 1, device_name.wire(), device_name.size(), SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 2, seq_no);
@@ -371,10 +438,12 @@ ActionLog::AddLocalActionDelete(const std::string& filename)
 
   sqlite3_bind_blob(stmt, 9, actionName.wireEncode().wire(), actionName.wireEncode().size(),
                     SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 10, actionData->wireEncode().wire(), actionData->wireEncode().size(),
-                    SQLITE_STATIC);
 
-  sqlite3_step(stmt);
+  if (sqlite3_step(stmt) == SQLITE_DONE) {
+    sqlite3_int64 actionId = sqlite3_last_insert_rowid(m_db);
+    saveActionData(device_name, seq_no, *actionData);
+    applyAction(Buffer(device_name.wire(), device_name.size()), seq_no, *item, actionId);
+  }
 
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
@@ -382,22 +451,16 @@ ActionLog::AddLocalActionDelete(const std::string& filename)
 
   // assign name to the action, serialize action, and create content object
 
-  sqlite3_finalize(stmt);
-
   // I had a problem including directory_name assignment as part of the initial insert.
-  sqlite3_prepare_v2(m_db,
-                     "UPDATE ActionLog SET directory=directory_name(filename) WHERE device_name=? AND seq_no=?",
-                     -1, &stmt, 0);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  Statement updateStmt(*this, "UPDATE ActionLog SET directory=directory_name(filename) "
+                              "WHERE device_name=? AND seq_no=?");
 
-  sqlite3_bind_blob(stmt, 1, device_name.wire(), device_name.size(), SQLITE_STATIC);
-  sqlite3_bind_int64(stmt, 2, seq_no);
-  sqlite3_step(stmt);
+  sqlite3_bind_blob(updateStmt, 1, device_name.wire(), device_name.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(updateStmt, 2, seq_no);
+  sqlite3_step(updateStmt);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
-  sqlite3_finalize(stmt);
-
-  sqlite3_exec(m_db, "END TRANSACTION;", 0, 0, 0);
+  commitTransaction();
 
   return item;
 }
@@ -405,10 +468,8 @@ ActionLog::AddLocalActionDelete(const std::string& filename)
 shared_ptr<Data>
 ActionLog::LookupActionData(const Name& deviceName, sqlite3_int64 seqno)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db,
-                     "SELECT action_content_object FROM ActionLog WHERE device_name=? AND seq_no=?",
-                     -1, &stmt, 0);
+  ReadConnection connection(*this);
+  Statement stmt(connection, "SELECT action_content_object FROM ActionContent WHERE device_name=? AND seq_no=?");
 
   sqlite3_bind_blob(stmt, 1, deviceName.wireEncode().wire(), deviceName.wireEncode().size(),
                     SQLITE_STATIC); // ndn version
@@ -425,9 +486,8 @@ ActionLog::LookupActionData(const Name& deviceName, sqlite3_int64 seqno)
   else {
     _LOG_TRACE("No action found for deviceName [" << deviceName << "] and seqno:" << seqno);
   }
-  // _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK && sqlite3_errcode(m_db) != SQLITE_ROW,
-  // sqlite3_errmsg(m_db));
-  sqlite3_finalize(stmt);
+  // _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK && sqlite3_errcode(connection) != SQLITE_ROW,
+  // sqlite3_errmsg(connection));
 
   return retval;
 }
@@ -447,9 +507,10 @@ ActionLog::LookupAction(const Name& deviceName, sqlite3_int64 seqno)
 shared_ptr<Data>
 ActionLog::LookupActionData(const Name& actionName)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "SELECT action_content_object FROM ActionLog WHERE action_name=?", -1,
-                     &stmt, 0);
+  ReadConnection connection(*this);
+  Statement stmt(connection, "SELECT action_content_object FROM ActionLog "
+                        "  JOIN ActionContent USING (device_name, seq_no) "
+                        "  WHERE action_name=?");
 
   _LOG_DEBUG(actionName);
 
@@ -468,8 +529,7 @@ ActionLog::LookupActionData(const Name& actionName)
   else {
     _LOG_TRACE("No action found for name: " << actionName);
   }
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_ROW, sqlite3_errmsg(m_db));
-  sqlite3_finalize(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_ROW, sqlite3_errmsg(connection));
 
   return retval;
 }
@@ -490,16 +550,15 @@ ActionLog::LookupAction(const Name& actionName)
 FileItemPtr
 ActionLog::LookupAction(const std::string& filename, sqlite3_int64 version, const Buffer& filehash)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db,
-                     "SELECT device_name, seq_no, strftime('%s', file_mtime), file_chmod, file_seg_num, file_hash "
-                     " FROM ActionLog "
-                     " WHERE action = 0 AND "
-                     "       filename=? AND "
-                     "       version=? AND "
-                     "       is_prefix(?, file_hash)=1",
-                     -1, &stmt, 0);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  ReadConnection connection(*this);
+  Statement stmt(connection, "SELECT device_name, seq_no, strftime('%s', file_mtime), file_chmod, file_seg_num, file_hash, "
+                        "       file_seg_size, file_chunked, file_manifest_hash, file_digest_segments "
+                        " FROM ActionLog "
+                        " WHERE action = 0 AND "
+                        "       filename=? AND "
+                        "       version=? AND "
+                        "       is_prefix(?, file_hash)=1");
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
   sqlite3_bind_text(stmt, 1, filename.c_str(), filename.size(), SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 2, version);
@@ -517,23 +576,45 @@ ActionLog::LookupAction(const std::string& filename, sqlite3_int64 version, cons
     fileItem->set_seg_num(sqlite3_column_int64(stmt, 4));
 
     fileItem->set_file_hash(sqlite3_column_blob(stmt, 5), sqlite3_column_bytes(stmt, 5));
+    if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
+      fileItem->set_seg_size(sqlite3_column_int(stmt, 6));
+    }
+    if (sqlite3_column_int(stmt, 7) != 0) {
+      fileItem->set_chunked(true);
+    }
+    if (sqlite3_column_type(stmt, 8) != SQLITE_NULL) {
+      fileItem->set_manifest_hash(sqlite3_column_blob(stmt, 8), sqlite3_column_bytes(stmt, 8));
+    }
+    if (sqlite3_column_int(stmt, 9) != 0) {
+      fileItem->set_digest_segments(true);
+    }
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE || sqlite3_errcode(m_db) != SQLITE_ROW ||
-                    sqlite3_errcode(m_db) != SQLITE_OK,
-                  sqlite3_errmsg(m_db));
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_DONE || sqlite3_errcode(connection) != SQLITE_ROW ||
+                    sqlite3_errcode(connection) != SQLITE_OK,
+                  sqlite3_errmsg(connection));
 
   return fileItem;
 }
 
 
 ActionItemPtr
-ActionLog::AddRemoteAction(const Name& deviceName, sqlite3_int64 seqno, shared_ptr<Data> actionData)
+ActionLog::insertRemoteAction(const Name& deviceName, sqlite3_int64 seqno,
+                              shared_ptr<Data> actionData)
 {
   if (!actionData) {
     _LOG_ERROR("actionData is not valid");
     return ActionItemPtr();
   }
+
+  if (actionData->getContentType() == tlv::ContentType_Nack) {
+    // the publisher has pruned the action, so it can be answered as gone here as well
+    _LOG_DEBUG("Action is gone: [" << deviceName << "] seqno: " << seqno);
+    const Block& deviceNameWire = deviceName.wireEncode();
+    recordActionGone(Buffer(deviceNameWire.wire(), deviceNameWire.size()), seqno);
+    return ActionItemPtr();
+  }
+
   ActionItemPtr action = deserializeMsg<ActionItem>(
     Buffer(actionData->getContent().value(), actionData->getContent().value_size()));
 
@@ -544,18 +625,17 @@ ActionLog::AddRemoteAction(const Name& deviceName, sqlite3_int64 seqno, shared_p
 
   _LOG_DEBUG("AddRemoteAction: [" << deviceName.toUri() << "] seqno: " << seqno);
 
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db,
-                     "INSERT INTO ActionLog "
-                     "(device_name, seq_no, action, filename, version, action_timestamp, "
-                     "file_hash, file_atime, file_mtime, file_ctime, file_chmod, file_seg_num, "
-                     "parent_device_name, parent_seq_no, "
-                     "action_name, action_content_object) "
-                     "VALUES (?, ?, ?, ?, ?, datetime(?, 'unixepoch'),"
-                     "        ?, datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?,?, "
-                     "        ?, ?, "
-                     "        ?, ?);",
-                     -1, &stmt, 0);
+  Statement stmt(*this, "INSERT INTO ActionLog "
+                        "(device_name, seq_no, action, filename, version, action_timestamp, "
+                        "file_hash, file_atime, file_mtime, file_ctime, file_chmod, file_seg_num, "
+                        "parent_device_name, parent_seq_no, "
+                        "action_name, directory, file_seg_size, file_chunked, "
+                        "file_manifest_hash, file_digest_segments) "
+                        "VALUES (?, ?, ?, ?, ?, datetime(?, 'unixepoch'),"
+                        "        ?, datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?,?, "
+                        "        ?, ?, "
+                        "        ?, ?, ?, ?, "
+                        "        ?, ?);");
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
 
   sqlite3_bind_blob(stmt, 1, deviceName.wireEncode().wire(), deviceName.wireEncode().size(),
@@ -577,6 +657,19 @@ ActionLog::AddRemoteAction(const Name& deviceName, sqlite3_int64 seqno, shared_p
 
     sqlite3_bind_int(stmt, 11, action->mode());
     sqlite3_bind_int(stmt, 12, action->seg_num());
+    if (action->has_seg_size()) {
+      sqlite3_bind_int(stmt, 17, action->seg_size());
+    }
+    if (action->chunked()) {
+      sqlite3_bind_int(stmt, 18, 1);
+    }
+    if (action->has_manifest_hash()) {
+      sqlite3_bind_blob(stmt, 19, action->manifest_hash().c_str(), action->manifest_hash().size(),
+                        SQLITE_STATIC);
+    }
+    if (action->digest_segments()) {
+      sqlite3_bind_int(stmt, 20, 1);
+    }
   }
 
   if (action->has_parent_device_name()) {
@@ -590,75 +683,120 @@ ActionLog::AddRemoteAction(const Name& deviceName, sqlite3_int64 seqno, shared_p
 
   sqlite3_bind_blob(stmt, 15, actionName.wireEncode().wire(), actionName.wireEncode().size(),
                     SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 16, actionData->wireEncode().wire(), actionData->wireEncode().size(),
-                    SQLITE_STATIC);
-  sqlite3_step(stmt);
-
-  // if action needs to be applied to file state, the trigger will take care of it
-
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
-  sqlite3_finalize(stmt);
+  // the same as directory_name(filename), NULL for files in the root folder
+  std::string directory =
+    boost::filesystem::path(action->filename()).parent_path().generic_string();
+  if (!directory.empty()) {
+    sqlite3_bind_text(stmt, 16, directory.c_str(), directory.size(), SQLITE_STATIC);
+  }
 
-  // I had a problem including directory_name assignment as part of the initial insert.
-  sqlite3_prepare_v2(m_db,
-                     "UPDATE ActionLog SET directory=directory_name(filename) WHERE device_name=? AND seq_no=?",
-                     -1, &stmt, 0);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  if (sqlite3_step(stmt) == SQLITE_DONE) {
+    sqlite3_int64 actionId = sqlite3_last_insert_rowid(m_db);
+    const Block& deviceNameWire = deviceName.wireEncode();
+    saveActionData(deviceNameWire, seqno, *actionData);
+    applyAction(Buffer(deviceNameWire.wire(), deviceNameWire.size()), seqno, *action, actionId);
+  }
 
-  sqlite3_bind_blob(stmt, 1, deviceName.wireEncode().wire(), deviceName.wireEncode().size(),
-                    SQLITE_STATIC);
-  sqlite3_bind_int64(stmt, 2, seqno);
-  sqlite3_step(stmt);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
-  sqlite3_finalize(stmt);
-
   return action;
 }
 
 ActionItemPtr
-ActionLog::AddRemoteAction(shared_ptr<Data> actionData)
+ActionLog::AddRemoteAction(const Name& deviceName, sqlite3_int64 seqno, shared_ptr<Data> actionData)
+{
+  beginTransaction();
+  ActionItemPtr action = insertRemoteAction(deviceName, seqno, actionData);
+  commitTransaction();
+
+  return action;
+}
+
+bool
+ActionLog::parseActionName(const Name& name, Name& deviceName, sqlite3_int64& seqno)
 {
-  Name name = actionData->getName();
   // action name: /<device_name>/<appname>/action/<shared-folder>/<action-seq>
+  if (name.size() < 4) {
+    _LOG_ERROR("not an action");
+    return false;
+  }
 
-  uint64_t seqno = name.get(-1).toNumber();
+  seqno = name.get(-1).toNumber();
   std::string sharedFolder = name.get(-2).toUri();
 
   if (sharedFolder != m_sharedFolderName) {
     _LOG_ERROR("Action doesn't belong to this shared folder");
-    return ActionItemPtr();
+    return false;
   }
 
   std::string action = name.get(-3).toUri();
 
   if (action != "action") {
     _LOG_ERROR("not an action");
-    return ActionItemPtr();
+    return false;
   }
 
   std::string appName = name.get(-4).toUri();
   if (appName != m_appName) {
     _LOG_ERROR("Action doesn't belong to this application");
-    return ActionItemPtr();
+    return false;
   }
 
-  Name deviceName = name.getSubName(0, name.size() - 4);
+  deviceName = name.getSubName(0, name.size() - 4);
 
   _LOG_DEBUG("From [" << name << "] extracted deviceName: " << deviceName << ", sharedFolder: "
                       << sharedFolder
                       << ", seqno: "
                       << seqno);
+  return true;
+}
+
+ActionItemPtr
+ActionLog::AddRemoteAction(shared_ptr<Data> actionData)
+{
+  Name deviceName;
+  sqlite3_int64 seqno;
+  if (!parseActionName(actionData->getName(), deviceName, seqno)) {
+    return ActionItemPtr();
+  }
 
   return AddRemoteAction(deviceName, seqno, actionData);
 }
 
+std::vector<ActionItemPtr>
+ActionLog::AddRemoteActions(const std::vector<shared_ptr<Data>>& actionData)
+{
+  std::vector<ActionItemPtr> actions;
+  actions.reserve(actionData.size());
+
+  _LOG_DEBUG("AddRemoteActions: " << actionData.size() << " actions");
+
+  // FileState updates made by the trigger are grouped the same way
+  m_fileState->BeginBatch();
+  beginTransaction();
+
+  for (const auto& data : actionData) {
+    Name deviceName;
+    sqlite3_int64 seqno;
+    if (!data || !parseActionName(data->getName(), deviceName, seqno)) {
+      actions.push_back(ActionItemPtr());
+      continue;
+    }
+
+    actions.push_back(insertRemoteAction(deviceName, seqno, data));
+  }
+
+  commitTransaction();
+  m_fileState->CommitBatch();
+
+  return actions;
+}
+
 sqlite3_int64
 ActionLog::LogSize()
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "SELECT count(*) FROM ActionLog", -1, &stmt, 0);
+  Statement stmt(*this, "SELECT count(*) FROM ActionLog");
 
   sqlite3_int64 retval = -1;
   if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -668,6 +806,156 @@ ActionLog::LogSize()
   return retval;
 }
 
+ActionLog::RetentionPolicy::RetentionPolicy()
+  : maxVersions(10)
+  , maxAge(time::days(30))
+{
+}
+
+void
+ActionLog::SetRetentionPolicy(const RetentionPolicy& policy)
+{
+  m_retentionPolicy = policy;
+  m_pruneCursor = 0;
+}
+
+void
+ActionLog::schedulePrune(const time::nanoseconds& delay)
+{
+  m_pruneEvent = m_scheduler.scheduleEvent(delay, [this] {
+    bool hasMore = Prune(PRUNE_BATCH);
+    schedulePrune(hasMore ? time::nanoseconds(time::milliseconds(10))
+                          : time::nanoseconds(time::seconds(PRUNE_INTERVAL)));
+  });
+}
+
+bool
+ActionLog::isActionInFileState(const std::string& filename, const Buffer& deviceName,
+                               sqlite3_int64 seqno)
+{
+  FileItemPtr file = m_fileState->LookupFile(filename);
+  return file && file->seq_no() == static_cast<uint64_t>(seqno) &&
+         file->device_name().size() == deviceName.size() &&
+         std::equal(deviceName.begin(), deviceName.end(), file->device_name().begin());
+}
+
+bool
+ActionLog::Prune(size_t maxActions)
+{
+  if (m_retentionPolicy.maxVersions == 0) {
+    return false;
+  }
+
+  // each step examines at most maxActions rows after the cursor, however few of them qualify
+  sqlite3_int64 lastRowid = 0;
+  bool hasMore = false;
+  {
+    Statement stmt(*this, "SELECT rowid FROM ActionLog WHERE rowid > ? "
+                          "  ORDER BY rowid LIMIT 1 OFFSET ?");
+    sqlite3_bind_int64(stmt, 1, m_pruneCursor);
+    sqlite3_bind_int64(stmt, 2, maxActions - 1);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      lastRowid = sqlite3_column_int64(stmt, 0);
+      hasMore = true;
+    }
+    else {
+      lastRowid = std::numeric_limits<sqlite3_int64>::max();
+    }
+  }
+
+  // candidates have at least maxVersions newer actions for the same file (in the order used by
+  // applyAction) and are older than maxAge
+  Statement stmt(*this,
+                 "SELECT rowid, device_name, seq_no, filename FROM ActionLog a "
+                 "  WHERE rowid > ? AND rowid <= ? AND "
+                 "        (? = 0 OR action_timestamp < datetime('now', ?)) AND "
+                 "        (SELECT 1 FROM ActionLog b "
+                 "           WHERE b.filename = a.filename AND "
+                 "                 (b.version > a.version OR "
+                 "                  (b.version = a.version AND b.device_name > a.device_name)) "
+                 "           LIMIT 1 OFFSET ?) IS NOT NULL "
+                 "  ORDER BY rowid");
+
+  std::string modifier = "-" + std::to_string(m_retentionPolicy.maxAge.count()) + " seconds";
+  sqlite3_bind_int64(stmt, 1, m_pruneCursor);
+  sqlite3_bind_int64(stmt, 2, lastRowid);
+  sqlite3_bind_int64(stmt, 3, m_retentionPolicy.maxAge.count());
+  sqlite3_bind_text(stmt, 4, modifier.c_str(), modifier.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 5, m_retentionPolicy.maxVersions - 1);
+
+  size_t nCandidates = 0;
+  size_t nRemoved = 0;
+
+  beginTransaction();
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    ++nCandidates;
+    sqlite3_int64 rowid = sqlite3_column_int64(stmt, 0);
+
+    Buffer deviceName(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1));
+    sqlite3_int64 seqno = sqlite3_column_int64(stmt, 2);
+    std::string filename(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)),
+                         sqlite3_column_bytes(stmt, 3));
+
+    if (isActionInFileState(filename, deviceName, seqno)) {
+      continue;
+    }
+
+    Statement deleteStmt(*this, "DELETE FROM ActionLog WHERE rowid=?");
+    sqlite3_bind_int64(deleteStmt, 1, rowid);
+    sqlite3_step(deleteStmt);
+    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
+
+    Statement deleteContentStmt(*this,
+                                "DELETE FROM ActionContent WHERE device_name=? AND seq_no=?");
+    sqlite3_bind_blob(deleteContentStmt, 1, deviceName.buf(), deviceName.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(deleteContentStmt, 2, seqno);
+    sqlite3_step(deleteContentStmt);
+    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
+
+    recordActionGone(deviceName, seqno);
+
+    ++nRemoved;
+  }
+  commitTransaction();
+
+  _LOG_DEBUG("Pruned " << nRemoved << " of " << nCandidates << " candidate actions");
+
+  // start the next pass from the beginning once the end is reached
+  m_pruneCursor = hasMore ? lastRowid : 0;
+  return hasMore;
+}
+
+void
+ActionLog::recordActionGone(const Buffer& deviceName, sqlite3_int64 seqno)
+{
+  Statement stmt(*this, "INSERT OR IGNORE INTO ActionLogGone (device_name, seq_no) VALUES (?, ?)");
+  sqlite3_bind_blob(stmt, 1, deviceName.buf(), deviceName.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, seqno);
+  sqlite3_step(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
+}
+
+bool
+ActionLog::IsActionPruned(const Name& deviceName, sqlite3_int64 seqno)
+{
+  Statement stmt(*this, "SELECT 1 FROM ActionLogGone WHERE device_name=? AND seq_no=?");
+
+  const Block& deviceNameWire = deviceName.wireEncode();
+  sqlite3_bind_blob(stmt, 1, deviceNameWire.wire(), deviceNameWire.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, seqno);
+
+  return sqlite3_step(stmt) == SQLITE_ROW;
+}
+
+shared_ptr<Data>
+ActionLog::MakeGoneReply(const Name& actionName)
+{
+  shared_ptr<Data> data = make_shared<Data>(actionName);
+  data->setContentType(tlv::ContentType_Nack);
+  m_keyChain.sign(*data);
+  return data;
+}
+
 bool
 ActionLog::LookupActionsInFolderRecursively(
   const function<void(const Name& name, sqlite3_int64 seq_no, const ActionItem&)>& visitor,
@@ -678,42 +966,42 @@ ActionLog::LookupActionsInFolderRecursively(
   if (limit >= 0)
     limit += 1; // to check if there is more data
 
-  sqlite3_stmt* stmt;
-  if (folder != "") {
-    /// @todo Do something to improve efficiency of this query. Right now it is basically scanning the whole database
-
-    sqlite3_prepare_v2(m_db,
-                       "SELECT device_name,seq_no,action,filename,directory,version,strftime('%s', action_timestamp), "
-                       "       file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num, "
-                       "       parent_device_name,parent_seq_no "
-                       "   FROM ActionLog "
-                       "   WHERE is_dir_prefix (?, directory)=1 "
-                       "   ORDER BY action_timestamp DESC "
-                       "   LIMIT ? OFFSET ?",
-                       -1, &stmt,
-                       0); // there is a small ambiguity with is_prefix matching, but should be ok for now
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  // The folder and its subfolders are a range scan of ActionLog_directory:
+  // [folder, folder + '0'), '0' being the character that follows '/'.  The range also includes
+  // siblings like "folder-1", which are filtered out by the last condition.
+  ReadConnection connection(*this);
+  Statement stmt(connection,
+                 folder != "" ?
+                   "SELECT device_name,seq_no,action,filename,directory,version,strftime('%s', action_timestamp), "
+                   "       file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num, "
+                   "       parent_device_name,parent_seq_no,file_seg_size,file_chunked, "
+                   "       file_manifest_hash,file_digest_segments "
+                   "   FROM ActionLog "
+                   "   WHERE directory >= :folder AND directory < :folder || '0' AND "
+                   "         (directory = :folder OR directory > :folder || '/') "
+                   "   ORDER BY action_timestamp DESC "
+                   "   LIMIT ? OFFSET ?" :
+                   "SELECT device_name,seq_no,action,filename,directory,version,strftime('%s', action_timestamp), "
+                   "       file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num, "
+                   "       parent_device_name,parent_seq_no,file_seg_size,file_chunked, "
+                   "       file_manifest_hash,file_digest_segments "
+                   "   FROM ActionLog "
+                   "   ORDER BY action_timestamp DESC "
+                   "   LIMIT ? OFFSET ?");
 
+  if (folder != "") {
     sqlite3_bind_text(stmt, 1, folder.c_str(), folder.size(), SQLITE_STATIC);
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+    _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
     sqlite3_bind_int(stmt, 2, limit);
     sqlite3_bind_int(stmt, 3, offset);
   }
   else {
-    sqlite3_prepare_v2(m_db,
-                       "SELECT device_name,seq_no,action,filename,directory,version,strftime('%s', action_timestamp), "
-                       "       file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num, "
-                       "       parent_device_name,parent_seq_no "
-                       "   FROM ActionLog "
-                       "   ORDER BY action_timestamp DESC "
-                       "   LIMIT ? OFFSET ?",
-                       -1, &stmt, 0);
     sqlite3_bind_int(stmt, 1, limit);
     sqlite3_bind_int(stmt, 2, offset);
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     if (limit == 1)
@@ -738,6 +1026,18 @@ ActionLog::LookupActionsInFolderRecursively(
       action.set_mtime(sqlite3_column_int(stmt, 8));
       action.set_mode(sqlite3_column_int(stmt, 9));
       action.set_seg_num(sqlite3_column_int64(stmt, 10));
+      if (sqlite3_column_type(stmt, 13) != SQLITE_NULL) {
+        action.set_seg_size(sqlite3_column_int(stmt, 13));
+      }
+      if (sqlite3_column_int(stmt, 14) != 0) {
+        action.set_chunked(true);
+      }
+      if (sqlite3_column_type(stmt, 15) != SQLITE_NULL) {
+        action.set_manifest_hash(sqlite3_column_blob(stmt, 15), sqlite3_column_bytes(stmt, 15));
+      }
+      if (sqlite3_column_int(stmt, 16) != 0) {
+        action.set_digest_segments(true);
+      }
     }
     if (sqlite3_column_bytes(stmt, 11) > 0) {
       action.set_parent_device_name(sqlite3_column_blob(stmt, 11), sqlite3_column_bytes(stmt, 11));
@@ -748,9 +1048,7 @@ ActionLog::LookupActionsInFolderRecursively(
     limit--;
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-
-  sqlite3_finalize(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_DONE, sqlite3_errmsg(connection));
 
   return (limit == 1); // more data is available
 }
@@ -770,26 +1068,24 @@ ActionLog::LookupActionsForFile(
   if (limit >= 0)
     limit += 1; // to check if there is more data
 
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db,
-                     "SELECT device_name,seq_no,action,filename,directory,version,strftime('%s', action_timestamp), "
-                     "       file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num, "
-                     "       parent_device_name,parent_seq_no "
-                     "   FROM ActionLog "
-                     "   WHERE filename=? "
-                     "   ORDER BY action_timestamp DESC "
-                     "   LIMIT ? OFFSET ?",
-                     -1, &stmt,
-                     0); // there is a small ambiguity with is_prefix matching, but should be ok for now
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  ReadConnection connection(*this);
+  Statement stmt(connection, "SELECT device_name,seq_no,action,filename,directory,version,strftime('%s', action_timestamp), "
+                        "       file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num, "
+                        "       parent_device_name,parent_seq_no,file_seg_size,file_chunked, "
+                        "       file_manifest_hash,file_digest_segments "
+                        "   FROM ActionLog "
+                        "   WHERE filename=? "
+                        "   ORDER BY action_timestamp DESC "
+                        "   LIMIT ? OFFSET ?"); // there is a small ambiguity with is_prefix matching, but should be ok for now
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
   sqlite3_bind_text(stmt, 1, file.c_str(), file.size(), SQLITE_STATIC);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
   sqlite3_bind_int(stmt, 2, limit);
   sqlite3_bind_int(stmt, 3, offset);
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     if (limit == 1)
@@ -814,6 +1110,18 @@ ActionLog::LookupActionsForFile(
       action.set_mtime(sqlite3_column_int(stmt, 8));
       action.set_mode(sqlite3_column_int(stmt, 9));
       action.set_seg_num(sqlite3_column_int64(stmt, 10));
+      if (sqlite3_column_type(stmt, 13) != SQLITE_NULL) {
+        action.set_seg_size(sqlite3_column_int(stmt, 13));
+      }
+      if (sqlite3_column_int(stmt, 14) != 0) {
+        action.set_chunked(true);
+      }
+      if (sqlite3_column_type(stmt, 15) != SQLITE_NULL) {
+        action.set_manifest_hash(sqlite3_column_blob(stmt, 15), sqlite3_column_bytes(stmt, 15));
+      }
+      if (sqlite3_column_int(stmt, 16) != 0) {
+        action.set_digest_segments(true);
+      }
     }
     if (sqlite3_column_bytes(stmt, 11) > 0) {
       action.set_parent_device_name(sqlite3_column_blob(stmt, 11), sqlite3_column_bytes(stmt, 11));
@@ -824,9 +1132,7 @@ ActionLog::LookupActionsForFile(
     limit--;
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-
-  sqlite3_finalize(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_DONE, sqlite3_errmsg(connection));
 
   return (limit == 1); // more data is available
 }
@@ -835,20 +1141,17 @@ void
 ActionLog::LookupRecentFileActions(const function<void(const std::string&, int, int)>& visitor,
                                    int limit)
 {
-  sqlite3_stmt* stmt;
-
-  sqlite3_prepare_v2(m_db,
-                     "SELECT AL.filename, AL.action"
-                     "   FROM ActionLog AL"
-                     "   JOIN "
-                     "   (SELECT filename, MAX(action_timestamp) AS action_timestamp "
-                     "       FROM ActionLog "
-                     "       GROUP BY filename ) AS GAL"
-                     "   ON AL.filename = GAL.filename AND AL.action_timestamp = GAL.action_timestamp "
-                     "   ORDER BY AL.action_timestamp DESC "
-                     "   LIMIT ?;",
-                     -1, &stmt, 0);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  ReadConnection connection(*this);
+  Statement stmt(connection, "SELECT AL.filename, AL.action"
+                        "   FROM ActionLog AL"
+                        "   JOIN "
+                        "   (SELECT filename, MAX(action_timestamp) AS action_timestamp "
+                        "       FROM ActionLog "
+                        "       GROUP BY filename ) AS GAL"
+                        "   ON AL.filename = GAL.filename AND AL.action_timestamp = GAL.action_timestamp "
+                        "   ORDER BY AL.action_timestamp DESC "
+                        "   LIMIT ?;");
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
   sqlite3_bind_int(stmt, 1, limit);
   int index = 0;
   while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -859,9 +1162,7 @@ ActionLog::LookupRecentFileActions(const function<void(const std::string&, int,
     index++;
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-
-  sqlite3_finalize(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_DONE, sqlite3_errmsg(connection));
 }
 
 
@@ -870,54 +1171,197 @@ ActionLog::LookupRecentFileActions(const function<void(const std::string&, int,
 ///////////////////////////////////////////////////////////////////////////////////
 
 void
-ActionLog::apply_action_xFun(sqlite3_context* context, int argc, sqlite3_value** argv)
+ActionLog::saveActionData(const Block& deviceName, sqlite3_int64 seqno, const Data& actionData)
 {
-  ActionLog* the = reinterpret_cast<ActionLog*>(sqlite3_user_data(context));
+  Statement stmt(*this, "INSERT OR REPLACE INTO ActionContent "
+                        "(device_name, seq_no, action_content_object) VALUES (?, ?, ?)");
 
-  if (argc != 11) {
-    sqlite3_result_error(context, "``apply_action'' expects 10 arguments", -1);
-    return;
+  sqlite3_bind_blob(stmt, 1, deviceName.wire(), deviceName.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, seqno);
+  sqlite3_bind_blob(stmt, 3, actionData.wireEncode().wire(), actionData.wireEncode().size(),
+                    SQLITE_STATIC);
+
+  sqlite3_step(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
+}
+
+void
+ActionLog::onTransactionRolledBack()
+{
+  // entries are loaded back on demand
+  m_latestVersions.clear();
+}
+
+bool
+ActionLog::updateLatestVersion(const std::string& filename, sqlite3_int64 version,
+                               const Buffer& deviceName)
+{
+  auto latest = m_latestVersions.find(filename);
+  if (latest == m_latestVersions.end()) {
+    if (m_latestVersions.size() >= LATEST_VERSIONS_LIMIT) {
+      // entries are loaded back on demand
+      m_latestVersions.clear();
+    }
+
+    Statement stmt(*this, "SELECT version, device_name FROM ActionLog "
+                          "  WHERE filename=? ORDER BY version DESC, device_name DESC LIMIT 1");
+    sqlite3_bind_text(stmt, 1, filename.c_str(), filename.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+      m_latestVersions[filename] = std::make_pair(version, deviceName);
+      return true;
+    }
+
+    latest = m_latestVersions.insert(
+      std::make_pair(filename,
+                     std::make_pair(sqlite3_column_int64(stmt, 0),
+                                    Buffer(sqlite3_column_blob(stmt, 1),
+                                           sqlite3_column_bytes(stmt, 1))))).first;
+  }
+
+  // device names are compared as BLOBs in SQLite
+  const Buffer& latestDevice = latest->second.second;
+  if (version < latest->second.first ||
+      (version == latest->second.first &&
+       std::lexicographical_compare(deviceName.begin(), deviceName.end(),
+                                    latestDevice.begin(), latestDevice.end()))) {
+    return false;
   }
 
-  Buffer device_name(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]));
-  sqlite3_int64 seq_no = sqlite3_value_int64(argv[1]);
-  int action = sqlite3_value_int(argv[2]);
-  std::string filename = reinterpret_cast<const char*>(sqlite3_value_text(argv[3]));
-  sqlite3_int64 version = sqlite3_value_int64(argv[4]);
+  latest->second = std::make_pair(version, deviceName);
+  return true;
+}
 
-  _LOG_TRACE("apply_function called with " << argc);
-  _LOG_TRACE("device_name: " << Name(Block(reinterpret_cast<const char*>(device_name.buf()),
-                                           device_name.size()))
-                             << ", action: "
-                             << action
-                             << ", file: "
-                             << filename);
+void
+ActionLog::applyAction(const Buffer& deviceName, sqlite3_int64 seqno, const ActionItem& action,
+                       sqlite3_int64 actionId)
+{
+  m_fileState->SetLastAppliedAction(actionId);
 
-  if (action == 0) // update
-  {
-    Buffer hash(sqlite3_value_blob(argv[5]), sqlite3_value_bytes(argv[5]));
-    time_t atime = static_cast<time_t>(sqlite3_value_int64(argv[6]));
-    time_t mtime = static_cast<time_t>(sqlite3_value_int64(argv[7]));
-    time_t ctime = static_cast<time_t>(sqlite3_value_int64(argv[8]));
-    int mode = sqlite3_value_int(argv[9]);
-    int seg_num = sqlite3_value_int(argv[10]);
+  if (!updateLatestVersion(action.filename(), action.version(), deviceName)) {
+    _LOG_TRACE("Newer action for " << action.filename() << " is already known");
+    return;
+  }
+
+  _LOG_TRACE("device_name: " << Name(Block(deviceName.buf(), deviceName.size()))
+                             << ", action: " << action.action()
+                             << ", file: " << action.filename());
+
+  if (action.action() == ActionItem::UPDATE) {
+    Buffer hash(action.file_hash().data(), action.file_hash().size());
 
-    _LOG_DEBUG("Update " << filename << " " << atime << " " << mtime << " " << ctime << " "
-                         << toHex(hash));
+    _LOG_DEBUG("Update " << action.filename() << " " << action.mtime() << " " << toHex(hash));
 
-    the->m_fileState->UpdateFile(filename, version, hash, device_name, seq_no, atime, mtime, ctime,
-                                 mode, seg_num);
+    m_fileState->UpdateFile(action.filename(), action.version(), hash, deviceName, seqno, 0,
+                            action.mtime(), 0, action.mode(), action.seg_num(),
+                            action.seg_size(), action.chunked(),
+                            action.has_manifest_hash() ?
+                              make_shared<Buffer>(action.manifest_hash().data(),
+                                                  action.manifest_hash().size()) :
+                              nullptr,
+                            action.digest_segments());
 
     // no callback here
   }
-  else if (action == 1) // delete
+  else if (action.action() == ActionItem::DELETE) {
+    m_fileState->DeleteFile(action.filename());
+
+    if (m_onFileRemoved) {
+      m_onFileRemoved(action.filename());
+    }
+  }
+}
+
+void
+ActionLog::recover()
+{
+  const Name& localName = m_syncLog->GetLocalName();
+  const Block& localNameWire = localName.wireEncode();
+
   {
-    the->m_fileState->DeleteFile(filename);
+    // highest local seq_no that is accounted for, either by an action or as gone
+    Statement stmt(*this, "SELECT MAX(IFNULL((SELECT MAX(seq_no) FROM ActionLog "
+                          "                     WHERE device_name=:device_name), 0), "
+                          "           IFNULL((SELECT MAX(seq_no) FROM ActionLogGone "
+                          "                     WHERE device_name=:device_name), 0))");
+    sqlite3_bind_blob(stmt, 1, localNameWire.wire(), localNameWire.size(), SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_int64 seqno = sqlite3_column_int64(stmt, 0);
+    sqlite3_int64 syncSeqNo = m_syncLog->SeqNo(localName);
+    if (seqno > syncSeqNo) {
+      _LOG_DEBUG("Restoring local seq_no " << seqno);
+      m_syncLog->UpdateLocalSeqNo(seqno);
+    }
+    else if (seqno < syncSeqNo) {
+      // seq_nos reserved before an unclean shutdown are skipped by SyncLog, but they are
+      // published and peers must learn that there are no actions for them
+      _LOG_DEBUG("Local seq_nos " << seqno + 1 << ".." << syncSeqNo << " have no actions");
+      Buffer deviceName(localNameWire.wire(), localNameWire.size());
+      beginTransaction();
+      for (sqlite3_int64 skipped = seqno + 1; skipped <= syncSeqNo; ++skipped) {
+        recordActionGone(deviceName, skipped);
+      }
+      commitTransaction();
+    }
+  }
 
-    the->m_onFileRemoved(filename);
+  sqlite3_int64 lastApplied = m_fileState->GetLastAppliedAction();
+  std::set<std::string> files;
+  sqlite3_int64 lastActionId = lastApplied;
+  {
+    Statement stmt(*this, "SELECT rowid, filename FROM ActionLog WHERE rowid > ?");
+    sqlite3_bind_int64(stmt, 1, lastApplied);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      lastActionId = std::max(lastActionId, sqlite3_column_int64(stmt, 0));
+      files.insert(std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+                               sqlite3_column_bytes(stmt, 1)));
+    }
   }
 
-  sqlite3_result_null(context);
+  if (files.empty()) {
+    return;
+  }
+
+  _LOG_DEBUG("Re-applying the latest actions for " << files.size() << " files");
+
+  // FileState must reflect the newest action of each file (see updateLatestVersion).  Removal
+  // callbacks are not called, as the folder is rescanned on start anyway.
+  beginTransaction();
+  for (const std::string& filename : files) {
+    Statement stmt(*this, "SELECT device_name, seq_no, action, version, file_hash, "
+                          "       strftime('%s', file_mtime), file_chmod, file_seg_num, "
+                          "       file_seg_size, file_chunked, file_manifest_hash, file_digest_segments "
+                          "  FROM ActionLog "
+                          "  WHERE filename=? ORDER BY version DESC, device_name DESC LIMIT 1");
+    sqlite3_bind_text(stmt, 1, filename.c_str(), filename.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+      continue;
+    }
+
+    Buffer deviceName(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+    if (sqlite3_column_int(stmt, 2) == ActionItem::DELETE) {
+      m_fileState->DeleteFile(filename);
+      continue;
+    }
+
+    m_fileState->UpdateFile(filename, sqlite3_column_int64(stmt, 3),
+                            Buffer(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4)),
+                            deviceName, sqlite3_column_int64(stmt, 1), 0,
+                            sqlite3_column_int64(stmt, 5), 0, sqlite3_column_int(stmt, 6),
+                            sqlite3_column_int(stmt, 7), sqlite3_column_int(stmt, 8),
+                            sqlite3_column_int(stmt, 9) != 0,
+                            sqlite3_column_type(stmt, 10) != SQLITE_NULL ?
+                              make_shared<Buffer>(sqlite3_column_blob(stmt, 10),
+                                                  sqlite3_column_bytes(stmt, 10)) :
+                              nullptr,
+                            sqlite3_column_int(stmt, 11) != 0);
+
+    // local files are complete by definition
+    if (deviceName == Buffer(localNameWire.wire(), localNameWire.size())) {
+      m_fileState->SetFileComplete(filename);
+    }
+  }
+  m_fileState->SetLastAppliedAction(lastActionId);
+  commitTransaction();
 }
 
 } // namespace chronoshare
@@ -31,6 +31,8 @@
 
 #include <ndn-cxx/face.hpp>
 #include <ndn-cxx/security/key-chain.hpp>
+#include <ndn-cxx/util/scheduler-scoped-event-id.hpp>
+#include <ndn-cxx/util/scheduler.hpp>
 
 namespace ndn {
 namespace chronoshare {
@@ -58,6 +60,25 @@ public:
 
   typedef boost::function<void(std::string /*filename*/)> OnFileRemovedCallback;
 
+  /**
+   * @brief Which actions are kept in ActionLog
+   *
+   * An action is kept if it is one of the @p maxVersions latest actions for its file, or if it
+   * is newer than @p maxAge.  Actions referenced by FileState are always kept.
+   */
+  struct RetentionPolicy
+  {
+    RetentionPolicy();
+
+    /// number of latest actions to keep for each file, 0 for no limit
+    size_t maxVersions;
+    /// maximum age of actions to keep regardless of their version, 0 for no limit
+    time::seconds maxAge;
+  };
+
+  static const int PRUNE_INTERVAL; // seconds
+  static const int PRUNE_BATCH;    // actions examined per step
+
 public:
   ActionLog(Face& face, const boost::filesystem::path& path, SyncLogPtr syncLog,
             const std::string& sharedFolder, const std::string& appName,
@@ -70,9 +91,16 @@ public:
   //////////////////////////
   // Local operations     //
   //////////////////////////
+  /**
+   * @param seg_size size of all segments except the last one, 0 if not known
+   * @param chunked whether segments carry the list of chunk digests instead of file content
+   * @param manifest_hash digest of the segment manifest (see ObjectManager), nullptr if the
+   *                      manifest is not published
+   */
   ActionItemPtr
   AddLocalActionUpdate(const std::string& filename, const Buffer& hash, time_t wtime, int mode,
-                       int seg_num);
+                       int seg_num, int seg_size = 0, bool chunked = false,
+                       ConstBufferPtr manifest_hash = nullptr, bool digest_segments = false);
 
   // void
   // AddActionMove(const std::string &oldFile, const std::string &newFile);
@@ -96,6 +124,18 @@ public:
   ActionItemPtr
   AddRemoteAction(shared_ptr<Data> actionData);
 
+  /**
+   * @brief Add a batch of remote actions in one transaction
+   *
+   * Used to catch up with other devices.  Each action is processed as by
+   * AddRemoteAction(shared_ptr<Data>), but ActionLog and FileState are updated in a single
+   * transaction each.
+   *
+   * @return parsed actions in the same order, null for actions that were not added
+   */
+  std::vector<ActionItemPtr>
+  AddRemoteActions(const std::vector<shared_ptr<Data>>& actionData);
+
   ///////////////////////////
   // General operations    //
   ///////////////////////////
@@ -132,6 +172,44 @@ public:
   void
   LookupRecentFileActions(const function<void(const std::string&, int, int)>& visitor, int limit = 5);
 
+  ///////////////////////////
+  // Retention             //
+  ///////////////////////////
+
+  void
+  SetRetentionPolicy(const RetentionPolicy& policy);
+
+  /**
+   * @brief Examine up to @p maxActions actions and remove those outside the retention policy
+   *
+   * Each call continues where the previous one stopped, so the whole log is examined in small
+   * steps.  Pruning runs periodically in the background; this method is public for tests.
+   *
+   * @return true if there are more actions to examine in the current pass
+   */
+  bool
+  Prune(size_t maxActions);
+
+  /**
+   * @brief Check if the action is gone, i.e., has been pruned here or by its publisher, or its
+   *        local seq_no has been skipped after an unclean shutdown (see
+   *        SyncLog::GetNextLocalSeqNo)
+   *
+   * Requests for such actions should be answered with a "gone" reply (see MakeGoneReply)
+   * rather than left unanswered.  Actions that have never been known are not gone.
+   */
+  bool
+  IsActionPruned(const Name& deviceName, sqlite3_int64 seqno);
+
+  /**
+   * @brief Create a signed "gone" reply for a pruned action
+   *
+   * The reply is an application-level Nack (ContentType_Nack).  AddRemoteAction records it, so
+   * that the action is not fetched again and requests from other devices are answered as gone.
+   */
+  shared_ptr<Data>
+  MakeGoneReply(const Name& actionName);
+
   //
   inline FileStatePtr
   GetFileState();
@@ -141,12 +219,87 @@ public:
   sqlite3_int64
   LogSize();
 
+protected:
+  /**
+   * @brief Forget latest versions, which may include versions of rolled back actions
+   */
+  void
+  onTransactionRolledBack() override;
+
 private:
+  /**
+   * @brief Insert remote action without starting a transaction
+   */
+  ActionItemPtr
+  insertRemoteAction(const Name& deviceName, sqlite3_int64 seqno, shared_ptr<Data> actionData);
+
+  /**
+   * @brief Extract device name and sequence number from the action name
+   * @return false if the action does not belong to this application and shared folder
+   */
+  bool
+  parseActionName(const Name& name, Name& deviceName, sqlite3_int64& seqno);
+
   std::tuple<sqlite3_int64 /*version*/, BufferPtr /*device name*/, sqlite3_int64 /*seq_no*/>
   GetLatestActionForFile(const std::string& filename);
 
-  static void
-  apply_action_xFun(sqlite3_context* context, int argc, sqlite3_value** argv);
+  /**
+   * @brief Store signed action in ActionContent, separately from ActionLog metadata
+   */
+  void
+  saveActionData(const Block& deviceName, sqlite3_int64 seqno, const Data& actionData);
+
+  /**
+   * @brief Check if the action is the newest for the file and remember it if it is
+   *
+   * The newest action has the highest version and, among actions with the same version, the
+   * highest device name.  Latest versions are kept in memory and loaded from the database on
+   * first use.
+   */
+  bool
+  updateLatestVersion(const std::string& filename, sqlite3_int64 version,
+                      const Buffer& deviceName);
+
+  /**
+   * @brief Apply action to FileState if it is the newest for the file
+   *
+   * Must be called after the action has been added to ActionLog, in the same transaction.
+   * @param actionId rowid of the action in ActionLog
+   */
+  void
+  applyAction(const Buffer& deviceName, sqlite3_int64 seqno, const ActionItem& action,
+              sqlite3_int64 actionId);
+
+  /**
+   * @brief Bring FileState and local seq_no in SyncNodes up to date with ActionLog
+   *
+   * Only action-log.db is synced to disk on commit, so file-state.db may miss the latest
+   * changes after a power loss.  Local seq_nos skipped by SyncLog after an unclean shutdown are
+   * recorded as gone.
+   */
+  void
+  recover();
+
+  /**
+   * @brief Move content of actions out of ActionLog rows of old databases, once
+   */
+  void
+  migrateActionContent();
+
+  void
+  schedulePrune(const time::nanoseconds& delay);
+
+  /**
+   * @brief Check if FileState still refers to the action
+   */
+  bool
+  isActionInFileState(const std::string& filename, const Buffer& deviceName, sqlite3_int64 seqno);
+
+  /**
+   * @brief Remember that the action is gone (see IsActionPruned)
+   */
+  void
+  recordActionGone(const Buffer& deviceName, sqlite3_int64 seqno);
 
 private:
   SyncLogPtr m_syncLog;
@@ -159,6 +312,16 @@ private:
   OnFileAddedOrChangedCallback m_onFileAddedOrChanged;
   OnFileRemovedCallback m_onFileRemoved;
   KeyChain m_keyChain;
+
+  // filename -> (version, device name) of the newest action
+  std::map<std::string, std::pair<sqlite3_int64, Buffer>> m_latestVersions;
+
+  RetentionPolicy m_retentionPolicy;
+  // rowid of the last action examined in the current pruning pass
+  sqlite3_int64 m_pruneCursor;
+
+  Scheduler m_scheduler;
+  util::scheduler::ScopedEventId m_pruneEvent;
 };
 
 inline FileStatePtr
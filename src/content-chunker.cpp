@@ -0,0 +1,123 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "content-chunker.hpp"
+
+#include <algorithm>
+
+namespace ndn {
+namespace chronoshare {
+
+const size_t ContentChunker::MIN_CHUNK_SIZE = 2048;
+const size_t ContentChunker::AVG_CHUNK_SIZE = 4096;
+const size_t ContentChunker::MAX_CHUNK_SIZE = 8000;
+
+// normalization level: the strict mask has this many more bits than avgSize, the loose mask
+// this many fewer
+static const int NORMALIZATION_LEVEL = 2;
+
+namespace {
+
+// Values of the gear table must be the same on all devices, so the table is generated from
+// a fixed seed (splitmix64) rather than taken from a random source
+struct GearTable
+{
+  GearTable()
+  {
+    uint64_t state = 0x4368726f6e6f5368ULL;
+    for (int i = 0; i < 256; i++) {
+      state += 0x9e3779b97f4a7c15ULL;
+      uint64_t z = state;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      values[i] = z ^ (z >> 31);
+    }
+  }
+
+  uint64_t values[256];
+};
+
+const GearTable GEAR;
+
+// mask with the given number of most significant bits set (these bits of the gear hash
+// depend on the longest window of preceding bytes)
+uint64_t
+topBitsMask(int bits)
+{
+  return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+} // namespace
+
+ContentChunker::ContentChunker(size_t minSize /*=MIN_CHUNK_SIZE*/,
+                               size_t avgSize /*=AVG_CHUNK_SIZE*/,
+                               size_t maxSize /*=MAX_CHUNK_SIZE*/)
+  : m_minSize(minSize)
+  , m_avgSize(avgSize)
+  , m_maxSize(maxSize)
+{
+  if (minSize == 0 || minSize > avgSize || avgSize > maxSize || (avgSize & (avgSize - 1)) != 0) {
+    BOOST_THROW_EXCEPTION(Error("Invalid chunk sizes"));
+  }
+
+  int bits = 0;
+  while ((static_cast<size_t>(1) << bits) < avgSize) {
+    bits++;
+  }
+  m_strictMask = topBitsMask(bits + NORMALIZATION_LEVEL);
+  m_looseMask = topBitsMask(bits - NORMALIZATION_LEVEL);
+}
+
+size_t
+ContentChunker::findBoundary(const uint8_t* data, size_t size) const
+{
+  if (size <= m_minSize) {
+    return size;
+  }
+
+  size_t end = std::min(size, m_maxSize);
+  size_t normal = std::min(end, m_avgSize);
+
+  // bytes before minSize cannot be a boundary and only need to fill the window of the hash
+  uint64_t hash = 0;
+  size_t i = m_minSize > 64 ? m_minSize - 64 : 0;
+  for (; i < m_minSize; i++) {
+    hash = (hash << 1) + GEAR.values[data[i]];
+  }
+
+  for (; i < normal; i++) {
+    hash = (hash << 1) + GEAR.values[data[i]];
+    if ((hash & m_strictMask) == 0) {
+      return i + 1;
+    }
+  }
+
+  for (; i < end; i++) {
+    hash = (hash << 1) + GEAR.values[data[i]];
+    if ((hash & m_looseMask) == 0) {
+      return i + 1;
+    }
+  }
+
+  return end;
+}
+
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,95 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#ifndef CHRONOSHARE_SRC_CONTENT_CHUNKER_HPP
+#define CHRONOSHARE_SRC_CONTENT_CHUNKER_HPP
+
+#include "core/chronoshare-common.hpp"
+
+namespace ndn {
+namespace chronoshare {
+
+/**
+ * @brief Content-defined chunking (FastCDC)
+ *
+ * Chunk boundaries are placed where a rolling gear hash of the last bytes matches a mask, so
+ * they depend only on the nearby content.  Inserting or removing bytes changes the chunks
+ * around the edit, while the rest of the file is split into the same chunks as before.
+ *
+ * Normalized chunking is used: a stricter mask before avgSize and a looser mask after it keep
+ * most chunks close to avgSize.  Chunks are never shorter than minSize (except the last one)
+ * and never longer than maxSize.
+ *
+ * The gear table is fixed, so all devices split the same content at the same boundaries.
+ */
+class ContentChunker
+{
+public:
+  class Error : public std::runtime_error
+  {
+  public:
+    explicit Error(const std::string& what)
+      : std::runtime_error(what)
+    {
+    }
+  };
+
+  /**
+   * @brief Create chunker
+   *
+   * avgSize must be a power of two and minSize <= avgSize <= maxSize
+   * @throw Error if the sizes are invalid
+   */
+  ContentChunker(size_t minSize = MIN_CHUNK_SIZE, size_t avgSize = AVG_CHUNK_SIZE,
+                 size_t maxSize = MAX_CHUNK_SIZE);
+
+  /**
+   * @brief Get length of the chunk that starts at data
+   *
+   * The whole buffer is the last chunk if it is shorter than maxSize, so the caller should
+   * pass at least maxSize bytes unless the end of the file has been reached.
+   */
+  size_t
+  findBoundary(const uint8_t* data, size_t size) const;
+
+  size_t
+  getMaxSize() const
+  {
+    return m_maxSize;
+  }
+
+public:
+  static const size_t MIN_CHUNK_SIZE;
+  static const size_t AVG_CHUNK_SIZE;
+  // every chunk fits into one segment (ObjectManager::MAX_SEGMENT_SIZE)
+  static const size_t MAX_CHUNK_SIZE;
+
+private:
+  size_t m_minSize;
+  size_t m_avgSize;
+  size_t m_maxSize;
+  uint64_t m_strictMask;
+  uint64_t m_looseMask;
+};
+
+} // namespace chronoshare
+} // namespace ndn
+
+#endif // CHRONOSHARE_SRC_CONTENT_CHUNKER_HPP
@@ -43,6 +43,7 @@ ContentServer::ContentServer(CcnxWrapperPtr ccnx, ActionLogPtr actionLog,
   , m_actionLog(actionLog)
   , m_dbFolder(rootDir / ".chronoshare")
   , m_freshness(freshness)
+  , m_store(ObjectStore::open(m_dbFolder))
   , m_scheduler(new Scheduler())
   , m_userName(userName)
   , m_sharedFolderName(sharedFolderName)
@@ -73,6 +74,7 @@ void
 ContentServer::registerPrefix(const Name& forwardingHint)
 {
   // Format for files:   /<forwarding-hint>/<device_name>/<appname>/file/<hash>/<segment>
+  // Format for chunks:  /<forwarding-hint>/<device_name>/<appname>/chunk/<digest>/0
   // Format for actions: /<forwarding-hint>/<device_name>/<appname>/action/<shared-folder>/<action-seq>
 
   _LOG_DEBUG(">> content server: register " << forwardingHint);
@@ -99,9 +101,11 @@ void
 ContentServer::filterAndServeImpl(const Name& forwardingHint, const Name& name, const Name& interest)
 {
   // interest for files:   /<forwarding-hint>/<device_name>/<appname>/file/<hash>/<segment>
+  // interest for chunks:  /<forwarding-hint>/<device_name>/<appname>/chunk/<digest>/0
   // interest for actions: /<forwarding-hint>/<device_name>/<appname>/action/<shared-folder>/<action-seq>
 
   // name for files:   /<device_name>/<appname>/file/<hash>/<segment>
+  // name for chunks:  /<device_name>/<appname>/chunk/<digest>/0
   // name for actions: /<device_name>/<appname>/action/<shared-folder>/<action-seq>
 
   try {
@@ -110,6 +114,9 @@ ContentServer::filterAndServeImpl(const Name& forwardingHint, const Name& name,
       if (type == "file") {
         serve_File(forwardingHint, name, interest);
       }
+      else if (type == "chunk") {
+        serve_Chunk(forwardingHint, name, interest);
+      }
       else if (type == "action") {
         string folder = name.getCompFromBackAsString(1);
         if (folder == m_sharedFolderName) {
@@ -165,6 +172,17 @@ ContentServer::serve_File(const Name& forwardingHint, const Name& name, const Na
   // need to unlock ccnx mutex... or at least don't lock it
 }
 
+void
+ContentServer::serve_Chunk(const Name& forwardingHint, const Name& name, const Name& interest)
+{
+  _LOG_DEBUG(">> content server serving CHUNK, hint: " << forwardingHint
+                                                       << ", interest: " << interest);
+
+  m_scheduler->scheduleOneTimeTask(m_scheduler, 0, bind(&ContentServer::serve_Chunk_Execute, this,
+                                                        forwardingHint, name, interest),
+                                   boost::lexical_cast<string>(name));
+}
+
 void
 ContentServer::serve_File_Execute(const Name& forwardingHint, const Name& name, const Name& interest)
 {
@@ -205,20 +223,11 @@ ContentServer::serve_File_Execute(const Name& forwardingHint, const Name& name,
   }
 
   if (db) {
+    // segments are served as saved, digest segments are verified by receivers against the
+    // signed manifest (see ObjectManager)
     BytesPtr co = db->fetchSegment(deviceName, segment);
     if (co) {
-      if (forwardingHint.size() == 0) {
-        _LOG_DEBUG(ParsedContentObject(*co).name());
-        m_ccnx->putToCcnd(*co);
-      }
-      else {
-        if (m_freshness > 0) {
-          m_ccnx->publishData(interest, *co, m_freshness);
-        }
-        else {
-          m_ccnx->publishData(interest, *co);
-        }
-      }
+      publishContentObject(forwardingHint, interest, *co);
     }
     else {
       _LOG_ERROR("ObjectDd exists, but no segment " << segment << " for device: " << deviceName
@@ -228,6 +237,48 @@ ContentServer::serve_File_Execute(const Name& forwardingHint, const Name& name,
   }
 }
 
+void
+ContentServer::serve_Chunk_Execute(const Name& forwardingHint, const Name& name,
+                                   const Name& interest)
+{
+  // forwardingHint: /<forwarding-hint>
+  // interest:       /<forwarding-hint>/<device_name>/<appname>/chunk/<digest>/0
+  // name:           /<device_name>/<appname>/chunk/<digest>/0
+
+  Name deviceName = name.getPartialName(0, name.size() - 4);
+  Hash digest(head(name.getCompFromBack(1)), name.getCompFromBack(1).size());
+
+  _LOG_DEBUG(" server CHUNK for device: " << deviceName << ", digest: " << digest.shortHash());
+
+  // chunks are complete when saved and are not cached like ObjectDb handles
+  BytesPtr co = m_store->fetchChunk(lexical_cast<string>(digest), deviceName);
+  if (co) {
+    publishContentObject(forwardingHint, interest, *co);
+  }
+  else {
+    _LOG_ERROR("CHUNK not found for device: " << deviceName << ", digest: "
+                                              << digest.shortHash());
+  }
+}
+
+void
+ContentServer::publishContentObject(const Name& forwardingHint, const Name& interest,
+                                    const Bytes& co)
+{
+  if (forwardingHint.size() == 0) {
+    _LOG_DEBUG(ParsedContentObject(co).name());
+    m_ccnx->putToCcnd(co);
+  }
+  else {
+    if (m_freshness > 0) {
+      m_ccnx->publishData(interest, co, m_freshness);
+    }
+    else {
+      m_ccnx->publishData(interest, co);
+    }
+  }
+}
+
 void
 ContentServer::serve_Action_Execute(const Name& forwardingHint, const Name& name, const Name& interest)
 {
@@ -255,6 +306,20 @@ ContentServer::serve_Action_Execute(const Name& forwardingHint, const Name& name
       }
     }
   }
+  else if (m_actionLog->IsActionPruned(deviceName, seqno)) {
+    // "gone" reply stops the fetcher from retrying and is recorded by the receiver
+    _LOG_DEBUG("ACTION has been pruned for device: " << deviceName << " and seqno: " << seqno);
+
+    shared_ptr<ndn::Data> goneReply = m_actionLog->MakeGoneReply(name);
+    const ndn::Block& goneWire = goneReply->wireEncode();
+    Bytes gone(goneWire.wire(), goneWire.wire() + goneWire.size());
+    if (forwardingHint.size() == 0) {
+      m_ccnx->putToCcnd(gone);
+    }
+    else {
+      m_ccnx->publishData(interest, gone);
+    }
+  }
   else {
     _LOG_ERROR("ACTION not found for device: " << deviceName << " and seqno: " << seqno);
   }
@@ -40,7 +40,7 @@ public:
 
   // the assumption is, when the interest comes in, interest is informs of
   // /some-prefix/topology-independent-name
-  // currently /topology-independent-name must begin with /action or /file
+  // currently /topology-independent-name must begin with /action, /file or /chunk
   // so that ContentServer knows where to look for the content object
   void
   registerPrefix(const Ccnx::Name& prefix);
@@ -61,6 +61,9 @@ private:
   void
   serve_File(const Ccnx::Name& forwardingHint, const Ccnx::Name& name, const Ccnx::Name& interest);
 
+  void
+  serve_Chunk(const Ccnx::Name& forwardingHint, const Ccnx::Name& name, const Ccnx::Name& interest);
+
   void
   serve_Action_Execute(const Ccnx::Name& forwardingHint, const Ccnx::Name& name,
                        const Ccnx::Name& interest);
@@ -69,6 +72,14 @@ private:
   serve_File_Execute(const Ccnx::Name& forwardingHint, const Ccnx::Name& name,
                      const Ccnx::Name& interest);
 
+  void
+  serve_Chunk_Execute(const Ccnx::Name& forwardingHint, const Ccnx::Name& name,
+                      const Ccnx::Name& interest);
+
+  void
+  publishContentObject(const Ccnx::Name& forwardingHint, const Ccnx::Name& interest,
+                       const Ccnx::Bytes& co);
+
   void
   flushStaleDbCache();
 
@@ -88,6 +99,7 @@ private:
   typedef std::map<Hash, ObjectDbPtr> DbCache;
   DbCache m_dbCache;
   Mutex m_dbCacheMutex;
+  ObjectStorePtr m_store;
 
   Ccnx::Name m_userName;
   std::string m_sharedFolderName;
@@ -19,9 +19,12 @@
  */
 
 #include "db-helper.hpp"
+#include "sync-digest-tree.hpp"
 #include "core/logging.hpp"
 
-#include <ndn-cxx/util/digest.hpp>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
 
 namespace ndn {
 namespace chronoshare {
@@ -30,54 +33,701 @@ _LOG_INIT(DbHelper);
 
 namespace fs = boost::filesystem;
 
-using util::Sha256;
-
 const std::string INIT_DATABASE = "\
     PRAGMA foreign_keys = ON;      \
 ";
 
-DbHelper::DbHelper(const fs::path& path, const std::string& dbname)
+static DbHelper::StorageProfile g_defaultStorageProfile;
+
+DbHelper::StorageProfile::StorageProfile()
+#ifdef DISABLE_SQLITE3_FS_LOCKING
+  // WAL requires shared memory, which is not available with unix-dot locking (e.g., on NFS)
+  : useWal(false)
+#else
+  : useWal(true)
+#endif // DISABLE_SQLITE3_FS_LOCKING
+  , synchronous(SYNCHRONOUS_FULL)
+  , mmapSize(0)
+  , cacheSize(0)
+  , busyTimeout(time::milliseconds(1000))
+  , groupCommitWindow(time::milliseconds::zero())
+  , groupCommitSize(100)
+  , useWriterThread(true)
+  , writerBatchSize(100)
+  , readConnections(4)
+{
+}
+
+void
+DbHelper::setDefaultStorageProfile(const StorageProfile& profile)
+{
+  g_defaultStorageProfile = profile;
+}
+
+const DbHelper::StorageProfile&
+DbHelper::getDefaultStorageProfile()
+{
+  return g_defaultStorageProfile;
+}
+
+DbHelper::DbHelper(const fs::path& path, const std::string& dbname, const StorageProfile& profile)
+  : m_profile(profile)
+  , m_host(nullptr)
+  , m_hasGroupTransaction(false)
+  , m_nGroupedTransactions(0)
+  , m_isGroupCommitTimerStopping(false)
+  , m_dbPath(path / dbname)
+  , m_nReadConnections(0)
+  , m_readConnectionsGeneration(0)
+  , m_transactionDepth(0)
+  , m_hasRolledBack(false)
 {
   fs::create_directories(path);
 
-  int res = sqlite3_open((path / dbname).c_str(), &m_db);
+  // the connection is shared with the writer thread
+  int res = sqlite3_open_v2(m_dbPath.c_str(), &m_db,
+                            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, 0);
   if (res != SQLITE_OK) {
-    BOOST_THROW_EXCEPTION(Error("Cannot open/create database: [" + (path / dbname).string() + "]"));
+    BOOST_THROW_EXCEPTION(Error("Cannot open/create database: [" + m_dbPath.string() + "]"));
+  }
+
+  registerFunctions(m_db);
+
+  sqlite3_exec(m_db, INIT_DATABASE.c_str(), NULL, NULL, NULL);
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+
+  sqlite3_busy_timeout(m_db, static_cast<int>(m_profile.busyTimeout.count()));
+
+  std::ostringstream pragmas;
+  pragmas << "PRAGMA journal_mode = " << (m_profile.useWal ? "WAL" : "DELETE") << ";"
+          << "PRAGMA synchronous = " << static_cast<int>(m_profile.synchronous) << ";"
+          << "PRAGMA mmap_size = " << m_profile.mmapSize << ";";
+  if (m_profile.cacheSize != 0) {
+    // negative value is interpreted by SQLite as the size in KiB, not in pages
+    pragmas << "PRAGMA cache_size = " << -m_profile.cacheSize << ";";
   }
 
-  res = sqlite3_create_function(m_db, "hash", 2, SQLITE_ANY, 0, 0, DbHelper::hash_xStep,
-                                DbHelper::hash_xFinal);
+  res = sqlite3_exec(m_db, pragmas.str().c_str(), NULL, NULL, NULL);
+  _LOG_DEBUG_COND(res != SQLITE_OK, "Cannot apply storage profile: " << sqlite3_errmsg(m_db));
+
+  if (m_profile.groupCommitWindow > time::milliseconds::zero()) {
+    m_groupCommitTimer = std::thread(&DbHelper::runGroupCommitTimer, this);
+  }
+}
+
+DbHelper::~DbHelper()
+{
+  stopWriter();
+  stopGroupCommitTimer();
+  if (m_host != nullptr) {
+    auto& guests = m_host->m_guests;
+    guests.erase(std::remove(guests.begin(), guests.end(), this), guests.end());
+
+    clearStatementCache();
+    // fails if the host has a transaction open, the database is detached on close then
+    sqlite3_exec(m_db, ("DETACH DATABASE " + m_alias).c_str(), NULL, NULL, NULL);
+    return;
+  }
+
+  flush();
+  // also closes idle read-only connections
+  clearStatementCache();
+
+  int res = sqlite3_close(m_db);
+  if (res != SQLITE_OK) {
+    // complain
+  }
+}
+
+void
+DbHelper::registerFunctions(sqlite3* db)
+{
+  int res = sqlite3_create_function(db, "hash", 2, SQLITE_ANY, 0, 0, DbHelper::hash_xStep,
+                                    DbHelper::hash_xFinal);
   if (res != SQLITE_OK) {
     BOOST_THROW_EXCEPTION(Error("Cannot create function ``hash''"));
   }
 
-  res = sqlite3_create_function(m_db, "is_prefix", 2, SQLITE_ANY, 0, DbHelper::is_prefix_xFun, 0, 0);
+  res = sqlite3_create_function(db, "is_prefix", 2, SQLITE_ANY, 0, DbHelper::is_prefix_xFun, 0, 0);
   if (res != SQLITE_OK) {
     BOOST_THROW_EXCEPTION(Error("Cannot create function ``is_prefix''"));
   }
 
-  res = sqlite3_create_function(m_db, "directory_name", -1, SQLITE_ANY, 0,
+  res = sqlite3_create_function(db, "directory_name", -1, SQLITE_ANY, 0,
                                 DbHelper::directory_name_xFun, 0, 0);
   if (res != SQLITE_OK) {
     BOOST_THROW_EXCEPTION(Error("Cannot create function ``directory_name''"));
   }
 
-  res = sqlite3_create_function(m_db, "is_dir_prefix", 2, SQLITE_ANY, 0,
+  res = sqlite3_create_function(db, "is_dir_prefix", 2, SQLITE_ANY, 0,
                                 DbHelper::is_dir_prefix_xFun, 0, 0);
   if (res != SQLITE_OK) {
     BOOST_THROW_EXCEPTION(Error("Cannot create function ``is_dir_prefix''"));
   }
+}
 
-  sqlite3_exec(m_db, INIT_DATABASE.c_str(), NULL, NULL, NULL);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+void
+DbHelper::attachDatabase(const fs::path& path, const std::string& alias)
+{
+  // ATTACH is not allowed inside transactions
+  flush();
+
+  Statement stmt(*this, "ATTACH DATABASE ? AS " + alias);
+  sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    BOOST_THROW_EXCEPTION(Error("Cannot attach database [" + path.string() + "]: " +
+                                sqlite3_errmsg(m_db)));
+  }
 }
 
-DbHelper::~DbHelper()
+bool
+DbHelper::hasColumn(const std::string& table, const std::string& column)
 {
-  int res = sqlite3_close(m_db);
+  Statement stmt(*this, "PRAGMA table_info(" + table + ")");
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (column == reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+DbHelper::addColumn(const std::string& table, const std::string& column, const std::string& type)
+{
+  if (hasColumn(table, column)) {
+    return;
+  }
+
+  std::string sql = "ALTER TABLE " + table + " ADD COLUMN " + column + " " + type;
+  if (sqlite3_exec(m_db, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+    BOOST_THROW_EXCEPTION(Error("Cannot add column " + table + "." + column + ": " +
+                                sqlite3_errmsg(m_db)));
+  }
+}
+
+int
+DbHelper::getSchemaVersion()
+{
+  Statement stmt(*this, "PRAGMA user_version");
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    return 0;
+  }
+  return sqlite3_column_int(stmt, 0);
+}
+
+void
+DbHelper::setSchemaVersion(int version)
+{
+  // PRAGMA does not accept bound parameters
+  std::string sql = "PRAGMA user_version = " + std::to_string(version);
+  if (sqlite3_exec(m_db, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+    BOOST_THROW_EXCEPTION(Error("Cannot record schema version: " +
+                                std::string(sqlite3_errmsg(m_db))));
+  }
+}
+
+void
+DbHelper::attachTo(DbHelper& host, const std::string& alias)
+{
+  if (m_host != nullptr || host.m_host != nullptr) {
+    BOOST_THROW_EXCEPTION(Error("Attached databases cannot be attached again"));
+  }
+
+  stopWriter();
+  stopGroupCommitTimer();
+  flush();
+  host.attachDatabase(m_dbPath, alias);
+
+  clearStatementCache();
+  sqlite3_close(m_db);
+
+  m_db = host.m_db;
+  m_host = &host;
+  m_alias = alias;
+  host.m_guests.push_back(this);
+}
+
+void
+DbHelper::flush()
+{
+  if (m_host != nullptr) {
+    return m_host->flush();
+  }
+
+  std::lock_guard<std::recursive_mutex> lock(m_transactionMutex);
+  if (!m_hasGroupTransaction) {
+    return;
+  }
+
+  int res = sqlite3_exec(m_db, "COMMIT;", 0, 0, 0);
   if (res != SQLITE_OK) {
-    // complain
+    // transaction is still open, commit will be retried later
+    _LOG_ERROR("Group commit failed: " << sqlite3_errmsg(m_db));
+    return;
+  }
+
+  _LOG_DEBUG("Group commit of " << m_nGroupedTransactions << " transactions");
+  m_hasGroupTransaction = false;
+}
+
+void
+DbHelper::runGroupCommitTimer()
+{
+  std::unique_lock<std::mutex> lock(m_groupCommitMutex);
+  while (!m_isGroupCommitTimerStopping) {
+    if (!m_hasGroupTransaction) {
+      m_groupCommitCondition.wait(lock);
+      continue;
+    }
+
+    time::nanoseconds remaining =
+      m_groupTransactionStart + m_profile.groupCommitWindow - time::steady_clock::now();
+    if (remaining > time::nanoseconds::zero()) {
+      m_groupCommitCondition.wait_for(lock, std::chrono::nanoseconds(remaining.count()));
+      continue;
+    }
+
+    // waits for the transaction of another thread, if any, to finish
+    lock.unlock();
+    flush();
+    lock.lock();
+
+    if (m_hasGroupTransaction) {
+      // commit failed or a new group has been started, check again after a full window
+      m_groupTransactionStart = time::steady_clock::now();
+    }
+  }
+}
+
+void
+DbHelper::stopGroupCommitTimer()
+{
+  if (!m_groupCommitTimer.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_groupCommitMutex);
+    m_isGroupCommitTimerStopping = true;
+  }
+  m_groupCommitCondition.notify_all();
+  m_groupCommitTimer.join();
+}
+
+int
+DbHelper::beginTransaction()
+{
+  if (m_host != nullptr) {
+    return m_host->beginTransaction();
+  }
+
+  m_transactionMutex.lock();
+  m_transactionOwner = std::this_thread::get_id();
+  ++m_transactionDepth;
+
+  int res = SQLITE_OK;
+  if (m_profile.groupCommitWindow > time::milliseconds::zero() && !m_hasGroupTransaction) {
+    res = sqlite3_exec(m_db, "BEGIN TRANSACTION;", 0, 0, 0);
+    if (res == SQLITE_OK) {
+      m_nGroupedTransactions = 0;
+      {
+        std::lock_guard<std::mutex> lock(m_groupCommitMutex);
+        m_groupTransactionStart = time::steady_clock::now();
+        m_hasGroupTransaction = true;
+      }
+      m_groupCommitCondition.notify_all();
+    }
+  }
+
+  if (res == SQLITE_OK) {
+    res = sqlite3_exec(m_db, "SAVEPOINT DbHelperTransaction;", 0, 0, 0);
+  }
+
+  if (res != SQLITE_OK) {
+    // callers do not commit or roll back a transaction that has not been started
+    _LOG_ERROR("Cannot begin transaction: " << sqlite3_errmsg(m_db));
+    releaseTransactionLock();
+  }
+  return res;
+}
+
+int
+DbHelper::commitTransaction()
+{
+  if (m_host != nullptr) {
+    return m_host->commitTransaction();
+  }
+
+  int res = sqlite3_exec(m_db, "RELEASE DbHelperTransaction;", 0, 0, 0);
+  // savepoints of nested transactions are released into the enclosing one, which can still be
+  // rolled back, so only the outermost transaction is part of the group
+  if (res == SQLITE_OK && m_hasGroupTransaction && m_transactionDepth == 1) {
+    ++m_nGroupedTransactions;
+    bool isWindowExpired = false;
+    {
+      std::lock_guard<std::mutex> lock(m_groupCommitMutex);
+      isWindowExpired =
+        time::steady_clock::now() - m_groupTransactionStart >= m_profile.groupCommitWindow;
+    }
+    if (m_nGroupedTransactions >= m_profile.groupCommitSize || isWindowExpired) {
+      flush();
+    }
+  }
+  else if (res != SQLITE_OK) {
+    _LOG_ERROR("Cannot commit transaction: " << sqlite3_errmsg(m_db));
+    m_hasRolledBack = true;
+    sqlite3_exec(m_db, "ROLLBACK TO DbHelperTransaction;", 0, 0, 0);
+    sqlite3_exec(m_db, "RELEASE DbHelperTransaction;", 0, 0, 0);
+    if (m_transactionDepth == 1 && !m_hasGroupTransaction && sqlite3_get_autocommit(m_db) == 0) {
+      // the savepoint is the transaction itself, which still cannot be released
+      sqlite3_exec(m_db, "ROLLBACK;", 0, 0, 0);
+    }
+  }
+
+  releaseTransactionLock();
+  return res;
+}
+
+void
+DbHelper::rollbackTransaction()
+{
+  if (m_host != nullptr) {
+    return m_host->rollbackTransaction();
+  }
+
+  if (isInTransaction()) {
+    m_hasRolledBack = true;
+  }
+  sqlite3_exec(m_db, "ROLLBACK TO DbHelperTransaction;", 0, 0, 0);
+  sqlite3_exec(m_db, "RELEASE DbHelperTransaction;", 0, 0, 0);
+
+  releaseTransactionLock();
+}
+
+void
+DbHelper::onTransactionRolledBack()
+{
+}
+
+void
+DbHelper::releaseTransactionLock()
+{
+  // rollback may be called by a thread that has no transaction open
+  if (m_transactionOwner != std::this_thread::get_id() || m_transactionDepth == 0) {
+    return;
+  }
+
+  if (--m_transactionDepth == 0) {
+    m_transactionOwner = std::thread::id();
+    if (m_hasRolledBack) {
+      m_hasRolledBack = false;
+      onTransactionRolledBack();
+      for (DbHelper* guest : m_guests) {
+        guest->onTransactionRolledBack();
+      }
+    }
+  }
+  m_transactionMutex.unlock();
+}
+
+void
+DbHelper::enqueueCommand(const DbWriter::Command& command, const DbWriter::Completion& completion)
+{
+  if (!m_profile.useWriterThread) {
+    std::exception_ptr error;
+    beginTransaction();
+    try {
+      command();
+      commitTransaction();
+    }
+    catch (const std::exception&) {
+      rollbackTransaction();
+      error = std::current_exception();
+    }
+    completion(error);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(m_writerMutex);
+  if (m_writer == nullptr) {
+    m_writer.reset(new DbWriter(*this, m_profile.writerBatchSize));
+  }
+  m_writer->enqueue(command, completion);
+}
+
+template<>
+std::future<void>
+DbHelper::enqueueWrite(const function<void()>& command)
+{
+  auto promise = make_shared<std::promise<void>>();
+  enqueueCommand(command, [promise] (std::exception_ptr error) {
+    if (error) {
+      promise->set_exception(error);
+    }
+    else {
+      promise->set_value();
+    }
+  });
+  return promise->get_future();
+}
+
+bool
+DbHelper::isInTransaction() const
+{
+  const DbHelper& owner = m_host != nullptr ? *m_host : *this;
+  return owner.m_transactionOwner == std::this_thread::get_id();
+}
+
+void
+DbHelper::waitForWrites()
+{
+  if (isInTransaction()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(m_writerMutex);
+  if (m_writer != nullptr) {
+    m_writer->wait();
+  }
+}
+
+DbWriter::Statistics
+DbHelper::getWriterStatistics() const
+{
+  std::lock_guard<std::mutex> lock(m_writerMutex);
+  if (m_writer == nullptr) {
+    return DbWriter::Statistics();
+  }
+  return m_writer->getStatistics();
+}
+
+void
+DbHelper::stopWriter()
+{
+  std::lock_guard<std::mutex> lock(m_writerMutex);
+  m_writer.reset();
+}
+
+struct DbHelper::Statement::Entry
+{
+  sqlite3_stmt* stmt;
+  bool inUse;
+  bool isStale;
+};
+
+struct DbHelper::ReadConnection::Entry
+{
+  sqlite3* db;
+  uint64_t generation;
+  Statement::Cache statements;
+  // the connection is used by one thread at a time, but Statement expects a lock for the cache
+  std::mutex statementsMutex;
+};
+
+void
+DbHelper::clearStatementCache()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_statementsMutex);
+    for (auto& statement : m_statements) {
+      if (statement.second->inUse) {
+        statement.second->isStale = true;
+      }
+      else {
+        sqlite3_finalize(statement.second->stmt);
+      }
+    }
+    m_statements.clear();
+  }
+
+  std::lock_guard<std::mutex> lock(m_readConnectionsMutex);
+  ++m_readConnectionsGeneration;
+  for (const auto& connection : m_readConnections) {
+    closeReadConnection(*connection);
+  }
+  m_nReadConnections -= m_readConnections.size();
+  m_readConnections.clear();
+}
+
+DbHelper::Statement::Statement(DbHelper& helper, const std::string& sql)
+  : m_cacheMutex(helper.m_statementsMutex)
+  , m_stmt(nullptr)
+{
+  prepare(helper.m_db, helper.m_statements, sql);
+}
+
+DbHelper::Statement::Statement(ReadConnection& connection, const std::string& sql)
+  : m_cacheMutex(connection.m_entry != nullptr ? connection.m_entry->statementsMutex :
+                                                 connection.m_helper.m_statementsMutex)
+  , m_stmt(nullptr)
+{
+  if (connection.m_entry != nullptr) {
+    prepare(connection.m_entry->db, connection.m_entry->statements, sql);
+  }
+  else {
+    prepare(connection.m_helper.m_db, connection.m_helper.m_statements, sql);
+  }
+}
+
+void
+DbHelper::Statement::prepare(sqlite3* db, Cache& cache, const std::string& sql)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_cacheMutex);
+    auto it = cache.find(sql);
+    if (it != cache.end()) {
+      if (!it->second->inUse) {
+        m_entry = it->second;
+        m_entry->inUse = true;
+        m_stmt = m_entry->stmt;
+        return;
+      }
+    }
+  }
+
+  int res = sqlite3_prepare_v2(db, sql.c_str(), -1, &m_stmt, 0);
+  if (res != SQLITE_OK) {
+    sqlite3_finalize(m_stmt);
+    BOOST_THROW_EXCEPTION(Error("Cannot prepare statement [" + sql + "]: " + sqlite3_errmsg(db)));
+  }
+
+  std::lock_guard<std::mutex> lock(m_cacheMutex);
+  auto it = cache.find(sql);
+  if (it == cache.end()) {
+    m_entry = make_shared<Entry>();
+    m_entry->stmt = m_stmt;
+    m_entry->inUse = true;
+    m_entry->isStale = false;
+    cache.insert(std::make_pair(sql, m_entry));
+  }
+  // otherwise the statement is private and will be finalized on release
+}
+
+DbHelper::Statement::~Statement()
+{
+  if (m_entry == nullptr) {
+    sqlite3_finalize(m_stmt);
+    return;
+  }
+
+  sqlite3_reset(m_stmt);
+  sqlite3_clear_bindings(m_stmt);
+
+  std::lock_guard<std::mutex> lock(m_cacheMutex);
+  if (m_entry->isStale) {
+    sqlite3_finalize(m_stmt);
+  }
+  else {
+    m_entry->inUse = false;
+  }
+}
+
+DbHelper::ReadConnection::ReadConnection(DbHelper& helper)
+  : m_helper(helper)
+  , m_db(helper.m_db)
+{
+  // uncommitted changes are visible only on the main connection
+  const DbHelper& owner = helper.m_host != nullptr ? *helper.m_host : helper;
+  if (owner.m_hasGroupTransaction || helper.isInTransaction()) {
+    return;
+  }
+
+  m_entry = helper.acquireReadConnection();
+  if (m_entry != nullptr) {
+    m_db = m_entry->db;
+  }
+}
+
+DbHelper::ReadConnection::~ReadConnection()
+{
+  if (m_entry != nullptr) {
+    m_helper.releaseReadConnection(m_entry);
+  }
+}
+
+shared_ptr<DbHelper::ReadConnection::Entry>
+DbHelper::acquireReadConnection()
+{
+  if (!m_profile.useWal) {
+    // readers and the writer would block each other
+    return nullptr;
+  }
+
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_readConnectionsMutex);
+    if (!m_readConnections.empty()) {
+      shared_ptr<ReadConnection::Entry> connection = m_readConnections.back();
+      m_readConnections.pop_back();
+      return connection;
+    }
+
+    if (m_nReadConnections >= m_profile.readConnections) {
+      return nullptr;
+    }
+    ++m_nReadConnections;
+    generation = m_readConnectionsGeneration;
+  }
+
+  auto connection = make_shared<ReadConnection::Entry>();
+  connection->db = nullptr;
+  connection->generation = generation;
+
+  // the connection is used by one thread at a time
+  int res = sqlite3_open_v2(m_dbPath.c_str(), &connection->db,
+                            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0);
+  if (res == SQLITE_OK) {
+    try {
+      registerFunctions(connection->db);
+    }
+    catch (const Error& e) {
+      _LOG_ERROR(e.what());
+      res = SQLITE_ERROR;
+    }
+  }
+
+  if (res != SQLITE_OK) {
+    _LOG_ERROR("Cannot open read-only connection: " << sqlite3_errmsg(connection->db));
+    sqlite3_close(connection->db);
+
+    std::lock_guard<std::mutex> lock(m_readConnectionsMutex);
+    --m_nReadConnections;
+    return nullptr;
+  }
+
+  sqlite3_busy_timeout(connection->db, static_cast<int>(m_profile.busyTimeout.count()));
+
+  std::ostringstream pragmas;
+  pragmas << "PRAGMA mmap_size = " << m_profile.mmapSize << ";";
+  if (m_profile.cacheSize != 0) {
+    pragmas << "PRAGMA cache_size = " << -m_profile.cacheSize << ";";
+  }
+  sqlite3_exec(connection->db, pragmas.str().c_str(), NULL, NULL, NULL);
+
+  return connection;
+}
+
+void
+DbHelper::releaseReadConnection(const shared_ptr<ReadConnection::Entry>& connection)
+{
+  std::lock_guard<std::mutex> lock(m_readConnectionsMutex);
+  if (connection->generation != m_readConnectionsGeneration) {
+    closeReadConnection(*connection);
+    --m_nReadConnections;
+    return;
+  }
+  m_readConnections.push_back(connection);
+}
+
+void
+DbHelper::closeReadConnection(ReadConnection::Entry& connection)
+{
+  for (const auto& statement : connection.statements) {
+    sqlite3_finalize(statement.second->stmt);
   }
+  connection.statements.clear();
+  sqlite3_close(connection.db);
 }
 
 void
@@ -95,45 +745,46 @@ DbHelper::hash_xStep(sqlite3_context* context, int argc, sqlite3_value** argv)
     return;
   }
 
-  Sha256** digest = reinterpret_cast<Sha256**>(sqlite3_aggregate_context(context, sizeof(Sha256*)));
+  SyncDigestTree** tree =
+    reinterpret_cast<SyncDigestTree**>(sqlite3_aggregate_context(context, sizeof(SyncDigestTree*)));
 
-  if (digest == nullptr) {
+  if (tree == nullptr) {
     sqlite3_result_error_nomem(context);
     return;
   }
 
-  if (*digest == nullptr) {
-    *digest = new Sha256();
+  if (*tree == nullptr) {
+    *tree = new SyncDigestTree();
   }
 
   int nameBytes = sqlite3_value_bytes(argv[0]);
-  const void* name = sqlite3_value_blob(argv[0]);
+  const uint8_t* name = reinterpret_cast<const uint8_t*>(sqlite3_value_blob(argv[0]));
   sqlite3_int64 seqno = sqlite3_value_int64(argv[1]);
 
-  (*digest)->update(reinterpret_cast<const uint8_t*>(name), nameBytes);
-  (*digest)->update(reinterpret_cast<const uint8_t*>(&seqno), sizeof(sqlite3_int64));
+  (*tree)->update(Buffer(name, nameBytes), seqno);
 }
 
 void
 DbHelper::hash_xFinal(sqlite3_context* context)
 {
-  Sha256** digest = reinterpret_cast<Sha256**>(sqlite3_aggregate_context(context, sizeof(Sha256*)));
+  SyncDigestTree** tree =
+    reinterpret_cast<SyncDigestTree**>(sqlite3_aggregate_context(context, sizeof(SyncDigestTree*)));
 
-  if (digest == nullptr) {
+  if (tree == nullptr) {
     sqlite3_result_error_nomem(context);
     return;
   }
 
-  if (*digest == nullptr) {
+  if (*tree == nullptr) {
     char charNullResult = 0;
     sqlite3_result_blob(context, &charNullResult, 1, SQLITE_TRANSIENT);
     return;
   }
 
-  shared_ptr<const Buffer> hash = (*digest)->computeDigest();
+  shared_ptr<const Buffer> hash = (*tree)->getRoot();
   sqlite3_result_blob(context, hash->buf(), hash->size(), SQLITE_TRANSIENT);
 
-  delete *digest;
+  delete *tree;
 }
 
 void
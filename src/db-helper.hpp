@@ -21,11 +21,22 @@
 #ifndef CHRONOSHARE_SRC_DB_HELPER_HPP
 #define CHRONOSHARE_SRC_DB_HELPER_HPP
 
+#include "db-writer.hpp"
 #include "core/chronoshare-common.hpp"
 
 #include <boost/filesystem.hpp>
+#include <ndn-cxx/util/time.hpp>
 #include <sqlite3.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 namespace ndn {
 namespace chronoshare {
 
@@ -41,11 +52,345 @@ public:
     }
   };
 
+  class ReadConnection;
+
+  /**
+   * @brief Prepared statement borrowed from the per-connection statement cache
+   *
+   * The statement is compiled once per distinct SQL text and reused afterwards.  When the
+   * object goes out of scope, the statement is reset, its bindings are cleared, and it is
+   * returned to the cache.  If the same SQL text is already in use (e.g., from a visitor
+   * callback or another thread), a private statement is prepared and finalized on release.
+   */
+  class Statement : boost::noncopyable
+  {
+  public:
+    Statement(DbHelper& helper, const std::string& sql);
+
+    Statement(ReadConnection& connection, const std::string& sql);
+
+    ~Statement();
+
+    operator sqlite3_stmt*()
+    {
+      return m_stmt;
+    }
+
+  private:
+    struct Entry;
+    typedef std::map<std::string, shared_ptr<Entry>> Cache;
+
+    void
+    prepare(sqlite3* db, Cache& cache, const std::string& sql);
+
+  private:
+    std::mutex& m_cacheMutex;
+    shared_ptr<Entry> m_entry;
+    sqlite3_stmt* m_stmt;
+
+    friend class DbHelper;
+  };
+
+  /**
+   * @brief Connection for read-only queries borrowed from the pool of read-only connections
+   *
+   * Pooled connections run queries in parallel with each other and with writes on the main
+   * connection (WAL mode only, see StorageProfile::readConnections).  Queries see only committed
+   * data, so the main connection is used instead if the calling thread is inside a transaction
+   * or a group transaction is open.  The main connection is also used if the pool is disabled or
+   * all pooled connections are busy.
+   */
+  class ReadConnection : boost::noncopyable
+  {
+  public:
+    explicit
+    ReadConnection(DbHelper& helper);
+
+    ~ReadConnection();
+
+    operator sqlite3*() const
+    {
+      return m_db;
+    }
+
+    /**
+     * @brief Check if the query runs on a pooled connection rather than on the main one
+     */
+    bool
+    isPooled() const
+    {
+      return m_entry != nullptr;
+    }
+
+  private:
+    struct Entry;
+
+    DbHelper& m_helper;
+    shared_ptr<Entry> m_entry;
+    sqlite3* m_db;
+
+    friend class DbHelper;
+    friend class Statement;
+  };
+
+  /**
+   * @brief Connection settings applied to every database opened through DbHelper
+   */
+  struct StorageProfile
+  {
+    enum Synchronous {
+      SYNCHRONOUS_OFF = 0,
+      SYNCHRONOUS_NORMAL = 1,
+      SYNCHRONOUS_FULL = 2
+    };
+
+    StorageProfile();
+
+    /// use write-ahead log instead of the rollback journal
+    bool useWal;
+    /// value of ``PRAGMA synchronous''
+    Synchronous synchronous;
+    /// value of ``PRAGMA mmap_size'' in bytes, 0 disables memory-mapped I/O
+    sqlite3_int64 mmapSize;
+    /// value of ``PRAGMA cache_size'' in KiB, 0 keeps the SQLite default
+    int cacheSize;
+    /// how long to wait for a lock held by another connection
+    time::milliseconds busyTimeout;
+
+    /**
+     * @brief Maximum time writes are held in one transaction, zero disables group commit
+     *
+     * With group commit enabled, transactions opened with beginTransaction() are nested
+     * into a long-running transaction that is committed when either the window expires (by a
+     * timer thread, so the last writes of a burst do not wait for the next one) or
+     * groupCommitSize transactions have accumulated (checked on commitTransaction()), or
+     * when flush() is called.
+     */
+    time::milliseconds groupCommitWindow;
+    size_t groupCommitSize;
+
+    /**
+     * @brief Execute writes queued with enqueueWrite() on a separate thread
+     *
+     * If disabled, queued writes are executed immediately by the calling thread.
+     */
+    bool useWriterThread;
+    /// maximum number of queued writes executed in one transaction
+    size_t writerBatchSize;
+
+    /**
+     * @brief Maximum number of read-only connections opened for ReadConnection
+     *
+     * Used only with useWal, 0 disables the pool.
+     */
+    size_t readConnections;
+  };
+
 public:
-  DbHelper(const boost::filesystem::path& path, const std::string& dbname);
+  DbHelper(const boost::filesystem::path& path, const std::string& dbname,
+           const StorageProfile& profile = getDefaultStorageProfile());
   virtual ~DbHelper();
 
+  /**
+   * @brief Set profile used for databases that are opened afterwards
+   */
+  static void
+  setDefaultStorageProfile(const StorageProfile& profile);
+
+  static const StorageProfile&
+  getDefaultStorageProfile();
+
+  const StorageProfile&
+  getStorageProfile() const
+  {
+    return m_profile;
+  }
+
+  const boost::filesystem::path&
+  getPath() const
+  {
+    return m_dbPath;
+  }
+
+  /**
+   * @brief Move the database onto the connection of @p host
+   *
+   * The database is attached to the connection of @p host under @p alias, and its own
+   * connection is closed.  Afterwards, transactions of this object are nested into transactions
+   * of @p host, so that changes to both databases are committed together.  Table names must be
+   * unique across the attached databases.  @p host must outlive this object.
+   *
+   * @throw Error if the database cannot be attached
+   */
+  void
+  attachTo(DbHelper& host, const std::string& alias);
+
+  /**
+   * @brief Commit the pending group transaction, if any
+   */
+  void
+  flush();
+
+  /**
+   * @brief Wait until all writes queued so far have been executed
+   *
+   * Does not wait if the calling thread is inside a transaction, as the writer could not make
+   * progress.
+   */
+  void
+  waitForWrites();
+
+  /**
+   * @brief Latency statistics of the writer thread (empty if it has not been started)
+   */
+  DbWriter::Statistics
+  getWriterStatistics() const;
+
+protected:
+  /**
+   * @brief Queue a write to be executed on the writer thread
+   *
+   * Writes queued together are executed in one transaction, each in its own savepoint.  The
+   * future becomes ready after the transaction has been committed (or added to the group
+   * transaction, see StorageProfile::groupCommitWindow) and holds the result of @p command or
+   * the exception it has thrown.
+   *
+   * The command runs concurrently with other threads, so it must not access state of the
+   * subclass that is not protected otherwise.  Reads on other threads see the write only after it
+   * has been executed; waitForWrites() can be used for that.
+   */
+  template<typename T>
+  std::future<T>
+  enqueueWrite(const function<T()>& command);
+
+  /**
+   * @brief Start an atomic update
+   *
+   * Updates are implemented as savepoints, so they can be nested into the group transaction
+   * (see StorageProfile::groupCommitWindow).
+   *
+   * @return SQLite result code, no update has been started unless it is SQLITE_OK
+   */
+  int
+  beginTransaction();
+
+  /**
+   * @brief Finish the innermost update
+   *
+   * If the update cannot be committed, it is rolled back as by rollbackTransaction().
+   *
+   * @return SQLite result code
+   */
+  int
+  commitTransaction();
+
+  /**
+   * @brief Roll back the innermost update
+   *
+   * onTransactionRolledBack() is called on this helper and the databases attached to it after
+   * the outermost update has finished.
+   */
+  void
+  rollbackTransaction();
+
+  /**
+   * @brief Called when changes made in an update may have been rolled back
+   *
+   * Subclasses that keep database state in memory must drop what may have been changed by the
+   * update.  Called after the outermost update has finished, with the transaction lock still
+   * held, so no other thread sees the stale state.
+   */
+  virtual void
+  onTransactionRolledBack();
+
+  /**
+   * @brief Finish all queued writes and stop the writer thread
+   *
+   * Must be called in the destructor of subclasses that queue writes, so that the writes are
+   * finished before the subclass is destroyed.
+   */
+  void
+  stopWriter();
+
+  /**
+   * @brief Attach database file @p path to the connection under @p alias
+   *
+   * Must be called outside of transactions.
+   *
+   * @throw Error if the database cannot be attached
+   */
+  void
+  attachDatabase(const boost::filesystem::path& path, const std::string& alias);
+
+  /**
+   * @brief Check if @p table of the main database has @p column
+   */
+  bool
+  hasColumn(const std::string& table, const std::string& column);
+
+  /**
+   * @brief Add @p column of @p type to @p table of the main database unless it already has it
+   *
+   * @throw Error if the column cannot be added
+   */
+  void
+  addColumn(const std::string& table, const std::string& column, const std::string& type);
+
+  /**
+   * @brief Get the schema version recorded by the subclass (PRAGMA user_version)
+   *
+   * The version is 0 for new databases and for databases created before it was recorded.
+   */
+  int
+  getSchemaVersion();
+
+  void
+  setSchemaVersion(int version);
+
+  /**
+   * @brief Finalize all cached statements
+   *
+   * Must be called after the database schema has been changed by the subclass.  Statements
+   * that are currently borrowed will be finalized when they are released.  Pooled read-only
+   * connections are closed as well and reopened on demand.
+   */
+  void
+  clearStatementCache();
+
 private:
+  static void
+  registerFunctions(sqlite3* db);
+
+  shared_ptr<ReadConnection::Entry>
+  acquireReadConnection();
+
+  void
+  releaseReadConnection(const shared_ptr<ReadConnection::Entry>& connection);
+
+  static void
+  closeReadConnection(ReadConnection::Entry& connection);
+
+  void
+  enqueueCommand(const DbWriter::Command& command, const DbWriter::Completion& completion);
+
+  void
+  releaseTransactionLock();
+
+  /**
+   * @brief Commit the group transaction when its window expires
+   */
+  void
+  runGroupCommitTimer();
+
+  void
+  stopGroupCommitTimer();
+
+  /**
+   * @brief Check if the calling thread has a transaction open on the connection
+   */
+  bool
+  isInTransaction() const;
+
   static void
   hash_xStep(sqlite3_context* context, int argc, sqlite3_value** argv);
 
@@ -63,8 +408,70 @@ private:
 
 protected:
   sqlite3* m_db;
+
+private:
+  StorageProfile m_profile;
+  // owner of the connection if the database is attached to another connection
+  DbHelper* m_host;
+  std::string m_alias;
+  std::atomic<bool> m_hasGroupTransaction;
+  size_t m_nGroupedTransactions;
+  // protected by m_groupCommitMutex
+  time::steady_clock::TimePoint m_groupTransactionStart;
+
+  std::mutex m_groupCommitMutex;
+  std::condition_variable m_groupCommitCondition;
+  bool m_isGroupCommitTimerStopping;
+  std::thread m_groupCommitTimer;
+
+  Statement::Cache m_statements;
+  std::mutex m_statementsMutex;
+
+  boost::filesystem::path m_dbPath;
+  // idle read-only connections; connections opened before the last clearStatementCache() are
+  // closed when released
+  std::vector<shared_ptr<ReadConnection::Entry>> m_readConnections;
+  size_t m_nReadConnections;
+  uint64_t m_readConnectionsGeneration;
+  std::mutex m_readConnectionsMutex;
+
+  // transactions are owned by one thread at a time, as the writer thread shares the connection
+  std::recursive_mutex m_transactionMutex;
+  std::atomic<std::thread::id> m_transactionOwner;
+  int m_transactionDepth;
+  // set when an update of the current outermost update has been rolled back
+  bool m_hasRolledBack;
+  // databases attached to the connection with attachTo()
+  std::vector<DbHelper*> m_guests;
+
+  mutable std::mutex m_writerMutex;
+  std::unique_ptr<DbWriter> m_writer;
+
+  friend class DbWriter;
 };
 
+template<typename T>
+std::future<T>
+DbHelper::enqueueWrite(const function<T()>& command)
+{
+  auto promise = make_shared<std::promise<T>>();
+  auto result = make_shared<T>();
+  enqueueCommand([command, result] { *result = command(); },
+                 [promise, result] (std::exception_ptr error) {
+                   if (error) {
+                     promise->set_exception(error);
+                   }
+                   else {
+                     promise->set_value(std::move(*result));
+                   }
+                 });
+  return promise->get_future();
+}
+
+template<>
+std::future<void>
+DbHelper::enqueueWrite(const function<void()>& command);
+
 typedef shared_ptr<DbHelper> DbHelperPtr;
 
 } // chronoshare
@@ -0,0 +1,228 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "db-writer.hpp"
+#include "db-helper.hpp"
+#include "core/logging.hpp"
+
+#include <ostream>
+
+namespace ndn {
+namespace chronoshare {
+
+_LOG_INIT(DbWriter);
+
+LatencyHistogram::LatencyHistogram()
+  : m_buckets(N_BUCKETS, 0)
+  , m_size(0)
+  , m_max(time::nanoseconds::zero())
+{
+}
+
+void
+LatencyHistogram::add(const time::nanoseconds& latency)
+{
+  uint64_t us = std::max<int64_t>(time::duration_cast<time::microseconds>(latency).count(), 0);
+
+  size_t bucket = 0;
+  while (us > 1 && bucket < N_BUCKETS - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+
+  ++m_buckets[bucket];
+  ++m_size;
+  m_max = std::max(m_max, latency);
+}
+
+time::microseconds
+LatencyHistogram::getPercentile(double fraction) const
+{
+  size_t threshold = static_cast<size_t>(fraction * m_size);
+  size_t count = 0;
+  for (size_t bucket = 0; bucket < N_BUCKETS; ++bucket) {
+    count += m_buckets[bucket];
+    if (count > threshold || count == m_size) {
+      return time::microseconds(uint64_t(1) << (bucket + 1));
+    }
+  }
+  return time::microseconds::zero();
+}
+
+std::ostream&
+operator<<(std::ostream& os, const LatencyHistogram& histogram)
+{
+  os << histogram.size() << " samples";
+  if (histogram.size() == 0) {
+    return os;
+  }
+
+  os << ", p50 < " << histogram.getPercentile(0.5).count() << "us"
+     << ", p99 < " << histogram.getPercentile(0.99).count() << "us"
+     << ", max " << time::duration_cast<time::microseconds>(histogram.getMax()).count() << "us";
+  return os;
+}
+
+DbWriter::DbWriter(DbHelper& helper, size_t maxBatchSize)
+  : m_helper(helper)
+  , m_maxBatchSize(maxBatchSize)
+  , m_nQueued(0)
+  , m_nCompleted(0)
+  , m_isStopping(false)
+  , m_thread(&DbWriter::run, this)
+{
+}
+
+DbWriter::~DbWriter()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_isStopping = true;
+  }
+  m_queueCondition.notify_all();
+  m_thread.join();
+
+  _LOG_DEBUG("Queue wait: " << m_statistics.queueWait);
+  _LOG_DEBUG("Commit: " << m_statistics.commit);
+}
+
+void
+DbWriter::enqueue(const Command& command, const Completion& completion)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.push_back(std::make_tuple(command, completion, time::steady_clock::now()));
+    ++m_nQueued;
+  }
+  m_queueCondition.notify_one();
+}
+
+void
+DbWriter::wait()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  uint64_t target = m_nQueued;
+  m_doneCondition.wait(lock, [this, target] { return m_nCompleted >= target; });
+}
+
+DbWriter::Statistics
+DbWriter::getStatistics() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_statistics;
+}
+
+void
+DbWriter::run()
+{
+  std::vector<std::tuple<Command, Completion, time::steady_clock::TimePoint>> batch;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_queueCondition.wait(lock, [this] { return m_isStopping || !m_queue.empty(); });
+    if (m_queue.empty()) {
+      // stopping and nothing left to do
+      break;
+    }
+
+    while (!m_queue.empty() && batch.size() < m_maxBatchSize) {
+      batch.push_back(std::move(m_queue.front()));
+      m_queue.pop_front();
+    }
+
+    lock.unlock();
+    executeBatch(batch);
+    lock.lock();
+
+    m_nCompleted += batch.size();
+    batch.clear();
+    m_doneCondition.notify_all();
+  }
+}
+
+void
+DbWriter::executeBatch(std::vector<std::tuple<Command, Completion, time::steady_clock::TimePoint>>& batch)
+{
+  std::vector<std::exception_ptr> errors(batch.size());
+  std::vector<time::nanoseconds> waits(batch.size());
+
+  auto makeError = [] (const std::string& what, int res) {
+    std::string message = what + ": " + sqlite3_errstr(res);
+    _LOG_ERROR("Database write failed: " << message);
+    return std::make_exception_ptr(DbHelper::Error(message));
+  };
+
+  int batchRes = m_helper.beginTransaction();
+  for (size_t i = 0; i < batch.size(); ++i) {
+    waits[i] = time::steady_clock::now() - std::get<2>(batch[i]);
+
+    int res = batchRes == SQLITE_OK ? m_helper.beginTransaction() : batchRes;
+    if (res != SQLITE_OK) {
+      errors[i] = makeError("Cannot begin transaction", res);
+      continue;
+    }
+    try {
+      std::get<0>(batch[i])();
+    }
+    catch (const std::exception& e) {
+      _LOG_ERROR("Database write failed: " << e.what());
+      m_helper.rollbackTransaction();
+      errors[i] = std::current_exception();
+      continue;
+    }
+    // a failed commit rolls the command back
+    res = m_helper.commitTransaction();
+    if (res != SQLITE_OK) {
+      errors[i] = makeError("Cannot commit transaction", res);
+    }
+  }
+
+  auto commitStart = time::steady_clock::now();
+  if (batchRes == SQLITE_OK) {
+    batchRes = m_helper.commitTransaction();
+  }
+  if (batchRes != SQLITE_OK) {
+    // the batch has been rolled back
+    std::exception_ptr error = makeError("Cannot commit transaction", batchRes);
+    for (std::exception_ptr& e : errors) {
+      if (e == nullptr) {
+        e = error;
+      }
+    }
+  }
+  time::nanoseconds commitTime = time::steady_clock::now() - commitStart;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& wait : waits) {
+      m_statistics.queueWait.add(wait);
+    }
+    m_statistics.commit.add(commitTime);
+  }
+
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (std::get<1>(batch[i])) {
+      std::get<1>(batch[i])(errors[i]);
+    }
+  }
+}
+
+} // namespace chronoshare
+} // namespace ndn
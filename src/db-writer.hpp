@@ -0,0 +1,158 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#ifndef CHRONOSHARE_SRC_DB_WRITER_HPP
+#define CHRONOSHARE_SRC_DB_WRITER_HPP
+
+#include "core/chronoshare-common.hpp"
+
+#include <ndn-cxx/util/time.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iosfwd>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace ndn {
+namespace chronoshare {
+
+class DbHelper;
+
+/**
+ * @brief Histogram of latencies with power-of-two buckets
+ *
+ * Bucket i counts latencies in [2^i, 2^(i+1)) microseconds; the first bucket also includes
+ * latencies below one microsecond.
+ */
+class LatencyHistogram
+{
+public:
+  static const size_t N_BUCKETS = 32;
+
+  LatencyHistogram();
+
+  void
+  add(const time::nanoseconds& latency);
+
+  size_t
+  size() const
+  {
+    return m_size;
+  }
+
+  /**
+   * @brief Upper bound of the bucket below which @p fraction of the latencies fall
+   */
+  time::microseconds
+  getPercentile(double fraction) const;
+
+  time::nanoseconds
+  getMax() const
+  {
+    return m_max;
+  }
+
+  size_t
+  getBucket(size_t bucket) const
+  {
+    return m_buckets[bucket];
+  }
+
+private:
+  std::vector<size_t> m_buckets;
+  size_t m_size;
+  time::nanoseconds m_max;
+};
+
+std::ostream&
+operator<<(std::ostream& os, const LatencyHistogram& histogram);
+
+/**
+ * @brief Thread that executes write commands queued for one database
+ *
+ * Commands that are queued while the previous batch is being committed are executed together
+ * in one transaction, each in its own savepoint, so that a failing command does not affect
+ * the others.  Completion callbacks are called after the transaction is committed.
+ */
+class DbWriter : boost::noncopyable
+{
+public:
+  typedef function<void()> Command;
+  typedef function<void(std::exception_ptr)> Completion;
+
+  struct Statistics
+  {
+    /// time from queueing a command until it starts executing
+    LatencyHistogram queueWait;
+    /// time to commit a batch
+    LatencyHistogram commit;
+  };
+
+  DbWriter(DbHelper& helper, size_t maxBatchSize);
+
+  /**
+   * @brief Execute the remaining commands and stop the thread
+   */
+  ~DbWriter();
+
+  void
+  enqueue(const Command& command, const Completion& completion);
+
+  /**
+   * @brief Wait until all commands queued so far are executed and committed
+   */
+  void
+  wait();
+
+  Statistics
+  getStatistics() const;
+
+private:
+  void
+  run();
+
+  void
+  executeBatch(std::vector<std::tuple<Command, Completion, time::steady_clock::TimePoint>>& batch);
+
+private:
+  DbHelper& m_helper;
+  size_t m_maxBatchSize;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_queueCondition;
+  std::condition_variable m_doneCondition;
+  std::deque<std::tuple<Command, Completion, time::steady_clock::TimePoint>> m_queue;
+  // numbers of commands queued and completed since the start
+  uint64_t m_nQueued;
+  uint64_t m_nCompleted;
+  bool m_isStopping;
+  Statistics m_statistics;
+
+  std::thread m_thread;
+};
+
+} // namespace chronoshare
+} // namespace ndn
+
+#endif // CHRONOSHARE_SRC_DB_WRITER_HPP
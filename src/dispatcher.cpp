@@ -36,6 +36,8 @@ static const string CHRONOSHARE_APP = "chronoshare";
 static const string BROADCAST_DOMAIN = "/ndn/broadcast";
 
 static const int CONTENT_FRESHNESS = 1800;                 // seconds
+// runs of missing segments separated by fewer reused segments are fetched as one range
+static const uint64_t MIN_REUSED_SEGMENTS_GAP = 8;
 const static double DEFAULT_SYNC_INTEREST_INTERVAL = 10.0; // seconds;
 
 Dispatcher::Dispatcher(const std::string& localUserName, const std::string& sharedFolder,
@@ -204,27 +206,35 @@ Dispatcher::Did_LocalFile_AddOrModify_Execute(filesystem::path relativeFilePath)
   }
 
   FileItemPtr currentFile = m_fileState->LookupFile(relativeFilePath.generic_string());
-  if (currentFile &&
-      *Hash::FromFileContent(absolutePath) ==
-        Hash(currentFile->file_hash().c_str(), currentFile->file_hash().size())
-      // The following two are commented out to prevent front end from reporting intermediate files
-      // should enable it if there is other way to prevent this
-      // && last_write_time (absolutePath) == currentFile->mtime ()
-      // && status (absolutePath).permissions () == static_cast<filesystem::perms> (currentFile->mode ())
-      ) {
-    _LOG_ERROR("Got notification about the same file [" << relativeFilePath << "]");
-    return;
-  }
-
   if (currentFile && !currentFile->is_complete()) {
     _LOG_ERROR("Got notification about incomplete file [" << relativeFilePath << "]");
     return;
   }
 
+  // file is hashed while it is published, so the same content is detected by ObjectManager
+  HashPtr currentHash;
+  if (currentFile) {
+    currentHash = make_shared<Hash>(currentFile->file_hash().c_str(),
+                                    currentFile->file_hash().size());
+  }
 
   int seg_num;
+  int seg_size;
+  bool chunked;
   HashPtr hash;
-  tie(hash, seg_num) = m_objectManager.localFileToObjects(absolutePath, m_localUserName);
+  HashPtr manifestHash;
+  tie(hash, seg_num, seg_size, chunked, manifestHash) =
+    m_objectManager.localFileToObjects(absolutePath, m_localUserName, currentHash.get());
+
+  if (seg_num == 0
+      // The following two are commented out to prevent front end from reporting intermediate files
+      // should enable it if there is other way to prevent this
+      // && last_write_time (absolutePath) == currentFile->mtime ()
+      // && status (absolutePath).permissions () == static_cast<filesystem::perms> (currentFile->mode ())
+      ) {
+    _LOG_ERROR("Got notification about the same file [" << relativeFilePath << "]");
+    return;
+  }
 
   try {
     m_actionLog->AddLocalActionUpdate(relativeFilePath.generic_string(),
@@ -235,7 +245,8 @@ Dispatcher::Did_LocalFile_AddOrModify_Execute(filesystem::path relativeFilePath)
 #else
                                       0,
 #endif
-                                      seg_num);
+                                      seg_num, seg_size, chunked, manifestHash,
+                                      m_objectManager.hasDigestSegments() && !chunked);
 
     // notify SyncCore to propagate the change
     m_core->localStateChangedDelayed();
@@ -326,13 +337,54 @@ Dispatcher::Did_FetchManager_ActionFetch(const Ccnx::Name& deviceName,
                                             << ", seqno: "
                                             << seqno);
 
-  ActionItemPtr action = m_actionLog->AddRemoteAction(deviceName, seqno, actionPco);
-  if (!action) {
-    _LOG_ERROR("AddRemoteAction did not insert action, ignoring");
-    return;
+  // actions that arrive before the queue is processed (e.g., when catching up with a device
+  // after being offline) are added to ActionLog in one batch
+  bool isFirst = false;
+  {
+    boost::mutex::scoped_lock lock(m_pendingActionsMutex);
+    isFirst = m_pendingActions.empty();
+    m_pendingActions.push_back(make_pair(deviceName, actionPco));
+  }
+
+  if (isFirst) {
+    m_executor.execute(bind(&Dispatcher::Did_FetchManager_ActionFetch_Execute, this));
+  }
+}
+
+void
+Dispatcher::Did_FetchManager_ActionFetch_Execute()
+{
+  std::vector<std::pair<Ccnx::Name, Ccnx::PcoPtr>> pendingActions;
+  {
+    boost::mutex::scoped_lock lock(m_pendingActionsMutex);
+    pendingActions.swap(m_pendingActions);
   }
+
+  std::vector<Ccnx::PcoPtr> actionPcos;
+  actionPcos.reserve(pendingActions.size());
+  for (size_t i = 0; i < pendingActions.size(); i++) {
+    actionPcos.push_back(pendingActions[i].second);
+  }
+
+  _LOG_DEBUG("Adding batch of " << actionPcos.size() << " actions");
+
+  // actions pruned by the other device are answered as gone, which ActionLog records instead
+  std::vector<ActionItemPtr> actions = m_actionLog->AddRemoteActions(actionPcos);
   // trigger may invoke Did_ActionLog_ActionApply_Delete or Did_ActionLog_ActionApply_AddOrModify callbacks
 
+  for (size_t i = 0; i < actions.size(); i++) {
+    if (!actions[i]) {
+      _LOG_ERROR("AddRemoteActions did not insert action, ignoring");
+      continue;
+    }
+
+    ProcessRemoteAction(pendingActions[i].first, actions[i]);
+  }
+}
+
+void
+Dispatcher::ProcessRemoteAction(const Ccnx::Name& deviceName, ActionItemPtr action)
+{
   if (action->action() == ActionItem::UPDATE) {
     Hash hash(action->file_hash().c_str(), action->file_hash().size());
 
@@ -351,11 +403,187 @@ Dispatcher::Did_FetchManager_ActionFetch(const Ccnx::Name& deviceName,
         m_objectDbMap[hash] = make_shared<ObjectDb>(m_rootDir / ".chronoshare", hashStr);
       }
 
-      m_fileFetcher->Enqueue(deviceName, fileNameBase, 0, action->seg_num() - 1,
-                             FetchManager::PRIORITY_NORMAL);
+      if (!FetchChangedSegments(deviceName, action)) {
+        m_fileFetcher->Enqueue(deviceName, fileNameBase, 0, action->seg_num() - 1,
+                               FetchManager::PRIORITY_NORMAL);
+      }
     }
   }
-  // if necessary (when version number is the highest) delete will be applied through the trigger in m_actionLog->AddRemoteAction call
+  // if necessary (when version number is the highest) delete will be applied through the trigger in m_actionLog->AddRemoteActions call
+}
+
+bool
+Dispatcher::FetchChangedSegments(const Ccnx::Name& deviceName, ActionItemPtr action)
+{
+  // only digest segments are verified against the manifest and can be rebuilt from the parent
+  // version, segments signed by the publisher are always fetched
+  if (!action->has_manifest_hash() || action->chunked() || !action->digest_segments()) {
+    return false;
+  }
+
+  Hash manifestHash(action->manifest_hash().c_str(), action->manifest_hash().size());
+  string manifestHashStr = lexical_cast<string>(manifestHash);
+
+  if (ObjectDb::DoesExist(m_rootDir / ".chronoshare", deviceName, manifestHashStr)) {
+    ReuseParentSegments(deviceName, action);
+    return true;
+  }
+
+  std::vector<std::pair<Name, ActionItemPtr>>& waiters = m_manifestWaiters[manifestHash];
+  if (waiters.empty()) {
+    m_objectDbMap[manifestHash] = make_shared<ObjectDb>(m_rootDir / ".chronoshare", manifestHashStr);
+
+    // manifest is published as a file named by its hash
+    Name manifestNameBase =
+      Name("/")(deviceName)(CHRONOSHARE_APP)("file")(manifestHash.GetHash(),
+                                                     manifestHash.GetHashBytes());
+    m_fileFetcher->Enqueue(deviceName, manifestNameBase, 0,
+                           ObjectManager::manifestSegments(action->seg_num()) - 1,
+                           FetchManager::PRIORITY_NORMAL);
+  }
+  waiters.push_back(make_pair(deviceName, action));
+
+  return true;
+}
+
+void
+Dispatcher::ReuseParentSegments(const Ccnx::Name& deviceName, ActionItemPtr action)
+{
+  Hash hash(action->file_hash().c_str(), action->file_hash().size());
+  Hash manifestHash(action->manifest_hash().c_str(), action->manifest_hash().size());
+  Name fileNameBase =
+    Name("/")(deviceName)(CHRONOSHARE_APP)("file")(hash.GetHash(), hash.GetHashBytes());
+
+  if (action->digest_segments()) {
+    // segments are verified against the manifest when they are received
+    string digests;
+    if (!m_objectManager.readManifest(deviceName, manifestHash, action->seg_num(), digests)) {
+      _LOG_ERROR("Manifest of " << fileNameBase << " is not available, segments cannot be verified");
+      return;
+    }
+    m_segmentDigests[hash] = digests;
+  }
+
+  ActionItemPtr parent;
+  Name parentDeviceName;
+  if (action->has_parent_device_name()) {
+    parentDeviceName =
+      Name(reinterpret_cast<const unsigned char*>(action->parent_device_name().c_str()),
+           action->parent_device_name().size());
+    parent = m_actionLog->LookupAction(parentDeviceName, action->parent_seq_no());
+  }
+  if (parent && (parent->action() != ActionItem::UPDATE || parent->chunked())) {
+    parent.reset();
+  }
+
+  map<Hash, ObjectDbPtr>::iterator db = m_objectDbMap.find(hash);
+  if (db == m_objectDbMap.end()) {
+    db = m_objectDbMap.insert(
+      make_pair(hash, make_shared<ObjectDb>(m_rootDir / ".chronoshare", lexical_cast<string>(hash))))
+      .first;
+  }
+
+  std::vector<sqlite3_int64> missing;
+  if (!parent ||
+      !m_objectManager.reuseParentSegments(*db->second, deviceName, hash, action->seg_num(),
+                                           manifestHash, parentDeviceName,
+                                           Hash(parent->file_hash().c_str(),
+                                                parent->file_hash().size()),
+                                           missing)) {
+    if (parent) {
+      _LOG_ERROR("Cannot reuse segments of the parent version, fetching all segments of "
+                 << fileNameBase);
+    }
+    m_fileFetcher->Enqueue(deviceName, fileNameBase, 0, action->seg_num() - 1,
+                           FetchManager::PRIORITY_NORMAL);
+    return;
+  }
+
+  if (missing.empty()) {
+    Did_FetchManager_FileFetchComplete_Execute(deviceName, fileNameBase);
+    return;
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> runs;
+  for (std::vector<sqlite3_int64>::iterator segment = missing.begin(); segment != missing.end();
+       ++segment) {
+    if (!runs.empty() &&
+        static_cast<uint64_t>(*segment) <= runs.back().second + MIN_REUSED_SEGMENTS_GAP) {
+      runs.back().second = *segment;
+    }
+    else {
+      runs.push_back(make_pair(*segment, *segment));
+    }
+  }
+
+  _LOG_DEBUG("Fetching " << missing.size() << " of " << action->seg_num() << " segments of "
+                         << fileNameBase << " in " << runs.size() << " ranges");
+
+  // ranges of the same file are fetched one after another (fetch tasks are identified by the
+  // base name), the next one is started when the previous one completes
+  std::vector<std::pair<uint64_t, uint64_t>>& pendingRuns = m_pendingSegmentRuns[fileNameBase];
+  pendingRuns.assign(runs.rbegin(), runs.rend());
+  FetchNextSegmentRun(deviceName, fileNameBase);
+}
+
+bool
+Dispatcher::FetchNextSegmentRun(const Ccnx::Name& deviceName, const Ccnx::Name& fileNameBase)
+{
+  std::map<Name, std::vector<std::pair<uint64_t, uint64_t>>>::iterator runs =
+    m_pendingSegmentRuns.find(fileNameBase);
+  if (runs == m_pendingSegmentRuns.end()) {
+    return false;
+  }
+
+  if (runs->second.empty()) {
+    m_pendingSegmentRuns.erase(runs);
+    return false;
+  }
+
+  std::pair<uint64_t, uint64_t> run = runs->second.back();
+  runs->second.pop_back();
+  m_fileFetcher->Enqueue(deviceName, fileNameBase, run.first, run.second,
+                         FetchManager::PRIORITY_NORMAL);
+  return true;
+}
+
+bool
+Dispatcher::LoadSegmentDigests(const Ccnx::Name& deviceName, const Hash& hash)
+{
+  if (m_segmentDigests.find(hash) != m_segmentDigests.end()) {
+    return true;
+  }
+
+  FileItemsPtr files = m_fileState->LookupFilesForHash(hash);
+  FileItems::iterator file = files->begin();
+  while (file != files->end() && !file->digest_segments()) {
+    ++file;
+  }
+  if (file == files->end()) {
+    // segments are signed by the publisher (or belong to a manifest, verified by its hash)
+    return true;
+  }
+  if (!file->has_manifest_hash()) {
+    _LOG_ERROR("Manifest hash of " << file->filename() << " is not known");
+    return false;
+  }
+
+  Hash manifestHash(file->manifest_hash().c_str(), file->manifest_hash().size());
+  string digests;
+  if (m_objectManager.readManifest(deviceName, manifestHash, file->seg_num(), digests)) {
+    m_segmentDigests[hash] = digests;
+    return true;
+  }
+
+  if (m_manifestWaiters.find(manifestHash) == m_manifestWaiters.end()) {
+    Name publisher(reinterpret_cast<const unsigned char*>(file->device_name().c_str()),
+                   file->device_name().size());
+    ActionItemPtr action = m_actionLog->LookupAction(publisher, file->seq_no());
+    if (action) {
+      FetchChangedSegments(deviceName, action);
+    }
+  }
+  return false;
 }
 
 void
@@ -409,10 +637,41 @@ Dispatcher::Did_FetchManager_FileSegmentFetch_Execute(Ccnx::Name deviceName,
                                                       uint32_t segment, Ccnx::PcoPtr fileSegmentPco)
 {
   // fileSegmentBaseName:  /<device_name>/<appname>/file/<hash>
+  //                   or  /<device_name>/<appname>/chunk/<digest>
 
   const Bytes& hashBytes = fileSegmentBaseName.getCompFromBack(0);
   Hash hash(head(hashBytes), hashBytes.size());
 
+  if (fileSegmentBaseName.getCompFromBackAsString(1) == "chunk") {
+    // chunk is named by its digest, anything else is not the requested chunk
+    BytesPtr content = fileSegmentPco->contentPtr();
+    if (!content || !(*Hash::FromBytes(*content) == hash)) {
+      _LOG_ERROR("Digest of chunk " << fileSegmentBaseName << " does not match, ignoring");
+      return;
+    }
+
+    ObjectStore::open(m_rootDir / ".chronoshare")
+      ->saveChunk(lexical_cast<string>(hash), deviceName, fileSegmentPco->buf());
+    return;
+  }
+
+  if (!LoadSegmentDigests(deviceName, hash)) {
+    _LOG_ERROR("Segment " << segment << " of " << fileSegmentBaseName
+                          << " cannot be verified without the manifest, ignoring");
+    return;
+  }
+
+  std::map<Hash, std::string>::iterator digests = m_segmentDigests.find(hash);
+  if (digests != m_segmentDigests.end()) {
+    // digest segments carry no signature, anything not listed in the manifest is rejected
+    BytesPtr content = fileSegmentPco->contentPtr();
+    if (!content || !ObjectManager::matchesManifest(digests->second, segment, *content)) {
+      _LOG_ERROR("Segment " << segment << " of " << fileSegmentBaseName
+                            << " does not match the manifest, ignoring");
+      return;
+    }
+  }
+
   _LOG_DEBUG("Received segment deviceName: " << deviceName << ", segmentBaseName: " << fileSegmentBaseName
                                              << ", segment: "
                                              << segment);
@@ -447,6 +706,16 @@ Dispatcher::Did_FetchManager_FileFetchComplete_Execute(Ccnx::Name deviceName, Cc
 
   _LOG_DEBUG("Finished fetching " << deviceName << ", fileBaseName: " << fileBaseName);
 
+  if (fileBaseName.getCompFromBackAsString(1) == "chunk") {
+    Did_FetchManager_ChunkFetchComplete(fileBaseName);
+    return;
+  }
+
+  if (FetchNextSegmentRun(deviceName, fileBaseName)) {
+    // other segments of the file are still missing
+    return;
+  }
+
   const Bytes& hashBytes = fileBaseName.getCompFromBack(0);
   Hash hash(head(hashBytes), hashBytes.size());
   _LOG_DEBUG("Extracted hash: " << hash.shortHash());
@@ -458,6 +727,20 @@ Dispatcher::Did_FetchManager_FileFetchComplete_Execute(Ccnx::Name deviceName, Cc
   else {
     _LOG_ERROR("no db available for this file: " << hash);
   }
+  m_segmentDigests.erase(hash);
+
+  std::map<Hash, std::vector<std::pair<Name, ActionItemPtr>>>::iterator manifestWaiters =
+    m_manifestWaiters.find(hash);
+  if (manifestWaiters != m_manifestWaiters.end()) {
+    // fetched file is the manifest of new versions of files
+    std::vector<std::pair<Name, ActionItemPtr>> waiters;
+    waiters.swap(manifestWaiters->second);
+    m_manifestWaiters.erase(manifestWaiters);
+
+    for (size_t i = 0; i < waiters.size(); i++) {
+      ReuseParentSegments(waiters[i].first, waiters[i].second);
+    }
+  }
 
   FileItemsPtr filesToAssemble = m_fileState->LookupFilesForHash(hash);
 
@@ -480,7 +763,13 @@ Dispatcher::Did_FetchManager_FileFetchComplete_Execute(Ccnx::Name deviceName, Cc
 
     if (ObjectDb::DoesExist(m_rootDir / ".chronoshare", deviceName,
                             boost::lexical_cast<string>(hash))) {
-      bool ok = m_objectManager.objectsToLocalFile(deviceName, hash, filePath);
+      if (file->chunked() && !FetchMissingChunks(deviceName, fileBaseName, hash, *file)) {
+        // file will be assembled when all chunks are fetched
+        continue;
+      }
+
+      bool ok = m_objectManager.objectsToLocalFile(deviceName, hash, filePath, file->seg_size(),
+                                                   file->chunked());
       if (ok) {
         last_write_time(filePath, file->mtime());
 #if BOOST_VERSION >= 104900
@@ -502,6 +791,73 @@ Dispatcher::Did_FetchManager_FileFetchComplete_Execute(Ccnx::Name deviceName, Cc
   }
 }
 
+bool
+Dispatcher::FetchMissingChunks(const Ccnx::Name& deviceName, const Ccnx::Name& fileBaseName,
+                               const Hash& hash, const FileItem& file)
+{
+  if (m_missingChunkCounts.find(fileBaseName) != m_missingChunkCounts.end()) {
+    _LOG_DEBUG("Chunks of " << fileBaseName << " are already being fetched");
+    return false;
+  }
+
+  std::vector<HashPtr> missing;
+  if (!m_objectManager.findMissingChunks(deviceName, hash, file.seg_size(), missing)) {
+    _LOG_ERROR("Chunk list of " << fileBaseName << " is not available");
+    return false;
+  }
+  if (missing.empty()) {
+    return true;
+  }
+
+  _LOG_DEBUG("Fetching " << missing.size() << " missing chunks of " << fileBaseName);
+  m_missingChunkCounts[fileBaseName] = missing.size();
+
+  for (std::vector<HashPtr>::iterator digest = missing.begin(); digest != missing.end(); ++digest) {
+    std::vector<Name>& waiters = m_chunkWaiters[**digest];
+    if (waiters.empty()) {
+      // chunks shared with other files being fetched are requested only once
+      Name chunkBaseName =
+        Name("/")(deviceName)(CHRONOSHARE_APP)("chunk")((*digest)->GetHash(),
+                                                        (*digest)->GetHashBytes());
+      m_fileFetcher->Enqueue(deviceName, chunkBaseName, 0, 0, FetchManager::PRIORITY_NORMAL);
+    }
+    waiters.push_back(fileBaseName);
+  }
+
+  return false;
+}
+
+void
+Dispatcher::Did_FetchManager_ChunkFetchComplete(const Ccnx::Name& chunkBaseName)
+{
+  // chunkBaseName:  /<device_name>/<appname>/chunk/<digest>
+
+  const Bytes& digestBytes = chunkBaseName.getCompFromBack(0);
+  Hash digest(head(digestBytes), digestBytes.size());
+
+  std::map<Hash, std::vector<Name>>::iterator waiters = m_chunkWaiters.find(digest);
+  if (waiters == m_chunkWaiters.end()) {
+    return;
+  }
+
+  std::vector<Name> fileBaseNames;
+  fileBaseNames.swap(waiters->second);
+  m_chunkWaiters.erase(waiters);
+
+  for (std::vector<Name>::iterator fileBaseName = fileBaseNames.begin();
+       fileBaseName != fileBaseNames.end(); ++fileBaseName) {
+    std::map<Name, size_t>::iterator count = m_missingChunkCounts.find(*fileBaseName);
+    if (count == m_missingChunkCounts.end() || --count->second > 0) {
+      continue;
+    }
+    m_missingChunkCounts.erase(count);
+
+    // fileBaseName:  /<device_name>/<appname>/file/<hash>
+    Name deviceName = fileBaseName->getPartialName(0, fileBaseName->size() - 3);
+    Did_FetchManager_FileFetchComplete_Execute(deviceName, *fileBaseName);
+  }
+}
+
 // moved to state-server
 // void
 // Dispatcher::Restore_LocalFile_Execute (FileItemPtr file)
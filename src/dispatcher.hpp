@@ -34,7 +34,9 @@
 #include <boost/filesystem.hpp>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <map>
+#include <vector>
 
 typedef boost::shared_ptr<ActionItem> ActionItemPtr;
 
@@ -74,6 +76,28 @@ public:
     return m_core->root();
   }
 
+  /**
+   * @brief Enable or disable content-defined chunking of local files (see ObjectManager)
+   *
+   * Devices running previous versions cannot assemble chunked files
+   */
+  void
+  SetContentDefinedChunking(bool enabled)
+  {
+    m_objectManager.setContentDefinedChunking(enabled);
+  }
+
+  /**
+   * @brief Enable or disable publishing local files with digest segments (see ObjectManager)
+   *
+   * Devices running previous versions cannot verify digest segments
+   */
+  void
+  SetDigestSegments(bool enabled)
+  {
+    m_objectManager.setDigestSegments(enabled);
+  }
+
   inline void
   LookupRecentFileActions(const boost::function<void(const std::string&, int, int)>& visitor,
                           int limit)
@@ -121,6 +145,54 @@ private:
   Did_FetchManager_ActionFetch(const Ccnx::Name& deviceName, const Ccnx::Name& actionName,
                                uint32_t seqno, Ccnx::PcoPtr actionPco);
 
+  /**
+   * @brief Add all queued actions to ActionLog in one batch
+   */
+  void
+  Did_FetchManager_ActionFetch_Execute();
+
+  void
+  ProcessRemoteAction(const Ccnx::Name& deviceName, ActionItemPtr action);
+
+  /**
+   * @brief Start fetching segments of the new version of a file that changed since the parent
+   *        version
+   *
+   * Used when segments carry only digests and cannot be verified without the manifest.  The
+   * manifest is fetched first, if necessary, and segments of the parent version are reused if
+   * it is available locally.
+   *
+   * @return false if all segments have to be fetched
+   */
+  bool
+  FetchChangedSegments(const Ccnx::Name& deviceName, ActionItemPtr action);
+
+  /**
+   * @brief Reuse segments of the parent version and fetch the rest (manifest must be available)
+   *
+   * If the parent version is not available, all segments are fetched.
+   */
+  void
+  ReuseParentSegments(const Ccnx::Name& deviceName, ActionItemPtr action);
+
+  /**
+   * @brief Start fetching the next range of missing segments of the file
+   * @return false if there are no more ranges to fetch
+   */
+  bool
+  FetchNextSegmentRun(const Ccnx::Name& deviceName, const Ccnx::Name& fileNameBase);
+
+  /**
+   * @brief Make sure digests of segments of the file are loaded if it has digest segments
+   *
+   * Digests are read from the manifest in the store.  If the manifest is not available, it is
+   * fetched and segments that are rejected until then are fetched again afterwards.
+   *
+   * @return false if the file has digest segments and its manifest is not available
+   */
+  bool
+  LoadSegmentDigests(const Ccnx::Name& deviceName, const Hash& hash);
+
   void
   Did_ActionLog_ActionApply_Delete(const std::string& filename);
 
@@ -148,6 +220,17 @@ private:
   void
   Did_LocalPrefix_Updated(const Ccnx::Name& prefix);
 
+  /**
+   * @brief Start fetching chunks of the chunked file that are not in the store
+   * @return true if all chunks are available and the file can be assembled
+   */
+  bool
+  FetchMissingChunks(const Ccnx::Name& deviceName, const Ccnx::Name& fileBaseName,
+                     const Hash& hash, const FileItem& file);
+
+  void
+  Did_FetchManager_ChunkFetchComplete(const Ccnx::Name& chunkBaseName);
+
 private:
   void
   AssembleFile_Execute(const Ccnx::Name& deviceName, const Hash& filehash,
@@ -185,6 +268,18 @@ private:
 
   std::map<Hash, ObjectDbPtr> m_objectDbMap;
 
+  // chunks being fetched -> base names of chunked files waiting for them
+  std::map<Hash, std::vector<Ccnx::Name>> m_chunkWaiters;
+  // base names of chunked files -> number of chunks they are still waiting for
+  std::map<Ccnx::Name, size_t> m_missingChunkCounts;
+
+  // manifests being fetched -> actions waiting for them, with their device names
+  std::map<Hash, std::vector<std::pair<Ccnx::Name, ActionItemPtr>>> m_manifestWaiters;
+  // files with digest segments being fetched -> SHA-256 digests of their segments (manifests)
+  std::map<Hash, std::string> m_segmentDigests;
+  // base names of files fetched by ranges -> ranges of segments that are not fetched yet
+  std::map<Ccnx::Name, std::vector<std::pair<uint64_t, uint64_t>>> m_pendingSegmentRuns;
+
   std::string m_sharedFolder;
   ContentServer* m_server;
   StateServer* m_stateServer;
@@ -192,6 +287,10 @@ private:
 
   FetchManagerPtr m_actionFetcher;
   FetchManagerPtr m_fileFetcher;
+
+  // fetched actions waiting to be added to ActionLog
+  boost::mutex m_pendingActionsMutex;
+  std::vector<std::pair<Ccnx::Name, Ccnx::PcoPtr>> m_pendingActions;
 };
 
 namespace Error {
@@ -248,10 +248,12 @@ FetchManager::DidFetchComplete(Fetcher& fetcher, const Name& deviceName, const N
     }
   }
 
-  // like TCP timed-wait
+  // like TCP timed-wait (tag is unique for the fetcher, as ranges of the same file can be fetched
+  // one after another)
   m_scheduler->scheduleOneTimeTask(m_scheduler, 10,
                                    boost::bind(&FetchManager::TimedWait, this, ref(fetcher)),
-                                   boost::lexical_cast<string>(baseName));
+                                   boost::lexical_cast<string>(baseName) + "#" +
+                                     boost::lexical_cast<string>(&fetcher));
 
   m_scheduler->rescheduleTaskAt(m_scheduleFetchesTask, 0);
 }
@@ -0,0 +1,99 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "file-reader.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ndn {
+namespace chronoshare {
+
+FileReader::FileReader(const boost::filesystem::path& file)
+  : m_fd(::open(file.c_str(), O_RDONLY))
+  , m_size(0)
+  , m_offset(0)
+{
+  struct stat st;
+  if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+    if (m_fd >= 0) {
+      close(m_fd);
+    }
+    BOOST_THROW_EXCEPTION(Error("Cannot open file: [" + file.string() + "]"));
+  }
+  m_size = st.st_size;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+FileReader::~FileReader()
+{
+  close(m_fd);
+}
+
+size_t
+FileReader::read(uint8_t* buf, size_t size)
+{
+  if (m_offset + size > m_size) {
+    size = m_size - m_offset;
+  }
+
+#ifdef POSIX_FADV_WILLNEED
+  // the next block is read by the kernel while this one is processed
+  if (m_offset + size < m_size) {
+    posix_fadvise(m_fd, m_offset + size, size, POSIX_FADV_WILLNEED);
+  }
+#endif
+
+  size_t done = 0;
+  while (done < size) {
+    ssize_t bytes = pread(m_fd, buf + done, size - done, m_offset + done);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      BOOST_THROW_EXCEPTION(Error("Cannot read file: " + std::string(std::strerror(errno))));
+    }
+    if (bytes == 0) {
+      // file was truncated
+      m_size = m_offset + done;
+      break;
+    }
+    done += bytes;
+  }
+
+  m_offset += done;
+  return done;
+}
+
+void
+FileReader::rewind()
+{
+  m_offset = 0;
+}
+
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,88 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#ifndef CHRONOSHARE_SRC_FILE_READER_HPP
+#define CHRONOSHARE_SRC_FILE_READER_HPP
+
+#include "core/chronoshare-common.hpp"
+
+#include <boost/filesystem.hpp>
+
+namespace ndn {
+namespace chronoshare {
+
+/**
+ * @brief Sequential reader of a local file with large reads
+ *
+ * While the caller processes a block, the kernel reads the next block of the same size ahead
+ * (POSIX_FADV_WILLNEED), so disk I/O overlaps with hashing and signing of the file.
+ *
+ * Reads never go past the size of the file at the time it was opened, so a file that grows
+ * while it is being published is read as a consistent prefix.  If the file is truncated, the
+ * size is reduced to what could be read.
+ */
+class FileReader : boost::noncopyable
+{
+public:
+  class Error : public std::runtime_error
+  {
+  public:
+    explicit Error(const std::string& what)
+      : std::runtime_error(what)
+    {
+    }
+  };
+
+  /**
+   * @throw Error if the file cannot be opened
+   */
+  explicit FileReader(const boost::filesystem::path& file);
+  ~FileReader();
+
+  uint64_t
+  getSize() const
+  {
+    return m_size;
+  }
+
+  /**
+   * @brief Read up to size bytes at the current position
+   * @return number of bytes read, 0 at the end of the file
+   * @throw Error if the file cannot be read
+   */
+  size_t
+  read(uint8_t* buf, size_t size);
+
+  /**
+   * @brief Start reading from the beginning of the file again
+   */
+  void
+  rewind();
+
+private:
+  int m_fd;
+  uint64_t m_size;
+  uint64_t m_offset;
+};
+
+} // namespace chronoshare
+} // namespace ndn
+
+#endif // CHRONOSHARE_SRC_FILE_READER_HPP
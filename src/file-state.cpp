@@ -42,6 +42,10 @@ CREATE TABLE FileState (                                                \n\
     file_chmod  INTEGER,                                                \n\
     file_seg_num INTEGER,                                               \n\
     is_complete INTEGER,                                               \n\
+    file_seg_size INTEGER, /* NULL if not known */                      \n\
+    file_chunked INTEGER, /* NULL if segments carry file content */     \n\
+    file_manifest_hash BLOB, /* NULL if the manifest is not published */ \n\
+    file_digest_segments INTEGER, /* NULL if segments are signed */     \n\
                                                                         \n\
     PRIMARY KEY (type, filename)                                        \n\
 );                                                                      \n\
@@ -50,11 +54,67 @@ CREATE INDEX FileState_device_name_seq_no ON FileState (device_name, seq_no); \n
 CREATE INDEX FileState_type_file_hash ON FileState (type, file_hash);   \n\
 ";
 
+// Changes after the initial schema (applied to existing databases as well)
+const std::string UPGRADE_DATABASE = "\
+CREATE INDEX IF NOT EXISTS FileState_type_directory ON FileState (type, directory); \n\
+                                                                        \n\
+CREATE TABLE IF NOT EXISTS FileStateAppliedAction (                     \n\
+    action_id   INTEGER NOT NULL /* see SetLastAppliedAction */         \n\
+);                                                                      \n\
+INSERT INTO FileStateAppliedAction (action_id)                          \n\
+    SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM FileStateAppliedAction);   \n\
+";
+
+const size_t FileState::FILE_CACHE_BUDGET = 32 * 1024 * 1024;
+
+// rough memory overhead of a cached file besides its strings
+static const size_t FILE_CACHE_ENTRY_OVERHEAD = 256;
+
+static void
+readFileItem(sqlite3_stmt* stmt, FileItem& file)
+{
+  file.set_filename(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+                    sqlite3_column_bytes(stmt, 0));
+  file.set_version(sqlite3_column_int64(stmt, 1));
+  file.set_device_name(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2));
+  file.set_seq_no(sqlite3_column_int64(stmt, 3));
+  file.set_file_hash(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
+  file.set_mtime(sqlite3_column_int(stmt, 5));
+  file.set_mode(sqlite3_column_int(stmt, 6));
+  file.set_seg_num(sqlite3_column_int64(stmt, 7));
+  file.set_is_complete(sqlite3_column_int(stmt, 8));
+  if (sqlite3_column_type(stmt, 9) != SQLITE_NULL) {
+    file.set_seg_size(sqlite3_column_int(stmt, 9));
+  }
+  if (sqlite3_column_int(stmt, 10) != 0) {
+    file.set_chunked(true);
+  }
+  if (sqlite3_column_type(stmt, 11) != SQLITE_NULL) {
+    file.set_manifest_hash(sqlite3_column_blob(stmt, 11), sqlite3_column_bytes(stmt, 11));
+  }
+  if (sqlite3_column_int(stmt, 12) != 0) {
+    file.set_digest_segments(true);
+  }
+}
+
 FileState::FileState(const boost::filesystem::path& path)
   : DbHelper(path / ".chronoshare", "file-state.db")
+  , m_fileCacheSize(0)
+  , m_fileCacheBudget(FILE_CACHE_BUDGET)
+  , m_isFileCacheComplete(false)
 {
   sqlite3_exec(m_db, INIT_DATABASE.c_str(), NULL, NULL, NULL);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  sqlite3_exec(m_db, UPGRADE_DATABASE.c_str(), NULL, NULL, NULL);
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  // columns added after the initial schema
+  addColumn("FileState", "file_seg_size", "INTEGER");
+  addColumn("FileState", "file_chunked", "INTEGER");
+  addColumn("FileState", "file_manifest_hash", "BLOB");
+  addColumn("FileState", "file_digest_segments", "INTEGER");
+  clearStatementCache();
+
+  loadFileCache();
 }
 
 FileState::~FileState()
@@ -64,53 +124,75 @@ FileState::~FileState()
 void
 FileState::UpdateFile(const std::string& filename, sqlite3_int64 version, const Buffer& hash,
                       const Buffer& device_name, sqlite3_int64 seq_no, time_t atime, time_t mtime,
-                      time_t ctime, int mode, int seg_num)
+                      time_t ctime, int mode, int seg_num, int seg_size /*=0*/,
+                      bool chunked /*=false*/, ConstBufferPtr manifest_hash /*=nullptr*/,
+                      bool digest_segments /*=false*/)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "UPDATE FileState "
-                           "SET "
-                           "device_name=?, seq_no=?, "
-                           "version=?,"
-                           "file_hash=?,"
-                           "file_atime=datetime(?, 'unixepoch'),"
-                           "file_mtime=datetime(?, 'unixepoch'),"
-                           "file_ctime=datetime(?, 'unixepoch'),"
-                           "file_chmod=?, "
-                           "file_seg_num=? "
-                           "WHERE type=0 AND filename=?",
-                     -1, &stmt, 0);
-
-  sqlite3_bind_blob(stmt, 1, device_name.buf(), device_name.size(), SQLITE_STATIC);
-  sqlite3_bind_int64(stmt, 2, seq_no);
-  sqlite3_bind_int64(stmt, 3, version);
-  sqlite3_bind_blob(stmt, 4, hash.buf(), hash.size(), SQLITE_STATIC);
-  sqlite3_bind_int64(stmt, 5, atime);
-  sqlite3_bind_int64(stmt, 6, mtime);
-  sqlite3_bind_int64(stmt, 7, ctime);
-  sqlite3_bind_int(stmt, 8, mode);
-  sqlite3_bind_int(stmt, 9, seg_num);
-  sqlite3_bind_text(stmt, 10, filename.c_str(), -1, SQLITE_STATIC);
+  // the transaction lock is taken before the cache lock, as ActionLog calls in with its
+  // transaction open.  The cache is updated before the commit and dropped if it fails
+  beginTransaction();
+  WriteLock lock(m_fileCacheMutex);
+
+  FileItemPtr file;
+  bool isCached = findCachedFile(filename, file);
+
+  int affected_rows = 0;
+  if (!isCached || file) {
+    Statement stmt(*this, "UPDATE FileState "
+                          "SET "
+                          "device_name=?, seq_no=?, "
+                          "version=?,"
+                          "file_hash=?,"
+                          "file_atime=datetime(?, 'unixepoch'),"
+                          "file_mtime=datetime(?, 'unixepoch'),"
+                          "file_ctime=datetime(?, 'unixepoch'),"
+                          "file_chmod=?, "
+                          "file_seg_num=?, "
+                          "file_seg_size=?, "
+                          "file_chunked=?, "
+                          "file_manifest_hash=?, "
+                          "file_digest_segments=? "
+                          "WHERE type=0 AND filename=?");
+
+    sqlite3_bind_blob(stmt, 1, device_name.buf(), device_name.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, seq_no);
+    sqlite3_bind_int64(stmt, 3, version);
+    sqlite3_bind_blob(stmt, 4, hash.buf(), hash.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, atime);
+    sqlite3_bind_int64(stmt, 6, mtime);
+    sqlite3_bind_int64(stmt, 7, ctime);
+    sqlite3_bind_int(stmt, 8, mode);
+    sqlite3_bind_int(stmt, 9, seg_num);
+    if (seg_size > 0) {
+      sqlite3_bind_int(stmt, 10, seg_size);
+    }
+    if (chunked) {
+      sqlite3_bind_int(stmt, 11, 1);
+    }
+    if (manifest_hash != nullptr) {
+      sqlite3_bind_blob(stmt, 12, manifest_hash->buf(), manifest_hash->size(), SQLITE_STATIC);
+    }
+    if (digest_segments) {
+      sqlite3_bind_int(stmt, 13, 1);
+    }
+    sqlite3_bind_text(stmt, 14, filename.c_str(), -1, SQLITE_STATIC);
 
-  sqlite3_step(stmt);
+    sqlite3_step(stmt);
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_ROW && sqlite3_errcode(m_db) != SQLITE_DONE,
-                  sqlite3_errmsg(m_db));
+    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_ROW && sqlite3_errcode(m_db) != SQLITE_DONE,
+                    sqlite3_errmsg(m_db));
 
-  sqlite3_finalize(stmt);
+    affected_rows = sqlite3_changes(m_db);
+  }
 
-  int affected_rows = sqlite3_changes(m_db);
   if (affected_rows == 0) // file didn't exist
   {
-    sqlite3_stmt* stmt;
-    sqlite3_prepare_v2(m_db,
-                       "INSERT INTO FileState "
-                       "(type,filename,version,device_name,seq_no,file_hash,"
-                       "file_atime,file_mtime,file_ctime,file_chmod,file_seg_num) "
-                       "VALUES (0, ?, ?, ?, ?, ?, "
-                       "datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?, ?)",
-                       -1, &stmt, 0);
-
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+    Statement stmt(*this, "INSERT INTO FileState "
+                          "(type,filename,version,device_name,seq_no,file_hash,"
+                          "file_atime,file_mtime,file_ctime,file_chmod,file_seg_num,directory,"
+                          "file_seg_size,file_chunked,file_manifest_hash,file_digest_segments) "
+                          "VALUES (0, ?, ?, ?, ?, ?, "
+                          "datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?, ?, ?, ?, ?, ?, ?)");
 
     sqlite3_bind_text(stmt, 1, filename.c_str(), -1, SQLITE_STATIC);
     sqlite3_bind_int64(stmt, 2, version);
@@ -123,49 +205,131 @@ FileState::UpdateFile(const std::string& filename, sqlite3_int64 version, const
     sqlite3_bind_int(stmt, 9, mode);
     sqlite3_bind_int(stmt, 10, seg_num);
 
+    // the same as directory_name(filename), NULL for files in the root folder
+    std::string directory = boost::filesystem::path(filename).parent_path().generic_string();
+    if (!directory.empty()) {
+      sqlite3_bind_text(stmt, 11, directory.c_str(), directory.size(), SQLITE_STATIC);
+    }
+    if (seg_size > 0) {
+      sqlite3_bind_int(stmt, 12, seg_size);
+    }
+    if (chunked) {
+      sqlite3_bind_int(stmt, 13, 1);
+    }
+    if (manifest_hash != nullptr) {
+      sqlite3_bind_blob(stmt, 14, manifest_hash->buf(), manifest_hash->size(), SQLITE_STATIC);
+    }
+    if (digest_segments) {
+      sqlite3_bind_int(stmt, 15, 1);
+    }
+
     sqlite3_step(stmt);
     _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-    sqlite3_finalize(stmt);
+  }
 
-    sqlite3_prepare_v2(m_db,
-                       "UPDATE FileState SET directory=directory_name(filename) WHERE filename=?",
-                       -1, &stmt, 0);
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  FileItemPtr newFile = make_shared<FileItem>();
+  newFile->set_filename(filename);
+  newFile->set_version(version);
+  newFile->set_device_name(device_name.buf(), device_name.size());
+  newFile->set_seq_no(seq_no);
+  newFile->set_file_hash(hash.buf(), hash.size());
+  newFile->set_mtime(mtime);
+  newFile->set_mode(mode);
+  newFile->set_seg_num(seg_num);
+  if (seg_size > 0) {
+    newFile->set_seg_size(seg_size);
+  }
+  if (chunked) {
+    newFile->set_chunked(true);
+  }
+  if (manifest_hash != nullptr) {
+    newFile->set_manifest_hash(manifest_hash->buf(), manifest_hash->size());
+  }
+  if (digest_segments) {
+    newFile->set_digest_segments(true);
+  }
+  // UPDATE keeps is_complete of the previous version
+  newFile->set_is_complete(affected_rows > 0 && isCached && file->is_complete());
 
-    sqlite3_bind_text(stmt, 1, filename.c_str(), -1, SQLITE_STATIC);
-    sqlite3_step(stmt);
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-    sqlite3_finalize(stmt);
+  if (affected_rows > 0 && !isCached) {
+    // previous value of is_complete is unknown
+    uncacheFile(filename);
+  }
+  else {
+    cacheFile(filename, newFile);
   }
+
+  lock.unlock();
+  commitTransaction();
 }
 
 void
 FileState::DeleteFile(const std::string& filename)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "DELETE FROM FileState WHERE type=0 AND filename=?", -1, &stmt, 0);
+  Statement stmt(*this, "DELETE FROM FileState WHERE type=0 AND filename=?");
   sqlite3_bind_text(stmt, 1, filename.c_str(), -1, SQLITE_STATIC);
 
   _LOG_DEBUG("Delete " << filename);
 
+  beginTransaction();
+  {
+    WriteLock lock(m_fileCacheMutex);
+    sqlite3_step(stmt);
+    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
+    cacheFile(filename, FileItemPtr());
+  }
+  commitTransaction();
+}
+
+void
+FileState::SetLastAppliedAction(sqlite3_int64 actionId)
+{
+  Statement stmt(*this, "UPDATE FileStateAppliedAction SET action_id=?");
+  sqlite3_bind_int64(stmt, 1, actionId);
   sqlite3_step(stmt);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-  sqlite3_finalize(stmt);
+}
+
+sqlite3_int64
+FileState::GetLastAppliedAction()
+{
+  Statement stmt(*this, "SELECT action_id FROM FileStateAppliedAction");
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    return 0;
+  }
+  return sqlite3_column_int64(stmt, 0);
+}
+
+void
+FileState::BeginBatch()
+{
+  beginTransaction();
+}
+
+void
+FileState::CommitBatch()
+{
+  commitTransaction();
 }
 
 void
 FileState::SetFileComplete(const std::string& filename)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "UPDATE FileState SET is_complete=1 WHERE type = 0 AND filename = ?", -1,
-                     &stmt, 0);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  Statement stmt(*this, "UPDATE FileState SET is_complete=1 WHERE type = 0 AND filename = ?");
   sqlite3_bind_text(stmt, 1, filename.c_str(), -1, SQLITE_STATIC);
 
-  sqlite3_step(stmt);
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
+  beginTransaction();
+  {
+    WriteLock lock(m_fileCacheMutex);
+    sqlite3_step(stmt);
+    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
-  sqlite3_finalize(stmt);
+    FileItemPtr file;
+    if (findCachedFile(filename, file) && file) {
+      file->set_is_complete(true);
+    }
+  }
+  commitTransaction();
 }
 
 /**
@@ -174,44 +338,49 @@ FileState::SetFileComplete(const std::string& filename)
 FileItemPtr
 FileState::LookupFile(const std::string& filename)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db,
-                     "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete "
-                     "       FROM FileState "
-                     "       WHERE type = 0 AND filename = ?",
-                     -1, &stmt, 0);
+  WriteLock lock(m_fileCacheMutex);
+
+  FileItemPtr cached;
+  if (findCachedFile(filename, cached)) {
+    // callers may modify the returned item
+    return cached ? make_shared<FileItem>(*cached) : cached;
+  }
+
+  Statement stmt(*this, "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete,file_seg_size,file_chunked,file_manifest_hash,file_digest_segments "
+                        "       FROM FileState "
+                        "       WHERE type = 0 AND filename = ?");
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
   sqlite3_bind_text(stmt, 1, filename.c_str(), -1, SQLITE_STATIC);
 
   FileItemPtr retval;
   if (sqlite3_step(stmt) == SQLITE_ROW) {
     retval = make_shared<FileItem>();
-    retval->set_filename(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
-                         sqlite3_column_bytes(stmt, 0));
-    retval->set_version(sqlite3_column_int64(stmt, 1));
-    retval->set_device_name(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2));
-    retval->set_seq_no(sqlite3_column_int64(stmt, 3));
-    retval->set_file_hash(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
-    retval->set_mtime(sqlite3_column_int(stmt, 5));
-    retval->set_mode(sqlite3_column_int(stmt, 6));
-    retval->set_seg_num(sqlite3_column_int64(stmt, 7));
-    retval->set_is_complete(sqlite3_column_int(stmt, 8));
+    readFileItem(stmt, *retval);
   }
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-  sqlite3_finalize(stmt);
 
-  return retval;
+  cacheFile(filename, retval);
+  return retval ? make_shared<FileItem>(*retval) : retval;
 }
 
 FileItemsPtr
 FileState::LookupFilesForHash(const Buffer& hash)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db,
-                     "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete "
-                     "   FROM FileState "
-                     "   WHERE type = 0 AND file_hash = ?",
-                     -1, &stmt, 0);
+  WriteLock lock(m_fileCacheMutex);
+
+  if (m_isFileCacheComplete) {
+    FileItemsPtr retval = make_shared<FileItems>();
+    std::string fileHash(hash.begin(), hash.end());
+    for (auto it = m_fileCacheByHash.lower_bound(std::make_pair(fileHash, std::string()));
+         it != m_fileCacheByHash.end() && it->first == fileHash; ++it) {
+      retval->push_back(*m_fileCache[it->second].file);
+    }
+    return retval;
+  }
+
+  Statement stmt(*this, "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete,file_seg_size,file_chunked,file_manifest_hash,file_digest_segments "
+                        "   FROM FileState "
+                        "   WHERE type = 0 AND file_hash = ?");
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
   sqlite3_bind_blob(stmt, 1, hash.buf(), hash.size(), SQLITE_STATIC);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
@@ -219,23 +388,12 @@ FileState::LookupFilesForHash(const Buffer& hash)
   FileItemsPtr retval = make_shared<FileItems>();
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     FileItem file;
-    file.set_filename(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
-                      sqlite3_column_bytes(stmt, 0));
-    file.set_version(sqlite3_column_int64(stmt, 1));
-    file.set_device_name(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2));
-    file.set_seq_no(sqlite3_column_int64(stmt, 3));
-    file.set_file_hash(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
-    file.set_mtime(sqlite3_column_int(stmt, 5));
-    file.set_mode(sqlite3_column_int(stmt, 6));
-    file.set_seg_num(sqlite3_column_int64(stmt, 7));
-    file.set_is_complete(sqlite3_column_int(stmt, 8));
+    readFileItem(stmt, file);
 
     retval->push_back(file);
   }
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
 
-  sqlite3_finalize(stmt);
-
   return retval;
 }
 
@@ -243,13 +401,11 @@ void
 FileState::LookupFilesInFolder(const function<void(const FileItem&)>& visitor,
                                const std::string& folder, int offset /*=0*/, int limit /*=-1*/)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db,
-                     "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete "
-                     "   FROM FileState "
-                     "   WHERE type = 0 AND directory = ?"
-                     "   LIMIT ? OFFSET ?",
-                     -1, &stmt, 0);
+  ReadConnection connection(*this);
+  Statement stmt(connection, "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete,file_seg_size,file_chunked,file_manifest_hash,file_digest_segments "
+                        "   FROM FileState "
+                        "   WHERE type = 0 AND directory = ?"
+                        "   LIMIT ? OFFSET ?");
   if (folder.size() == 0)
     sqlite3_bind_null(stmt, 1);
   else
@@ -260,23 +416,12 @@ FileState::LookupFilesInFolder(const function<void(const FileItem&)>& visitor,
 
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     FileItem file;
-    file.set_filename(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
-                      sqlite3_column_bytes(stmt, 0));
-    file.set_version(sqlite3_column_int64(stmt, 1));
-    file.set_device_name(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2));
-    file.set_seq_no(sqlite3_column_int64(stmt, 3));
-    file.set_file_hash(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
-    file.set_mtime(sqlite3_column_int(stmt, 5));
-    file.set_mode(sqlite3_column_int(stmt, 6));
-    file.set_seg_num(sqlite3_column_int64(stmt, 7));
-    file.set_is_complete(sqlite3_column_int(stmt, 8));
+    readFileItem(stmt, file);
 
     visitor(file);
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-
-  sqlite3_finalize(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_DONE, sqlite3_errmsg(connection));
 }
 
 FileItemsPtr
@@ -300,63 +445,49 @@ FileState::LookupFilesInFolderRecursively(const function<void(const FileItem&)>&
   if (limit >= 0)
     limit++;
 
-  sqlite3_stmt* stmt;
-  if (folder != "") {
-    /// @todo Do something to improve efficiency of this query. Right now it is basically scanning the whole database
-
-    sqlite3_prepare_v2(m_db,
-                       "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete "
-                       "   FROM FileState "
-                       "   WHERE type = 0 AND is_dir_prefix(?, directory)=1 "
-                       "   ORDER BY filename "
-                       "   LIMIT ? OFFSET ?",
-                       -1, &stmt,
-                       0); // there is a small ambiguity with is_prefix matching, but should be ok for now
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  // The folder and its subfolders are a range scan of FileState_type_directory (see
+  // ActionLog::LookupActionsInFolderRecursively)
+  ReadConnection connection(*this);
+  Statement stmt(connection,
+                 folder != "" ?
+                   "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete,file_seg_size,file_chunked,file_manifest_hash,file_digest_segments "
+                   "   FROM FileState "
+                   "   WHERE type = 0 AND directory >= :folder AND directory < :folder || '0' AND "
+                   "         (directory = :folder OR directory > :folder || '/') "
+                   "   ORDER BY filename "
+                   "   LIMIT ? OFFSET ?" :
+                   "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete,file_seg_size,file_chunked,file_manifest_hash,file_digest_segments "
+                   "   FROM FileState "
+                   "   WHERE type = 0"
+                   "   ORDER BY filename "
+                   "   LIMIT ? OFFSET ?");
 
+  if (folder != "") {
     sqlite3_bind_text(stmt, 1, folder.c_str(), folder.size(), SQLITE_STATIC);
-    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+    _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
     sqlite3_bind_int(stmt, 2, limit);
     sqlite3_bind_int(stmt, 3, offset);
   }
   else {
-    sqlite3_prepare_v2(m_db,
-                       "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete "
-                       "   FROM FileState "
-                       "   WHERE type = 0"
-                       "   ORDER BY filename "
-                       "   LIMIT ? OFFSET ?",
-                       -1, &stmt, 0);
     sqlite3_bind_int(stmt, 1, limit);
     sqlite3_bind_int(stmt, 2, offset);
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, sqlite3_errmsg(m_db));
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_OK, sqlite3_errmsg(connection));
 
   while (sqlite3_step(stmt) == SQLITE_ROW) {
     if (limit == 1)
       break;
 
     FileItem file;
-    file.set_filename(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
-                      sqlite3_column_bytes(stmt, 0));
-    file.set_version(sqlite3_column_int64(stmt, 1));
-    file.set_device_name(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2));
-    file.set_seq_no(sqlite3_column_int64(stmt, 3));
-    file.set_file_hash(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
-    file.set_mtime(sqlite3_column_int(stmt, 5));
-    file.set_mode(sqlite3_column_int(stmt, 6));
-    file.set_seg_num(sqlite3_column_int64(stmt, 7));
-    file.set_is_complete(sqlite3_column_int(stmt, 8));
+    readFileItem(stmt, file);
 
     visitor(file);
     limit--;
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, sqlite3_errmsg(m_db));
-
-  sqlite3_finalize(stmt);
+  _LOG_DEBUG_COND(sqlite3_errcode(connection) != SQLITE_DONE, sqlite3_errmsg(connection));
 
   return (limit == 1);
 }
@@ -373,5 +504,134 @@ FileState::LookupFilesInFolderRecursively(const std::string& folder, int offset
   return retval;
 }
 
+void
+FileState::SetFileCacheBudget(size_t budget)
+{
+  {
+    WriteLock lock(m_fileCacheMutex);
+    m_fileCacheBudget = budget;
+    clearFileCache();
+  }
+
+  loadFileCache();
+}
+
+void
+FileState::onTransactionRolledBack()
+{
+  // the cache is updated as soon as the changes are made, they may be gone now
+  {
+    WriteLock lock(m_fileCacheMutex);
+    clearFileCache();
+  }
+
+  loadFileCache();
+}
+
+void
+FileState::clearFileCache()
+{
+  m_fileCache.clear();
+  m_fileCacheLru.clear();
+  m_fileCacheByHash.clear();
+  m_fileCacheSize = 0;
+  m_isFileCacheComplete = false;
+}
+
+void
+FileState::loadFileCache()
+{
+  WriteLock lock(m_fileCacheMutex);
+  if (m_fileCacheBudget == 0) {
+    return;
+  }
+
+  Statement stmt(*this, "SELECT filename,version,device_name,seq_no,file_hash,strftime('%s', file_mtime),file_chmod,file_seg_num,is_complete,file_seg_size,file_chunked,file_manifest_hash,file_digest_segments "
+                        "   FROM FileState "
+                        "   WHERE type = 0");
+
+  m_isFileCacheComplete = true;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    FileItemPtr file = make_shared<FileItem>();
+    readFileItem(stmt, *file);
+    cacheFile(file->filename(), file);
+
+    if (!m_isFileCacheComplete) {
+      // the budget is exhausted, the rest is loaded on demand
+      break;
+    }
+  }
+
+  _LOG_DEBUG("Loaded " << m_fileCache.size() << " files into the cache"
+                       << (m_isFileCacheComplete ? "" : " (incomplete)"));
+}
+
+bool
+FileState::findCachedFile(const std::string& filename, FileItemPtr& file)
+{
+  auto cached = m_fileCache.find(filename);
+  if (cached == m_fileCache.end()) {
+    if (m_isFileCacheComplete) {
+      file.reset();
+      return true;
+    }
+    return false;
+  }
+
+  m_fileCacheLru.splice(m_fileCacheLru.begin(), m_fileCacheLru, cached->second.lruPosition);
+  file = cached->second.file;
+  return true;
+}
+
+void
+FileState::cacheFile(const std::string& filename, FileItemPtr file)
+{
+  if (m_fileCacheBudget == 0) {
+    return;
+  }
+
+  uncacheFile(filename);
+
+  if (!file && m_isFileCacheComplete) {
+    // absence of the file is implied
+    return;
+  }
+
+  CachedFile& cached = m_fileCache[filename];
+  cached.file = file;
+  cached.size = FILE_CACHE_ENTRY_OVERHEAD + 2 * filename.size();
+  if (file) {
+    cached.size += file->file_hash().size() + file->device_name().size() +
+                   file->manifest_hash().size();
+    m_fileCacheByHash.insert(std::make_pair(file->file_hash(), filename));
+  }
+  m_fileCacheLru.push_front(filename);
+  cached.lruPosition = m_fileCacheLru.begin();
+  m_fileCacheSize += cached.size;
+
+  while (m_fileCacheSize > m_fileCacheBudget && !m_fileCacheLru.empty()) {
+    std::string oldest = m_fileCacheLru.back();
+    uncacheFile(oldest);
+    m_isFileCacheComplete = false;
+  }
+}
+
+void
+FileState::uncacheFile(const std::string& filename)
+{
+  auto cached = m_fileCache.find(filename);
+  if (cached == m_fileCache.end()) {
+    return;
+  }
+
+  if (cached->second.file) {
+    m_fileCacheByHash.erase(std::make_pair(cached->second.file->file_hash(), filename));
+  }
+
+  m_fileCacheLru.erase(cached->second.lruPosition);
+  m_fileCacheSize -= cached->second.size;
+  m_fileCache.erase(cached);
+}
+
 } // namespace chronoshare
 } // namespace ndn
@@ -28,7 +28,11 @@
 
 #include <ndn-cxx/util/digest.hpp>
 
+#include <boost/thread/mutex.hpp>
+
 #include <list>
+#include <map>
+#include <set>
 
 namespace ndn {
 namespace chronoshare {
@@ -39,17 +43,25 @@ typedef shared_ptr<FileItems> FileItemsPtr;
 
 class FileState : public DbHelper
 {
+public:
+  static const size_t FILE_CACHE_BUDGET; // bytes
+
 public:
   FileState(const boost::filesystem::path& path);
   ~FileState();
 
   /**
    * @brief Update or add a file
+   * @param seg_size size of all segments except the last one, 0 if not known
+   * @param chunked whether segments carry the list of chunk digests instead of file content
+   * @param manifest_hash digest of the segment manifest, nullptr if it is not published
+   * @param digest_segments whether segments must be verified against the manifest
    */
   void
   UpdateFile(const std::string& filename, sqlite3_int64 version, const Buffer& hash,
              const Buffer& device_name, sqlite3_int64 seqno, time_t atime, time_t mtime,
-             time_t ctime, int mode, int seg_num);
+             time_t ctime, int mode, int seg_num, int seg_size = 0, bool chunked = false,
+             ConstBufferPtr manifest_hash = nullptr, bool digest_segments = false);
 
   /**
    * @brief Delete file
@@ -57,6 +69,15 @@ public:
   void
   DeleteFile(const std::string& filename);
 
+  /**
+   * @brief Group all following updates into one transaction until CommitBatch is called
+   */
+  void
+  BeginBatch();
+
+  void
+  CommitBatch();
+
   /**
    * @brief Set "complete" flag
    *
@@ -66,6 +87,18 @@ public:
   void
   SetFileComplete(const std::string& filename);
 
+  /**
+   * @brief Record that all actions up to @p actionId (rowid in ActionLog) have been applied
+   *
+   * Must be called in the same transaction as the changes of the action, so that ActionLog
+   * can re-apply actions that are missing after a crash.
+   */
+  void
+  SetLastAppliedAction(sqlite3_int64 actionId);
+
+  sqlite3_int64
+  GetLastAppliedAction();
+
   /**
    * @brief Lookup file state using file name
    */
@@ -105,6 +138,71 @@ public:
    */
   FileItemsPtr
   LookupFilesInFolderRecursively(const std::string& folder, int offset = 0, int limit = -1);
+
+  /**
+   * @brief Set approximate memory limit for files kept in memory for LookupFile and
+   *        LookupFilesForHash
+   *
+   * 0 disables the cache, so that all lookups go to the database
+   */
+  void
+  SetFileCacheBudget(size_t budget);
+
+protected:
+  void
+  onTransactionRolledBack() override;
+
+private:
+  /**
+   * @brief Load files into the cache until the budget is exhausted
+   */
+  void
+  loadFileCache();
+
+  /**
+   * @brief Get file from the cache (must be called with m_fileCacheMutex locked)
+   * @return false if the cache knows nothing about the file
+   */
+  bool
+  findCachedFile(const std::string& filename, FileItemPtr& file);
+
+  /**
+   * @brief Put file into the cache, null @p file records that the file does not exist
+   *        (must be called with m_fileCacheMutex locked)
+   */
+  void
+  cacheFile(const std::string& filename, FileItemPtr file);
+
+  void
+  uncacheFile(const std::string& filename);
+
+  /**
+   * @brief Drop all files from the cache (must be called with m_fileCacheMutex locked)
+   */
+  void
+  clearFileCache();
+
+private:
+  typedef boost::mutex Mutex;
+  typedef boost::unique_lock<Mutex> WriteLock;
+
+  struct CachedFile
+  {
+    FileItemPtr file; // null if the file does not exist
+    std::list<std::string>::iterator lruPosition;
+    size_t size;
+  };
+
+  Mutex m_fileCacheMutex;
+  std::map<std::string, CachedFile> m_fileCache;
+  // recently used files first
+  std::list<std::string> m_fileCacheLru;
+  // (file hash, filename) of cached files
+  std::set<std::pair<std::string, std::string>> m_fileCacheByHash;
+  size_t m_fileCacheSize;
+  size_t m_fileCacheBudget;
+  // true if all files are in the cache, so that misses and hash lookups need no database access
+  bool m_isFileCacheComplete;
 };
 
 typedef shared_ptr<FileState> FileStatePtr;
@@ -18,53 +18,58 @@
  * See AUTHORS.md for complete list of ChronoShare authors and contributors.
  */
 
-#ifndef OBJECT_DB_H
-#define OBJECT_DB_H
+#ifndef CHRONOSHARE_SRC_OBJECT_DB_HPP
+#define CHRONOSHARE_SRC_OBJECT_DB_HPP
+
+#include "object-store.hpp"
+
+#include <ndn-cxx/data.hpp>
 
 #include <boost/filesystem.hpp>
-#include <boost/shared_ptr.hpp>
-#include <ccnx-common.h>
-#include <ccnx-name.h>
+
 #include <ctime>
+#include <set>
 #include <sqlite3.h>
 #include <string>
-#include <vector>
 
+namespace ndn {
+namespace chronoshare {
+
+/**
+ * @brief Handle to segments of one file in the shared ObjectStore of the folder
+ *
+ * Segments saved through the handle become visible to DoesExist when the handle is destroyed.
+ */
 class ObjectDb
 {
 public:
-  // database will be create in <folder>/<first-pair-of-hash-bytes>/<rest-of-hash>
+  // segments are stored in <folder>/objects/pack-<n> (see ObjectStore)
   ObjectDb(const boost::filesystem::path& folder, const std::string& hash);
+
   ~ObjectDb();
 
   void
-  saveContentObject(const Ccnx::Name& deviceName, sqlite3_int64 segment, const Ccnx::Bytes& data);
+  saveContentObject(const Name& deviceName, sqlite3_int64 segment, const Data& data);
 
-  Ccnx::BytesPtr
-  fetchSegment(const Ccnx::Name& deviceName, sqlite3_int64 segment);
-
-  // sqlite3_int64
-  // getNumberOfSegments (const Ndnx::Name &deviceName);
+  shared_ptr<Data>
+  fetchSegment(const Name& deviceName, sqlite3_int64 segment);
 
   time_t
   secondsSinceLastUse();
 
   static bool
-  DoesExist(const boost::filesystem::path& folder, const Ccnx::Name& deviceName,
-            const std::string& hash);
+  DoesExist(const boost::filesystem::path& folder, const Name& deviceName, const std::string& hash);
 
 private:
-  void
-  willStartSave();
-
-  void
-  didStopSave();
-
-private:
-  sqlite3* m_db;
+  ObjectStorePtr m_store;
+  std::string m_hash;
+  std::set<Name> m_savedDevices;
   time_t m_lastUsed;
 };
 
-typedef boost::shared_ptr<ObjectDb> ObjectDbPtr;
+typedef shared_ptr<ObjectDb> ObjectDbPtr;
+
+} // namespace chronoshare
+} // namespace ndn
 
-#endif // OBJECT_DB_H
+#endif // CHRONOSHARE_SRC_OBJECT_DB_HPP
@@ -19,88 +19,344 @@
  */
 
 #include "object-manager.hpp"
-#include "ccnx-common.hpp"
-#include "ccnx-name.hpp"
-#include "ccnx-pco.hpp"
-#include "logging.hpp"
+#include "file-reader.hpp"
 #include "object-db.hpp"
+#include "object-store.hpp"
+#include "core/logging.hpp"
 
-#include <sys/stat.h>
+#include <ndn-cxx/util/digest.hpp>
+#include <ndn-cxx/util/string-helper.hpp>
 
 #include <boost/filesystem/fstream.hpp>
-#include <boost/lexical_cast.hpp>
-#include <boost/throw_exception.hpp>
-#include <fstream>
+
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+
+namespace ndn {
+namespace chronoshare {
 
 _LOG_INIT(Object.Manager);
 
-using namespace Ndnx;
-using namespace boost;
-using namespace std;
 namespace fs = boost::filesystem;
 
-const int MAX_FILE_SEGMENT_SIZE = 1024;
+using util::Sha256;
+
+const size_t ObjectManager::MIN_SEGMENT_SIZE = 1024;
+const size_t ObjectManager::MAX_SEGMENT_SIZE = 8000;
+const size_t ObjectManager::SEGMENTS_PER_FILE = 64;
+const size_t ObjectManager::MANIFEST_SEGMENT_SIZE = 8000;
+const size_t ObjectManager::MAX_BUFFERED_FILE_SIZE = 32 * 1024 * 1024;
+const size_t ObjectManager::SIGNING_WINDOW = 256;
+
+// size of SHA-256 digests in the chunk list and the manifest
+static const size_t CHUNK_DIGEST_SIZE = 32;
+
+// local files are read in blocks of this size
+static const size_t READ_BLOCK_SIZE = 1024 * 1024;
+
+static void
+saveSegment(ObjectDb& fileDb, const Name& deviceName, sqlite3_int64 firstSegment,
+            std::string* digests, size_t index, SegmentSigner::Segment& segment)
+{
+  fileDb.saveContentObject(deviceName, firstSegment + index, *segment.data);
+
+  if (digests != nullptr) {
+    ConstBufferPtr digest = Sha256::computeDigest(segment.buf, segment.size);
+    digests->append(reinterpret_cast<const char*>(digest->data()), digest->size());
+  }
+}
+
+static void
+saveChunk(ObjectStore& store, const Name& deviceName, const std::vector<std::string>& digests,
+          size_t index, SegmentSigner::Segment& chunk)
+{
+  store.saveChunk(digests[index], deviceName, chunk.data->wireEncode());
+}
+
+// Hash the whole file, keeping its content if it is not larger than MAX_BUFFERED_FILE_SIZE
+static ConstBufferPtr
+hashFile(FileReader& reader, Buffer& content)
+{
+  Sha256 digest;
+
+  bool isBuffered = reader.getSize() <= ObjectManager::MAX_BUFFERED_FILE_SIZE;
+  Buffer buf(isBuffered ? 0 : READ_BLOCK_SIZE);
+  if (isBuffered) {
+    content.resize(reader.getSize());
+  }
+
+  uint64_t total = 0;
+  while (total < reader.getSize()) {
+    uint8_t* block = isBuffered ? content.data() + total : buf.data();
+    size_t size = reader.read(block, READ_BLOCK_SIZE);
+    digest.update(block, size);
+    total += size;
+  }
+  if (isBuffered) {
+    // file could have been truncated
+    content.resize(total);
+  }
+
+  return digest.computeDigest();
+}
 
-ObjectManager::ObjectManager(Ccnx::CcnxWrapperPtr ccnx, const fs::path& folder,
-                             const std::string& appName)
-  : m_ccnx(ccnx)
-  , m_folder(folder / ".chronoshare")
+ObjectManager::ObjectManager(const fs::path& folder, const std::string& appName)
+  : m_folder(folder / ".chronoshare")
   , m_appName(appName)
+  , m_minSegmentSize(MIN_SEGMENT_SIZE)
+  , m_maxSegmentSize(MAX_SEGMENT_SIZE)
+  , m_hasDigestSegments(false)
+  , m_isChunking(false)
 {
   fs::create_directories(m_folder);
+  m_store = ObjectStore::open(m_folder);
+  setSigningThreads(std::thread::hardware_concurrency());
 }
 
 ObjectManager::~ObjectManager()
 {
 }
 
+void
+ObjectManager::setSegmentSizeLimits(size_t minSize, size_t maxSize)
+{
+  if (minSize == 0 || minSize > maxSize) {
+    BOOST_THROW_EXCEPTION(Error("Invalid segment size limits"));
+  }
+
+  m_minSegmentSize = minSize;
+  m_maxSegmentSize = maxSize;
+}
+
+void
+ObjectManager::setSigningThreads(size_t nThreads)
+{
+  m_signer.reset(); // stop the old threads first
+  m_signer.reset(new SegmentSigner(nThreads, SIGNING_WINDOW));
+}
+
+size_t
+ObjectManager::chooseSegmentSize(uint64_t fileSize) const
+{
+  uint64_t size = (fileSize / SEGMENTS_PER_FILE + m_minSegmentSize - 1) / m_minSegmentSize
+                   * m_minSegmentSize;
+  return std::max<uint64_t>(m_minSegmentSize, std::min<uint64_t>(size, m_maxSegmentSize));
+}
+
+void
+ObjectManager::setContentDefinedChunking(bool enabled)
+{
+  m_isChunking = enabled;
+}
+
+void
+ObjectManager::setDigestSegments(bool enabled)
+{
+  m_hasDigestSegments = enabled;
+}
+
+Name
+ObjectManager::makeSegmentName(const Name& deviceName, const Buffer& fileHash,
+                               sqlite3_int64 segment) const
+{
+  return Name(deviceName)
+    .append(m_appName)
+    .append("file")
+    .appendImplicitSha256Digest(fileHash.data(), fileHash.size())
+    .appendNumber(segment);
+}
+
 // /<devicename>/<appname>/file/<hash>/<segment>
-boost::tuple<HashPtr /*object-db name*/, size_t /* number of segments*/>
-ObjectManager::localFileToObjects(const fs::path& file, const Ccnx::Name& deviceName)
+std::tuple<ConstBufferPtr /*object-db name*/, size_t /* number of segments*/,
+           size_t /* segment size*/, bool /* chunked */,
+           ConstBufferPtr /* manifest hash, if published */>
+ObjectManager::localFileToObjects(const fs::path& file, const Name& deviceName,
+                                  const Buffer* currentHash /*=nullptr*/)
 {
-  HashPtr fileHash = Hash::FromFileContent(file);
-  ObjectDb fileDb(m_folder, lexical_cast<string>(*fileHash));
+  FileReader reader(file);
 
-  fs::ifstream iff(file, std::ios::in | std::ios::binary);
-  sqlite3_int64 segment = 0;
-  while (iff.good() && !iff.eof()) {
-    char buf[MAX_FILE_SEGMENT_SIZE];
-    iff.read(buf, MAX_FILE_SEGMENT_SIZE);
-    if (iff.gcount() == 0) {
-      // stupid streams...
-      break;
+  Buffer content;
+  ConstBufferPtr fileHash = hashFile(reader, content);
+  if (currentHash != nullptr && *fileHash == *currentHash) {
+    return std::make_tuple(fileHash, 0, 0, false, nullptr);
+  }
+
+  ObjectDb fileDb(m_folder, toHex(*fileHash));
+
+  uint64_t fileSize = reader.getSize();
+  if (m_isChunking && fileSize > m_chunker.getMaxSize()) {
+    std::string chunkList = chunkFile(reader, content, deviceName);
+
+    size_t segmentSize = chooseSegmentSize(chunkList.size());
+    size_t segments = saveSegments(reinterpret_cast<const uint8_t*>(chunkList.data()),
+                                   chunkList.size(), fileDb, *fileHash, deviceName, segmentSize);
+
+    return std::make_tuple(fileHash, segments, segmentSize, true, nullptr);
+  }
+
+  size_t segmentSize = chooseSegmentSize(fileSize);
+  std::string digests;
+  size_t segments = 0;
+  if (fileSize <= MAX_BUFFERED_FILE_SIZE) {
+    segments = saveSegments(content.data(), content.size(), fileDb, *fileHash, deviceName,
+                            segmentSize, 0, &digests, !m_hasDigestSegments);
+  }
+  else {
+    // every block is a whole number of segments
+    Buffer buf(READ_BLOCK_SIZE / segmentSize * segmentSize);
+    reader.rewind();
+    for (size_t size = reader.read(buf.data(), buf.size()); size > 0;
+         size = reader.read(buf.data(), buf.size())) {
+      segments += saveSegments(buf.data(), size, fileDb, *fileHash, deviceName, segmentSize,
+                               segments, &digests, !m_hasDigestSegments);
     }
+  }
 
-    Name name = Name("/")(deviceName)(m_appName)("file")(fileHash->GetHash(),
-                                                         fileHash->GetHashBytes())(segment);
+  // manifest is published as a file named by its own hash, so it is served and fetched the
+  // same way as any other file.  Digest segments cannot be verified without it.
+  ConstBufferPtr manifestHash;
+  if (m_hasDigestSegments) {
+    const uint8_t* manifest = reinterpret_cast<const uint8_t*>(digests.data());
+    manifestHash = Sha256::computeDigest(manifest, digests.size());
+    ObjectDb manifestDb(m_folder, toHex(*manifestHash));
+    saveSegments(manifest, digests.size(), manifestDb, *manifestHash, deviceName,
+                 MANIFEST_SEGMENT_SIZE);
+  }
 
-    // cout << *fileHash << endl;
-    // cout << name << endl;
-    //_LOG_DEBUG ("Read " << iff.gcount () << " from " << file << " for segment " << segment);
+  return std::make_tuple(fileHash, segments, segmentSize, false, manifestHash);
+}
 
-    Bytes data = m_ccnx->createContentObject(name, buf, iff.gcount());
-    fileDb.saveContentObject(deviceName, segment, data);
+size_t
+ObjectManager::saveSegments(const uint8_t* buf, size_t size, ObjectDb& fileDb,
+                            const Buffer& fileHash, const Name& deviceName,
+                            size_t segmentSize, sqlite3_int64 firstSegment /*=0*/,
+                            std::string* digests /*=nullptr*/, bool isSigned /*=true*/)
+{
+  using namespace std::placeholders;
 
-    segment++;
+  std::vector<SegmentSigner::Segment> segments((size + segmentSize - 1) / segmentSize);
+  for (size_t i = 0; i < segments.size(); i++) {
+    segments[i].name = makeSegmentName(deviceName, fileHash,
+                                       firstSegment + static_cast<sqlite3_int64>(i));
+    segments[i].buf = buf + i * segmentSize;
+    segments[i].size = std::min(segmentSize, size - i * segmentSize);
   }
+  if (isSigned) {
+    m_signer->sign(segments, std::bind(saveSegment, std::ref(fileDb), std::cref(deviceName),
+                                       firstSegment, digests, _1, _2));
+  }
+  else {
+    // digest is cheap enough to be calculated on the calling thread
+    for (size_t i = 0; i < segments.size(); i++) {
+      segments[i].data = make_shared<Data>(segments[i].name);
+      segments[i].data->setContent(segments[i].buf, segments[i].size);
+      m_keyChain.sign(*segments[i].data, signingWithSha256());
+      saveSegment(fileDb, deviceName, firstSegment, digests, i, segments[i]);
+    }
+  }
+
+  sqlite3_int64 segment = firstSegment + segments.size();
   if (segment == 0) // handle empty files
   {
-    Name name =
-      Name("/")(m_appName)("file")(fileHash->GetHash(), fileHash->GetHashBytes())(deviceName)(0);
-    Bytes data = m_ccnx->createContentObject(name, 0, 0);
+    Data data(makeSegmentName(deviceName, fileHash, 0));
+    if (isSigned) {
+      m_keyChain.sign(data);
+    }
+    else {
+      m_keyChain.sign(data, signingWithSha256());
+    }
     fileDb.saveContentObject(deviceName, 0, data);
 
+    if (digests != nullptr) {
+      ConstBufferPtr digest = Sha256::computeDigest(nullptr, 0);
+      digests->append(reinterpret_cast<const char*>(digest->data()), digest->size());
+    }
+
     segment++;
   }
 
-  return make_tuple(fileHash, segment);
+  return segment - firstSegment;
+}
+
+// /<devicename>/<appname>/chunk/<digest>/0
+std::string
+ObjectManager::chunkFile(FileReader& reader, const Buffer& content, const Name& deviceName)
+{
+  std::string chunkList;
+  if (!content.empty()) {
+    chunkData(content.data(), content.size(), true, deviceName, chunkList);
+    return chunkList;
+  }
+
+  Buffer buf(READ_BLOCK_SIZE);
+  size_t end = 0;
+  reader.rewind();
+  while (true) {
+    size_t size = reader.read(buf.data() + end, buf.size() - end);
+    end += size;
+    if (end == 0) {
+      break;
+    }
+
+    size_t consumed = chunkData(buf.data(), end, size == 0, deviceName, chunkList);
+    std::memmove(buf.data(), buf.data() + consumed, end - consumed);
+    end -= consumed;
+  }
+
+  return chunkList;
+}
+
+size_t
+ObjectManager::chunkData(const uint8_t* buf, size_t size, bool isLast, const Name& deviceName,
+                         std::string& chunkList)
+{
+  using namespace std::placeholders;
+
+  std::vector<SegmentSigner::Segment> chunks;
+  std::vector<std::string> chunkDigests;
+  std::set<std::string> newChunks;
+
+  size_t pos = 0;
+  // chunker needs up to max chunk size bytes to find the boundary
+  while (pos < size && (isLast || size - pos >= m_chunker.getMaxSize())) {
+    size_t length = m_chunker.findBoundary(buf + pos, size - pos);
+    ConstBufferPtr digest = Sha256::computeDigest(buf + pos, length);
+    std::string digestStr = toHex(*digest);
+
+    // chunks already published by the device (in other files or versions) are not signed
+    // or stored again
+    if (newChunks.find(digestStr) == newChunks.end() &&
+        !m_store->doesChunkExist(digestStr, deviceName)) {
+      SegmentSigner::Segment chunk;
+      chunk.name = Name(deviceName)
+                     .append(m_appName)
+                     .append("chunk")
+                     .appendImplicitSha256Digest(digest)
+                     .appendNumber(0);
+      chunk.buf = buf + pos;
+      chunk.size = length;
+      chunks.push_back(chunk);
+      chunkDigests.push_back(digestStr);
+      newChunks.insert(digestStr);
+    }
+
+    chunkList.append(reinterpret_cast<const char*>(digest->data()), digest->size());
+    pos += length;
+  }
+
+  m_signer->sign(chunks, std::bind(saveChunk, std::ref(*m_store), std::cref(deviceName),
+                                   std::cref(chunkDigests), _1, _2));
+  return pos;
 }
 
 bool
-ObjectManager::objectsToLocalFile(/*in*/ const Ccnx::Name& deviceName, /*in*/ const Hash& fileHash,
-                                  /*out*/ const fs::path& file)
+ObjectManager::objectsToLocalFile(/*in*/ const Name& deviceName, /*in*/ const Buffer& fileHash,
+                                  /*out*/ const fs::path& file, /*in*/ size_t segmentSize /*=0*/,
+                                  /*in*/ bool chunked /*=false*/)
 {
-  string hashStr = lexical_cast<string>(fileHash);
+  std::string hashStr = toHex(fileHash);
   if (!ObjectDb::DoesExist(m_folder, deviceName, hashStr)) {
     _LOG_ERROR("ObjectDb for [" << m_folder << ", " << deviceName << ", " << hashStr
                                 << "] does not exist or not all segments are available");
@@ -111,24 +367,210 @@ ObjectManager::objectsToLocalFile(/*in*/ const Ccnx::Name& deviceName, /*in*/ co
     create_directories(file.parent_path());
   }
 
+  if (!chunked) {
+    fs::ofstream off(file, std::ios::out | std::ios::binary);
+    if (!readSegments(deviceName, hashStr, segmentSize, off)) {
+      off.close();
+      fs::remove(file);
+      return false;
+    }
+
+    // permission and timestamp should be assigned somewhere else (ObjectManager has no idea about that)
+
+    return true;
+  }
+
+  std::ostringstream chunkList;
+  if (!readSegments(deviceName, hashStr, segmentSize, chunkList) ||
+      chunkList.str().size() % CHUNK_DIGEST_SIZE != 0) {
+    _LOG_ERROR("Chunk list of " << hashStr << " is corrupt");
+    return false;
+  }
+
   fs::ofstream off(file, std::ios::out | std::ios::binary);
+  std::string digests = chunkList.str();
+  for (size_t pos = 0; pos < digests.size(); pos += CHUNK_DIGEST_SIZE) {
+    Buffer digest(digests.data() + pos, CHUNK_DIGEST_SIZE);
+    std::string digestStr = toHex(digest);
+
+    // chunk could have been published by any device
+    ConstBufferPtr wire = m_store->fetchChunk(digestStr);
+    shared_ptr<Data> data;
+    if (wire != nullptr) {
+      data = make_shared<Data>(Block(wire));
+    }
+
+    if (data == nullptr ||
+        *Sha256::computeDigest(data->getContent().value(), data->getContent().value_size()) !=
+          digest) {
+      _LOG_ERROR("Chunk " << digestStr << " of " << hashStr << " is not available or corrupt");
+      off.close();
+      fs::remove(file);
+      return false;
+    }
+
+    off.write(reinterpret_cast<const char*>(data->getContent().value()),
+              data->getContent().value_size());
+  }
+
+  return true;
+}
+
+bool
+ObjectManager::findMissingChunks(const Name& deviceName, const Buffer& fileHash,
+                                 size_t segmentSize, std::vector<ConstBufferPtr>& missing)
+{
+  std::string hashStr = toHex(fileHash);
+
+  std::ostringstream chunkList;
+  if (!ObjectDb::DoesExist(m_folder, deviceName, hashStr) ||
+      !readSegments(deviceName, hashStr, segmentSize, chunkList) ||
+      chunkList.str().size() % CHUNK_DIGEST_SIZE != 0) {
+    return false;
+  }
+
+  std::set<std::string> seen;
+  std::string digests = chunkList.str();
+  for (size_t pos = 0; pos < digests.size(); pos += CHUNK_DIGEST_SIZE) {
+    ConstBufferPtr digest = make_shared<Buffer>(digests.data() + pos, CHUNK_DIGEST_SIZE);
+    std::string digestStr = toHex(*digest);
+
+    if (seen.insert(digestStr).second && !m_store->doesChunkExist(digestStr)) {
+      missing.push_back(digest);
+    }
+  }
+
+  return true;
+}
+
+size_t
+ObjectManager::manifestSegments(size_t segments)
+{
+  return (segments * CHUNK_DIGEST_SIZE + MANIFEST_SEGMENT_SIZE - 1) / MANIFEST_SEGMENT_SIZE;
+}
+
+bool
+ObjectManager::reuseParentSegments(ObjectDb& fileDb, const Name& deviceName,
+                                   const Buffer& fileHash, size_t segments,
+                                   const Buffer& manifestHash, const Name& parentDeviceName,
+                                   const Buffer& parentHash, std::vector<sqlite3_int64>& missing)
+{
+  std::string parentHashStr = toHex(parentHash);
+
+  // manifest hash comes from the signed action, so matching segments can be trusted
+  std::string digests;
+  if (!ObjectDb::DoesExist(m_folder, parentDeviceName, parentHashStr) ||
+      !readManifest(deviceName, manifestHash, segments, digests)) {
+    return false;
+  }
+
+  // digests of the parent segments are calculated, as the parent could have been published
+  // without a manifest
+  std::map<std::string, sqlite3_int64> parentSegments;
+  for (sqlite3_int64 segment = 0;; segment++) {
+    ConstBufferPtr wire = m_store->fetchSegment(parentHashStr, parentDeviceName, segment);
+    if (wire == nullptr) {
+      break;
+    }
+
+    Data data{Block(wire)};
+    ConstBufferPtr digest = Sha256::computeDigest(data.getContent().value(),
+                                                  data.getContent().value_size());
+    parentSegments.insert(
+      std::make_pair(std::string(reinterpret_cast<const char*>(digest->data()), digest->size()),
+                     segment));
+  }
+
+  for (sqlite3_int64 segment = 0; segment < static_cast<sqlite3_int64>(segments); segment++) {
+    auto parentSegment =
+      parentSegments.find(digests.substr(segment * CHUNK_DIGEST_SIZE, CHUNK_DIGEST_SIZE));
+
+    ConstBufferPtr wire;
+    if (parentSegment != parentSegments.end()) {
+      wire = m_store->fetchSegment(parentHashStr, parentDeviceName, parentSegment->second);
+    }
+
+    if (wire == nullptr) {
+      missing.push_back(segment);
+      continue;
+    }
+
+    // the same packet as the publisher's digest segment, no local key is involved
+    Data parentData{Block(wire)};
+    Data data(makeSegmentName(deviceName, fileHash, segment));
+    data.setContent(parentData.getContent());
+    m_keyChain.sign(data, signingWithSha256());
+    fileDb.saveContentObject(deviceName, segment, data);
+  }
+
+  _LOG_DEBUG("Reused " << (segments - missing.size()) << " of " << segments << " segments of "
+                       << toHex(fileHash) << " from " << toHex(parentHash));
+  return true;
+}
+
+bool
+ObjectManager::readManifest(const Name& deviceName, const Buffer& manifestHash,
+                            size_t segments, std::string& digests)
+{
+  std::string manifestHashStr = toHex(manifestHash);
+
+  std::ostringstream manifest;
+  if (!ObjectDb::DoesExist(m_folder, deviceName, manifestHashStr) ||
+      !readSegments(deviceName, manifestHashStr, MANIFEST_SEGMENT_SIZE, manifest)) {
+    return false;
+  }
+
+  digests = manifest.str();
+  if (digests.size() != segments * CHUNK_DIGEST_SIZE ||
+      *Sha256::computeDigest(reinterpret_cast<const uint8_t*>(digests.data()), digests.size()) !=
+        manifestHash) {
+    _LOG_ERROR("Manifest " << manifestHashStr << " is corrupt");
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ObjectManager::matchesManifest(const std::string& digests, uint64_t segment,
+                               const Block& content)
+{
+  if (segment >= digests.size() / CHUNK_DIGEST_SIZE) {
+    return false;
+  }
+
+  ConstBufferPtr digest = Sha256::computeDigest(content.value(), content.value_size());
+  return digests.compare(segment * CHUNK_DIGEST_SIZE, CHUNK_DIGEST_SIZE,
+                         reinterpret_cast<const char*>(digest->data()), digest->size()) == 0;
+}
+
+bool
+ObjectManager::readSegments(const Name& deviceName, const std::string& hashStr,
+                            size_t segmentSize, std::ostream& os)
+{
   ObjectDb fileDb(m_folder, hashStr);
 
   sqlite3_int64 segment = 0;
-  BytesPtr bytes = fileDb.fetchSegment(deviceName, 0);
-  while (bytes) {
-    ParsedContentObject obj(*bytes);
-    BytesPtr data = obj.contentPtr();
-
-    if (data) {
-      off.write(reinterpret_cast<const char*>(head(*data)), data->size());
+  size_t lastSize = segmentSize;
+  shared_ptr<Data> data = fileDb.fetchSegment(deviceName, 0);
+  while (data != nullptr) {
+    // only the last segment can be shorter
+    if (segmentSize > 0 && lastSize != segmentSize) {
+      _LOG_ERROR("Segment " << (segment - 1) << " of " << hashStr << " has " << lastSize
+                            << " bytes, expected " << segmentSize);
+      return false;
     }
 
+    const Block& content = data->getContent();
+    lastSize = content.value_size();
+    os.write(reinterpret_cast<const char*>(content.value()), content.value_size());
+
     segment++;
-    bytes = fileDb.fetchSegment(deviceName, segment);
+    data = fileDb.fetchSegment(deviceName, segment);
   }
 
-  // permission and timestamp should be assigned somewhere else (ObjectManager has no idea about that)
-
   return true;
 }
+
+} // namespace chronoshare
+} // namespace ndn
@@ -18,48 +18,266 @@
  * See AUTHORS.md for complete list of ChronoShare authors and contributors.
  */
 
-#ifndef OBJECT_MANAGER_H
-#define OBJECT_MANAGER_H
+#ifndef CHRONOSHARE_SRC_OBJECT_MANAGER_HPP
+#define CHRONOSHARE_SRC_OBJECT_MANAGER_HPP
+
+#include "content-chunker.hpp"
+#include "object-store.hpp"
+#include "segment-signer.hpp"
+
+#include <ndn-cxx/security/key-chain.hpp>
 
 #include <boost/filesystem.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <ccnx-wrapper.h>
-#include <hash-helper.h>
+
+#include <iosfwd>
 #include <string>
+#include <tuple>
+#include <vector>
+
+namespace ndn {
+namespace chronoshare {
+
+class FileReader;
+class ObjectDb;
 
 // everything related to managing object files
 
 class ObjectManager
 {
 public:
-  ObjectManager(Ccnx::CcnxWrapperPtr ccnx, const boost::filesystem::path& folder,
-                const std::string& appName);
+  class Error : public std::runtime_error
+  {
+  public:
+    explicit Error(const std::string& what)
+      : std::runtime_error(what)
+    {
+    }
+  };
+
+public:
+  ObjectManager(const boost::filesystem::path& folder, const std::string& appName);
   virtual ~ObjectManager();
 
   /**
    * @brief Creates and saves local file in a local database file
    *
-   * Format: /<appname>/file/<hash>/<devicename>/<segment>
+   * Format: /<devicename>/<appname>/file/<hash>/<segment>
+   *
+   * Segment size is chosen for the file with chooseSegmentSize
+   *
+   * With content-defined chunking enabled, files larger than one chunk are split with
+   * ContentChunker.  Every chunk is published once per device as
+   * /<devicename>/<appname>/chunk/<digest>/0, and segments of the file carry the list of
+   * SHA-256 digests of its chunks instead of the file content (chunked is true).
+   *
+   * With digest segments enabled (see setDigestSegments), SHA-256 digests of the segments (the
+   * manifest) are published for every file that is not chunked, as a separate file with
+   * segments of MANIFEST_SEGMENT_SIZE bytes, and only the manifest segments are signed.
+   * Segments of the file carry a DigestSha256 signature, and receivers verify them against the
+   * manifest, whose hash is in the signed action.  The manifest also lets receivers of the next
+   * versions fetch only the segments that changed (see reuseParentSegments).
+   *
+   * The file is hashed with large reads (see FileReader).  Segments are named by the hash, so
+   * they are cut after the whole file is hashed: files up to MAX_BUFFERED_FILE_SIZE are kept in
+   * memory in the meantime, larger files are read again (mostly from the page cache).
+   *
+   * Segments and chunks are signed in parallel (see setSigningThreads).
+   *
+   * If currentHash is given and the file has the same hash, nothing is published and the
+   * returned number of segments is 0.
+   */
+  std::tuple<ConstBufferPtr /*object-db name*/, size_t /* number of segments*/,
+             size_t /* segment size*/, bool /* chunked */,
+             ConstBufferPtr /* manifest hash, if published */>
+  localFileToObjects(const boost::filesystem::path& file, const Name& deviceName,
+                     const Buffer* currentHash = nullptr);
+
+  /**
+   * @brief Assemble file from its segments
+   *
+   * If segmentSize is not 0, all segments except the last one must be of that size.  If chunked
+   * is true, segments carry the chunk list and all chunks must be available in the store.
+   */
+  bool
+  objectsToLocalFile(/*in*/ const Name& deviceName, /*in*/ const Buffer& hash,
+                     /*out*/ const boost::filesystem::path& file, /*in*/ size_t segmentSize = 0,
+                     /*in*/ bool chunked = false);
+
+  /**
+   * @brief Get chunks of the chunked file that are not in the store yet
+   *
+   * Segments of the file (the chunk list) must be available.  Chunks saved for any device are
+   * not reported.
+   *
+   * @return false if the chunk list is not available
    */
-  boost::tuple<HashPtr /*object-db name*/, size_t /* number of segments*/>
-  localFileToObjects(const boost::filesystem::path& file, const Ccnx::Name& deviceName);
+  bool
+  findMissingChunks(const Name& deviceName, const Buffer& hash, size_t segmentSize,
+                    std::vector<ConstBufferPtr>& missing);
 
+  /**
+   * @brief Save segments of the file that are the same as segments of its parent version
+   *
+   * Segment digests are taken from the manifest of the file, which must be available in the
+   * store (it is fetched as a file of manifestSegments(segments) segments).  Segments of the
+   * parent version with matching digests are saved through fileDb under the names of the new
+   * version.
+   *
+   * Only files published with digest segments can be rebuilt this way: a reused segment gets
+   * the same DigestSha256 signature as the publisher's one, so the saved packet is the packet
+   * the publisher serves.  A segment signed by the publisher's key cannot be rebuilt, and the
+   * local key must not sign packets under the publisher's name.
+   *
+   * @param missing segments that are not available locally and have to be fetched
+   * @return false if the manifest is not available or corrupt, or the parent version is not
+   *         available
+   */
   bool
-  objectsToLocalFile(/*in*/ const Ccnx::Name& deviceName, /*in*/ const Hash& hash,
-                     /*out*/ const boost::filesystem::path& file);
+  reuseParentSegments(ObjectDb& fileDb, const Name& deviceName, const Buffer& hash,
+                      size_t segments, const Buffer& manifestHash, const Name& parentDeviceName,
+                      const Buffer& parentHash, std::vector<sqlite3_int64>& missing);
+
+  /**
+   * @brief Read the manifest of a file with the given number of segments from the store
+   * @param digests SHA-256 digests of the segments
+   * @return false if the manifest is not available or does not match manifestHash
+   */
+  bool
+  readManifest(const Name& deviceName, const Buffer& manifestHash, size_t segments,
+               std::string& digests);
+
+  /**
+   * @brief Check that the digest of the segment content is the one listed in the manifest
+   */
+  static bool
+  matchesManifest(const std::string& digests, uint64_t segment, const Block& content);
+
+  /**
+   * @brief Get number of segments of the manifest of a file with the given number of segments
+   */
+  static size_t
+  manifestSegments(size_t segments);
+
+  /**
+   * @brief Enable or disable content-defined chunking of new local files
+   *
+   * Chunking is disabled by default
+   */
+  void
+  setContentDefinedChunking(bool enabled);
+
+  /**
+   * @brief Set range of segment sizes chosen by localFileToObjects
+   *
+   * Setting both limits to the same value makes segment size fixed
+   */
+  void
+  setSegmentSizeLimits(size_t minSize, size_t maxSize);
+
+  /**
+   * @brief Set number of threads that sign segments and chunks of new local files
+   *
+   * By default, one thread per CPU core is used
+   */
+  void
+  setSigningThreads(size_t nThreads);
+
+  /**
+   * @brief Enable or disable publishing new local files with digest segments
+   *
+   * Digest segments are disabled by default.  Devices running previous versions cannot verify
+   * digest segments.
+   */
+  void
+  setDigestSegments(bool enabled);
+
+  bool
+  hasDigestSegments() const
+  {
+    return m_hasDigestSegments;
+  }
+
+  /**
+   * @brief Get segment size for a file of fileSize bytes
+   *
+   * Small files are split into segments of minSize bytes.  Larger files get larger segments (in
+   * multiples of minSize, up to maxSize), so that they are split into about
+   * SEGMENTS_PER_FILE segments.
+   */
+  size_t
+  chooseSegmentSize(uint64_t fileSize) const;
+
+public:
+  // segment size used by previous versions
+  static const size_t MIN_SEGMENT_SIZE;
+  // leaves room for name and signature within the NDN packet size limit (8800 bytes)
+  static const size_t MAX_SEGMENT_SIZE;
+  static const size_t SEGMENTS_PER_FILE;
+  // size of manifest segments (250 digests), the same on all devices
+  static const size_t MANIFEST_SEGMENT_SIZE;
+  // files up to this size are read only once by localFileToObjects
+  static const size_t MAX_BUFFERED_FILE_SIZE;
+  // number of segments that can be signed ahead of the one saved to the store
+  static const size_t SIGNING_WINDOW;
 
 private:
-  Ndnx::NdnxWrapperPtr m_ndnx;
+  /**
+   * @brief Save segments of segmentSize bytes cut from data, numbered from firstSegment
+   * @param digests if not null, SHA-256 digests of the segment contents are appended to it
+   * @param isSigned if false, segments carry only a DigestSha256 signature
+   * @return number of saved segments
+   */
+  size_t
+  saveSegments(const uint8_t* buf, size_t size, ObjectDb& fileDb, const Buffer& fileHash,
+               const Name& deviceName, size_t segmentSize, sqlite3_int64 firstSegment = 0,
+               std::string* digests = nullptr, bool isSigned = true);
+
+  bool
+  readSegments(const Name& deviceName, const std::string& hashStr, size_t segmentSize,
+               std::ostream& os);
+
+  Name
+  makeSegmentName(const Name& deviceName, const Buffer& fileHash, sqlite3_int64 segment) const;
+
+  /**
+   * @brief Split file into chunks, saving the ones that are not in the store yet
+   *
+   * content is the whole file if it was kept in memory, otherwise the file is read again
+   *
+   * @return list of chunk digests
+   */
+  std::string
+  chunkFile(FileReader& reader, const Buffer& content, const Name& deviceName);
+
+  /**
+   * @brief Cut chunks from data and append their digests to chunkList
+   *
+   * Unless isLast is true, the tail that is shorter than the maximum chunk size is left for the
+   * next call
+   *
+   * @return number of bytes consumed
+   */
+  size_t
+  chunkData(const uint8_t* buf, size_t size, bool isLast, const Name& deviceName,
+            std::string& chunkList);
+
+private:
+  KeyChain m_keyChain;
   boost::filesystem::path m_folder;
   std::string m_appName;
+  size_t m_minSegmentSize;
+  size_t m_maxSegmentSize;
+
+  ObjectStorePtr m_store;
+  std::unique_ptr<SegmentSigner> m_signer;
+  bool m_hasDigestSegments;
+  bool m_isChunking;
+  ContentChunker m_chunker;
 };
 
-typedef boost::shared_ptr<ObjectManager> ObjectManagerPtr;
+typedef shared_ptr<ObjectManager> ObjectManagerPtr;
 
-namespace Error {
-struct ObjectManager : virtual boost::exception, virtual std::exception
-{
-};
-}
+} // namespace chronoshare
+} // namespace ndn
 
-#endif // OBJECT_MANAGER_H
+#endif // CHRONOSHARE_SRC_OBJECT_MANAGER_HPP
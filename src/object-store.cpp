@@ -0,0 +1,614 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "object-store.hpp"
+#include "core/logging.hpp"
+
+#include <algorithm>
+#include <set>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ndn {
+namespace chronoshare {
+
+_LOG_INIT(ObjectStore);
+
+namespace fs = boost::filesystem;
+
+// pack file is rolled over when it reaches this size
+const off_t MAX_PACK_SIZE = 256 * 1024 * 1024;
+
+// number of saved segments after which pending index updates are committed
+const int MAX_PENDING_RECORDS = 1024;
+
+// size of the memory-mapped region of the index
+const sqlite3_int64 INDEX_MMAP_SIZE = 64 * 1024 * 1024;
+
+const std::string INIT_DATABASE = "\
+CREATE TABLE IF NOT EXISTS                                              \n\
+    Segment(                                                            \n\
+        file_hash       BLOB NOT NULL,                                  \n\
+        device_name     BLOB NOT NULL,                                  \n\
+        segment         INTEGER NOT NULL,                               \n\
+        pack            INTEGER NOT NULL,                               \n\
+        offset          INTEGER NOT NULL,                               \n\
+        length          INTEGER NOT NULL,                               \n\
+        is_complete     INTEGER NOT NULL DEFAULT 0,                     \n\
+                                                                        \
+        PRIMARY KEY (file_hash, device_name, segment)                   \n\
+    ) WITHOUT ROWID;                                                    \n\
+                                                                        \n\
+CREATE TABLE IF NOT EXISTS                                              \n\
+    Chunk(                                                              \n\
+        digest          BLOB NOT NULL,                                  \n\
+        device_name     BLOB NOT NULL,                                  \n\
+        pack            INTEGER NOT NULL,                               \n\
+        offset          INTEGER NOT NULL,                               \n\
+        length          INTEGER NOT NULL,                               \n\
+                                                                        \
+        PRIMARY KEY (digest, device_name)                               \n\
+    ) WITHOUT ROWID;                                                    \n\
+";
+
+// segment number of chunk records in pack files
+const sqlite3_int64 CHUNK_SEGMENT = -1;
+
+/**
+ * @brief Default storage profile adjusted for the index
+ */
+static DbHelper::StorageProfile
+makeIndexProfile()
+{
+  DbHelper::StorageProfile profile = DbHelper::getDefaultStorageProfile();
+  // index commits lost on power failure leave only unreferenced records in pack files
+  profile.synchronous = DbHelper::StorageProfile::SYNCHRONOUS_NORMAL;
+  profile.mmapSize = std::max(profile.mmapSize, INDEX_MMAP_SIZE);
+  // index updates are batched by ObjectStore, which syncs pack files before committing them
+  profile.groupCommitWindow = time::milliseconds::zero();
+  return profile;
+}
+
+static Buffer
+hashToBytes(const std::string& hash)
+{
+  Buffer retval;
+  retval.reserve(hash.size() / 2);
+  for (size_t i = 0; i + 1 < hash.size(); i += 2) {
+    retval.push_back(static_cast<uint8_t>(strtol(hash.substr(i, 2).c_str(), 0, 16)));
+  }
+  return retval;
+}
+
+static bool
+writeAll(int fd, const void* buf, size_t size, off_t offset)
+{
+  const char* ptr = reinterpret_cast<const char*>(buf);
+  while (size > 0) {
+    ssize_t written = pwrite(fd, ptr, size, offset);
+    if (written <= 0) {
+      return false;
+    }
+    ptr += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+ObjectStorePtr
+ObjectStore::open(const fs::path& folder)
+{
+  static std::mutex storesMutex;
+  static std::map<std::string, ObjectStorePtr> stores;
+
+  std::lock_guard<std::mutex> lock(storesMutex);
+  std::string key = fs::absolute(folder).string();
+
+  ObjectStorePtr& store = stores[key];
+  if (store == nullptr) {
+    store.reset(new ObjectStore(folder));
+  }
+  return store;
+}
+
+ObjectStore::ObjectStore(const fs::path& folder)
+  : DbHelper(folder / "objects", "index.db", makeIndexProfile())
+  , m_folder(folder / "objects")
+  , m_inTransaction(false)
+  , m_pendingRecords(0)
+  , m_currentPack(0)
+  , m_currentPackSize(0)
+  , m_currentPackDirty(false)
+{
+  char* errmsg = 0;
+  int res = sqlite3_exec(m_db, INIT_DATABASE.c_str(), NULL, NULL, &errmsg);
+  if (res != SQLITE_OK && errmsg != 0) {
+    _LOG_ERROR("Init \"error\": " << errmsg);
+    sqlite3_free(errmsg);
+  }
+
+  // continue appending to the last pack (garbage left after a crash is simply never referenced)
+  {
+    Statement stmt(*this, "SELECT MAX((SELECT MAX(pack) FROM Segment), "
+                          "           (SELECT MAX(pack) FROM Chunk))");
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      m_currentPack = sqlite3_column_int(stmt, 0);
+    }
+  }
+
+  int fd = openPack(m_currentPack);
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    m_currentPackSize = st.st_size;
+  }
+
+  migrateObjectDbs();
+}
+
+ObjectStore::~ObjectStore()
+{
+  flush();
+
+  for (const auto& fd : m_packFds) {
+    close(fd.second);
+  }
+}
+
+int
+ObjectStore::openPack(int pack)
+{
+  auto fd = m_packFds.find(pack);
+  if (fd != m_packFds.end()) {
+    return fd->second;
+  }
+
+  fs::path packFile = m_folder / ("pack-" + std::to_string(pack));
+  int newFd = ::open(packFile.c_str(), O_RDWR | O_CREAT, 0644);
+  if (newFd < 0) {
+    BOOST_THROW_EXCEPTION(Error("Cannot open pack file: [" + packFile.string() + "]"));
+  }
+
+  m_packFds[pack] = newFd;
+  return newFd;
+}
+
+void
+ObjectStore::beginIndexTransaction()
+{
+  // caller must hold m_mutex
+  if (m_inTransaction) {
+    return;
+  }
+
+  if (sqlite3_exec(m_db, "BEGIN TRANSACTION;", 0, 0, 0) != SQLITE_OK) {
+    BOOST_THROW_EXCEPTION(Error("Cannot begin index transaction: " +
+                                std::string(sqlite3_errmsg(m_db))));
+  }
+  m_inTransaction = true;
+}
+
+off_t
+ObjectStore::writeRecord(const Buffer& hashBytes, const Block& name, sqlite3_int64 segment,
+                         const uint8_t* data, size_t size)
+{
+  // caller must hold m_mutex
+  if (m_currentPackSize >= MAX_PACK_SIZE) {
+    flushLocked();
+    m_currentPack++;
+    m_currentPackSize = 0;
+
+    beginIndexTransaction();
+  }
+
+  // record: [hash size][name size][segment][data size] [hash][name][data]
+  // (enough to rebuild the index from pack files)
+  uint32_t header[5] = {static_cast<uint32_t>(hashBytes.size()),
+                        static_cast<uint32_t>(name.size()),
+                        static_cast<uint32_t>(segment >> 32),
+                        static_cast<uint32_t>(segment & 0xFFFFFFFF),
+                        static_cast<uint32_t>(size)};
+
+  int fd = openPack(m_currentPack);
+  off_t offset = m_currentPackSize;
+  off_t dataOffset = offset + sizeof(header) + hashBytes.size() + name.size();
+
+  if (!writeAll(fd, header, sizeof(header), offset) ||
+      !writeAll(fd, hashBytes.data(), hashBytes.size(), offset + sizeof(header)) ||
+      !writeAll(fd, name.wire(), name.size(), offset + sizeof(header) + hashBytes.size()) ||
+      !writeAll(fd, data, size, dataOffset)) {
+    BOOST_THROW_EXCEPTION(Error("Cannot write to pack " + std::to_string(m_currentPack)));
+  }
+  m_currentPackSize = dataOffset + size;
+  m_currentPackDirty = true;
+
+  return dataOffset;
+}
+
+void
+ObjectStore::recordSaved()
+{
+  // caller must hold m_mutex
+  m_pendingRecords++;
+  if (m_pendingRecords >= MAX_PENDING_RECORDS) {
+    flushLocked();
+  }
+}
+
+void
+ObjectStore::appendRecord(const std::string& hash, const Name& deviceName, sqlite3_int64 segment,
+                          const uint8_t* data, size_t size)
+{
+  // caller must hold m_mutex
+  Buffer hashBytes = hashToBytes(hash);
+  const Block& name = deviceName.wireEncode();
+
+  beginIndexTransaction();
+
+  {
+    Statement stmt(*this, "SELECT 1 FROM Segment "
+                          "WHERE file_hash=? AND device_name=? AND segment=?");
+    sqlite3_bind_blob(stmt, 1, hashBytes.data(), hashBytes.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, segment);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      // content-addressed: the same segment of the same file is always the same
+      return;
+    }
+  }
+
+  off_t dataOffset = writeRecord(hashBytes, name, segment, data, size);
+
+  Statement stmt(*this, "INSERT INTO Segment "
+                        "(file_hash, device_name, segment, pack, offset, length) "
+                        "VALUES (?, ?, ?, ?, ?, ?)");
+  sqlite3_bind_blob(stmt, 1, hashBytes.data(), hashBytes.size(), SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 3, segment);
+  sqlite3_bind_int(stmt, 4, m_currentPack);
+  sqlite3_bind_int64(stmt, 5, dataOffset);
+  sqlite3_bind_int64(stmt, 6, size);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    _LOG_ERROR("Cannot index segment: " << sqlite3_errmsg(m_db));
+  }
+
+  recordSaved();
+}
+
+void
+ObjectStore::saveContentObject(const std::string& hash, const Name& deviceName,
+                               sqlite3_int64 segment, const Block& data)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  appendRecord(hash, deviceName, segment, data.wire(), data.size());
+}
+
+ConstBufferPtr
+ObjectStore::fetchSegment(const std::string& hash, const Name& deviceName, sqlite3_int64 segment)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Buffer hashBytes = hashToBytes(hash);
+  const Block& name = deviceName.wireEncode();
+
+  Statement stmt(*this, "SELECT pack, offset, length FROM Segment "
+                        "WHERE file_hash=? AND device_name=? AND segment=?");
+  sqlite3_bind_blob(stmt, 1, hashBytes.data(), hashBytes.size(), SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 3, segment);
+
+  ConstBufferPtr ret;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    ret = readRecord(sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 1),
+                     sqlite3_column_int64(stmt, 2));
+    _LOG_ERROR_COND(ret == nullptr, "Pack file is truncated, segment " << segment << " of "
+                                                                       << hash
+                                                                       << " is not available");
+  }
+
+  return ret;
+}
+
+ConstBufferPtr
+ObjectStore::readRecord(int pack, off_t offset, size_t length)
+{
+  // caller must hold m_mutex
+  int fd = openPack(pack);
+
+  auto ret = make_shared<Buffer>(length);
+  size_t done = 0;
+  while (done < length) {
+    ssize_t bytes = pread(fd, ret->data() + done, length - done, offset + done);
+    if (bytes <= 0) {
+      return nullptr;
+    }
+    done += bytes;
+  }
+  return ret;
+}
+
+bool
+ObjectStore::doesExist(const std::string& hash, const Name& deviceName)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Buffer hashBytes = hashToBytes(hash);
+  const Block& name = deviceName.wireEncode();
+
+  // segments of the device are numbered from 0 without gaps
+  Statement stmt(*this, "SELECT count(*), max(segment) FROM Segment "
+                        "WHERE file_hash=? AND device_name=? AND is_complete=1");
+  sqlite3_bind_blob(stmt, 1, hashBytes.data(), hashBytes.size(), SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+
+  bool retval = false;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    sqlite3_int64 count = sqlite3_column_int64(stmt, 0);
+    retval = count > 0 && sqlite3_column_int64(stmt, 1) == count - 1;
+  }
+
+  return retval;
+}
+
+void
+ObjectStore::markComplete(const std::string& hash, const Name& deviceName)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  markCompleteLocked(hash, deviceName);
+}
+
+void
+ObjectStore::markCompleteLocked(const std::string& hash, const Name& deviceName)
+{
+  Buffer hashBytes = hashToBytes(hash);
+  const Block& name = deviceName.wireEncode();
+
+  int nChanges = 0;
+  {
+    Statement stmt(*this, "UPDATE Segment SET is_complete=1 "
+                          "WHERE file_hash=? AND device_name=? AND is_complete=0");
+    sqlite3_bind_blob(stmt, 1, hashBytes.data(), hashBytes.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      _LOG_ERROR("Cannot mark segments complete: " << sqlite3_errmsg(m_db));
+    }
+    nChanges = sqlite3_changes(m_db);
+  }
+
+  if (nChanges > 0) {
+    flushLocked();
+  }
+}
+
+void
+ObjectStore::saveChunk(const std::string& digest, const Name& deviceName, const Block& data)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Buffer digestBytes = hashToBytes(digest);
+  const Block& name = deviceName.wireEncode();
+
+  beginIndexTransaction();
+
+  {
+    Statement stmt(*this, "SELECT 1 FROM Chunk WHERE digest=? AND device_name=?");
+    sqlite3_bind_blob(stmt, 1, digestBytes.data(), digestBytes.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      return;
+    }
+  }
+
+  off_t dataOffset = writeRecord(digestBytes, name, CHUNK_SEGMENT, data.wire(), data.size());
+
+  Statement stmt(*this, "INSERT INTO Chunk (digest, device_name, pack, offset, length) "
+                        "VALUES (?, ?, ?, ?, ?)");
+  sqlite3_bind_blob(stmt, 1, digestBytes.data(), digestBytes.size(), SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 3, m_currentPack);
+  sqlite3_bind_int64(stmt, 4, dataOffset);
+  sqlite3_bind_int64(stmt, 5, data.size());
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    _LOG_ERROR("Cannot index chunk: " << sqlite3_errmsg(m_db));
+  }
+
+  recordSaved();
+}
+
+ConstBufferPtr
+ObjectStore::fetchChunk(const std::string& digest, const Name& deviceName)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Buffer digestBytes = hashToBytes(digest);
+  const Block& name = deviceName.wireEncode();
+
+  Statement stmt(*this, "SELECT pack, offset, length FROM Chunk "
+                        "WHERE digest=? AND device_name=?");
+  sqlite3_bind_blob(stmt, 1, digestBytes.data(), digestBytes.size(), SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+
+  ConstBufferPtr ret;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    ret = readRecord(sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 1),
+                     sqlite3_column_int64(stmt, 2));
+    _LOG_ERROR_COND(ret == nullptr, "Pack file is truncated, chunk " << digest
+                                                                     << " is not available");
+  }
+
+  return ret;
+}
+
+ConstBufferPtr
+ObjectStore::fetchChunk(const std::string& digest)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Buffer digestBytes = hashToBytes(digest);
+
+  Statement stmt(*this, "SELECT pack, offset, length FROM Chunk WHERE digest=? LIMIT 1");
+  sqlite3_bind_blob(stmt, 1, digestBytes.data(), digestBytes.size(), SQLITE_STATIC);
+
+  ConstBufferPtr ret;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    ret = readRecord(sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 1),
+                     sqlite3_column_int64(stmt, 2));
+    _LOG_ERROR_COND(ret == nullptr, "Pack file is truncated, chunk " << digest
+                                                                     << " is not available");
+  }
+
+  return ret;
+}
+
+bool
+ObjectStore::doesChunkExist(const std::string& digest, const Name& deviceName)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Buffer digestBytes = hashToBytes(digest);
+  const Block& name = deviceName.wireEncode();
+
+  Statement stmt(*this, "SELECT 1 FROM Chunk WHERE digest=? AND device_name=?");
+  sqlite3_bind_blob(stmt, 1, digestBytes.data(), digestBytes.size(), SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, name.wire(), name.size(), SQLITE_STATIC);
+
+  return sqlite3_step(stmt) == SQLITE_ROW;
+}
+
+bool
+ObjectStore::doesChunkExist(const std::string& digest)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  Buffer digestBytes = hashToBytes(digest);
+
+  Statement stmt(*this, "SELECT 1 FROM Chunk WHERE digest=? LIMIT 1");
+  sqlite3_bind_blob(stmt, 1, digestBytes.data(), digestBytes.size(), SQLITE_STATIC);
+
+  return sqlite3_step(stmt) == SQLITE_ROW;
+}
+
+void
+ObjectStore::flush()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  flushLocked();
+}
+
+void
+ObjectStore::flushLocked()
+{
+  // pack data must be durable before the index starts referencing it
+  if (m_currentPackDirty) {
+    fdatasync(openPack(m_currentPack));
+    m_currentPackDirty = false;
+  }
+
+  if (m_inTransaction) {
+    if (sqlite3_exec(m_db, "END TRANSACTION;", 0, 0, 0) != SQLITE_OK) {
+      _LOG_ERROR("Cannot commit index updates: " << sqlite3_errmsg(m_db));
+      if (sqlite3_get_autocommit(m_db) == 0) {
+        // transaction is still open, commit will be retried by the next flush
+        return;
+      }
+      _LOG_ERROR(m_pendingRecords << " index updates have been rolled back");
+    }
+    m_inTransaction = false;
+  }
+  m_pendingRecords = 0;
+}
+
+bool
+ObjectStore::importObjectDb(const fs::path& dbFile, const std::string& hash)
+{
+  sqlite3* db;
+  int res = sqlite3_open_v2(dbFile.c_str(), &db, SQLITE_OPEN_READONLY, 0);
+  if (res != SQLITE_OK) {
+    sqlite3_close(db);
+    return false;
+  }
+
+  _LOG_DEBUG("Import " << dbFile);
+
+  sqlite3_stmt* stmt;
+  res = sqlite3_prepare_v2(db, "SELECT device_name, segment, content_object FROM File", -1, &stmt, 0);
+  bool ok = (res == SQLITE_OK);
+  if (ok) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::set<Name> devices;
+    try {
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        Name deviceName(Block(reinterpret_cast<const uint8_t*>(sqlite3_column_blob(stmt, 0)),
+                              sqlite3_column_bytes(stmt, 0)));
+        appendRecord(hash, deviceName, sqlite3_column_int64(stmt, 1),
+                     reinterpret_cast<const uint8_t*>(sqlite3_column_blob(stmt, 2)),
+                     sqlite3_column_bytes(stmt, 2));
+        devices.insert(deviceName);
+      }
+      ok = (sqlite3_errcode(db) == SQLITE_DONE);
+    }
+    catch (const tlv::Error& e) {
+      _LOG_ERROR("Invalid device name in " << dbFile << ": " << e.what());
+      ok = false;
+    }
+
+    // ObjectDb never exposed partially saved files, so everything imported is complete
+    if (ok) {
+      for (const auto& device : devices) {
+        markCompleteLocked(hash, device);
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  if (!ok) {
+    _LOG_ERROR("Cannot import " << dbFile << ", leaving it in place");
+    return false;
+  }
+
+  fs::remove(dbFile);
+  return true;
+}
+
+void
+ObjectStore::migrateObjectDbs()
+{
+  // old layout: <folder>/objects/<first-pair-of-hash-bytes>/<rest-of-hash>
+  for (fs::directory_iterator dir(m_folder); dir != fs::directory_iterator(); ++dir) {
+    if (!fs::is_directory(dir->status()) || dir->path().filename().string().size() != 2) {
+      continue;
+    }
+
+    std::string prefix = dir->path().filename().string();
+    for (fs::directory_iterator file(dir->path()); file != fs::directory_iterator(); ++file) {
+      importObjectDb(file->path(), prefix + file->path().filename().string());
+    }
+
+    if (fs::is_empty(dir->path())) {
+      fs::remove(dir->path());
+    }
+  }
+}
+
+} // namespace chronoshare
+} // namespace ndn
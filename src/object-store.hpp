@@ -0,0 +1,213 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#ifndef CHRONOSHARE_SRC_OBJECT_STORE_HPP
+#define CHRONOSHARE_SRC_OBJECT_STORE_HPP
+
+#include "db-helper.hpp"
+#include "core/chronoshare-common.hpp"
+
+#include <ndn-cxx/encoding/block.hpp>
+#include <ndn-cxx/encoding/buffer.hpp>
+#include <ndn-cxx/name.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace ndn {
+namespace chronoshare {
+
+/**
+ * @brief Content-addressed store for file segments shared by all files of a shared folder
+ *
+ * Segments are appended to pack files <folder>/objects/pack-<n>, which are rolled over when
+ * they reach MAX_PACK_SIZE.  The location of every segment is kept in a single index
+ * database <folder>/objects/index.db, keyed by (file hash, device name, segment).
+ *
+ * Saved segments stay invisible to doesExist until the file of the device is marked complete
+ * with markComplete (this replicates semantics of per-file transactions in the old ObjectDb).
+ *
+ * Content-defined chunks (see ObjectManager) are kept in the same pack files, but are indexed
+ * separately by (digest, device name): a chunk is a single content object, complete as soon as
+ * it is saved, and is shared by all files and versions that contain it.
+ *
+ * Per-file databases created by previous versions (<folder>/objects/<xx>/<rest-of-hash>)
+ * are imported and removed when the store is opened.
+ *
+ * Index updates are batched in a transaction of their own rather than in DbHelper transactions,
+ * as the batch spans calls from different threads and must be committed only after pack data
+ * has been synced (see flush).  For the same reason, the index is always queried on the main
+ * connection, which sees the pending updates.
+ */
+class ObjectStore : public DbHelper
+{
+public:
+  class Error : public DbHelper::Error
+  {
+  public:
+    explicit
+    Error(const std::string& what)
+      : DbHelper::Error(what)
+    {
+    }
+  };
+
+  /**
+   * @brief Get the store for the folder, opening it if necessary
+   *
+   * Only one instance per folder is kept open within the process.  The store stays open
+   * until the end of the process, so that lookups do not reopen the index.
+   */
+  static shared_ptr<ObjectStore>
+  open(const boost::filesystem::path& folder);
+
+  ~ObjectStore();
+
+  /**
+   * @param data wire encoding of the content object
+   */
+  void
+  saveContentObject(const std::string& hash, const Name& deviceName, sqlite3_int64 segment,
+                    const Block& data);
+
+  /**
+   * @return wire encoding of the content object, nullptr if the segment is not stored
+   */
+  ConstBufferPtr
+  fetchSegment(const std::string& hash, const Name& deviceName, sqlite3_int64 segment);
+
+  /**
+   * @brief Check if segments 0..n of the file have been saved for the device and marked complete
+   */
+  bool
+  doesExist(const std::string& hash, const Name& deviceName);
+
+  /**
+   * @brief Make segments of the file that have been saved so far for the device visible to
+   *        doesExist
+   */
+  void
+  markComplete(const std::string& hash, const Name& deviceName);
+
+  /**
+   * @brief Save content object of the chunk, unless it is already stored for the device
+   */
+  void
+  saveChunk(const std::string& digest, const Name& deviceName, const Block& data);
+
+  ConstBufferPtr
+  fetchChunk(const std::string& digest, const Name& deviceName);
+
+  /**
+   * @brief Fetch content object of the chunk saved for any device
+   */
+  ConstBufferPtr
+  fetchChunk(const std::string& digest);
+
+  bool
+  doesChunkExist(const std::string& digest, const Name& deviceName);
+
+  /**
+   * @brief Check if the chunk is saved for any device
+   */
+  bool
+  doesChunkExist(const std::string& digest);
+
+  /**
+   * @brief Make pack data durable and commit pending index updates
+   *
+   * If the index updates cannot be committed, they are kept pending and committed by the next
+   * flush.
+   */
+  void
+  flush();
+
+  /**
+   * @brief Import and remove per-file database created by previous versions of ObjectDb
+   */
+  bool
+  importObjectDb(const boost::filesystem::path& dbFile, const std::string& hash);
+
+private:
+  explicit
+  ObjectStore(const boost::filesystem::path& folder);
+
+  void
+  migrateObjectDbs();
+
+  int
+  openPack(int pack);
+
+  /**
+   * @brief Start a batch of index updates unless one is already pending
+   * @throw Error if the transaction cannot be started
+   */
+  void
+  beginIndexTransaction();
+
+  /**
+   * @brief Append record to the current pack, rolling it over if necessary
+   * @return offset of the data in the current pack
+   */
+  off_t
+  writeRecord(const Buffer& hashBytes, const Block& name, sqlite3_int64 segment,
+              const uint8_t* data, size_t size);
+
+  /**
+   * @brief Commit pending index updates if there are too many of them
+   */
+  void
+  recordSaved();
+
+  ConstBufferPtr
+  readRecord(int pack, off_t offset, size_t length);
+
+  void
+  appendRecord(const std::string& hash, const Name& deviceName, sqlite3_int64 segment,
+               const uint8_t* data, size_t size);
+
+  void
+  markCompleteLocked(const std::string& hash, const Name& deviceName);
+
+  void
+  flushLocked();
+
+private:
+  boost::filesystem::path m_folder;
+  std::mutex m_mutex;
+
+  bool m_inTransaction;
+  int m_pendingRecords;
+
+  std::map<int, int> m_packFds;
+  int m_currentPack;
+  off_t m_currentPackSize;
+  bool m_currentPackDirty;
+};
+
+typedef shared_ptr<ObjectStore> ObjectStorePtr;
+
+} // namespace chronoshare
+} // namespace ndn
+
+#endif // CHRONOSHARE_SRC_OBJECT_STORE_HPP
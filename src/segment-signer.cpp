@@ -0,0 +1,174 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "segment-signer.hpp"
+
+#include <algorithm>
+
+namespace ndn {
+namespace chronoshare {
+
+SegmentSigner::SegmentSigner(size_t nThreads, size_t windowSize,
+                             const security::SigningInfo& signingInfo)
+  : m_nThreads(std::max<size_t>(nThreads, 1))
+  , m_windowSize(std::max<size_t>(windowSize, 1))
+  , m_signingInfo(signingInfo)
+  , m_segments(nullptr)
+  , m_next(0)
+  , m_saved(0)
+  , m_inProgress(0)
+  , m_isStopping(false)
+{
+  if (m_nThreads == 1) {
+    m_keyChain.reset(new KeyChain());
+  }
+  else {
+    for (size_t i = 0; i < m_nThreads; i++) {
+      m_threads.emplace_back(&SegmentSigner::run, this);
+    }
+  }
+}
+
+SegmentSigner::~SegmentSigner()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_isStopping = true;
+  }
+  m_workCondition.notify_all();
+  for (auto& thread : m_threads) {
+    thread.join();
+  }
+}
+
+shared_ptr<Data>
+SegmentSigner::signSegment(KeyChain& keyChain, const Segment& segment) const
+{
+  shared_ptr<Data> data = make_shared<Data>(segment.name);
+  data->setContent(segment.buf, segment.size);
+  keyChain.sign(*data, m_signingInfo);
+  return data;
+}
+
+void
+SegmentSigner::sign(std::vector<Segment>& segments, const SaveCallback& save)
+{
+  std::lock_guard<std::mutex> signLock(m_signMutex);
+
+  if (m_nThreads == 1) {
+    for (size_t i = 0; i < segments.size(); i++) {
+      segments[i].data = signSegment(*m_keyChain, segments[i]);
+      save(i, segments[i]);
+      segments[i].data.reset();
+    }
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_segments = &segments;
+  m_isDone.assign(segments.size(), 0);
+  m_next = 0;
+  m_saved = 0;
+  m_error = nullptr;
+  m_workCondition.notify_all();
+
+  while (m_saved < segments.size()) {
+    m_doneCondition.wait(lock, [this] { return m_isDone[m_saved] || m_error; });
+    if (m_error) {
+      break;
+    }
+
+    Segment& segment = segments[m_saved];
+    lock.unlock();
+    try {
+      save(m_saved, segment);
+    }
+    catch (...) {
+      lock.lock();
+      m_error = std::current_exception();
+      break;
+    }
+    segment.data.reset();
+    lock.lock();
+
+    m_saved++;
+    // one more segment fits into the window
+    m_workCondition.notify_one();
+  }
+
+  // no new segments are taken, but the ones being signed still refer to the vector
+  m_next = segments.size();
+  m_doneCondition.wait(lock, [this] { return m_inProgress == 0; });
+  m_segments = nullptr;
+
+  if (m_error) {
+    std::exception_ptr error = m_error;
+    m_error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void
+SegmentSigner::run()
+{
+  // KeyChain is not thread-safe
+  KeyChain keyChain;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_workCondition.wait(lock, [this] {
+        return m_isStopping ||
+               (m_segments != nullptr && m_next < m_segments->size() &&
+                m_next < m_saved + m_windowSize);
+      });
+    if (m_isStopping) {
+      return;
+    }
+
+    size_t index = m_next++;
+    Segment& segment = (*m_segments)[index];
+    m_inProgress++;
+    lock.unlock();
+
+    shared_ptr<Data> data;
+    std::exception_ptr error;
+    try {
+      data = signSegment(keyChain, segment);
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    segment.data = data;
+    if (error && !m_error) {
+      m_error = error;
+    }
+    m_isDone[index] = 1;
+    m_inProgress--;
+    // the caller waits only for the next segment to save or for the last one in progress
+    if (index == m_saved || m_error || m_inProgress == 0) {
+      m_doneCondition.notify_all();
+    }
+  }
+}
+
+} // namespace chronoshare
+} // namespace ndn
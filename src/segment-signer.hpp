@@ -0,0 +1,115 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#ifndef CHRONOSHARE_SRC_SEGMENT_SIGNER_HPP
+#define CHRONOSHARE_SRC_SEGMENT_SIGNER_HPP
+
+#include "core/chronoshare-common.hpp"
+
+#include <ndn-cxx/data.hpp>
+#include <ndn-cxx/security/key-chain.hpp>
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ndn {
+namespace chronoshare {
+
+/**
+ * @brief Pool of threads that sign content objects of a file
+ *
+ * Segments are signed in parallel, but handed back to the caller strictly in order, so they are
+ * saved to the store in the same order as when signed one by one.  At most windowSize segments
+ * are signed ahead of the last saved one, which bounds the memory taken by signed content
+ * objects that wait for the preceding segments.
+ *
+ * KeyChain is not thread-safe, so every thread signs with its own KeyChain.  With one thread,
+ * segments are signed on the calling thread.
+ */
+class SegmentSigner : boost::noncopyable
+{
+public:
+  struct Segment
+  {
+    Name name;
+    const uint8_t* buf;
+    size_t size;
+    shared_ptr<Data> data;
+  };
+
+  typedef function<void(size_t /*index*/, Segment&)> SaveCallback;
+
+  SegmentSigner(size_t nThreads, size_t windowSize,
+                const security::SigningInfo& signingInfo = security::SigningInfo());
+  ~SegmentSigner();
+
+  size_t
+  getThreadCount() const
+  {
+    return m_nThreads;
+  }
+
+  /**
+   * @brief Sign all segments, calling save for each of them in order on the calling thread
+   *
+   * Data packet of a segment is released after save returns.  If signing or save throws,
+   * the remaining segments are not saved and the exception is rethrown.
+   */
+  void
+  sign(std::vector<Segment>& segments, const SaveCallback& save);
+
+private:
+  void
+  run();
+
+  shared_ptr<Data>
+  signSegment(KeyChain& keyChain, const Segment& segment) const;
+
+private:
+  size_t m_nThreads;
+  size_t m_windowSize;
+  security::SigningInfo m_signingInfo;
+
+  // one file is signed at a time
+  std::mutex m_signMutex;
+  // used only when segments are signed on the calling thread
+  std::unique_ptr<KeyChain> m_keyChain;
+
+  std::mutex m_mutex;
+  std::condition_variable m_workCondition;
+  std::condition_variable m_doneCondition;
+  std::vector<Segment>* m_segments;
+  std::vector<char> m_isDone;
+  size_t m_next;
+  size_t m_saved;
+  size_t m_inProgress;
+  std::exception_ptr m_error;
+  bool m_isStopping;
+
+  std::vector<std::thread> m_threads;
+};
+
+} // namespace chronoshare
+} // namespace ndn
+
+#endif // CHRONOSHARE_SRC_SEGMENT_SIGNER_HPP
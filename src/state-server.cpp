@@ -462,7 +462,8 @@ StateServer::cmd_restore_file_Execute(const Ccnx::Name& interest)
     }
 
     _LOG_TRACE("Restoring file [" << filePath << "]");
-    if (m_objectManager.objectsToLocalFile(deviceName, hash, filePath)) {
+    if (m_objectManager.objectsToLocalFile(deviceName, hash, filePath, file->seg_size(),
+                                           file->chunked())) {
       last_write_time(filePath, file->mtime());
 #if BOOST_VERSION >= 104900
       permissions(filePath, static_cast<filesystem::perms>(file->mode()));
@@ -35,6 +35,9 @@ const int SyncCore::FRESHNESS = 2;
 const std::string SyncCore::RECOVER = "RECOVER";
 const double SyncCore::WAIT = 0.05;
 const double SyncCore::RANDOM_PERCENT = 0.5;
+const int SyncCore::COMPACTION_INTERVAL = 60;
+const int SyncCore::COMPACTION_BATCH = 100;
+const size_t SyncCore::REPLY_CACHE_SIZE = 16;
 
 SyncCore::SyncCore(Face& face, SyncLogPtr syncLog, const Name& userName, const Name& localPrefix,
                    const Name& syncPrefix, const StateMsgCallback& callback,
@@ -45,11 +48,14 @@ SyncCore::SyncCore(Face& face, SyncLogPtr syncLog, const Name& userName, const N
   , m_syncInterestEvent(m_scheduler)
   , m_periodicInterestEvent(m_scheduler)
   , m_localStateDelayedEvent(m_scheduler)
+  , m_compactionEvent(m_scheduler)
   , m_stateMsgCallback(callback)
   , m_syncPrefix(syncPrefix)
   , m_recoverWaitGenerator(
       new RandomIntervalGenerator(WAIT, RANDOM_PERCENT, RandomIntervalGenerator::Direction::UP))
   , m_syncInterestInterval(syncInterestInterval)
+  , m_nReplyCacheHits(0)
+  , m_nReplyCacheMisses(0)
 {
   m_rootDigest = m_log->RememberStateInStateLog();
 
@@ -68,6 +74,9 @@ SyncCore::SyncCore(Face& face, SyncLogPtr syncLog, const Name& userName, const N
 
   m_syncInterestEvent =
     m_scheduler.scheduleEvent(time::milliseconds(100), bind(&SyncCore::sendSyncInterest, this));
+
+  m_compactionEvent = m_scheduler.scheduleEvent(time::seconds(COMPACTION_INTERVAL),
+                                                bind(&SyncCore::compactSyncLog, this));
 }
 
 void
@@ -78,6 +87,23 @@ SyncCore::sendPeriodicSyncInterest(const time::seconds& interval)
     m_scheduler.scheduleEvent(interval, bind(&SyncCore::sendPeriodicSyncInterest, this, interval));
 }
 
+void
+SyncCore::compactSyncLog()
+{
+  bool hasMore = false;
+  try {
+    hasMore = m_log->Compact(COMPACTION_BATCH);
+  }
+  catch (const DbHelper::Error& e) {
+    // retried with the next scheduled compaction
+    _LOG_ERROR("Cannot compact SyncLog: " << e.what());
+  }
+
+  m_compactionEvent =
+    m_scheduler.scheduleEvent(hasMore ? time::milliseconds(10) : time::seconds(COMPACTION_INTERVAL),
+                              bind(&SyncCore::compactSyncLog, this));
+}
+
 SyncCore::~SyncCore()
 {
   // need to "deregister" closures
@@ -95,31 +121,18 @@ void
 SyncCore::localStateChanged()
 {
   ConstBufferPtr oldDigest = m_rootDigest;
-  m_rootDigest = m_log->RememberStateInStateLog();
+  setRootDigest(m_log->RememberStateInStateLog());
 
   _LOG_DEBUG("[" << m_log->GetLocalName() << "] localStateChanged ");
   _LOG_TRACE("[" << m_log->GetLocalName() << "] publishes: oldDigest--" << toHex(*oldDigest)
                  << " newDigest--"
                  << toHex(*m_rootDigest));
 
-  SyncStateMsgPtr msg = m_log->FindStateDifferences(*oldDigest, *m_rootDigest);
-
   // reply sync Interest with oldDigest as last component
-
   Name syncName(m_syncPrefix);
   syncName.appendImplicitSha256Digest(oldDigest);
 
-  BufferPtr syncData = serializeGZipMsg(*msg);
-
-  // Create Data packet
-  shared_ptr<Data> data = make_shared<Data>();
-  data->setName(syncName);
-  data->setFreshnessPeriod(time::seconds(FRESHNESS));
-  data->setContent(reinterpret_cast<const uint8_t*>(syncData->buf()), syncData->size());
-  m_keyChain.sign(*data);
-  m_face.put(*data);
-
-  _LOG_TRACE(msg);
+  putSyncReply(syncName, *oldDigest);
 
   // no hurry in sending out new Sync Interest; if others send the new Sync Interest first, no
   // problem, we know the new root digest already;
@@ -190,6 +203,57 @@ SyncCore::recover(ConstBufferPtr digest)
   }
 }
 
+void
+SyncCore::setRootDigest(ConstBufferPtr digest)
+{
+  if (!(*digest == *m_rootDigest)) {
+    // replies for the old root digest are no longer valid
+    m_replies.clear();
+    m_replyIndex.clear();
+  }
+  m_rootDigest = digest;
+}
+
+void
+SyncCore::putSyncReply(const Name& name, const Buffer& oldDigest)
+{
+  ReplyKey key(oldDigest, *m_rootDigest);
+
+  auto cached = m_replyIndex.find(key);
+  if (cached != m_replyIndex.end() && cached->second->second->getName() == name) {
+    ++m_nReplyCacheHits;
+    m_replies.splice(m_replies.begin(), m_replies, cached->second);
+    m_face.put(*m_replies.front().second);
+    return;
+  }
+  ++m_nReplyCacheMisses;
+
+  SyncStateMsgPtr msg = m_log->FindStateDifferences(oldDigest, *m_rootDigest);
+
+  BufferPtr syncData = serializeGZipMsg(*msg);
+  shared_ptr<Data> data = make_shared<Data>();
+  data->setName(name);
+  data->setFreshnessPeriod(time::seconds(FRESHNESS));
+  data->setContent(reinterpret_cast<const uint8_t*>(syncData->buf()), syncData->size());
+  m_keyChain.sign(*data);
+  m_face.put(*data);
+
+  _LOG_TRACE(msg);
+
+  if (cached != m_replyIndex.end()) {
+    m_replies.erase(cached->second);
+    m_replyIndex.erase(cached);
+  }
+
+  m_replies.push_front(std::make_pair(key, data));
+  m_replyIndex[key] = m_replies.begin();
+
+  if (m_replies.size() > REPLY_CACHE_SIZE) {
+    m_replyIndex.erase(m_replies.back().first);
+    m_replies.pop_back();
+  }
+}
+
 void
 SyncCore::handleInterest(const InterestFilter& filter, const Interest& interest)
 {
@@ -221,19 +285,10 @@ SyncCore::handleSyncInterest(const Name& name)
   else if (m_log->LookupSyncLog(*digest) > 0) {
     // we know something more
     _LOG_TRACE("found digest in sync log");
-    SyncStateMsgPtr msg = m_log->FindStateDifferences(*digest, *m_rootDigest);
-
-    BufferPtr syncData = serializeGZipMsg(*msg);
-    shared_ptr<Data> data = make_shared<Data>();
-    data->setName(name);
-    data->setFreshnessPeriod(time::seconds(FRESHNESS));
-    data->setContent(reinterpret_cast<const uint8_t*>(syncData->buf()), syncData->size());
-    m_keyChain.sign(*data);
-    m_face.put(*data);
+    putSyncReply(name, *digest);
 
     _LOG_TRACE(m_log->GetLocalName() << " publishes: " << toHex(*digest) << " my_rootDigest:"
                                      << toHex(*m_rootDigest));
-    _LOG_TRACE(msg);
   }
   else {
     // we don't recognize the digest, send recover Interest if still don't know the digest after a
@@ -380,7 +435,7 @@ SyncCore::handleStateData(const Buffer& content)
 
   // find the actuall difference and invoke callback on the actual difference
   ConstBufferPtr oldDigest = m_rootDigest;
-  m_rootDigest = m_log->RememberStateInStateLog();
+  setRootDigest(m_log->RememberStateInStateLog());
   // get diff with both new SeqNo and old SeqNo
   SyncStateMsgPtr diff = m_log->FindStateDifferences(*oldDigest, *m_rootDigest, true);
 
@@ -34,6 +34,9 @@
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 
+#include <list>
+#include <map>
+
 namespace ndn {
 namespace chronoshare {
 
@@ -105,6 +108,9 @@ public:
   static const std::string RECOVER;
   static const double WAIT;           // seconds;
   static const double RANDOM_PERCENT; // seconds;
+  static const int COMPACTION_INTERVAL; // seconds
+  static const int COMPACTION_BATCH;    // states removed per step
+  static const size_t REPLY_CACHE_SIZE; // signed sync replies
 
   class Error : public boost::exception, public std::runtime_error
   {
@@ -140,6 +146,24 @@ public:
   void
   localStateChangedDelayed();
 
+  /**
+   * @brief Number of sync replies served from the reply cache
+   */
+  uint64_t
+  replyCacheHits() const
+  {
+    return m_nReplyCacheHits;
+  }
+
+  /**
+   * @brief Number of sync replies that had to be computed and signed
+   */
+  uint64_t
+  replyCacheMisses() const
+  {
+    return m_nReplyCacheMisses;
+  }
+
   // ------------------ only used in test -------------------------
 
 public:
@@ -167,9 +191,31 @@ private:
   void
   sendPeriodicSyncInterest(const time::seconds& interval);
 
+  /**
+   * @brief Remove a batch of old states from the log and schedule the next step
+   *
+   * Compaction is split into small batches, so interests can be processed in between
+   */
+  void
+  compactSyncLog();
+
   void
   recover(ConstBufferPtr digest);
 
+  /**
+   * @brief Set new root digest, invalidating cached sync replies if it has changed
+   */
+  void
+  setRootDigest(ConstBufferPtr digest);
+
+  /**
+   * @brief Reply with difference between @p oldDigest and the root digest
+   *
+   * Signed replies are kept in a small LRU cache, as peers often send the same stale digest
+   */
+  void
+  putSyncReply(const Name& name, const Buffer& oldDigest);
+
   void
   handleInterest(const InterestFilter& filter, const Interest& interest);
 
@@ -206,6 +252,7 @@ private:
   util::scheduler::ScopedEventId m_syncInterestEvent;
   util::scheduler::ScopedEventId m_periodicInterestEvent;
   util::scheduler::ScopedEventId m_localStateDelayedEvent;
+  util::scheduler::ScopedEventId m_compactionEvent;
 
   StateMsgCallback m_stateMsgCallback;
 
@@ -216,6 +263,16 @@ private:
 
   long m_syncInterestInterval;
   KeyChain m_keyChain;
+
+  // (old digest, new digest)
+  typedef std::pair<Buffer, Buffer> ReplyKey;
+  typedef std::list<std::pair<ReplyKey, shared_ptr<const Data>>> ReplyList;
+  // most recently used first
+  ReplyList m_replies;
+  std::map<ReplyKey, ReplyList::iterator> m_replyIndex;
+  uint64_t m_nReplyCacheHits;
+  uint64_t m_nReplyCacheMisses;
+
   const RegisteredPrefixId* m_registeredPrefixId;
 };
 
@@ -0,0 +1,92 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "sync-digest-filter.hpp"
+
+#include <algorithm>
+
+namespace ndn {
+namespace chronoshare {
+
+// 10 bits per digest and 7 probes give about 1% false positives at full capacity
+static const size_t BITS_PER_DIGEST = 10;
+static const int N_PROBES = 7;
+
+// Two independent 64-bit hashes of the digest for double hashing (FNV-1a and its splitmix64
+// finalization).  Digests are mostly SHA-256, but the empty state has a 1-byte digest.
+static void
+hashDigest(const Buffer& digest, uint64_t& h1, uint64_t& h2)
+{
+  h1 = 14695981039346656037ULL;
+  for (uint8_t byte : digest) {
+    h1 ^= byte;
+    h1 *= 1099511628211ULL;
+  }
+
+  h2 = h1 + 0x9E3779B97F4A7C15ULL;
+  h2 = (h2 ^ (h2 >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h2 = (h2 ^ (h2 >> 27)) * 0x94D049BB133111EBULL;
+  h2 = (h2 ^ (h2 >> 31)) | 1;
+}
+
+SyncDigestFilter::SyncDigestFilter(size_t capacity)
+{
+  reset(capacity);
+}
+
+void
+SyncDigestFilter::reset(size_t capacity)
+{
+  m_capacity = std::max<size_t>(capacity, 1);
+  m_nBits = m_capacity * BITS_PER_DIGEST;
+  m_bits.assign((m_nBits + 63) / 64, 0);
+  m_size = 0;
+}
+
+void
+SyncDigestFilter::insert(const Buffer& digest)
+{
+  uint64_t h1, h2;
+  hashDigest(digest, h1, h2);
+
+  for (int i = 0; i < N_PROBES; i++) {
+    size_t bit = (h1 + i * h2) % m_nBits;
+    m_bits[bit / 64] |= (1ULL << (bit % 64));
+  }
+  ++m_size;
+}
+
+bool
+SyncDigestFilter::mayContain(const Buffer& digest) const
+{
+  uint64_t h1, h2;
+  hashDigest(digest, h1, h2);
+
+  for (int i = 0; i < N_PROBES; i++) {
+    size_t bit = (h1 + i * h2) % m_nBits;
+    if ((m_bits[bit / 64] & (1ULL << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,93 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#ifndef CHRONOSHARE_SRC_SYNC_DIGEST_FILTER_HPP
+#define CHRONOSHARE_SRC_SYNC_DIGEST_FILTER_HPP
+
+#include "core/chronoshare-common.hpp"
+
+#include <ndn-cxx/encoding/buffer.hpp>
+
+#include <vector>
+
+namespace ndn {
+namespace chronoshare {
+
+/**
+ * @brief Bloom filter over state digests recorded in SyncLog
+ *
+ * The filter answers "definitely unknown" for digests that were never inserted, so that
+ * digests sent by peers that are out of sync do not need a database lookup.  Digests cannot be
+ * removed; the filter has to be rebuilt instead.
+ */
+class SyncDigestFilter
+{
+public:
+  /**
+   * @brief Create an empty filter sized for @p capacity digests
+   */
+  explicit SyncDigestFilter(size_t capacity = 1024);
+
+  /**
+   * @brief Remove all digests and resize the filter for @p capacity digests
+   */
+  void
+  reset(size_t capacity);
+
+  void
+  insert(const Buffer& digest);
+
+  /**
+   * @return false if the digest has definitely not been inserted
+   */
+  bool
+  mayContain(const Buffer& digest) const;
+
+  /**
+   * @brief Number of inserted digests
+   */
+  size_t
+  size() const
+  {
+    return m_size;
+  }
+
+  /**
+   * @brief Number of digests the filter is sized for
+   *
+   * The false positive rate grows above 1% when more digests are inserted.
+   */
+  size_t
+  capacity() const
+  {
+    return m_capacity;
+  }
+
+private:
+  std::vector<uint64_t> m_bits;
+  size_t m_nBits;
+  size_t m_size;
+  size_t m_capacity;
+};
+
+} // namespace chronoshare
+} // namespace ndn
+
+#endif // CHRONOSHARE_SRC_SYNC_DIGEST_FILTER_HPP
@@ -0,0 +1,116 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+
+#include "sync-digest-tree.hpp"
+
+#include <ndn-cxx/util/digest.hpp>
+
+namespace ndn {
+namespace chronoshare {
+
+using util::Sha256;
+
+static ConstBufferPtr
+makeLeaf(const Buffer& deviceName, int64_t seqNo)
+{
+  Sha256 digest;
+  digest.update(deviceName.buf(), deviceName.size());
+  digest.update(reinterpret_cast<const uint8_t*>(&seqNo), sizeof(seqNo));
+  return digest.computeDigest();
+}
+
+SyncDigestTree::SyncDigestTree()
+  : m_needsRebuild(false)
+{
+}
+
+void
+SyncDigestTree::update(const Buffer& deviceName, int64_t seqNo)
+{
+  auto leaf = m_leaves.find(deviceName);
+  if (leaf == m_leaves.end()) {
+    m_leaves[deviceName].digest = makeLeaf(deviceName, seqNo);
+    m_needsRebuild = true;
+    return;
+  }
+
+  leaf->second.digest = makeLeaf(deviceName, seqNo);
+  if (m_needsRebuild) {
+    return;
+  }
+
+  size_t node = leaf->second.node;
+  m_nodes[node] = leaf->second.digest;
+  for (node /= 2; node > 0; node /= 2) {
+    m_nodes[node] = combine(m_nodes[2 * node], m_nodes[2 * node + 1]);
+  }
+}
+
+ConstBufferPtr
+SyncDigestTree::getRoot()
+{
+  if (m_leaves.empty()) {
+    // the same as ``hash'' aggregate over the empty set
+    return make_shared<Buffer>(1);
+  }
+
+  if (m_needsRebuild) {
+    rebuild();
+  }
+  return m_nodes[1];
+}
+
+void
+SyncDigestTree::rebuild()
+{
+  size_t width = 1;
+  while (width < m_leaves.size()) {
+    width *= 2;
+  }
+
+  m_nodes.assign(2 * width, nullptr);
+  size_t node = width;
+  for (auto& leaf : m_leaves) {
+    leaf.second.node = node;
+    m_nodes[node++] = leaf.second.digest;
+  }
+  for (node = width - 1; node > 0; node--) {
+    m_nodes[node] = combine(m_nodes[2 * node], m_nodes[2 * node + 1]);
+  }
+  m_needsRebuild = false;
+}
+
+ConstBufferPtr
+SyncDigestTree::combine(const ConstBufferPtr& left, const ConstBufferPtr& right)
+{
+  // leaves are packed to the left, so a node without a right subtree takes the left one as is
+  if (right == nullptr) {
+    return left;
+  }
+
+  Sha256 digest;
+  digest.update(left->buf(), left->size());
+  digest.update(right->buf(), right->size());
+  return digest.computeDigest();
+}
+
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,93 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+
+#ifndef CHRONOSHARE_SRC_SYNC_DIGEST_TREE_HPP
+#define CHRONOSHARE_SRC_SYNC_DIGEST_TREE_HPP
+
+#include "core/chronoshare-common.hpp"
+
+#include <ndn-cxx/encoding/buffer.hpp>
+
+#include <map>
+#include <vector>
+
+namespace ndn {
+namespace chronoshare {
+
+/**
+ * @brief Root digest of the sync state, maintained per device
+ *
+ * Each device is a leaf with SHA-256 over its wire-encoded name and seq_no.  Leaves are ordered
+ * by name and hashed pairwise up to the root, so a new seq_no of a known device re-hashes only
+ * its leaf and the leaf's ancestors.  A new device rebuilds the tree on the next getRoot().
+ */
+class SyncDigestTree
+{
+public:
+  SyncDigestTree();
+
+  /**
+   * @brief Set seq_no of the device, adding the device if it is new
+   */
+  void
+  update(const Buffer& deviceName, int64_t seqNo);
+
+  /**
+   * @brief Get the root digest
+   *
+   * The digest of an empty tree is a single zero byte.
+   */
+  ConstBufferPtr
+  getRoot();
+
+  size_t
+  size() const
+  {
+    return m_leaves.size();
+  }
+
+private:
+  void
+  rebuild();
+
+  static ConstBufferPtr
+  combine(const ConstBufferPtr& left, const ConstBufferPtr& right);
+
+private:
+  struct Leaf
+  {
+    ConstBufferPtr digest;
+    // index of the leaf in m_nodes, valid unless m_needsRebuild
+    size_t node;
+  };
+
+  // wire-encoded device name -> leaf, ordered the same way as BLOBs in SQLite
+  std::map<Buffer, Leaf> m_leaves;
+  // complete binary tree, node i has children 2i and 2i+1, root is node 1; subtrees that have
+  // no leaves are null
+  std::vector<ConstBufferPtr> m_nodes;
+  bool m_needsRebuild;
+};
+
+} // namespace chronoshare
+} // namespace ndn
+
+#endif // CHRONOSHARE_SRC_SYNC_DIGEST_TREE_HPP
@@ -24,6 +24,8 @@
 #include <ndn-cxx/util/sqlite3-statement.hpp>
 #include <ndn-cxx/util/string-helper.hpp>
 
+#include <algorithm>
+
 namespace ndn {
 namespace chronoshare {
 
@@ -48,26 +50,13 @@ CREATE TABLE                                                    \n\
         last_update     TIMESTAMP                               \n\
     );                                                          \n\
                                                                 \n\
-CREATE TRIGGER SyncNodesUpdater_trigger                                \n\
-    BEFORE INSERT ON SyncNodes                                         \n\
-    FOR EACH ROW                                                       \n\
-    WHEN (SELECT device_id                                             \n\
-             FROM SyncNodes                                            \n\
-             WHERE device_name=NEW.device_name)                        \n\
-         IS NOT NULL                                                   \n\
-    BEGIN                                                              \n\
-        UPDATE SyncNodes                                               \n\
-            SET seq_no=max(seq_no,NEW.seq_no)                          \n\
-            WHERE device_name=NEW.device_name;                         \n\
-        SELECT RAISE(IGNORE);                                          \n\
-    END;                                                               \n\
-                                                                       \n\
 CREATE INDEX SyncNodes_device_name ON SyncNodes (device_name);         \n\
                                                                        \n\
 CREATE TABLE SyncLog(                                                  \n\
         state_id    INTEGER PRIMARY KEY AUTOINCREMENT,                 \n\
         state_hash  BLOB NOT NULL UNIQUE,                              \n\
-        last_update TIMESTAMP NOT NULL                                 \n\
+        last_update TIMESTAMP NOT NULL,                                \n\
+        is_checkpoint INTEGER NOT NULL DEFAULT 1                       \n\
     );                                                                 \n\
                                                                        \n\
 CREATE TABLE                                                            \n\
@@ -96,12 +85,53 @@ CREATE TRIGGER SyncLogGuard_trigger                                     \n\
     END;                                                                \n\
 ";
 
+// States recorded by previous versions contain all devices, i.e., they are all checkpoints
+const std::string UPGRADE_DATABASE = "\
+ALTER TABLE SyncLog ADD COLUMN is_checkpoint INTEGER NOT NULL DEFAULT 1; \n\
+";
+
+// The whole block is skipped after a crash, as any seq_no of it may have been published
+const std::string INIT_LOCAL_SEQ_NO = "\
+CREATE TABLE IF NOT EXISTS SyncLocalSeqNo (                             \n\
+    reserved_seq_no INTEGER NOT NULL                                    \n\
+);                                                                      \n\
+INSERT INTO SyncLocalSeqNo (reserved_seq_no)                            \n\
+    SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM SyncLocalSeqNo);           \n\
+";
+
+// Number of seq_nos reserved at once by GetNextLocalSeqNo
+const size_t LOCAL_SEQ_NO_BLOCK_SIZE = 100;
+
+// Number of states between full copies of the state in SyncStateNodes.  Other states store only
+// devices that have changed since the previous state.
+const int CHECKPOINT_INTERVAL = 100;
+
+// Default number of recent states kept in memory for FindStateDifferences
+const size_t STATE_CACHE_SIZE = 1000;
+
+// Minimum number of digests the digest filter is sized for
+const size_t DIGEST_FILTER_CAPACITY = 1024;
+
 SyncLog::SyncLog(const boost::filesystem::path& path, const Name& localName)
   : DbHelper(path / ".chronoshare", "sync-log.db")
   , m_localName(localName)
+  , m_checkpointInterval(CHECKPOINT_INTERVAL)
+  , m_isStateChainBroken(false)
+  , m_localSeqNoBlockSize(LOCAL_SEQ_NO_BLOCK_SIZE)
+  , m_stateCacheSize(STATE_CACHE_SIZE)
+  , m_isRebuildingFilter(false)
 {
   sqlite3_exec(m_db, INIT_DATABASE.c_str(), NULL, NULL, NULL);
   _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, "DB Constructor: " << sqlite3_errmsg(m_db));
+  sqlite3_exec(m_db, UPGRADE_DATABASE.c_str(), NULL, NULL, NULL); // fails if already upgraded
+  // SyncNodes are updated by UpdateDeviceSeqNo now
+  sqlite3_exec(m_db, "DROP TRIGGER IF EXISTS SyncNodesUpdater_trigger", NULL, NULL, NULL);
+  sqlite3_exec(m_db, INIT_LOCAL_SEQ_NO.c_str(), NULL, NULL, NULL);
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, "DB Constructor: " << sqlite3_errmsg(m_db));
+  clearStatementCache();
+
+  // changes since the last recorded state are not known, so the next state must be a checkpoint
+  m_nStatesSinceCheckpoint = m_checkpointInterval;
 
   UpdateDeviceSeqNo(localName, 0);
 
@@ -114,26 +144,116 @@ SyncLog::SyncLog(const boost::filesystem::path& path, const Name& localName)
   else {
     BOOST_THROW_EXCEPTION(Error("Impossible thing in SyncLog::SyncLog"));
   }
+
+  Statement nodesStmt(*this, "SELECT device_id, device_name, seq_no, last_known_locator "
+                             "  FROM SyncNodes");
+  while (sqlite3_step(nodesStmt) == SQLITE_ROW) {
+    sqlite3_int64 deviceId = sqlite3_column_int64(nodesStmt, 0);
+    Buffer deviceName(sqlite3_column_blob(nodesStmt, 1), sqlite3_column_bytes(nodesStmt, 1));
+    m_deviceIds[deviceName] = deviceId;
+    updateCachedState(deviceName, sqlite3_column_int64(nodesStmt, 2));
+
+    DeviceInfo& device = m_devices[deviceId];
+    device.name = deviceName;
+    if (sqlite3_column_type(nodesStmt, 3) == SQLITE_BLOB) {
+      device.locator = Buffer(sqlite3_column_blob(nodesStmt, 3), sqlite3_column_bytes(nodesStmt, 3));
+    }
+  }
+
+  // state_id is AUTOINCREMENT, so ids of removed states are not reused either
+  Statement lastStateStmt(*this, "SELECT MAX(IFNULL((SELECT seq FROM sqlite_sequence "
+                                 "                     WHERE name='SyncLog'), 0), "
+                                 "           IFNULL((SELECT MAX(state_id) FROM SyncLog), 0))");
+  sqlite3_step(lastStateStmt);
+  m_lastStateId = sqlite3_column_int64(lastStateStmt, 0);
+
+  rebuildDigestFilter();
+
+  Statement reservedStmt(*this, "SELECT reserved_seq_no FROM SyncLocalSeqNo");
+  m_reservedLocalSeqNo = 0;
+  if (sqlite3_step(reservedStmt) == SQLITE_ROW) {
+    m_reservedLocalSeqNo = sqlite3_column_int64(reservedStmt, 0);
+  }
+
+  if (m_reservedLocalSeqNo > findLocalNode()->second) {
+    _LOG_DEBUG("Skipping local seq_nos reserved before unclean shutdown, up to "
+               << m_reservedLocalSeqNo);
+    UpdateLocalSeqNo(m_reservedLocalSeqNo);
+  }
+}
+
+SyncLog::~SyncLog()
+{
+  // updates that have failed get one more chance
+  if (hasPendingDeviceUpdates()) {
+    enqueueWrite<void>(bind(&SyncLog::writePendingDeviceUpdates, this));
+  }
+  // queued writes refer to this object
+  stopWriter();
+  _LOG_ERROR_COND(hasPendingDeviceUpdates(), "Updates of SyncNodes have been lost");
+
+  // SyncNodes is up to date now, so unused reserved seq_nos can be given back
+  sqlite3_int64 seqNo = findLocalNode()->second;
+  if (m_reservedLocalSeqNo > seqNo) {
+    Statement stmt(*this, "UPDATE SyncLocalSeqNo SET reserved_seq_no=?");
+    sqlite3_bind_int64(stmt, 1, seqNo);
+    sqlite3_step(stmt);
+    _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, "DbError: " << sqlite3_errmsg(m_db));
+  }
 }
 
 sqlite3_int64
 SyncLog::GetNextLocalSeqNo()
 {
-  Sqlite3Statement stmt_seq(m_db, "SELECT seq_no FROM SyncNodes WHERE device_id = ?");
-  stmt_seq.bind(1, m_localDeviceId);
+  WriteLock lock(m_stateUpdateMutex);
 
-  if (sqlite3_step(stmt_seq) != SQLITE_ROW) {
-    BOOST_THROW_EXCEPTION(Error("Impossible thing in SyncLog::GetNextLocalSeqNo"));
+  auto node = findLocalNode();
+  sqlite3_int64 seq_no = node->second + 1;
+  if (seq_no > m_reservedLocalSeqNo) {
+    reserveLocalSeqNos(seq_no + m_localSeqNoBlockSize - 1);
   }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE,
-                  "DB GetNextLocalSeqNo: " << sqlite3_errmsg(m_db));
+  updateCachedState(node->first, seq_no);
+  addPendingSeqNo(m_localDeviceId, seq_no);
+  return seq_no;
+}
 
-  sqlite3_int64 seq_no = stmt_seq.getInt(0) + 1;
+void
+SyncLog::SetLocalSeqNoBlockSize(size_t size)
+{
+  WriteLock lock(m_stateUpdateMutex);
+  m_localSeqNoBlockSize = std::max<size_t>(size, 1);
+}
 
-  UpdateDeviceSeqNo(m_localDeviceId, seq_no);
+std::map<Buffer, sqlite3_int64>::iterator
+SyncLog::findLocalNode()
+{
+  const Block& wire = m_localName.wireEncode();
+  auto node = m_state.find(Buffer(wire.wire(), wire.size()));
+  if (node == m_state.end()) {
+    BOOST_THROW_EXCEPTION(Error("Impossible thing in SyncLog::findLocalNode"));
+  }
+  return node;
+}
 
-  return seq_no;
+void
+SyncLog::reserveLocalSeqNos(sqlite3_int64 seqNo)
+{
+  beginTransaction();
+  {
+    Statement stmt(*this, "UPDATE SyncLocalSeqNo SET reserved_seq_no=?");
+    sqlite3_bind_int64(stmt, 1, seqNo);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      _LOG_ERROR("Cannot reserve local seq_nos: " << sqlite3_errmsg(m_db));
+      rollbackTransaction();
+      BOOST_THROW_EXCEPTION(Error("Cannot reserve local seq_nos"));
+    }
+  }
+  commitTransaction();
+
+  // the reservation must reach the disk before any of the seq_nos is used
+  flush();
+  m_reservedLocalSeqNo = seqNo;
 }
 
 ConstBufferPtr
@@ -141,74 +261,166 @@ SyncLog::RememberStateInStateLog()
 {
   WriteLock lock(m_stateUpdateMutex);
 
-  int res = sqlite3_exec(m_db, "BEGIN TRANSACTION;", 0, 0, 0);
+  // retry seq_nos and locators that could not be written before
+  if (hasPendingDeviceUpdates()) {
+    enqueueWrite<void>(bind(&SyncLog::writePendingDeviceUpdates, this));
+  }
 
-  res += sqlite3_exec(m_db, "\
-INSERT INTO SyncLog                                                \
-    (state_hash, last_update)                                      \
-    SELECT                                                         \
-       hash(device_name, seq_no), datetime('now')                  \
-    FROM (SELECT * FROM SyncNodes                                  \
-              ORDER BY device_name);                               \
-",
-                      0, 0, 0);
+  ConstBufferPtr digest = getStateDigest();
+
+  // seq_no never decreases, so the only state that can be seen again is the last recorded one
+  sqlite3_int64 existingState = LookupSyncLog(*digest);
+  if (existingState > 0) {
+    enqueueWrite<void>([this, existingState] {
+      Statement touchStmt(*this, "UPDATE SyncLog SET last_update=datetime('now') WHERE state_id=?");
+      sqlite3_bind_int64(touchStmt, 1, existingState);
+      sqlite3_step(touchStmt);
+      _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, "DbError: " << sqlite3_errmsg(m_db));
+    });
+
+    cacheState(*digest, existingState, getStateVector());
+    m_changedDevices.clear();
+    return digest;
+  }
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK, "DbError: " << sqlite3_errmsg(m_db));
+  bool isCheckpoint = (m_nStatesSinceCheckpoint >= m_checkpointInterval);
+  sqlite3_int64 stateId = ++m_lastStateId;
 
-  if (res != SQLITE_OK) {
-    sqlite3_exec(m_db, "ROLLBACK TRANSACTION;", 0, 0, 0);
-    BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+  ConstStateVectorPtr state = getStateVector();
+  StateVector nodes;
+  if (isCheckpoint) {
+    nodes = *state;
+  }
+  else {
+    for (const Buffer& deviceName : m_changedDevices) {
+      nodes.push_back(std::make_pair(m_deviceIds[deviceName], m_state[deviceName]));
+    }
   }
 
-  sqlite3_int64 rowId = sqlite3_last_insert_rowid(m_db);
+  // the state is known from now on, even though it may not have been written yet
+  enqueueWrite<void>(bind(&SyncLog::writeState, this, stateId, *digest, isCheckpoint, nodes,
+                          state));
+
+  cacheState(*digest, stateId, state);
+  bool isFilterFull = false;
+  {
+    WriteLock cacheLock(m_stateCacheMutex);
+    m_digestFilter.insert(*digest);
+    if (m_isRebuildingFilter) {
+      m_digestsDuringRebuild.push_back(*digest);
+    }
+    isFilterFull = m_digestFilter.size() > m_digestFilter.capacity();
+  }
+  if (isFilterFull) {
+    scheduleDigestFilterRebuild();
+  }
 
-  sqlite3_stmt* insertStmt;
-  res += sqlite3_prepare(m_db, "\
-INSERT INTO SyncStateNodes                              \
-      (state_id, device_id, seq_no)                     \
-      SELECT ?, device_id, seq_no                       \
-            FROM SyncNodes;                             \
-",
-                         -1, &insertStmt, 0);
+  m_changedDevices.clear();
+  m_nStatesSinceCheckpoint = isCheckpoint ? 1 : m_nStatesSinceCheckpoint + 1;
 
-  res += sqlite3_bind_int64(insertStmt, 1, rowId);
-  sqlite3_step(insertStmt);
+  return digest;
+}
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, "DbError: " << sqlite3_errmsg(m_db));
-  if (res != SQLITE_OK) {
-    sqlite3_exec(m_db, "ROLLBACK TRANSACTION;", 0, 0, 0);
-    BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+void
+SyncLog::writeState(sqlite3_int64 stateId, const Buffer& stateHash, bool isCheckpoint,
+                    const StateVector& nodes, ConstStateVectorPtr state)
+{
+  // deltas are restored relative to the preceding states, which must all be in SyncLog
+  if (m_isStateChainBroken && !isCheckpoint) {
+    _LOG_DEBUG("Recording state " << stateId << " as a checkpoint after a failed write");
+    return writeState(stateId, stateHash, true, *state, state);
   }
-  sqlite3_finalize(insertStmt);
 
-  sqlite3_stmt* getHashStmt;
-  res += sqlite3_prepare(m_db, "\
-SELECT state_hash FROM SyncLog WHERE state_id = ?\
-",
-                         -1, &getHashStmt, 0);
-  res += sqlite3_bind_int64(getHashStmt, 1, rowId);
+  try {
+    insertState(stateId, stateHash, isCheckpoint, nodes);
+  }
+  catch (const Error&) {
+    // the state has not been recorded, forget what is known about it in memory
+    m_isStateChainBroken = true;
+    {
+      WriteLock lock(m_stateCacheMutex);
+      auto cachedId = m_stateCacheIds.find(stateId);
+      if (cachedId != m_stateCacheIds.end()) {
+        m_stateCache.erase(cachedId->second);
+        m_stateCacheIds.erase(cachedId);
+      }
+    }
+    // the digest stays in the filter, which only makes lookups of the state go to the database
+    throw;
+  }
 
-  BufferPtr retval;
-  int stepRes = sqlite3_step(getHashStmt);
-  if (stepRes == SQLITE_ROW) {
-    retval = make_shared<Buffer>(static_cast<const uint8_t*>(sqlite3_column_blob(getHashStmt, 0)),
-                                 sqlite3_column_bytes(getHashStmt, 0));
+  if (isCheckpoint) {
+    m_isStateChainBroken = false;
   }
-  else {
-    sqlite3_exec(m_db, "ROLLBACK TRANSACTION;", 0, 0, 0);
+}
 
-    _LOG_ERROR("DbError: " << sqlite3_errmsg(m_db));
-    BOOST_THROW_EXCEPTION(Error("Not a valid hash in rememberStateInStateLog"));
+void
+SyncLog::insertState(sqlite3_int64 stateId, const Buffer& stateHash, bool isCheckpoint,
+                     const StateVector& nodes)
+{
+  {
+    Statement insertLogStmt(*this, "INSERT INTO SyncLog (state_id, state_hash, last_update, "
+                                   "                     is_checkpoint) "
+                                   "VALUES (?, ?, datetime('now'), ?)");
+    sqlite3_bind_int64(insertLogStmt, 1, stateId);
+    sqlite3_bind_blob(insertLogStmt, 2, stateHash.buf(), stateHash.size(), SQLITE_STATIC);
+    sqlite3_bind_int(insertLogStmt, 3, isCheckpoint ? 1 : 0);
+    if (sqlite3_step(insertLogStmt) != SQLITE_DONE) {
+      BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+    }
   }
-  sqlite3_finalize(getHashStmt);
-  res += sqlite3_exec(m_db, "COMMIT;", 0, 0, 0);
 
-  if (res != SQLITE_OK) {
-    sqlite3_exec(m_db, "ROLLBACK TRANSACTION;", 0, 0, 0);
-    BOOST_THROW_EXCEPTION(Error("Some error with rememberStateInStateLog"));
+  Statement insertStmt(*this, "INSERT INTO SyncStateNodes (state_id, device_id, seq_no) "
+                              "VALUES (?,?,?)");
+  for (const auto& node : nodes) {
+    sqlite3_bind_int64(insertStmt, 1, stateId);
+    sqlite3_bind_int64(insertStmt, 2, node.first);
+    sqlite3_bind_int64(insertStmt, 3, node.second);
+    if (sqlite3_step(insertStmt) != SQLITE_DONE) {
+      BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+    }
+    sqlite3_reset(insertStmt);
   }
+}
 
-  return retval;
+void
+SyncLog::rebuildDigestFilter()
+{
+  Statement countStmt(*this, "SELECT COUNT(*) FROM SyncLog");
+  sqlite3_step(countStmt);
+  size_t nStates = sqlite3_column_int64(countStmt, 0);
+
+  // leave room to grow, so the filter is not rebuilt too often
+  SyncDigestFilter filter(std::max(2 * nStates, DIGEST_FILTER_CAPACITY));
+
+  Statement stmt(*this, "SELECT state_hash FROM SyncLog");
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    filter.insert(Buffer(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0)));
+  }
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, "DbError: " << sqlite3_errmsg(m_db));
+
+  WriteLock lock(m_stateCacheMutex);
+  // these states are still queued behind the rebuild
+  for (const Buffer& digest : m_digestsDuringRebuild) {
+    filter.insert(digest);
+  }
+  m_digestFilter = std::move(filter);
+  m_isRebuildingFilter = false;
+  m_digestsDuringRebuild.clear();
+}
+
+void
+SyncLog::scheduleDigestFilterRebuild()
+{
+  {
+    WriteLock lock(m_stateCacheMutex);
+    if (m_isRebuildingFilter) {
+      return;
+    }
+    m_isRebuildingFilter = true;
+  }
+
+  enqueueWrite<void>(bind(&SyncLog::rebuildDigestFilter, this));
 }
 
 sqlite3_int64
@@ -220,14 +432,23 @@ SyncLog::LookupSyncLog(const std::string& stateHash)
 sqlite3_int64
 SyncLog::LookupSyncLog(const Buffer& stateHash)
 {
-  sqlite3_stmt* stmt;
-  int res = sqlite3_prepare(m_db, "SELECT state_id FROM SyncLog WHERE state_hash = ?", -1, &stmt, 0);
+  {
+    WriteLock lock(m_stateCacheMutex);
+    auto cached = m_stateCache.find(stateHash);
+    if (cached != m_stateCache.end()) {
+      return cached->second.stateId;
+    }
 
-  if (res != SQLITE_OK) {
-    BOOST_THROW_EXCEPTION(Error("Cannot prepare statement"));
+    if (!m_digestFilter.mayContain(stateHash)) {
+      return 0;
+    }
   }
 
-  res = sqlite3_bind_blob(stmt, 1, stateHash.buf(), stateHash.size(), SQLITE_STATIC);
+  waitForWrites();
+
+  Statement stmt(*this, "SELECT state_id FROM SyncLog WHERE state_hash = ?");
+
+  int res = sqlite3_bind_blob(stmt, 1, stateHash.buf(), stateHash.size(), SQLITE_STATIC);
   if (res != SQLITE_OK) {
     BOOST_THROW_EXCEPTION(Error("Cannot bind"));
   }
@@ -238,28 +459,68 @@ SyncLog::LookupSyncLog(const Buffer& stateHash)
     row = sqlite3_column_int64(stmt, 0);
   }
 
-  sqlite3_finalize(stmt);
-
   return row;
 }
 
 void
 SyncLog::UpdateDeviceSeqNo(const Name& name, sqlite3_int64 seqNo)
 {
-  sqlite3_stmt* stmt;
-  // update is performed using trigger
-  int res =
-    sqlite3_prepare(m_db, "INSERT INTO SyncNodes (device_name, seq_no) VALUES (?,?);", -1, &stmt, 0);
+  WriteLock lock(m_stateUpdateMutex);
+
+  const Block& wire = name.wireEncode();
+  Buffer deviceName(wire.wire(), wire.size());
+  auto deviceId = m_deviceIds.find(deviceName);
+  if (deviceId != m_deviceIds.end()) {
+    enqueueSeqNoUpdate(deviceId->second, seqNo);
+    updateCachedState(deviceName, seqNo);
+    return;
+  }
+
+  // device_id of a new device is needed right away, so the device is added synchronously
+  waitForWrites();
+
+  // the device may already be in the database (e.g., the local device on startup)
+  Statement updateStmt(*this, "UPDATE SyncNodes SET seq_no=MAX(seq_no,?) WHERE device_name=?");
+  Statement insertStmt(*this, "INSERT INTO SyncNodes (device_name, seq_no) VALUES (?,?)");
 
-  res +=
-    sqlite3_bind_blob(stmt, 1, name.wireEncode().wire(), name.wireEncode().size(), SQLITE_STATIC);
-  res += sqlite3_bind_int64(stmt, 2, seqNo);
-  sqlite3_step(stmt);
+  int res = beginTransaction();
+  if (res == SQLITE_OK) {
+    sqlite3_bind_int64(updateStmt, 1, seqNo);
+    sqlite3_bind_blob(updateStmt, 2, deviceName.buf(), deviceName.size(), SQLITE_STATIC);
+    res = sqlite3_step(updateStmt);
+
+    if (res == SQLITE_DONE && sqlite3_changes(m_db) == 0) {
+      sqlite3_bind_blob(insertStmt, 1, deviceName.buf(), deviceName.size(), SQLITE_STATIC);
+      sqlite3_bind_int64(insertStmt, 2, seqNo);
+      res = sqlite3_step(insertStmt);
+    }
+
+    if (res == SQLITE_DONE) {
+      res = commitTransaction();
+    }
+    else {
+      _LOG_ERROR("UpdateDeviceSeqNo(name): " << sqlite3_errmsg(m_db));
+      rollbackTransaction();
+    }
+  }
 
   if (res != SQLITE_OK) {
     BOOST_THROW_EXCEPTION(Error("Some error with UpdateDeviceSeqNo(name)"));
   }
-  sqlite3_finalize(stmt);
+
+  {
+    Statement idStmt(*this, "SELECT device_id FROM SyncNodes WHERE device_name=?");
+    sqlite3_bind_blob(idStmt, 1, deviceName.buf(), deviceName.size(), SQLITE_STATIC);
+    if (sqlite3_step(idStmt) != SQLITE_ROW) {
+      BOOST_THROW_EXCEPTION(Error("Some error with UpdateDeviceSeqNo(name)"));
+    }
+    m_deviceIds[deviceName] = sqlite3_column_int64(idStmt, 0);
+
+    WriteLock devicesLock(m_devicesMutex);
+    m_devices[sqlite3_column_int64(idStmt, 0)].name = deviceName;
+  }
+
+  updateCachedState(deviceName, seqNo);
 }
 
 void
@@ -271,48 +532,160 @@ SyncLog::UpdateLocalSeqNo(sqlite3_int64 seqNo)
 void
 SyncLog::UpdateDeviceSeqNo(sqlite3_int64 deviceId, sqlite3_int64 seqNo)
 {
-  sqlite3_stmt* stmt;
-  // update is performed using trigger
-  int res = sqlite3_prepare(m_db, "UPDATE SyncNodes SET seq_no=MAX(seq_no,?) WHERE device_id=?;",
-                            -1, &stmt, 0);
+  WriteLock lock(m_stateUpdateMutex);
 
-  res += sqlite3_bind_int64(stmt, 1, seqNo);
-  res += sqlite3_bind_int64(stmt, 2, deviceId);
-  sqlite3_step(stmt);
+  if (deviceId == m_localDeviceId) {
+    // local seq_no is durable in ActionLog, so it is written together with the next write (e.g.,
+    // the next recorded state) instead of costing a commit of its own
+    addPendingSeqNo(deviceId, seqNo);
 
-  if (res != SQLITE_OK) {
-    BOOST_THROW_EXCEPTION(Error("Some error with UpdateDeviceSeqNo(id)"));
+    const Block& wire = m_localName.wireEncode();
+    updateCachedState(Buffer(wire.wire(), wire.size()), seqNo);
+  }
+  else {
+    enqueueSeqNoUpdate(deviceId, seqNo);
+
+    Buffer deviceName;
+    {
+      WriteLock devicesLock(m_devicesMutex);
+      auto device = m_devices.find(deviceId);
+      if (device == m_devices.end()) {
+        return;
+      }
+      deviceName = device->second.name;
+    }
+    m_deviceIds[deviceName] = deviceId;
+    updateCachedState(deviceName, seqNo);
   }
+}
 
-  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_OK,
-                  "DB UpdateDeviceSeqNo: " << sqlite3_errmsg(m_db));
+void
+SyncLog::enqueueSeqNoUpdate(sqlite3_int64 deviceId, sqlite3_int64 seqNo)
+{
+  addPendingSeqNo(deviceId, seqNo);
+  enqueueWrite<void>(bind(&SyncLog::writePendingDeviceUpdates, this));
+}
 
-  sqlite3_finalize(stmt);
+void
+SyncLog::addPendingSeqNo(sqlite3_int64 deviceId, sqlite3_int64 seqNo)
+{
+  WriteLock lock(m_pendingDeviceUpdatesMutex);
+  sqlite3_int64& pending = m_pendingSeqNos[deviceId];
+  pending = std::max(pending, seqNo);
 }
 
-Name
-SyncLog::LookupLocator(const Name& deviceName)
+bool
+SyncLog::hasPendingDeviceUpdates()
+{
+  WriteLock lock(m_pendingDeviceUpdatesMutex);
+  return !m_pendingSeqNos.empty() || !m_pendingLocators.empty();
+}
+
+void
+SyncLog::writePendingDeviceUpdates()
+{
+  std::map<sqlite3_int64, sqlite3_int64> seqNos;
+  std::map<Buffer, Buffer> locators;
+  {
+    WriteLock lock(m_pendingDeviceUpdatesMutex);
+    seqNos.swap(m_pendingSeqNos);
+    locators.swap(m_pendingLocators);
+  }
+
+  try {
+    Statement seqNoStmt(*this, "UPDATE SyncNodes SET seq_no=MAX(seq_no,?) WHERE device_id=?;");
+    for (const auto& seqNo : seqNos) {
+      sqlite3_bind_int64(seqNoStmt, 1, seqNo.second);
+      sqlite3_bind_int64(seqNoStmt, 2, seqNo.first);
+      if (sqlite3_step(seqNoStmt) != SQLITE_DONE) {
+        BOOST_THROW_EXCEPTION(Error("Cannot update seq_no: " + std::string(sqlite3_errmsg(m_db))));
+      }
+      sqlite3_reset(seqNoStmt);
+    }
+
+    Statement locatorStmt(*this, "UPDATE SyncNodes SET last_known_locator=?,"
+                                 "  last_update=datetime('now', 'localtime') "
+                                 "WHERE device_name=?;");
+    for (const auto& locator : locators) {
+      sqlite3_bind_blob(locatorStmt, 1, locator.second.buf(), locator.second.size(),
+                        SQLITE_STATIC);
+      sqlite3_bind_blob(locatorStmt, 2, locator.first.buf(), locator.first.size(),
+                        SQLITE_STATIC);
+      if (sqlite3_step(locatorStmt) != SQLITE_DONE) {
+        BOOST_THROW_EXCEPTION(Error("Cannot update locator: " +
+                                    std::string(sqlite3_errmsg(m_db))));
+      }
+      sqlite3_reset(locatorStmt);
+    }
+  }
+  catch (const Error&) {
+    // the write is rolled back as a whole, so all updates are retried with the next one
+    for (const auto& seqNo : seqNos) {
+      addPendingSeqNo(seqNo.first, seqNo.second);
+    }
+    WriteLock lock(m_pendingDeviceUpdatesMutex);
+    // newer locators take precedence
+    m_pendingLocators.insert(locators.begin(), locators.end());
+    throw;
+  }
+}
+
+void
+SyncLog::updateCachedState(const Buffer& deviceName, sqlite3_int64 seqNo)
+{
+  auto node = m_state.find(deviceName);
+  if (node == m_state.end()) {
+    m_state.insert(std::make_pair(deviceName, seqNo));
+  }
+  else if (node->second < seqNo) {
+    node->second = seqNo;
+  }
+  else {
+    return;
+  }
+
+  m_digestTree.update(deviceName, seqNo);
+  m_changedDevices.insert(deviceName);
+}
+
+ConstBufferPtr
+SyncLog::getStateDigest()
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "SELECT last_known_locator FROM SyncNodes WHERE device_name=?;", -1,
-                     &stmt, 0);
-  sqlite3_bind_blob(stmt, 1, deviceName.wireEncode().wire(), deviceName.wireEncode().size(),
-                    SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  Name locator;
-  switch (res) {
-    case SQLITE_ROW: {
-      locator = Name(Block(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0)));
+  return m_digestTree.getRoot();
+}
+
+SyncLog::ConstStateVectorPtr
+SyncLog::getStateVector()
+{
+  auto state = make_shared<StateVector>();
+  state->reserve(m_state.size());
+  for (const auto& node : m_state) {
+    auto deviceId = m_deviceIds.find(node.first);
+    if (deviceId != m_deviceIds.end()) {
+      state->push_back(std::make_pair(deviceId->second, node.second));
     }
-    case SQLITE_DONE:
-      break;
-    default:
-      BOOST_THROW_EXCEPTION(Error("Error in LookupLocator()"));
   }
+  std::sort(state->begin(), state->end());
+  return state;
+}
+
+Name
+SyncLog::LookupLocator(const Name& deviceName)
+{
+  WriteLock lock(m_stateUpdateMutex);
 
-  sqlite3_finalize(stmt);
+  const Block& wire = deviceName.wireEncode();
+  auto deviceId = m_deviceIds.find(Buffer(wire.wire(), wire.size()));
+  if (deviceId == m_deviceIds.end()) {
+    return Name();
+  }
 
-  return locator;
+  WriteLock devicesLock(m_devicesMutex);
+  const Buffer& locator = m_devices[deviceId->second].locator;
+  if (locator.empty()) {
+    return Name();
+  }
+  return Name(Block(locator.buf(), locator.size()));
 }
 
 Name
@@ -324,22 +697,26 @@ SyncLog::LookupLocalLocator()
 void
 SyncLog::UpdateLocator(const Name& deviceName, const Name& locator)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "UPDATE SyncNodes SET last_known_locator=?,last_update=datetime('now', "
-                           "'localtime') WHERE device_name=?;",
-                     -1, &stmt, 0);
-
-  sqlite3_bind_blob(stmt, 1, locator.wireEncode().wire(), locator.wireEncode().size(), SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 2, deviceName.wireEncode().wire(), deviceName.wireEncode().size(),
-                    SQLITE_STATIC);
-
-  int res = sqlite3_step(stmt);
-
-  if (res != SQLITE_OK && res != SQLITE_DONE) {
-    BOOST_THROW_EXCEPTION(Error("Error in UpdateLoactor()"));
+  const Block& nameWire = deviceName.wireEncode();
+  Buffer name(nameWire.wire(), nameWire.size());
+  const Block& locatorWire = locator.wireEncode();
+  Buffer locatorBuffer(locatorWire.wire(), locatorWire.size());
+
+  {
+    WriteLock lock(m_stateUpdateMutex);
+
+    auto deviceId = m_deviceIds.find(name);
+    if (deviceId != m_deviceIds.end()) {
+      WriteLock devicesLock(m_devicesMutex);
+      m_devices[deviceId->second].locator = locatorBuffer;
+    }
   }
 
-  sqlite3_finalize(stmt);
+  {
+    WriteLock lock(m_pendingDeviceUpdatesMutex);
+    m_pendingLocators[name] = locatorBuffer;
+  }
+  enqueueWrite<void>(bind(&SyncLog::writePendingDeviceUpdates, this));
 }
 
 void
@@ -355,131 +732,357 @@ SyncLog::FindStateDifferences(const std::string& oldHash, const std::string& new
   return FindStateDifferences(*fromHex(oldHash), *fromHex(newHash), includeOldSeq);
 }
 
-SyncStateMsgPtr
-SyncLog::FindStateDifferences(const Buffer& oldHash, const Buffer& newHash, bool includeOldSeq)
+SyncLog::StateVector
+SyncLog::lookupState(sqlite3_int64 stateId)
 {
-  sqlite3_stmt* stmt;
-
-  int res = sqlite3_prepare_v2(m_db, "\
-SELECT sn.device_name, sn.last_known_locator, s_old.seq_no, s_new.seq_no\
-    FROM (SELECT *                                                      \
-            FROM SyncStateNodes                                         \
-            WHERE state_id=(SELECT state_id                             \
-                                FROM SyncLog                            \
-                                WHERE state_hash=:old_hash)) s_old      \
-    LEFT JOIN (SELECT *                                                 \
-                FROM SyncStateNodes                                     \
-                WHERE state_id=(SELECT state_id                         \
-                                    FROM SyncLog                        \
-                                    WHERE state_hash=:new_hash)) s_new  \
-                                                                        \
-        ON s_old.device_id = s_new.device_id                            \
-    JOIN SyncNodes sn ON sn.device_id = s_old.device_id                 \
-                                                                        \
-    WHERE s_new.seq_no IS NULL OR                                       \
-          s_old.seq_no != s_new.seq_no                                  \
-                                                                        \
-UNION ALL                                                               \
-                                                                        \
-SELECT sn.device_name, sn.last_known_locator, s_old.seq_no, s_new.seq_no\
-    FROM (SELECT *                                                      \
-            FROM SyncStateNodes                                         \
-            WHERE state_id=(SELECT state_id                             \
-                                FROM SyncLog                            \
-                                WHERE state_hash=:new_hash )) s_new     \
-    LEFT JOIN (SELECT *                                                 \
-                FROM SyncStateNodes                                     \
-                WHERE state_id=(SELECT state_id                         \
-                                    FROM SyncLog                        \
-                                    WHERE state_hash=:old_hash)) s_old  \
-                                                                        \
-        ON s_old.device_id = s_new.device_id                            \
-    JOIN SyncNodes sn ON sn.device_id = s_new.device_id                 \
-                                                                        \
-    WHERE s_old.seq_no IS NULL                                          \
-",
-                               -1, &stmt, 0);
+  waitForWrites();
+
+  StateVector state;
+
+  // seq_no never decreases, so the state is the latest seq_no of each device recorded since the
+  // closest checkpoint
+  Statement stmt(*this, "\
+SELECT device_id, MAX(seq_no)                                           \
+    FROM SyncStateNodes                                                 \
+    WHERE state_id <= :state_id AND                                     \
+          state_id >= (SELECT MAX(state_id)                             \
+                           FROM SyncLog                                 \
+                           WHERE state_id <= :state_id AND is_checkpoint=1) \
+    GROUP BY device_id                                                  \
+    ORDER BY device_id                                                  \
+");
+
+  sqlite3_bind_int64(stmt, 1, stateId);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    state.push_back(std::make_pair(sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1)));
+  }
+  _LOG_DEBUG_COND(sqlite3_errcode(m_db) != SQLITE_DONE, "DbError: " << sqlite3_errmsg(m_db));
 
-  if (res != SQLITE_OK) {
-    BOOST_THROW_EXCEPTION(Error("Some error with FindStateDifferences"));
+  return state;
+}
+
+SyncLog::ConstStateVectorPtr
+SyncLog::findState(const Buffer& stateHash)
+{
+  {
+    WriteLock lock(m_stateCacheMutex);
+    auto cached = m_stateCache.find(stateHash);
+    if (cached != m_stateCache.end()) {
+      return cached->second.state;
+    }
   }
 
-  res += sqlite3_bind_blob(stmt, 1, oldHash.buf(), oldHash.size(), SQLITE_STATIC);
-  res += sqlite3_bind_blob(stmt, 2, newHash.buf(), newHash.size(), SQLITE_STATIC);
+  sqlite3_int64 stateId = LookupSyncLog(stateHash);
+  if (stateId <= 0) {
+    // unknown states are treated as empty
+    return make_shared<StateVector>();
+  }
+
+  auto state = make_shared<StateVector>(lookupState(stateId));
+  cacheState(stateHash, stateId, state);
+  return state;
+}
+
+void
+SyncLog::cacheState(const Buffer& stateHash, sqlite3_int64 stateId, ConstStateVectorPtr state)
+{
+  WriteLock lock(m_stateCacheMutex);
+  if (m_stateCacheSize == 0) {
+    return;
+  }
+
+  m_stateCache[stateHash] = CachedState{stateId, state};
+  m_stateCacheIds[stateId] = stateHash;
+
+  while (m_stateCache.size() > m_stateCacheSize) {
+    auto oldest = m_stateCacheIds.begin();
+    m_stateCache.erase(oldest->second);
+    m_stateCacheIds.erase(oldest);
+  }
+}
+
+void
+SyncLog::uncacheStatesBefore(sqlite3_int64 stateId)
+{
+  WriteLock lock(m_stateCacheMutex);
+  auto boundary = m_stateCacheIds.lower_bound(stateId);
+  for (auto state = m_stateCacheIds.begin(); state != boundary; ++state) {
+    m_stateCache.erase(state->second);
+  }
+  m_stateCacheIds.erase(m_stateCacheIds.begin(), boundary);
+}
+
+void
+SyncLog::SetStateCacheSize(size_t size)
+{
+  WriteLock lock(m_stateCacheMutex);
+  m_stateCacheSize = size;
+  m_stateCache.clear();
+  m_stateCacheIds.clear();
+}
+
+void
+SyncLog::SetCheckpointInterval(int interval)
+{
+  WriteLock lock(m_stateUpdateMutex);
+  m_checkpointInterval = std::max(interval, 1);
+}
+
+SyncStateMsgPtr
+SyncLog::FindStateDifferences(const Buffer& oldHash, const Buffer& newHash, bool includeOldSeq)
+{
+  ConstStateVectorPtr oldState = findState(oldHash);
+  ConstStateVectorPtr newState = findState(newHash);
 
   SyncStateMsgPtr msg = make_shared<SyncStateMsg>();
 
-  // sqlite3_trace(m_db, xTrace, NULL);
+  // names and locators of all devices are kept in memory
+  WriteLock devicesLock(m_devicesMutex);
+
+  auto addState = [&] (sqlite3_int64 deviceId, const sqlite3_int64* oldSeqNo,
+                       const sqlite3_int64* newSeqNo) {
+    auto device = m_devices.find(deviceId);
+    if (device == m_devices.end()) {
+      return;
+    }
 
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
     SyncState* state = msg->add_state();
 
     // set name
-    state->set_name(reinterpret_cast<const char*>(sqlite3_column_blob(stmt, 0)),
-                    sqlite3_column_bytes(stmt, 0));
+    state->set_name(reinterpret_cast<const char*>(device->second.name.buf()),
+                    device->second.name.size());
 
-    // locator is optional, so must check if it is null
-    if (sqlite3_column_type(stmt, 1) == SQLITE_BLOB) {
-      state->set_locator(reinterpret_cast<const char*>(sqlite3_column_blob(stmt, 1)),
-                         sqlite3_column_bytes(stmt, 1));
+    // locator is optional
+    if (!device->second.locator.empty()) {
+      state->set_locator(reinterpret_cast<const char*>(device->second.locator.buf()),
+                         device->second.locator.size());
     }
 
     // set old seq
     if (includeOldSeq) {
-      if (sqlite3_column_type(stmt, 2) == SQLITE_NULL) {
-        // old seq is zero; we always have an initial action of zero seq
-        // other's do not need to fetch this action
-        state->set_old_seq(0);
-      }
-      else {
-        sqlite3_int64 oldSeqNo = sqlite3_column_int64(stmt, 2);
-        state->set_old_seq(oldSeqNo);
-      }
+      // old seq is zero if unknown; we always have an initial action of zero seq
+      // other's do not need to fetch this action
+      state->set_old_seq(oldSeqNo != nullptr ? *oldSeqNo : 0);
     }
 
     // set new seq
-    if (sqlite3_column_type(stmt, 3) == SQLITE_NULL) {
+    if (newSeqNo == nullptr) {
       state->set_type(SyncState::DELETE);
     }
     else {
-      sqlite3_int64 newSeqNo = sqlite3_column_int64(stmt, 3);
       state->set_type(SyncState::UPDATE);
-      state->set_seq(newSeqNo);
+      state->set_seq(*newSeqNo);
+    }
+  };
+
+  // both vectors are ordered by device_id
+  auto oldNode = oldState->begin();
+  auto newNode = newState->begin();
+  while (oldNode != oldState->end() || newNode != newState->end()) {
+    if (newNode == newState->end() ||
+        (oldNode != oldState->end() && oldNode->first < newNode->first)) {
+      // device disappeared
+      addState(oldNode->first, &oldNode->second, nullptr);
+      ++oldNode;
+    }
+    else if (oldNode == oldState->end() || newNode->first < oldNode->first) {
+      // device appeared
+      addState(newNode->first, nullptr, &newNode->second);
+      ++newNode;
+    }
+    else {
+      if (oldNode->second != newNode->second) {
+        addState(oldNode->first, &oldNode->second, &newNode->second);
+      }
+      ++oldNode;
+      ++newNode;
     }
-
-    // std::cout << sqlite3_column_text (stmt, 0) <<
-    //   ": from "  << sqlite3_column_int64 (stmt, 1) <<
-    //   " to "     << sqlite3_column_int64 (stmt, 2) <<
-    //   std::endl;
   }
-  sqlite3_finalize(stmt);
-
-  // sqlite3_trace(m_db, NULL, NULL);
 
   return msg;
 }
 
+SyncLog::RetentionPolicy::RetentionPolicy()
+  : maxStates(10000)
+  , maxAge(time::days(30))
+{
+}
+
+void
+SyncLog::SetRetentionPolicy(const RetentionPolicy& policy)
+{
+  WriteLock lock(m_stateUpdateMutex);
+  m_retentionPolicy = policy;
+}
+
 sqlite3_int64
-SyncLog::SeqNo(const Name& name)
+SyncLog::findRetentionBoundary(const RetentionPolicy& policy)
 {
-  sqlite3_stmt* stmt;
-  sqlite3_int64 seq = -1;
-  sqlite3_prepare_v2(m_db, "SELECT seq_no FROM SyncNodes WHERE device_name=?;", -1, &stmt, 0);
+  sqlite3_int64 boundary = 0;
+
+  if (policy.maxStates > 0) {
+    Statement stmt(*this, "SELECT state_id FROM SyncLog ORDER BY state_id DESC LIMIT 1 OFFSET ?");
+    sqlite3_bind_int64(stmt, 1, policy.maxStates - 1);
+    int res = sqlite3_step(stmt);
+    if (res == SQLITE_ROW) {
+      boundary = std::max(boundary, sqlite3_column_int64(stmt, 0));
+    }
+    else if (res != SQLITE_DONE) {
+      BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+    }
+  }
 
-  sqlite3_bind_blob(stmt, 1, name.wireEncode().wire(), name.wireEncode().size(), SQLITE_STATIC);
+  if (policy.maxAge > time::seconds::zero()) {
+    // last_update grows together with state_id, so the scan stops at the first recent state
+    Statement stmt(*this, "SELECT state_id FROM SyncLog "
+                          "  WHERE last_update >= datetime('now', ?) ORDER BY state_id LIMIT 1");
+    std::string modifier = "-" + std::to_string(policy.maxAge.count()) + " seconds";
+    sqlite3_bind_text(stmt, 1, modifier.c_str(), modifier.size(), SQLITE_STATIC);
 
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    seq = sqlite3_column_int64(stmt, 0);
+    int res = sqlite3_step(stmt);
+    if (res == SQLITE_ROW) {
+      boundary = std::max(boundary, sqlite3_column_int64(stmt, 0));
+    }
+    else if (res == SQLITE_DONE) {
+      // everything is too old, but the latest state must be kept
+      Statement latestStmt(*this, "SELECT MAX(state_id) FROM SyncLog");
+      if (sqlite3_step(latestStmt) != SQLITE_ROW) {
+        BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+      }
+      boundary = std::max(boundary, sqlite3_column_int64(latestStmt, 0));
+    }
+    else {
+      BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+    }
+  }
+
+  return boundary;
+}
+
+void
+SyncLog::makeCheckpoint(sqlite3_int64 stateId)
+{
+  StateVector state = lookupState(stateId);
+
+  {
+    Statement stmt(*this, "DELETE FROM SyncStateNodes WHERE state_id=?");
+    sqlite3_bind_int64(stmt, 1, stateId);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+    }
+  }
+
+  {
+    Statement stmt(*this, "INSERT INTO SyncStateNodes (state_id, device_id, seq_no) VALUES (?,?,?)");
+    for (const auto& node : state) {
+      sqlite3_bind_int64(stmt, 1, stateId);
+      sqlite3_bind_int64(stmt, 2, node.first);
+      sqlite3_bind_int64(stmt, 3, node.second);
+      if (sqlite3_step(stmt) != SQLITE_DONE) {
+        BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+      }
+      sqlite3_reset(stmt);
+    }
   }
 
-  return seq;
+  Statement stmt(*this, "UPDATE SyncLog SET is_checkpoint=1 WHERE state_id=?");
+  sqlite3_bind_int64(stmt, 1, stateId);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+  }
+}
+
+bool
+SyncLog::Compact(size_t maxStates)
+{
+  RetentionPolicy policy;
+  {
+    WriteLock lock(m_stateUpdateMutex);
+    policy = m_retentionPolicy;
+  }
+
+  size_t nRemoved = enqueueWrite<size_t>(bind(&SyncLog::removeOldStates, this, maxStates,
+                                              policy)).get();
+  bool hasMore = nRemoved == maxStates;
+  if (nRemoved > 0 && !hasMore) {
+    // drop digests of the removed states from the filter
+    scheduleDigestFilterRebuild();
+  }
+  return hasMore;
+}
+
+size_t
+SyncLog::removeOldStates(size_t maxStates, const RetentionPolicy& policy)
+{
+  sqlite3_int64 boundary = findRetentionBoundary(policy);
+  if (boundary <= 0) {
+    return 0;
+  }
+
+  bool isCheckpoint = false;
+  bool hasOlderStates = false;
+  {
+    Statement stmt(*this, "SELECT is_checkpoint, "
+                          "       EXISTS (SELECT 1 FROM SyncLog WHERE state_id < :state_id) "
+                          "  FROM SyncLog WHERE state_id = :state_id");
+    sqlite3_bind_int64(stmt, 1, boundary);
+    int res = sqlite3_step(stmt);
+    if (res == SQLITE_ROW) {
+      isCheckpoint = (sqlite3_column_int(stmt, 0) != 0);
+      hasOlderStates = (sqlite3_column_int(stmt, 1) != 0);
+    }
+    else if (res != SQLITE_DONE) {
+      BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+    }
+  }
+
+  if (!hasOlderStates) {
+    return 0;
+  }
+
+  // the oldest remaining state must not depend on deltas that are about to be removed
+  if (!isCheckpoint) {
+    _LOG_DEBUG("Converting state " << boundary << " to checkpoint");
+    makeCheckpoint(boundary);
+  }
+
+  // SyncStateNodes are removed by ON DELETE CASCADE
+  Statement stmt(*this, "DELETE FROM SyncLog WHERE state_id IN "
+                        "  (SELECT state_id FROM SyncLog WHERE state_id < ? "
+                        "     ORDER BY state_id LIMIT ?)");
+  sqlite3_bind_int64(stmt, 1, boundary);
+  sqlite3_bind_int64(stmt, 2, maxStates);
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    BOOST_THROW_EXCEPTION(Error(sqlite3_errmsg(m_db)));
+  }
+
+  size_t nRemoved = sqlite3_changes(m_db);
+  uncacheStatesBefore(boundary);
+
+  _LOG_DEBUG("Removed " << nRemoved << " states older than " << boundary);
+  return nRemoved;
+}
+
+sqlite3_int64
+SyncLog::SeqNo(const Name& name)
+{
+  WriteLock lock(m_stateUpdateMutex);
+
+  // all devices in SyncNodes are kept in memory
+  const Block& wire = name.wireEncode();
+  auto node = m_state.find(Buffer(wire.wire(), wire.size()));
+  if (node == m_state.end()) {
+    return -1;
+  }
+  return node->second;
 }
 
 sqlite3_int64
 SyncLog::LogSize()
 {
-  sqlite3_stmt* stmt;
-  sqlite3_prepare_v2(m_db, "SELECT count(*) FROM SyncLog", -1, &stmt, 0);
+  waitForWrites();
+
+  Statement stmt(*this, "SELECT count(*) FROM SyncLog");
 
   sqlite3_int64 retval = -1;
   if (sqlite3_step(stmt) == SQLITE_ROW) {
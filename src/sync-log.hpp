@@ -22,12 +22,17 @@
 #define CHRONOSHARE_SRC_SYNC_LOG_HPP
 
 #include "db-helper.hpp"
+#include "sync-digest-filter.hpp"
+#include "sync-digest-tree.hpp"
 #include "sync-state.pb.h"
 #include "core/chronoshare-common.hpp"
 
 #include <ndn-cxx/name.hpp>
+#include <ndn-cxx/util/time.hpp>
 
 #include <map>
+#include <set>
+#include <vector>
 
 // @todo Replace with std::thread
 #include <boost/thread.hpp>
@@ -51,21 +56,61 @@ public:
     }
   };
 
+  /**
+   * @brief Limits on the history kept in SyncLog
+   *
+   * A state is removed by compaction if it is beyond either of the limits, except the latest
+   * state.  Peers that send digests of removed states are handled through the RECOVER path.
+   */
+  struct RetentionPolicy
+  {
+    RetentionPolicy();
+
+    /// maximum number of states to keep, 0 for no limit
+    size_t maxStates;
+    /// maximum age of states to keep, 0 for no limit
+    time::seconds maxAge;
+  };
+
   SyncLog(const boost::filesystem::path& path, const Name& localName);
 
+  ~SyncLog();
+
   /**
    * @brief Get local username
    */
   const Name&
   GetLocalName() const;
 
+  /**
+   * @brief Allocate the next local seq_no
+   *
+   * Seq_nos are reserved on disk in blocks (see SetLocalSeqNoBlockSize) and then handed out from
+   * memory, so only the first seq_no of a block waits for a database write.  Unused seq_nos of
+   * the block are given back when SyncLog is destroyed.  If the process is terminated instead,
+   * they are skipped on the next start, so that no seq_no is ever handed out twice.  Users of
+   * the seq_nos must answer requests for skipped ones as gone (see ActionLog).
+   *
+   * SyncNodes is updated together with the next write, as the seq_no is covered by the block.
+   */
   sqlite3_int64
-  GetNextLocalSeqNo(); // side effect: local seq_no will be increased
+  GetNextLocalSeqNo();
+
+  /**
+   * @brief Set the number of seq_nos reserved at once by GetNextLocalSeqNo
+   *
+   * 1 makes every seq_no wait for a database write.
+   */
+  void
+  SetLocalSeqNoBlockSize(size_t size);
 
   // done
   void
   UpdateDeviceSeqNo(const Name& name, sqlite3_int64 seqNo);
 
+  /**
+   * @brief Update local seq_no, which is written into SyncNodes with the next write
+   */
   void
   UpdateLocalSeqNo(sqlite3_int64 seqNo);
 
@@ -104,6 +149,39 @@ public:
   SyncStateMsgPtr
   FindStateDifferences(const Buffer& oldHash, const Buffer& newHash, bool includeOldSeq = false);
 
+  void
+  SetRetentionPolicy(const RetentionPolicy& policy);
+
+  /**
+   * @brief Remove up to @p maxStates states that are outside the retention policy
+   *
+   * The oldest remaining state is converted to a checkpoint first, if necessary.  States are
+   * removed by the writer, after the states recorded so far have been written, so state updates
+   * and lookups do not wait for the compaction.  The call waits for it, so it must not be made
+   * inside a transaction.
+   *
+   * @return true if there are more states to remove
+   * @throw DbHelper::Error the states could not be removed
+   */
+  bool
+  Compact(size_t maxStates);
+
+  /**
+   * @brief Set the number of recent states kept in memory to answer FindStateDifferences
+   *
+   * 0 disables the cache, so that all states are restored from the database
+   */
+  void
+  SetStateCacheSize(size_t size);
+
+  /**
+   * @brief Set the number of states between full copies of the state in SyncStateNodes
+   *
+   * 1 stores every state in full.
+   */
+  void
+  SetCheckpointInterval(int interval);
+
   //-------- only used in test -----------------
   sqlite3_int64
   SeqNo(const Name& name);
@@ -115,6 +193,139 @@ protected:
   void
   UpdateDeviceSeqNo(sqlite3_int64 deviceId, sqlite3_int64 seqNo);
 
+private:
+  // (device_id, seq_no) pairs ordered by device_id
+  typedef std::vector<std::pair<sqlite3_int64, sqlite3_int64>> StateVector;
+  typedef shared_ptr<const StateVector> ConstStateVectorPtr;
+
+  /**
+   * @brief Restore state recorded in SyncLog from the closest checkpoint and subsequent deltas
+   */
+  StateVector
+  lookupState(sqlite3_int64 stateId);
+
+  /**
+   * @brief Get state vector for the digest from the cache or, on a miss, from the database
+   * @return state vector, empty if the state is not known
+   */
+  ConstStateVectorPtr
+  findState(const Buffer& stateHash);
+
+  void
+  cacheState(const Buffer& stateHash, sqlite3_int64 stateId, ConstStateVectorPtr state);
+
+  /**
+   * @brief Remove states older than @p stateId from the cache
+   */
+  void
+  uncacheStatesBefore(sqlite3_int64 stateId);
+
+  /**
+   * @brief Get state vector of the current state (must be called with m_stateUpdateMutex locked)
+   */
+  ConstStateVectorPtr
+  getStateVector();
+
+  /**
+   * @brief Rebuild the digest filter from all states in SyncLog
+   *
+   * Must be executed by the writer (see scheduleDigestFilterRebuild) or before any state is
+   * recorded, so that all known states are in SyncLog.
+   */
+  void
+  rebuildDigestFilter();
+
+  /**
+   * @brief Rebuild the digest filter on the writer thread, unless a rebuild is already pending
+   *
+   * Digests of states recorded meanwhile are added to the new filter.
+   */
+  void
+  scheduleDigestFilterRebuild();
+
+  /**
+   * @brief Get the oldest state that must be kept according to the retention policy
+   */
+  sqlite3_int64
+  findRetentionBoundary(const RetentionPolicy& policy);
+
+  /**
+   * @brief Remove states for Compact (executed on the writer thread)
+   * @return number of removed states
+   */
+  size_t
+  removeOldStates(size_t maxStates, const RetentionPolicy& policy);
+
+  void
+  makeCheckpoint(sqlite3_int64 stateId);
+
+  /**
+   * @brief Write the state into SyncLog and SyncStateNodes (executed on the writer thread)
+   * @param nodes devices of the state, all of them if the state is a checkpoint
+   * @param state all devices of the state, written instead of @p nodes if a preceding state
+   *              could not be written
+   *
+   * If the write fails, the state is removed from the state cache, so that it is looked up in
+   * the database (and not found) from then on.
+   */
+  void
+  writeState(sqlite3_int64 stateId, const Buffer& stateHash, bool isCheckpoint,
+             const StateVector& nodes, ConstStateVectorPtr state);
+
+  void
+  insertState(sqlite3_int64 stateId, const Buffer& stateHash, bool isCheckpoint,
+              const StateVector& nodes);
+
+  /**
+   * @brief Get the in-memory local seq_no (must be called with m_stateUpdateMutex locked)
+   */
+  std::map<Buffer, sqlite3_int64>::iterator
+  findLocalNode();
+
+  /**
+   * @brief Durably reserve local seq_nos up to @p seqNo
+   */
+  void
+  reserveLocalSeqNos(sqlite3_int64 seqNo);
+
+  /**
+   * @brief Queue update of seq_no of a known device in SyncNodes
+   */
+  void
+  enqueueSeqNoUpdate(sqlite3_int64 deviceId, sqlite3_int64 seqNo);
+
+  /**
+   * @brief Remember seq_no to be written into SyncNodes with the next pending device updates
+   */
+  void
+  addPendingSeqNo(sqlite3_int64 deviceId, sqlite3_int64 seqNo);
+
+  /**
+   * @brief Write pending seq_nos and locators into SyncNodes (executed on the writer thread)
+   *
+   * Updates that cannot be written stay pending and are written together with the next ones.
+   */
+  void
+  writePendingDeviceUpdates();
+
+  bool
+  hasPendingDeviceUpdates();
+
+  /**
+   * @brief Update in-memory copy of the state (must be called with m_stateUpdateMutex locked)
+   */
+  void
+  updateCachedState(const Buffer& deviceName, sqlite3_int64 seqNo);
+
+  /**
+   * @brief Get digest of the current state
+   *
+   * The digest is the root of SyncDigestTree over all devices, the same as the one calculated
+   * by ``hash'' SQL aggregate over SyncNodes.
+   */
+  ConstBufferPtr
+  getStateDigest();
+
 protected:
   Name m_localName;
 
@@ -124,6 +335,66 @@ protected:
   typedef boost::unique_lock<Mutex> WriteLock;
 
   Mutex m_stateUpdateMutex;
+
+private:
+  // wire-encoded device name -> seq_no, ordered the same way as BLOBs in SQLite
+  std::map<Buffer, sqlite3_int64> m_state;
+  SyncDigestTree m_digestTree;
+  // wire-encoded device name -> device_id for all devices in m_state
+  std::map<Buffer, sqlite3_int64> m_deviceIds;
+
+  // devices that have changed since the last recorded state
+  std::set<Buffer> m_changedDevices;
+  int m_nStatesSinceCheckpoint;
+  int m_checkpointInterval;
+  // state_id of the last recorded state; new states are numbered before they are written
+  sqlite3_int64 m_lastStateId;
+  // set if a state could not be written, so that the next one must be a checkpoint (accessed
+  // only by writes, which are executed one at a time)
+  bool m_isStateChainBroken;
+
+  // local seq_nos up to this one are reserved in SyncLocalSeqNo
+  sqlite3_int64 m_reservedLocalSeqNo;
+  size_t m_localSeqNoBlockSize;
+
+  RetentionPolicy m_retentionPolicy;
+
+  struct CachedState
+  {
+    sqlite3_int64 stateId;
+    ConstStateVectorPtr state;
+  };
+
+  struct DeviceInfo
+  {
+    // wire-encoded device name
+    Buffer name;
+    // wire-encoded last known locator, empty if not known
+    Buffer locator;
+  };
+
+  Mutex m_devicesMutex;
+  // device_id -> name and locator of all devices in SyncNodes, so that state differences are
+  // answered without the database
+  std::map<sqlite3_int64, DeviceInfo> m_devices;
+
+  Mutex m_pendingDeviceUpdatesMutex;
+  // device_id -> seq_no and wire-encoded device name -> locator, not yet written to SyncNodes
+  std::map<sqlite3_int64, sqlite3_int64> m_pendingSeqNos;
+  std::map<Buffer, Buffer> m_pendingLocators;
+
+  Mutex m_stateCacheMutex;
+  // state digest -> state vector of recent states
+  std::map<Buffer, CachedState> m_stateCache;
+  // state_id -> state digest of cached states, to evict the oldest ones first
+  std::map<sqlite3_int64, Buffer> m_stateCacheIds;
+  size_t m_stateCacheSize;
+  // digests of all states in SyncLog (protected by m_stateCacheMutex)
+  SyncDigestFilter m_digestFilter;
+  // set while a rebuild of the filter is pending; digests recorded meanwhile are kept for the
+  // new filter (protected by m_stateCacheMutex)
+  bool m_isRebuildingFilter;
+  std::vector<Buffer> m_digestsDuringRebuild;
 };
 
 typedef shared_ptr<SyncLog> SyncLogPtr;
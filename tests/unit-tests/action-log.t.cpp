@@ -18,131 +18,709 @@
  * See AUTHORS.md for complete list of ChronoShare authors and contributors.
  */
 
-#include <boost/lexical_cast.hpp>
-#include <boost/test/unit_test.hpp>
-
 #include "action-log.hpp"
-#include "logging.hpp"
 
-#include <boost/filesystem.hpp>
-#include <boost/make_shared.hpp>
-#include <iostream>
+#include "test-common.hpp"
+#include "dummy-forwarder.hpp"
+
+#include <map>
+
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include <sys/wait.h>
 #include <unistd.h>
 
-using namespace std;
-using namespace boost;
-using namespace Ndnx;
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
 namespace fs = boost::filesystem;
 
-BOOST_AUTO_TEST_SUITE(TestActionLog)
+_LOG_INIT(Test.ActionLog);
+
+/**
+ * @brief SQLite VFS that counts xSync calls, registered as the default VFS while alive
+ */
+class SyncCountingVfs : boost::noncopyable
+{
+public:
+  SyncCountingVfs()
+  {
+    s_original = sqlite3_vfs_find(nullptr);
+    s_vfs = *s_original;
+    s_vfs.zName = "sync-counting";
+    s_vfs.xOpen = &SyncCountingVfs::open;
+    s_nSyncs = 0;
+    sqlite3_vfs_register(&s_vfs, 1);
+  }
+
+  ~SyncCountingVfs()
+  {
+    sqlite3_vfs_register(s_original, 1);
+    sqlite3_vfs_unregister(&s_vfs);
+  }
+
+  int
+  getSyncCount() const
+  {
+    return s_nSyncs;
+  }
+
+private:
+  static int
+  open(sqlite3_vfs*, const char* name, sqlite3_file* file, int flags, int* outFlags)
+  {
+    int res = s_original->xOpen(s_original, name, file, flags, outFlags);
+    if (res != SQLITE_OK || file->pMethods == nullptr) {
+      return res;
+    }
+
+    sqlite3_io_methods& methods = s_methods[file->pMethods];
+    if (methods.xSync == nullptr) {
+      methods = *file->pMethods;
+      methods.xSync = &SyncCountingVfs::sync;
+      s_originalMethods[&methods] = file->pMethods;
+    }
+    file->pMethods = &methods;
+    return res;
+  }
+
+  static int
+  sync(sqlite3_file* file, int flags)
+  {
+    ++s_nSyncs;
+    return s_originalMethods[file->pMethods]->xSync(file, flags);
+  }
+
+private:
+  static sqlite3_vfs* s_original;
+  static sqlite3_vfs s_vfs;
+  static std::map<const sqlite3_io_methods*, sqlite3_io_methods> s_methods;
+  static std::map<const sqlite3_io_methods*, const sqlite3_io_methods*> s_originalMethods;
+  static int s_nSyncs;
+};
+
+sqlite3_vfs* SyncCountingVfs::s_original;
+sqlite3_vfs SyncCountingVfs::s_vfs;
+std::map<const sqlite3_io_methods*, sqlite3_io_methods> SyncCountingVfs::s_methods;
+std::map<const sqlite3_io_methods*, const sqlite3_io_methods*> SyncCountingVfs::s_originalMethods;
+int SyncCountingVfs::s_nSyncs;
+
+class RollbackActionLog : public ActionLog
+{
+public:
+  using ActionLog::ActionLog;
+
+  /**
+   * @brief Make @p updates in a transaction that is rolled back
+   */
+  void
+  rollBack(const function<void()>& updates)
+  {
+    beginTransaction();
+    updates();
+    rollbackTransaction();
+  }
+};
+
+class TestActionLogFixture : public IdentityManagementTimeFixture
+{
+public:
+  TestActionLogFixture()
+    : forwarder(m_io, m_keyChain)
+    , localName("/alex")
+    , tmpdir(fs::unique_path(UNIT_TEST_CONFIG_PATH) / "ActionLogTest")
+    , hash(fromHex("2ff304769cdb0125ac039e6fe7575f8576dceffc62618a431715aaf6eea2bf1c"))
+  {
+    if (exists(tmpdir)) {
+      remove_all(tmpdir);
+    }
+  }
+
+  ~TestActionLogFixture()
+  {
+    remove_all(tmpdir);
+  }
+
+  ActionLogPtr
+  openActionLog(Face& face, const SyncLogPtr& syncLog,
+                const ActionLog::OnFileRemovedCallback& onFileRemoved =
+                  ActionLog::OnFileRemovedCallback())
+  {
+    return std::make_shared<ActionLog>(face, tmpdir, syncLog, "top-secret", "test-chronoshare",
+                                       ActionLog::OnFileAddedOrChangedCallback(), onFileRemoved);
+  }
+
+  /**
+   * @brief Create an update action of @p filename published by @p deviceName
+   */
+  shared_ptr<Data>
+  makeRemoteAction(const Name& deviceName, sqlite3_int64 seqno, const std::string& filename,
+                   sqlite3_int64 version, int segNum = 1)
+  {
+    ActionItem item;
+    item.set_action(ActionItem::UPDATE);
+    item.set_filename(filename);
+    item.set_version(version);
+    item.set_timestamp(std::time(nullptr));
+    item.set_file_hash(hash->data(), hash->size());
+    item.set_mtime(std::time(nullptr));
+    item.set_mode(0644);
+    item.set_seg_num(segNum);
+
+    std::string content;
+    item.SerializeToString(&content);
+
+    shared_ptr<Data> data = make_shared<Data>(Name(deviceName).append("test-chronoshare")
+                                                .append("action").append("top-secret")
+                                                .appendNumber(seqno));
+    data->setContent(reinterpret_cast<const uint8_t*>(content.data()), content.size());
+    m_keyChain.sign(*data);
+    return data;
+  }
+
+  /**
+   * @brief Execute @p sql directly on a database in the .chronoshare folder
+   */
+  void
+  execute(const std::string& dbName, const std::string& sql)
+  {
+    sqlite3* db = nullptr;
+    BOOST_REQUIRE_EQUAL(sqlite3_open((tmpdir / ".chronoshare" / dbName).c_str(), &db), SQLITE_OK);
+    BOOST_CHECK_EQUAL(sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL), SQLITE_OK);
+    sqlite3_close(db);
+  }
+
+  /**
+   * @brief Get the integer result of @p sql on a database in the .chronoshare folder
+   */
+  sqlite3_int64
+  queryInt(const std::string& dbName, const std::string& sql)
+  {
+    sqlite3* db = nullptr;
+    BOOST_REQUIRE_EQUAL(sqlite3_open((tmpdir / ".chronoshare" / dbName).c_str(), &db), SQLITE_OK);
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+    BOOST_CHECK_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    sqlite3_int64 value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return value;
+  }
+
+public:
+  DummyForwarder forwarder;
+  Name localName;
+  fs::path tmpdir;
+  BufferPtr hash;
+};
+
+BOOST_FIXTURE_TEST_SUITE(TestActionLog, TestActionLogFixture)
 
 BOOST_AUTO_TEST_CASE(ActionLogTest)
 {
-  Name localName("/alex");
-
-  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
-  SyncLogPtr syncLog = make_shared<SyncLog>(tmpdir, localName);
-  CcnxWrapperPtr ccnx = make_shared<CcnxWrapper>();
-
-  ActionLogPtr actionLog =
-    make_shared<ActionLog>(ccnx, tmpdir, syncLog, "top-secret", "test-chronoshare",
-                           ActionLog::OnFileAddedOrChangedCallback(),
-                           ActionLog::OnFileRemovedCallback());
-
-  // const std::string &filename,
-  //                    const Hash &hash,
-  //                    time_t wtime,
-  //                    int mode,
-  //                    int seg_num
-  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 0);
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  ActionLogPtr actionLog = openActionLog(face, syncLog);
 
-  BOOST_CHECK_EQUAL(syncLog->LogSize(), 0);
+  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 0);
   BOOST_CHECK_EQUAL(actionLog->LogSize(), 0);
 
-  actionLog->AddLocalActionUpdate("file.txt",
-                                  *Hash::FromString(
-                                    "2ff304769cdb0125ac039e6fe7575f8576dceffc62618a431715aaf6eea2bf1c"),
-                                  time(NULL), 0755, 10);
+  actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0755, 10);
 
   BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 1);
-  BOOST_CHECK_EQUAL(syncLog->LogSize(), 0);
   BOOST_CHECK_EQUAL(actionLog->LogSize(), 1);
 
-  HashPtr hash = syncLog->RememberStateInStateLog();
-  BOOST_CHECK_EQUAL(syncLog->LogSize(), 1);
-  BOOST_CHECK_EQUAL(lexical_cast<string>(*hash),
-                    "3410477233f98d6c3f9a6f8da24494bf5a65e1a7c9f4f66b228128bd4e020558");
+  BOOST_CHECK(actionLog->LookupActionData(localName, 0) == nullptr);
+  BOOST_CHECK(actionLog->LookupActionData(localName, 1) != nullptr);
+
+  ActionItemPtr action = actionLog->LookupAction(localName, 1);
+  BOOST_REQUIRE(action != nullptr);
+  BOOST_CHECK_EQUAL(action->version(), 0);
+  BOOST_CHECK_EQUAL(action->action(), 0);
+  BOOST_CHECK_EQUAL(action->filename(), "file.txt");
+  BOOST_CHECK_EQUAL(action->seg_num(), 10);
+  BOOST_CHECK_EQUAL(action->file_hash().size(), 32);
+  BOOST_CHECK_EQUAL(action->mode(), 0755);
+  BOOST_CHECK_EQUAL(action->has_parent_device_name(), false);
+  BOOST_CHECK_EQUAL(action->has_parent_seq_no(), false);
+  BOOST_CHECK_EQUAL(action->has_seg_size(), false);
+  BOOST_CHECK_EQUAL(action->chunked(), false);
+  BOOST_CHECK_EQUAL(action->has_manifest_hash(), false);
+
+  actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0755, 10, 4096, true);
+  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 2);
+  BOOST_CHECK_EQUAL(actionLog->LogSize(), 2);
+
+  action = actionLog->LookupAction(localName, 2);
+  BOOST_REQUIRE(action != nullptr);
+  BOOST_CHECK_EQUAL(action->has_parent_device_name(), true);
+  BOOST_CHECK_EQUAL(action->parent_seq_no(), 1);
+  BOOST_CHECK_EQUAL(action->version(), 1);
+  BOOST_CHECK_EQUAL(action->seg_size(), 4096);
+  BOOST_CHECK_EQUAL(action->chunked(), true);
+
+  FileItemPtr file = actionLog->GetFileState()->LookupFile("file.txt");
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK_EQUAL(file->version(), 1);
+  BOOST_CHECK_EQUAL(file->seq_no(), 2);
+  BOOST_CHECK_EQUAL(file->is_complete(), true);
+  BOOST_CHECK_EQUAL(file->seg_size(), 4096);
+  BOOST_CHECK_EQUAL(file->chunked(), true);
+
+  file = actionLog->LookupAction("file.txt", 1, *hash);
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK_EQUAL(file->seg_size(), 4096);
+  BOOST_CHECK_EQUAL(file->chunked(), true);
+
+  BOOST_CHECK_EQUAL(actionLog->AddLocalActionDelete("file.txt") != nullptr, true);
+  BOOST_CHECK(actionLog->GetFileState()->LookupFile("file.txt") == nullptr);
+  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 3);
+
+  actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0755, 10, 4096, false,
+                                  hash);
+  action = actionLog->LookupAction(localName, 4);
+  BOOST_REQUIRE(action != nullptr);
+  BOOST_CHECK_EQUAL(action->chunked(), false);
+  BOOST_CHECK(action->manifest_hash() ==
+              std::string(reinterpret_cast<const char*>(hash->data()), hash->size()));
+  BOOST_CHECK_EQUAL(action->digest_segments(), false);
+
+  actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0755, 10, 4096, false,
+                                  hash, true);
+  action = actionLog->LookupAction(localName, 5);
+  BOOST_REQUIRE(action != nullptr);
+  BOOST_CHECK_EQUAL(action->digest_segments(), true);
+
+  // both are needed to verify segments of a file that is fetched later
+  std::string manifestHash(reinterpret_cast<const char*>(hash->data()), hash->size());
+  file = actionLog->GetFileState()->LookupFile("file.txt");
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK(file->manifest_hash() == manifestHash);
+  BOOST_CHECK_EQUAL(file->digest_segments(), true);
+
+  file = actionLog->LookupAction("file.txt", 4, *hash);
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK(file->manifest_hash() == manifestHash);
+  BOOST_CHECK_EQUAL(file->digest_segments(), true);
+
+  int visited = 0;
+  actionLog->LookupActionsForFile([&](const Name&, sqlite3_int64 seqNo, const ActionItem& item) {
+      if (seqNo == 5) {
+        BOOST_CHECK(item.manifest_hash() == manifestHash);
+        BOOST_CHECK_EQUAL(item.digest_segments(), true);
+        visited++;
+      }
+    }, "file.txt");
+  BOOST_CHECK_EQUAL(visited, 1);
+}
+
+BOOST_AUTO_TEST_CASE(LatestVersionsRollback)
+{
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  auto actionLog = std::make_shared<RollbackActionLog>(face, tmpdir, syncLog, "top-secret",
+                                                       "test-chronoshare",
+                                                       ActionLog::OnFileAddedOrChangedCallback(),
+                                                       ActionLog::OnFileRemovedCallback());
+
+  actionLog->AddLocalActionUpdate("a.txt", *hash, std::time(nullptr), 0644, 1);
+  actionLog->rollBack([&] {
+    actionLog->AddLocalActionUpdate("a.txt", *hash, std::time(nullptr), 0644, 2);
+  });
+
+  FileItemPtr file = actionLog->GetFileState()->LookupFile("a.txt");
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK_EQUAL(file->version(), 0);
+
+  // version 1 of a device with a lower name is the newest one, the rolled back version is gone
+  BOOST_REQUIRE(actionLog->AddRemoteAction(makeRemoteAction("/aaa", 1, "a.txt", 1, 3)) != nullptr);
+  file = actionLog->GetFileState()->LookupFile("a.txt");
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK_EQUAL(file->version(), 1);
+  BOOST_CHECK_EQUAL(file->seg_num(), 3);
+
+  // the next local version follows the committed one
+  ActionItemPtr action = actionLog->AddLocalActionUpdate("a.txt", *hash, std::time(nullptr),
+                                                         0644, 4);
+  BOOST_REQUIRE(action != nullptr);
+  BOOST_CHECK_EQUAL(action->version(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(CrashConsistency)
+{
+  // the child is killed in the middle of AddLocalActionDelete, before the commit
+  pid_t pid = fork();
+  BOOST_REQUIRE(pid >= 0);
+  if (pid == 0) {
+    Face& face = forwarder.addFace();
+    SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+    syncLog->SetLocalSeqNoBlockSize(10);
+    ActionLogPtr actionLog = openActionLog(face, syncLog, [] (const std::string&) { _exit(0); });
+
+    actionLog->AddLocalActionUpdate("a.txt", *hash, std::time(nullptr), 0644, 1);
+    actionLog->AddLocalActionUpdate("b.txt", *hash, std::time(nullptr), 0644, 1);
+    actionLog->AddLocalActionUpdate("b.txt", *hash, std::time(nullptr), 0644, 2);
+    actionLog->AddLocalActionDelete("a.txt");
+    _exit(1);
+  }
+
+  int status = 0;
+  BOOST_REQUIRE_EQUAL(waitpid(pid, &status, 0), pid);
+  BOOST_REQUIRE(WIFEXITED(status));
+  BOOST_REQUIRE_EQUAL(WEXITSTATUS(status), 0);
+
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  ActionLogPtr actionLog = openActionLog(face, syncLog);
 
-  PcoPtr pco = actionLog->LookupActionPco(localName, 0);
-  BOOST_CHECK_EQUAL((bool)pco, false);
+  BOOST_CHECK_EQUAL(actionLog->LogSize(), 3);
+  BOOST_CHECK(actionLog->GetFileState()->LookupFile("a.txt") != nullptr);
 
-  pco = actionLog->LookupActionPco(localName, 1);
-  BOOST_CHECK_EQUAL((bool)pco, true);
+  // the rest of the reserved block is skipped and answered as gone
+  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 10);
+  BOOST_CHECK_EQUAL(actionLog->IsActionPruned(localName, 3), false);
+  for (int seqno = 4; seqno <= 10; ++seqno) {
+    BOOST_CHECK_EQUAL(actionLog->IsActionPruned(localName, seqno), true);
+  }
 
-  BOOST_CHECK_EQUAL(pco->name(), "/alex/test-chronoshare/action/top-secret/%00%01");
+  FileItemPtr file = actionLog->GetFileState()->LookupFile("b.txt");
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK_EQUAL(file->version(), 1);
+  BOOST_CHECK_EQUAL(file->seg_num(), 2);
 
-  ActionItemPtr action = actionLog->LookupAction(Name("/alex/test-chronoshare/action/top-secret")(0));
-  BOOST_CHECK_EQUAL((bool)action, false);
+  actionLog->AddLocalActionUpdate("c.txt", *hash, std::time(nullptr), 0644, 1);
+  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 11);
+}
 
-  action = actionLog->LookupAction(Name("/alex/test-chronoshare/action/top-secret")(1));
-  BOOST_CHECK_EQUAL((bool)action, true);
+BOOST_AUTO_TEST_CASE(RecoverAttachedDatabases)
+{
+  {
+    Face& face = forwarder.addFace();
+    SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+    ActionLogPtr actionLog = openActionLog(face, syncLog);
+
+    actionLog->AddLocalActionUpdate("a.txt", *hash, std::time(nullptr), 0644, 1);
+    actionLog->AddLocalActionUpdate("b.txt", *hash, std::time(nullptr), 0644, 1);
+    actionLog->AddLocalActionDelete("a.txt");
+    actionLog->AddLocalActionUpdate("b.txt", *hash, std::time(nullptr), 0644, 2);
+  }
 
-  if (action) {
-    BOOST_CHECK_EQUAL(action->version(), 0);
-    BOOST_CHECK_EQUAL(action->action(), 0);
+  // file-state.db and sync-log.db are not synced on commit and may lose the latest commits
+  execute("file-state.db", "DELETE FROM FileState; "
+                           "INSERT INTO FileState (type, filename, version, directory, "
+                           "    device_name, seq_no, file_hash, file_mtime, file_chmod, "
+                           "    file_seg_num, is_complete) "
+                           "  VALUES (0, 'a.txt', 0, '', X'00', 1, X'00', 0, 0644, 1, 1); "
+                           "UPDATE FileStateAppliedAction SET action_id = 1;");
+  execute("sync-log.db", "UPDATE SyncNodes SET seq_no = 1;");
+
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  ActionLogPtr actionLog = openActionLog(face, syncLog);
+
+  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 4);
+  BOOST_CHECK(actionLog->GetFileState()->LookupFile("a.txt") == nullptr);
+
+  FileItemPtr file = actionLog->GetFileState()->LookupFile("b.txt");
+  BOOST_REQUIRE(file != nullptr);
+  BOOST_CHECK_EQUAL(file->version(), 1);
+  BOOST_CHECK_EQUAL(file->seq_no(), 4);
+  BOOST_CHECK_EQUAL(file->seg_num(), 2);
+  BOOST_CHECK_EQUAL(file->is_complete(), true);
+}
 
-    BOOST_CHECK_EQUAL(action->filename(), "file.txt");
-    BOOST_CHECK_EQUAL(action->seg_num(), 10);
-    BOOST_CHECK_EQUAL(action->file_hash().size(), 32);
-    BOOST_CHECK_EQUAL(action->mode(), 0755);
+BOOST_AUTO_TEST_CASE(PruneAndGone)
+{
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  ActionLogPtr actionLog = openActionLog(face, syncLog);
 
-    BOOST_CHECK_EQUAL(action->has_parent_device_name(), false);
-    BOOST_CHECK_EQUAL(action->has_parent_seq_no(), false);
+  ActionLog::RetentionPolicy policy;
+  policy.maxVersions = 2;
+  policy.maxAge = time::seconds::zero();
+  actionLog->SetRetentionPolicy(policy);
+
+  for (int i = 0; i < 5; ++i) {
+    actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0644, 1);
+  }
+  actionLog->AddLocalActionUpdate("other.txt", *hash, std::time(nullptr), 0644, 1);
+
+  // each step examines only two actions
+  BOOST_CHECK_EQUAL(actionLog->Prune(2), true);
+  BOOST_CHECK_EQUAL(actionLog->LogSize(), 4);
+  int nSteps = 1;
+  while (actionLog->Prune(2)) {
+    ++nSteps;
   }
+  BOOST_CHECK_EQUAL(nSteps, 3);
 
-  actionLog->AddLocalActionUpdate("file.txt",
-                                  *Hash::FromString(
-                                    "2ff304769cdb0125ac039e6fe7575f8576dceffc62618a431715aaf6eea2bf1c"),
-                                  time(NULL), 0755, 10);
-  BOOST_CHECK_EQUAL(syncLog->SeqNo(localName), 2);
-  BOOST_CHECK_EQUAL(syncLog->LogSize(), 1);
-  BOOST_CHECK_EQUAL(actionLog->LogSize(), 2);
+  // the two newest versions of file.txt are kept
+  BOOST_CHECK_EQUAL(actionLog->LogSize(), 3);
+  for (int seqno = 1; seqno <= 3; ++seqno) {
+    BOOST_CHECK(actionLog->LookupActionData(localName, seqno) == nullptr);
+    BOOST_CHECK_EQUAL(actionLog->IsActionPruned(localName, seqno), true);
+  }
+  BOOST_CHECK_EQUAL(actionLog->IsActionPruned(localName, 4), false);
+  BOOST_CHECK_EQUAL(actionLog->IsActionPruned(localName, 7), false);
+  BOOST_CHECK_EQUAL(actionLog->IsActionPruned(Name("/bob"), 1), false);
 
-  action = actionLog->LookupAction(Name("/alex"), 2);
-  BOOST_CHECK_EQUAL((bool)action, true);
+  // gone reply of the publisher is recorded, so that the action is not fetched again
+  Name actionName = Name("/bob").append("test-chronoshare").append("action").append("top-secret");
+  shared_ptr<Data> gone = actionLog->MakeGoneReply(Name(actionName).appendNumber(3));
+  BOOST_CHECK_EQUAL(gone->getContentType(), tlv::ContentType_Nack);
 
-  if (action) {
-    BOOST_CHECK_EQUAL(action->has_parent_device_name(), true);
-    BOOST_CHECK_EQUAL(action->has_parent_seq_no(), true);
+  BOOST_CHECK(actionLog->AddRemoteAction(gone) == nullptr);
+  BOOST_CHECK_EQUAL(actionLog->LogSize(), 3);
+  BOOST_CHECK_EQUAL(actionLog->IsActionPruned(Name("/bob"), 3), true);
+  BOOST_CHECK_EQUAL(actionLog->IsActionPruned(Name("/bob"), 2), false);
+}
+
+BOOST_AUTO_TEST_CASE(MigrateActionContent)
+{
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  openActionLog(face, syncLog)->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr),
+                                                     0644, 1);
+  syncLog->waitForWrites();
+
+  // database of an older version, with the content in ActionLog and a large action
+  execute("action-log.db",
+          "ALTER TABLE ActionLog ADD COLUMN action_content_object BLOB;"
+          "UPDATE ActionLog SET action_content_object="
+          "  (SELECT action_content_object FROM ActionContent c"
+          "     WHERE c.device_name=ActionLog.device_name AND c.seq_no=ActionLog.seq_no);"
+          "DELETE FROM ActionContent;"
+          "INSERT INTO ActionLog (device_name, seq_no, action, filename, version,"
+          "                       action_timestamp, action_content_object)"
+          "  VALUES (x'00', 1, 0, 'large.txt', 0, 0, zeroblob(1000000));"
+          "PRAGMA user_version = 0;");
+  BOOST_REQUIRE_GT(queryInt("action-log.db", "PRAGMA page_count") *
+                   queryInt("action-log.db", "PRAGMA page_size"), 1000000);
+
+  BOOST_CHECK(openActionLog(face, syncLog)->LookupActionData(localName, 1) != nullptr);
+  BOOST_CHECK_EQUAL(queryInt("action-log.db", "PRAGMA user_version"), 1);
+  BOOST_CHECK_EQUAL(queryInt("action-log.db", "SELECT count(*) FROM ActionContent"), 2);
+  BOOST_CHECK_EQUAL(queryInt("action-log.db", "SELECT count(*) FROM ActionLog "
+                                              "WHERE action_content_object IS NOT NULL"), 0);
+  // the space of the content left behind in ActionLog is given back to the file system
+  BOOST_CHECK_EQUAL(queryInt("action-log.db", "PRAGMA freelist_count"), 0);
+  BOOST_CHECK_LT(queryInt("action-log.db", "PRAGMA page_count") *
+                 queryInt("action-log.db", "PRAGMA page_size"), 1500000);
+
+  // migrated databases are not scanned again
+  execute("action-log.db", "UPDATE ActionLog SET action_content_object=x'00' WHERE seq_no=1");
+  openActionLog(face, syncLog);
+  BOOST_CHECK_EQUAL(queryInt("action-log.db", "SELECT count(*) FROM ActionLog "
+                                              "WHERE action_content_object IS NOT NULL"), 2);
+}
 
-    BOOST_CHECK_EQUAL(action->parent_seq_no(), 1);
-    BOOST_CHECK_EQUAL(action->version(), 1);
+BOOST_AUTO_TEST_CASE(SyncsPerLocalAction)
+{
+  SyncCountingVfs vfs;
+
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  ActionLogPtr actionLog = openActionLog(face, syncLog);
+
+  const int nActions = 100;
+  // seq_nos of all actions are reserved at once
+  syncLog->SetLocalSeqNoBlockSize(2 * nActions);
+
+  // the first action adds the file to FileState
+  actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0644, 1);
+  syncLog->waitForWrites();
+
+  int before = vfs.getSyncCount();
+  for (int i = 0; i < nActions; ++i) {
+    actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0644, 1);
+    syncLog->waitForWrites();
   }
+  double syncsPerAction = static_cast<double>(vfs.getSyncCount() - before) / nActions;
 
-  BOOST_CHECK_EQUAL((bool)actionLog->AddRemoteAction(pco), true);
-  BOOST_CHECK_EQUAL(actionLog->LogSize(), 2);
+  BOOST_TEST_MESSAGE("fsync calls per local action: " << syncsPerAction);
+  BOOST_CHECK_LE(syncsPerAction, 1.0);
+}
 
-  // create a real remote action
-  ActionItem item;
-  item.set_action(ActionItem::UPDATE);
-  item.set_filename("file.txt");
-  item.set_version(2);
-  item.set_timestamp(time(NULL));
+// Benchmarks are disabled by default, run them explicitly, e.g.,
+//   ./build/unit-tests -t TestActionLog/GroupCommitBenchmark
+BOOST_AUTO_TEST_CASE(GroupCommitBenchmark, *boost::unit_test::disabled())
+{
+  SyncCountingVfs vfs;
+  const int nActions = 500;
 
-  BytesPtr item_msg = serializeMsg(item);
-  Name actionName = Name("/")(Name("/zhenkai/test"))("test-chronoshare")("action")("top-secret")(1);
-  Bytes actionData = ccnx->createContentObject(actionName, head(*item_msg), item_msg->size());
+  std::vector<shared_ptr<Data>> remoteActions;
+  for (int i = 0; i < nActions; ++i) {
+    remoteActions.push_back(makeRemoteAction("/bob", i + 1, "remote-" + std::to_string(i), 1));
+  }
 
-  pco = make_shared<ParsedContentObject>(actionData);
-  BOOST_CHECK_EQUAL((bool)actionLog->AddRemoteAction(pco), true);
-  BOOST_CHECK_EQUAL(actionLog->LogSize(), 3);
+  DbHelper::StorageProfile defaultProfile = DbHelper::getDefaultStorageProfile();
+
+  DbHelper::StorageProfile journal;
+  journal.useWal = false;
+  DbHelper::StorageProfile wal;
+  wal.synchronous = DbHelper::StorageProfile::SYNCHRONOUS_NORMAL;
+  DbHelper::StorageProfile group = wal;
+  group.groupCommitWindow = time::milliseconds(10);
+
+  for (const auto& profile : {std::make_pair("journal", journal), std::make_pair("wal", wal),
+                              std::make_pair("wal+group", group)}) {
+    remove_all(tmpdir);
+    DbHelper::setDefaultStorageProfile(profile.second);
+
+    Face& face = forwarder.addFace();
+    SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+    ActionLogPtr actionLog = openActionLog(face, syncLog);
+    syncLog->SetLocalSeqNoBlockSize(2 * nActions);
+
+    auto runActions = [&] (const function<void(int)>& addAction) {
+      actionLog->flush();
+      syncLog->waitForWrites();
+      syncLog->flush();
+      int before = vfs.getSyncCount();
+      auto start = time::steady_clock::now();
+      for (int i = 0; i < nActions; ++i) {
+        addAction(i);
+      }
+      actionLog->flush();
+      syncLog->waitForWrites();
+      syncLog->flush();
+      auto elapsed = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+      return std::make_pair(elapsed.count() / nActions,
+                            static_cast<double>(vfs.getSyncCount() - before) / nActions);
+    };
+
+    auto local = runActions([&] (int) {
+      actionLog->AddLocalActionUpdate("file.txt", *hash, std::time(nullptr), 0644, 1);
+    });
+    auto remote = runActions([&] (int i) {
+      BOOST_CHECK(actionLog->AddRemoteAction(remoteActions[i]) != nullptr);
+    });
+
+    BOOST_TEST_MESSAGE(profile.first << ": local " << local.first << "us and " << local.second
+                       << " fsyncs per action, remote " << remote.first << "us and "
+                       << remote.second << " fsyncs per action");
+  }
+
+  DbHelper::setDefaultStorageProfile(defaultProfile);
+}
+
+BOOST_AUTO_TEST_CASE(CatchUpBenchmark, *boost::unit_test::disabled())
+{
+  // a device catching up with 100k actions on 1000 files, added one by one or in batches of
+  // the size of a fetch window
+  const int nActions = 100000;
+  const size_t batchSize = 1000;
+
+  std::vector<shared_ptr<Data>> remoteActions;
+  remoteActions.reserve(nActions);
+  for (int i = 0; i < nActions; ++i) {
+    remoteActions.push_back(makeRemoteAction("/bob", i + 1, "dir-" + std::to_string(i % 10) +
+                                             "/file-" + std::to_string(i % 1000), i / 1000 + 1));
+  }
+
+  auto catchUp = [&] (const function<void(ActionLog&)>& addActions) {
+    remove_all(tmpdir);
+    Face& face = forwarder.addFace();
+    SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+    ActionLogPtr actionLog = openActionLog(face, syncLog);
+
+    auto start = time::steady_clock::now();
+    addActions(*actionLog);
+    actionLog->flush();
+    auto elapsed = time::duration_cast<time::milliseconds>(time::steady_clock::now() - start);
+
+    BOOST_CHECK_EQUAL(actionLog->LogSize(), nActions);
+    BOOST_CHECK_EQUAL(actionLog->GetFileState()->LookupFilesInFolder("dir-0")->size(), 100);
+    return elapsed;
+  };
+
+  time::milliseconds oneByOne = catchUp([&] (ActionLog& actionLog) {
+    for (const auto& action : remoteActions) {
+      actionLog.AddRemoteAction(action);
+    }
+  });
+
+  time::milliseconds batched = catchUp([&] (ActionLog& actionLog) {
+    for (size_t i = 0; i < remoteActions.size(); i += batchSize) {
+      size_t end = std::min(i + batchSize, remoteActions.size());
+      actionLog.AddRemoteActions(std::vector<shared_ptr<Data>>(remoteActions.begin() + i,
+                                                               remoteActions.begin() + end));
+    }
+  });
+
+  BOOST_TEST_MESSAGE(nActions << " remote actions: one by one " << oneByOne.count()
+                     << "ms, in batches of " << batchSize << " " << batched.count() << "ms");
+}
+
+BOOST_AUTO_TEST_CASE(ActionContentCompressionBenchmark, *boost::unit_test::disabled())
+{
+  // ActionContent keeps signed actions as they are: each one is a short name, a file hash and a
+  // signature, which zlib cannot shrink one blob at a time
+  const int nActions = 1000;
+  namespace io = boost::iostreams;
+
+  Face& face = forwarder.addFace();
+  SyncLogPtr syncLog = std::make_shared<SyncLog>(tmpdir, localName);
+  ActionLogPtr actionLog = openActionLog(face, syncLog);
+
+  std::vector<shared_ptr<Data>> remoteActions;
+  for (int i = 0; i < nActions; ++i) {
+    remoteActions.push_back(makeRemoteAction("/bob", i + 1, "photos/" + std::to_string(i % 10) +
+                                             "/IMG_" + std::to_string(1000 + i) + ".jpg", 1));
+  }
+  actionLog->AddRemoteActions(remoteActions);
+  actionLog->flush();
+
+  size_t rawSize = 0;
+  size_t compressedSize = 0;
+  int nSmaller = 0;
+  time::nanoseconds lookupTime(0);
+  time::nanoseconds decompressTime(0);
+  for (int i = 0; i < nActions; ++i) {
+    auto start = time::steady_clock::now();
+    shared_ptr<Data> action = actionLog->LookupActionData(Name("/bob"), i + 1);
+    lookupTime += time::steady_clock::now() - start;
+    BOOST_REQUIRE(action != nullptr);
+
+    const Block& wire = action->wireEncode();
+    std::vector<char> compressed;
+    {
+      io::filtering_ostream out;
+      out.push(io::zlib_compressor());
+      out.push(io::back_inserter(compressed));
+      out.write(reinterpret_cast<const char*>(wire.wire()), wire.size());
+    }
+
+    start = time::steady_clock::now();
+    std::vector<char> decompressed;
+    io::filtering_istream in;
+    in.push(io::zlib_decompressor());
+    in.push(io::array_source(compressed.data(), compressed.size()));
+    io::copy(in, io::back_inserter(decompressed));
+    decompressTime += time::steady_clock::now() - start;
+    BOOST_CHECK_EQUAL(decompressed.size(), wire.size());
+
+    rawSize += wire.size();
+    compressedSize += compressed.size();
+    nSmaller += compressed.size() < wire.size();
+  }
 
-  remove_all(tmpdir);
+  BOOST_TEST_MESSAGE(nActions << " signed actions with " << remoteActions[0]->getSignature()
+                     .getValue().size() << "-byte signatures: " << rawSize / nActions
+                     << " bytes stored per action, " << compressedSize / nActions
+                     << " with zlib, smaller for " << nSmaller);
+  BOOST_TEST_MESSAGE("lookup " << lookupTime.count() / nActions / 1000.0 << "us, zlib "
+                     "decompression " << decompressTime.count() / nActions / 1000.0
+                     << "us per action");
 }
 
 BOOST_AUTO_TEST_SUITE_END()
 
-// catch (boost::exception &err)
-//   {
-//     cout << *boost::get_error_info<errmsg_info_str> (err) << endl;
-//   }
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
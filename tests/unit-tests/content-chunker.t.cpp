@@ -0,0 +1,122 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "content-chunker.hpp"
+
+#include "test-common.hpp"
+
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+using std::string;
+using std::vector;
+
+_LOG_INIT(Test.ContentChunker);
+
+static vector<uint8_t>
+randomData(size_t size)
+{
+  vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = static_cast<uint8_t>(rand());
+  }
+  return data;
+}
+
+static vector<string>
+split(const ContentChunker& chunker, const vector<uint8_t>& data)
+{
+  vector<string> chunks;
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t length = chunker.findBoundary(&data[pos], data.size() - pos);
+    chunks.push_back(string(reinterpret_cast<const char*>(&data[pos]), length));
+    pos += length;
+  }
+  return chunks;
+}
+
+BOOST_AUTO_TEST_SUITE(TestContentChunker)
+
+BOOST_AUTO_TEST_CASE(ChunkSizes)
+{
+  ContentChunker chunker;
+  vector<uint8_t> data = randomData(1024 * 1024);
+
+  vector<string> chunks = split(chunker, data);
+  size_t total = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    total += chunks[i].size();
+    BOOST_CHECK_LE(chunks[i].size(), ContentChunker::MAX_CHUNK_SIZE);
+    if (i + 1 < chunks.size()) {
+      BOOST_CHECK_GE(chunks[i].size(), ContentChunker::MIN_CHUNK_SIZE);
+    }
+  }
+  BOOST_CHECK_EQUAL(total, data.size());
+
+  // normalized chunking keeps the average close to AVG_CHUNK_SIZE
+  size_t average = total / chunks.size();
+  BOOST_CHECK_GE(average, ContentChunker::AVG_CHUNK_SIZE * 3 / 4);
+  BOOST_CHECK_LE(average, ContentChunker::AVG_CHUNK_SIZE * 3 / 2);
+
+  // short tail is a single chunk
+  BOOST_CHECK_EQUAL(chunker.findBoundary(&data[0], 100), 100);
+
+  BOOST_CHECK_THROW(ContentChunker(2048, 3000, 8000), ContentChunker::Error);
+  BOOST_CHECK_THROW(ContentChunker(4096, 2048, 8000), ContentChunker::Error);
+  BOOST_CHECK_THROW(ContentChunker(2048, 4096, 4000), ContentChunker::Error);
+}
+
+BOOST_AUTO_TEST_CASE(BoundariesSurviveEdits)
+{
+  ContentChunker chunker;
+  vector<uint8_t> data = randomData(1024 * 1024);
+  vector<string> original = split(chunker, data);
+  std::set<string> known(original.begin(), original.end());
+
+  // insert one byte near the beginning
+  vector<uint8_t> edited = data;
+  edited.insert(edited.begin() + 100, 'x');
+
+  vector<string> chunks = split(chunker, edited);
+  size_t changed = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (known.find(chunks[i]) == known.end()) {
+      changed++;
+    }
+  }
+  _LOG_DEBUG("Changed " << changed << " of " << chunks.size() << " chunks");
+  BOOST_CHECK_LE(changed, 2);
+
+  // the same content is always split the same way
+  BOOST_CHECK(split(ContentChunker(), data) == original);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,541 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "db-helper.hpp"
+
+#include "test-common.hpp"
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+namespace fs = boost::filesystem;
+
+class TestableDbHelper : public DbHelper
+{
+public:
+  explicit TestableDbHelper(const fs::path& path,
+                            const StorageProfile& profile = getDefaultStorageProfile())
+    : DbHelper(path, "test.db", profile)
+  {
+    sqlite3_exec(m_db, "CREATE TABLE IF NOT EXISTS Test (value INTEGER)", 0, 0, 0);
+    clearStatementCache();
+  }
+
+  void
+  insert(int value)
+  {
+    Statement stmt(*this, "INSERT INTO Test VALUES (?)");
+    sqlite3_bind_int(stmt, 1, value);
+    sqlite3_step(stmt);
+  }
+
+  int
+  count()
+  {
+    ReadConnection connection(*this);
+    return count(connection);
+  }
+
+  int
+  count(ReadConnection& connection)
+  {
+    Statement stmt(connection, "SELECT count(*) FROM Test");
+    sqlite3_step(stmt);
+    return sqlite3_column_int(stmt, 0);
+  }
+
+  std::string
+  getJournalMode()
+  {
+    Statement stmt(*this, "PRAGMA journal_mode");
+    sqlite3_step(stmt);
+    return reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+  }
+
+  using DbHelper::clearStatementCache;
+  using DbHelper::beginTransaction;
+  using DbHelper::commitTransaction;
+  using DbHelper::rollbackTransaction;
+  using DbHelper::enqueueWrite;
+  using DbHelper::m_db;
+};
+
+static int
+countCommittedRows(const fs::path& path)
+{
+  sqlite3* db = nullptr;
+  sqlite3_open((path / "test.db").c_str(), &db);
+  sqlite3_stmt* stmt = nullptr;
+  sqlite3_prepare_v2(db, "SELECT count(*) FROM Test", -1, &stmt, 0);
+  int count = -1;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    count = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return count;
+}
+
+BOOST_AUTO_TEST_SUITE(TestDbHelper)
+
+BOOST_AUTO_TEST_CASE(StatementCache)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  TestableDbHelper db(tmpdir);
+
+  sqlite3_stmt* first = nullptr;
+  {
+    DbHelper::Statement stmt(db, "SELECT ?");
+    first = stmt;
+    sqlite3_bind_int(stmt, 1, 42);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 0), 42);
+  }
+
+  {
+    // the same statement is reused, reset, and has no bindings left
+    DbHelper::Statement stmt(db, "SELECT ?");
+    BOOST_CHECK(static_cast<sqlite3_stmt*>(stmt) == first);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL(sqlite3_column_type(stmt, 0), SQLITE_NULL);
+
+    // nested use of the same SQL gets a private statement
+    DbHelper::Statement nested(db, "SELECT ?");
+    BOOST_CHECK(static_cast<sqlite3_stmt*>(nested) != first);
+    sqlite3_bind_int(nested, 1, 1);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(nested), SQLITE_ROW);
+    BOOST_CHECK_EQUAL(sqlite3_column_int(nested, 0), 1);
+
+    // statements in use survive cache invalidation
+    db.clearStatementCache();
+    BOOST_CHECK_EQUAL(sqlite3_step(stmt), SQLITE_DONE);
+  }
+
+  {
+    DbHelper::Statement stmt(db, "SELECT 1");
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 0), 1);
+  }
+
+  BOOST_CHECK_THROW(DbHelper::Statement(db, "SELECT * FROM NoSuchTable"), DbHelper::Error);
+}
+
+BOOST_AUTO_TEST_CASE(GroupCommit)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  DbHelper::StorageProfile profile;
+  profile.useWal = true;
+  profile.synchronous = DbHelper::StorageProfile::SYNCHRONOUS_NORMAL;
+  profile.groupCommitWindow = time::seconds(3600);
+  profile.groupCommitSize = 3;
+
+  TestableDbHelper db(tmpdir, profile);
+  BOOST_CHECK_EQUAL(db.getJournalMode(), "wal");
+
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(1);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+
+  // rolled back transaction does not affect other transactions in the group
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(2);
+  db.rollbackTransaction();
+
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(3);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 0);
+
+  // third transaction in the group triggers commit
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(4);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 3);
+
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(5);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 3);
+
+  db.flush();
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 4);
+}
+
+BOOST_AUTO_TEST_CASE(NestedGroupCommit)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  DbHelper::StorageProfile profile;
+  profile.useWal = true;
+  profile.groupCommitWindow = time::seconds(3600);
+  profile.groupCommitSize = 1;
+
+  TestableDbHelper db(tmpdir, profile);
+
+  // commit of a nested transaction does not commit the enclosing one
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(1);
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(2);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 0);
+  db.rollbackTransaction();
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 0);
+  BOOST_CHECK_EQUAL(db.count(), 0);
+
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(3);
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(4);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 2);
+}
+
+BOOST_AUTO_TEST_CASE(FailedBegin)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  DbHelper::StorageProfile profile;
+  profile.groupCommitWindow = time::seconds(3600);
+  TestableDbHelper db(tmpdir, profile);
+
+  // BEGIN fails inside a transaction that DbHelper does not know about
+  BOOST_REQUIRE_EQUAL(sqlite3_exec(db.m_db, "BEGIN", 0, 0, 0), SQLITE_OK);
+  BOOST_CHECK_NE(db.beginTransaction(), SQLITE_OK);
+  BOOST_REQUIRE_EQUAL(sqlite3_exec(db.m_db, "COMMIT", 0, 0, 0), SQLITE_OK);
+
+  // the transaction lock has been released
+  std::future<int> other = std::async(std::launch::async, [&db] {
+      int res = db.beginTransaction();
+      if (res == SQLITE_OK) {
+        db.insert(1);
+        res = db.commitTransaction();
+      }
+      return res;
+    });
+  BOOST_REQUIRE(other.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+  BOOST_CHECK_EQUAL(other.get(), SQLITE_OK);
+  db.flush();
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 1);
+}
+
+BOOST_AUTO_TEST_CASE(GroupCommitTimer)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  DbHelper::StorageProfile profile;
+  profile.useWal = true;
+  profile.groupCommitWindow = time::milliseconds(100);
+  profile.groupCommitSize = 100;
+
+  TestableDbHelper db(tmpdir, profile);
+
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(1);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 0);
+
+  // the last transaction of a burst is committed when the window expires, without further writes
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 1);
+
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(2);
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 2);
+}
+
+BOOST_AUTO_TEST_CASE(ReadConnectionPool)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  DbHelper::StorageProfile profile;
+  profile.useWal = true;
+  profile.readConnections = 2;
+  TestableDbHelper db(tmpdir, profile);
+  db.insert(1);
+
+  sqlite3* pooled = nullptr;
+  {
+    DbHelper::ReadConnection first(db);
+    DbHelper::ReadConnection second(db);
+    BOOST_REQUIRE(first.isPooled());
+    BOOST_REQUIRE(second.isPooled());
+    BOOST_CHECK(static_cast<sqlite3*>(first) != static_cast<sqlite3*>(second));
+    BOOST_CHECK(static_cast<sqlite3*>(first) != db.m_db);
+    pooled = first;
+
+    // all pooled connections are busy
+    DbHelper::ReadConnection third(db);
+    BOOST_CHECK(!third.isPooled());
+
+    BOOST_CHECK_EQUAL(db.count(first), 1);
+    BOOST_CHECK_EQUAL(db.count(third), 1);
+
+    // functions are available on pooled connections
+    DbHelper::Statement stmt(second, "SELECT is_dir_prefix('a', 'a/b')");
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 0), 1);
+
+    // pooled connections are read-only
+    DbHelper::Statement insertStmt(first, "INSERT INTO Test VALUES (2)");
+    BOOST_CHECK_EQUAL(sqlite3_step(insertStmt), SQLITE_READONLY);
+  }
+
+  {
+    // released connections are reused and see committed changes
+    DbHelper::ReadConnection connection(db);
+    BOOST_CHECK(connection.isPooled());
+    BOOST_CHECK(static_cast<sqlite3*>(connection) == pooled);
+    db.insert(2);
+    BOOST_CHECK_EQUAL(db.count(connection), 2);
+  }
+
+  // uncommitted changes are visible only on the main connection
+  BOOST_CHECK_EQUAL(db.beginTransaction(), SQLITE_OK);
+  db.insert(3);
+  std::thread([&db] {
+    DbHelper::ReadConnection connection(db);
+    BOOST_CHECK(connection.isPooled());
+    BOOST_CHECK_EQUAL(db.count(connection), 2);
+  }).join();
+  {
+    DbHelper::ReadConnection connection(db);
+    BOOST_CHECK(!connection.isPooled());
+    BOOST_CHECK_EQUAL(db.count(connection), 3);
+  }
+  BOOST_CHECK_EQUAL(db.commitTransaction(), SQLITE_OK);
+
+  // the pool is reopened after the schema change
+  db.clearStatementCache();
+  {
+    DbHelper::ReadConnection connection(db);
+    BOOST_CHECK(connection.isPooled());
+    BOOST_CHECK_EQUAL(db.count(connection), 3);
+  }
+
+  profile.useWal = false;
+  TestableDbHelper noWal(tmpdir / "no-wal", profile);
+  DbHelper::ReadConnection connection(noWal);
+  BOOST_CHECK(!connection.isPooled());
+}
+
+BOOST_AUTO_TEST_CASE(WriterThread)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  TestableDbHelper db(tmpdir);
+
+  std::vector<std::future<int>> results;
+  for (int i = 0; i < 100; i++) {
+    results.push_back(db.enqueueWrite<int>([&db, i] {
+      db.insert(i);
+      return i;
+    }));
+  }
+
+  // failing write does not affect other writes in the same transaction
+  std::future<void> failed = db.enqueueWrite<void>([&db] {
+    db.insert(-1);
+    BOOST_THROW_EXCEPTION(DbHelper::Error("expected failure"));
+  });
+  std::future<void> last = db.enqueueWrite<void>([&db] { db.insert(100); });
+
+  for (int i = 0; i < 100; i++) {
+    BOOST_CHECK_EQUAL(results[i].get(), i);
+  }
+  BOOST_CHECK_THROW(failed.get(), DbHelper::Error);
+  last.get();
+
+  // writes are committed before their futures become ready
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 101);
+
+  db.enqueueWrite<void>([&db] { db.insert(101); });
+  db.waitForWrites();
+  BOOST_CHECK_EQUAL(db.count(), 102);
+
+  DbWriter::Statistics statistics = db.getWriterStatistics();
+  BOOST_CHECK_EQUAL(statistics.queueWait.size(), 103);
+  BOOST_CHECK_GE(statistics.commit.size(), 2);
+  BOOST_CHECK_LE(statistics.commit.size(), 103);
+  BOOST_CHECK(statistics.commit.getPercentile(0.5) <= statistics.commit.getPercentile(1.0));
+}
+
+BOOST_AUTO_TEST_CASE(WriterThreadCommitFailure)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  DbHelper::StorageProfile profile;
+  profile.useWal = false;
+  profile.busyTimeout = time::milliseconds(10);
+  TestableDbHelper db(tmpdir, profile);
+
+  // reader on another connection keeps the database from being written
+  sqlite3* reader = nullptr;
+  sqlite3_open((tmpdir / "test.db").c_str(), &reader);
+  sqlite3_exec(reader, "BEGIN", 0, 0, 0);
+  sqlite3_stmt* stmt = nullptr;
+  sqlite3_prepare_v2(reader, "SELECT count(*) FROM Test", -1, &stmt, 0);
+  BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+
+  std::future<void> failed = db.enqueueWrite<void>([&db] { db.insert(1); });
+  BOOST_CHECK_THROW(failed.get(), DbHelper::Error);
+
+  sqlite3_finalize(stmt);
+  sqlite3_exec(reader, "COMMIT", 0, 0, 0);
+  sqlite3_close(reader);
+
+  db.enqueueWrite<void>([&db] { db.insert(2); }).get();
+  BOOST_CHECK_EQUAL(countCommittedRows(tmpdir), 1);
+}
+
+BOOST_AUTO_TEST_CASE(WriterThreadDisabled)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  DbHelper::StorageProfile profile;
+  profile.useWriterThread = false;
+  TestableDbHelper db(tmpdir, profile);
+
+  // the write is executed right away
+  std::future<int> result = db.enqueueWrite<int>([&db] {
+    db.insert(1);
+    return 1;
+  });
+  BOOST_CHECK_EQUAL(db.count(), 1);
+  BOOST_CHECK_EQUAL(result.get(), 1);
+
+  std::future<void> failed = db.enqueueWrite<void>([&db] {
+    db.insert(2);
+    BOOST_THROW_EXCEPTION(DbHelper::Error("expected failure"));
+  });
+  BOOST_CHECK_THROW(failed.get(), DbHelper::Error);
+  BOOST_CHECK_EQUAL(db.count(), 1);
+
+  BOOST_CHECK_EQUAL(db.getWriterStatistics().queueWait.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(Histogram)
+{
+  LatencyHistogram histogram;
+  BOOST_CHECK_EQUAL(histogram.size(), 0);
+
+  for (int i = 0; i < 90; i++) {
+    histogram.add(time::microseconds(3));
+  }
+  for (int i = 0; i < 10; i++) {
+    histogram.add(time::milliseconds(1));
+  }
+
+  BOOST_CHECK_EQUAL(histogram.size(), 100);
+  BOOST_CHECK_EQUAL(histogram.getBucket(1), 90);
+  BOOST_CHECK_EQUAL(histogram.getBucket(9), 10);
+  BOOST_CHECK(histogram.getPercentile(0.5) == time::microseconds(4));
+  BOOST_CHECK(histogram.getPercentile(0.99) == time::microseconds(1024));
+  BOOST_CHECK(histogram.getMax() == time::milliseconds(1));
+}
+
+// Benchmarks are disabled by default, run them explicitly, e.g.,
+//   ./build/unit-tests -t TestDbHelper/StatementCacheBenchmark
+BOOST_AUTO_TEST_CASE(StatementCacheBenchmark, *boost::unit_test::disabled())
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  TestableDbHelper db(tmpdir);
+  db.beginTransaction();
+  for (int i = 0; i < 1000; i++) {
+    db.insert(i);
+  }
+  db.commitTransaction();
+
+  // a lookup similar to the ones on the sync and serve paths, e.g., LookupActionData
+  const std::string sql = "SELECT value FROM Test WHERE rowid=? AND value IS NOT NULL";
+  const int N_OPS = 100000;
+
+  // compiles the statement for every operation, as the logs did without the cache
+  sqlite3_int64 uncachedSum = 0;
+  auto start = time::steady_clock::now();
+  for (int i = 0; i < N_OPS; i++) {
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(db.m_db, sql.c_str(), -1, &stmt, 0);
+    sqlite3_bind_int(stmt, 1, i % 1000 + 1);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      uncachedSum += sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  auto uncachedTime = time::duration_cast<time::nanoseconds>(time::steady_clock::now() - start);
+
+  sqlite3_int64 cachedSum = 0;
+  start = time::steady_clock::now();
+  for (int i = 0; i < N_OPS; i++) {
+    DbHelper::Statement stmt(db, sql);
+    sqlite3_bind_int(stmt, 1, i % 1000 + 1);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      cachedSum += sqlite3_column_int(stmt, 0);
+    }
+  }
+  auto cachedTime = time::duration_cast<time::nanoseconds>(time::steady_clock::now() - start);
+
+  BOOST_CHECK_EQUAL(uncachedSum, cachedSum);
+  BOOST_TEST_MESSAGE("prepare and finalize: " << uncachedTime.count() / N_OPS << "ns per lookup, "
+                     << "statement cache: " << cachedTime.count() / N_OPS << "ns per lookup");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
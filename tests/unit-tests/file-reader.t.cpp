@@ -0,0 +1,128 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "file-reader.hpp"
+
+#include "test-common.hpp"
+
+#include <boost/filesystem/fstream.hpp>
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+namespace fs = boost::filesystem;
+
+class FileReaderFixture
+{
+public:
+  FileReaderFixture()
+    : dir(fs::path(UNIT_TEST_CONFIG_PATH) / "TestFileReader")
+    , file(dir / "file")
+  {
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    for (size_t i = 0; i < 10000; i++) {
+      content.push_back(static_cast<uint8_t>(i * 7));
+    }
+    write(content);
+  }
+
+  ~FileReaderFixture()
+  {
+    fs::remove_all(dir);
+  }
+
+  void
+  write(const std::vector<uint8_t>& data, std::ios::openmode mode = std::ios::trunc)
+  {
+    fs::ofstream os(file, std::ios::binary | std::ios::out | mode);
+    os.write(reinterpret_cast<const char*>(data.data()), data.size());
+  }
+
+  std::vector<uint8_t>
+  readAll(FileReader& reader, size_t blockSize)
+  {
+    std::vector<uint8_t> result;
+    std::vector<uint8_t> buf(blockSize);
+    size_t bytes;
+    while ((bytes = reader.read(buf.data(), buf.size())) > 0) {
+      result.insert(result.end(), buf.begin(), buf.begin() + bytes);
+    }
+    return result;
+  }
+
+public:
+  fs::path dir;
+  fs::path file;
+  std::vector<uint8_t> content;
+};
+
+BOOST_FIXTURE_TEST_SUITE(TestFileReader, FileReaderFixture)
+
+BOOST_AUTO_TEST_CASE(ReadInBlocks)
+{
+  FileReader reader(file);
+  BOOST_CHECK_EQUAL(reader.getSize(), content.size());
+
+  // block size that does not divide the file size
+  std::vector<uint8_t> result = readAll(reader, 1024);
+  BOOST_CHECK_EQUAL_COLLECTIONS(result.begin(), result.end(), content.begin(), content.end());
+
+  uint8_t byte;
+  BOOST_CHECK_EQUAL(reader.read(&byte, 1), 0);
+
+  reader.rewind();
+  result = readAll(reader, 100000);
+  BOOST_CHECK_EQUAL_COLLECTIONS(result.begin(), result.end(), content.begin(), content.end());
+}
+
+BOOST_AUTO_TEST_CASE(GrowingFile)
+{
+  FileReader reader(file);
+  write(std::vector<uint8_t>(5000, 1), std::ios::app);
+
+  std::vector<uint8_t> result = readAll(reader, 4096);
+  BOOST_CHECK_EQUAL(reader.getSize(), content.size());
+  BOOST_CHECK_EQUAL_COLLECTIONS(result.begin(), result.end(), content.begin(), content.end());
+}
+
+BOOST_AUTO_TEST_CASE(TruncatedFile)
+{
+  FileReader reader(file);
+  fs::resize_file(file, 3000);
+
+  std::vector<uint8_t> result = readAll(reader, 1024);
+  BOOST_CHECK_EQUAL(reader.getSize(), 3000);
+  BOOST_CHECK_EQUAL_COLLECTIONS(result.begin(), result.end(),
+                                content.begin(), content.begin() + 3000);
+}
+
+BOOST_AUTO_TEST_CASE(MissingFile)
+{
+  BOOST_CHECK_THROW(FileReader reader(dir / "missing"), FileReader::Error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,465 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "file-state.hpp"
+
+#include "test-common.hpp"
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+namespace fs = boost::filesystem;
+
+class FileStateWithFiles : public FileState
+{
+public:
+  using FileState::FileState;
+
+  /**
+   * @brief Insert @p nFiles files "d<i % 100>/s<i / 100 % 100>/f<i>" directly into the database
+   */
+  void
+  insertFiles(int nFiles)
+  {
+    sqlite3_exec(m_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    Statement stmt(*this, "\
+WITH RECURSIVE                                                                  \
+  files(i, filename) AS (                                                       \
+    SELECT 0, 'd0/s0/f0'                                                        \
+    UNION ALL                                                                   \
+    SELECT i + 1, 'd' || ((i + 1) % 100) || '/s' || ((i + 1) / 100 % 100) || '/f' || (i + 1) \
+      FROM files WHERE i + 1 < ?)                                               \
+INSERT INTO FileState                                                           \
+    (type, filename, version, directory, device_name, seq_no, file_hash,        \
+     file_mtime, file_chmod, file_seg_num, is_complete)                         \
+  SELECT 0, filename, 0, directory_name(filename), X'00', i, X'00',             \
+         datetime(0, 'unixepoch'), 0644, 1, 1                                   \
+    FROM files                                                                  \
+");
+    sqlite3_bind_int(stmt, 1, nFiles);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_DONE);
+    sqlite3_exec(m_db, "END TRANSACTION", NULL, NULL, NULL);
+  }
+
+  /**
+   * @brief Count files in the folder using the full scan with is_dir_prefix
+   */
+  int
+  countFilesByScan(const std::string& folder)
+  {
+    Statement stmt(*this, "SELECT count(*) FROM FileState "
+                          "  WHERE type = 0 AND is_dir_prefix(?, directory)=1");
+    sqlite3_bind_text(stmt, 1, folder.c_str(), folder.size(), SQLITE_STATIC);
+    sqlite3_step(stmt);
+    return sqlite3_column_int(stmt, 0);
+  }
+
+  void
+  execute(const std::string& sql)
+  {
+    BOOST_REQUIRE_EQUAL(sqlite3_exec(m_db, sql.c_str(), NULL, NULL, NULL), SQLITE_OK);
+  }
+
+  /**
+   * @brief Make @p updates in a transaction that is rolled back
+   */
+  void
+  rollBack(const function<void()>& updates)
+  {
+    beginTransaction();
+    updates();
+    rollbackTransaction();
+  }
+
+  /**
+   * @brief Make @p updates in a transaction that is committed
+   */
+  void
+  commit(const function<void()>& updates)
+  {
+    beginTransaction();
+    updates();
+    commitTransaction();
+  }
+
+  std::string
+  getQueryPlan(const std::string& folder)
+  {
+    Statement stmt(*this, "EXPLAIN QUERY PLAN "
+                          "SELECT filename FROM FileState "
+                          "   WHERE type = 0 AND directory >= :folder AND directory < :folder || '0' AND "
+                          "         (directory = :folder OR directory > :folder || '/') "
+                          "   ORDER BY filename");
+    sqlite3_bind_text(stmt, 1, folder.c_str(), folder.size(), SQLITE_STATIC);
+
+    std::string plan;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      plan += reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+      plan += "\n";
+    }
+    return plan;
+  }
+};
+
+BOOST_FIXTURE_TEST_SUITE(TestFileState, IdentityManagementTimeFixture)
+
+BOOST_AUTO_TEST_CASE(FolderQueries)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  FileStateWithFiles fileState(tmpdir);
+  for (const char* filename : {"a/f", "a/b/f", "a/b/c/f", "a-b/f", "a0/f", "ab/f", "f"}) {
+    fileState.UpdateFile(filename, 0, Buffer(1), Buffer(1), 1, 0, 0, 0, 0644, 1);
+  }
+
+  auto countRecursively = [&] (const std::string& folder) {
+    int n = 0;
+    fileState.LookupFilesInFolderRecursively([&] (const FileItem&) { n++; }, folder);
+    return n;
+  };
+
+  BOOST_CHECK_EQUAL(countRecursively(""), 7);
+  BOOST_CHECK_EQUAL(countRecursively("a"), 3);
+  BOOST_CHECK_EQUAL(countRecursively("a/b"), 2);
+  BOOST_CHECK_EQUAL(countRecursively("a/b/c"), 1);
+  BOOST_CHECK_EQUAL(countRecursively("a-b"), 1);
+  BOOST_CHECK_EQUAL(countRecursively("a/"), 0);
+  BOOST_CHECK_EQUAL(countRecursively("b"), 0);
+
+  BOOST_CHECK_EQUAL(fileState.LookupFilesInFolder("a")->size(), 1);
+}
+
+// Benchmarks are disabled by default, run them explicitly, e.g.,
+//   ./build/unit-tests -t TestFileState/FolderQueriesBenchmark
+BOOST_AUTO_TEST_CASE(FolderQueriesBenchmark, *boost::unit_test::disabled())
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  const int N_FILES = 1000000;
+
+  FileStateWithFiles fileState(tmpdir);
+  fileState.insertFiles(N_FILES);
+
+  BOOST_CHECK_NE(fileState.getQueryPlan("d7").find("FileState_type_directory"), std::string::npos);
+
+  for (const char* folder : {"d7", "d7/s3"}) {
+    auto start = time::steady_clock::now();
+    int nScanned = fileState.countFilesByScan(folder);
+    auto scanTime = time::duration_cast<time::milliseconds>(time::steady_clock::now() - start);
+
+    start = time::steady_clock::now();
+    int nFound = 0;
+    bool hasMore = fileState.LookupFilesInFolderRecursively([&] (const FileItem&) { nFound++; },
+                                                            folder, 0, 100);
+    auto pageTime = time::duration_cast<time::milliseconds>(time::steady_clock::now() - start);
+
+    start = time::steady_clock::now();
+    int nTotal = 0;
+    fileState.LookupFilesInFolderRecursively([&] (const FileItem&) { nTotal++; }, folder);
+    auto rangeTime = time::duration_cast<time::milliseconds>(time::steady_clock::now() - start);
+
+    BOOST_CHECK_EQUAL(nFound, 100);
+    BOOST_CHECK(hasMore);
+    BOOST_CHECK_EQUAL(nTotal, nScanned);
+    BOOST_TEST_MESSAGE(N_FILES << " files, folder " << folder << " (" << nTotal << " files): "
+                       << "is_dir_prefix scan " << scanTime.count() << "ms, "
+                       << "first page " << pageTime.count() << "ms, "
+                       << "all files " << rangeTime.count() << "ms");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(FileCache)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  // the same operations with the cache disabled, holding a few files, and holding all files
+  for (size_t budget : {0, 2048, 1 << 20}) {
+    FileState fileState(tmpdir);
+    fileState.SetFileCacheBudget(budget);
+
+    for (int i = 0; i < 20; i++) {
+      fileState.UpdateFile("f" + std::to_string(i), 0, Buffer(1), Buffer(1), i, 0, 0, 0, 0644, 1);
+    }
+    Buffer hash(32);
+    std::fill(hash.begin(), hash.end(), 'h');
+    fileState.UpdateFile("f3", 1, hash, Buffer(1), 100, 0, 1000, 0, 0600, 5);
+    fileState.UpdateFile("f5", 1, hash, Buffer(1), 101, 0, 1000, 0, 0600, 5);
+    fileState.SetFileComplete("f5");
+    fileState.UpdateFile("f5", 2, hash, Buffer(1), 102, 0, 1001, 0, 0600, 6);
+    fileState.DeleteFile("f7");
+
+    FileItemPtr file = fileState.LookupFile("f3");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(file->version(), 1);
+    BOOST_CHECK_EQUAL(file->seq_no(), 100);
+    BOOST_CHECK_EQUAL(file->mtime(), 1000);
+    BOOST_CHECK_EQUAL(file->mode(), 0600);
+    BOOST_CHECK_EQUAL(file->seg_num(), 5);
+    BOOST_CHECK_EQUAL(file->is_complete(), false);
+
+    // returned items are copies
+    file->set_version(42);
+    BOOST_CHECK_EQUAL(fileState.LookupFile("f3")->version(), 1);
+
+    // is_complete stays set when the file is updated
+    file = fileState.LookupFile("f5");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(file->version(), 2);
+    BOOST_CHECK_EQUAL(file->is_complete(), true);
+
+    BOOST_CHECK(!fileState.LookupFile("f7"));
+    BOOST_CHECK(!fileState.LookupFile("nonexistent"));
+    BOOST_CHECK_EQUAL(fileState.LookupFilesForHash(hash)->size(), 2);
+    BOOST_CHECK_EQUAL(fileState.LookupFilesForHash(Buffer(1))->size(), 17);
+
+    remove_all(tmpdir);
+  }
+
+  // cache is loaded from the database on startup
+  {
+    FileState fileState(tmpdir);
+    fileState.UpdateFile("a", 0, Buffer(1), Buffer(1), 1, 0, 0, 0, 0644, 1);
+    fileState.SetFileComplete("a");
+  }
+  FileState fileState(tmpdir);
+  FileItemPtr file = fileState.LookupFile("a");
+  BOOST_REQUIRE(file);
+  BOOST_CHECK_EQUAL(file->is_complete(), true);
+  BOOST_CHECK_EQUAL(fileState.LookupFilesForHash(Buffer(1))->size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(FileCacheRollback)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  for (size_t budget : {0, 2048, 1 << 20}) {
+    FileStateWithFiles fileState(tmpdir);
+    fileState.SetFileCacheBudget(budget);
+    fileState.UpdateFile("a", 0, Buffer(1), Buffer(1), 1, 0, 0, 0, 0644, 1);
+    fileState.UpdateFile("b", 0, Buffer(1), Buffer(1), 2, 0, 0, 0, 0644, 1);
+
+    fileState.rollBack([&] {
+      fileState.UpdateFile("a", 1, Buffer(1), Buffer(1), 3, 0, 0, 0, 0644, 1);
+      fileState.SetFileComplete("a");
+      fileState.DeleteFile("b");
+      fileState.UpdateFile("c", 0, Buffer(1), Buffer(1), 4, 0, 0, 0, 0644, 1);
+    });
+
+    FileItemPtr file = fileState.LookupFile("a");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(file->version(), 0);
+    BOOST_CHECK_EQUAL(file->is_complete(), false);
+    BOOST_CHECK(fileState.LookupFile("b"));
+    BOOST_CHECK(!fileState.LookupFile("c"));
+    BOOST_CHECK_EQUAL(fileState.LookupFilesForHash(Buffer(1))->size(), 2);
+
+    remove_all(tmpdir);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentUpdates)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  FileStateWithFiles fileState(tmpdir);
+
+  // updates inside a transaction of the host database (as from ActionLog) and direct updates
+  // (as from Dispatcher) take the locks in the same order
+  std::future<void> host = std::async(std::launch::async, [&fileState] {
+      for (int i = 0; i < 500; i++) {
+        fileState.commit([&] {
+          fileState.UpdateFile("a", i, Buffer(1), Buffer(1), i, 0, 0, 0, 0644, 1);
+          fileState.LookupFile("a");
+        });
+      }
+    });
+  std::future<void> direct = std::async(std::launch::async, [&fileState] {
+      for (int i = 0; i < 500; i++) {
+        fileState.UpdateFile("b", i, Buffer(1), Buffer(1), i, 0, 0, 0, 0644, 1);
+        fileState.SetFileComplete("b");
+      }
+    });
+
+  BOOST_REQUIRE(host.wait_for(std::chrono::seconds(30)) == std::future_status::ready);
+  BOOST_REQUIRE(direct.wait_for(std::chrono::seconds(30)) == std::future_status::ready);
+  BOOST_CHECK_EQUAL(fileState.LookupFile("a")->version(), 499);
+  BOOST_CHECK_EQUAL(fileState.LookupFile("b")->is_complete(), true);
+
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(AddedColumns)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  // database that has only the first of the columns added after the initial schema
+  {
+    FileStateWithFiles fileState(tmpdir);
+    fileState.execute("ALTER TABLE FileState DROP COLUMN file_digest_segments");
+    fileState.execute("ALTER TABLE FileState DROP COLUMN file_manifest_hash");
+    fileState.execute("ALTER TABLE FileState DROP COLUMN file_chunked");
+  }
+
+  FileState fileState(tmpdir);
+  fileState.UpdateFile("a", 0, Buffer(1), Buffer(1), 1, 0, 0, 0, 0644, 1, 4096, true);
+  fileState.UpdateFile("b", 0, Buffer(1), Buffer(1), 2, 0, 0, 0, 0644, 1, 4096, false,
+                       make_shared<Buffer>(32), true);
+  fileState.SetFileCacheBudget(0);
+  FileItemPtr file = fileState.LookupFile("a");
+  BOOST_REQUIRE(file);
+  BOOST_CHECK_EQUAL(file->seg_size(), 4096);
+  BOOST_CHECK_EQUAL(file->chunked(), true);
+  BOOST_CHECK_EQUAL(file->has_manifest_hash(), false);
+  BOOST_CHECK_EQUAL(file->digest_segments(), false);
+
+  file = fileState.LookupFile("b");
+  BOOST_REQUIRE(file);
+  BOOST_CHECK_EQUAL(file->manifest_hash().size(), 32);
+  BOOST_CHECK_EQUAL(file->digest_segments(), true);
+
+  remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(FileCacheBenchmark, *boost::unit_test::disabled())
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  const int N_FILES = 100000;
+  const int N_NOTIFICATIONS = 100000;
+
+  FileStateWithFiles fileState(tmpdir);
+  fileState.insertFiles(N_FILES);
+
+  for (size_t budget : {size_t(0), FileState::FILE_CACHE_BUDGET}) {
+    fileState.SetFileCacheBudget(budget);
+
+    // a local change notification looks up the file and updates it if the content has changed
+    auto notify = [&] (int i, bool isChanged) {
+      std::string filename = "d" + std::to_string(i % 100) + "/s" + std::to_string(i / 100 % 100) +
+                             "/f" + std::to_string(i);
+      FileItemPtr file = fileState.LookupFile(filename);
+      BOOST_REQUIRE(file);
+      if (isChanged) {
+        fileState.UpdateFile(filename, file->version() + 1, Buffer(1), Buffer(1), i, 0, 0, 0,
+                             0644, 1);
+      }
+    };
+
+    for (bool isChanged : {false, true}) {
+      auto start = time::steady_clock::now();
+      for (int i = 0; i < N_NOTIFICATIONS; i++) {
+        notify(i * 7 % N_FILES, isChanged);
+      }
+      auto time = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+
+      BOOST_TEST_MESSAGE(N_FILES << " files, cache budget " << budget << ", "
+                         << (isChanged ? "changed" : "unchanged") << " files: "
+                         << static_cast<double>(time.count()) / N_NOTIFICATIONS
+                         << "us per notification");
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ReadConnectionBenchmark, *boost::unit_test::disabled())
+{
+  const int N_FILES = 20000;
+  const int N_READERS = 4;
+  const int N_QUERIES = 200;
+
+  DbHelper::StorageProfile defaultProfile = DbHelper::getDefaultStorageProfile();
+
+  for (size_t nConnections : {size_t(0), size_t(N_READERS)}) {
+    fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+    if (exists(tmpdir)) {
+      remove_all(tmpdir);
+    }
+
+    DbHelper::StorageProfile profile = defaultProfile;
+    profile.readConnections = nConnections;
+    DbHelper::setDefaultStorageProfile(profile);
+
+    FileStateWithFiles fileState(tmpdir);
+    fileState.insertFiles(N_FILES);
+
+    // browsing folders while local changes are written
+    std::atomic<bool> isDone(false);
+    int nWrites = 0;
+    std::thread writer([&] {
+      for (int i = 0; !isDone; i++, nWrites++) {
+        fileState.UpdateFile("d" + std::to_string(i % 100) + "/f" + std::to_string(i), i,
+                             Buffer(1), Buffer(1), i, 0, 0, 0, 0644, 1);
+      }
+    });
+
+    auto start = time::steady_clock::now();
+    std::vector<std::thread> readers;
+    for (int reader = 0; reader < N_READERS; reader++) {
+      readers.emplace_back([&fileState, reader] {
+        for (int i = 0; i < N_QUERIES; i++) {
+          size_t nFiles = 0;
+          fileState.LookupFilesInFolderRecursively([&nFiles] (const FileItem&) { ++nFiles; },
+                                                   "d" + std::to_string((i * N_READERS + reader) % 100));
+          BOOST_CHECK_GE(nFiles, N_FILES / 100);
+        }
+      });
+    }
+    for (auto& reader : readers) {
+      reader.join();
+    }
+    auto time = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+
+    isDone = true;
+    writer.join();
+
+    BOOST_TEST_MESSAGE(N_READERS << " readers, " << nConnections << " read-only connections: "
+                       << static_cast<double>(time.count()) / (N_READERS * N_QUERIES)
+                       << "us per folder query, " << nWrites << " concurrent writes");
+  }
+
+  DbHelper::setDefaultStorageProfile(defaultProfile);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
@@ -18,25 +18,166 @@
  * See AUTHORS.md for complete list of ChronoShare authors and contributors.
  */
 
-#include "logging.hpp"
 #include "object-manager.hpp"
+#include "object-db.hpp"
+#include "object-store.hpp"
 
-#include <boost/filesystem.hpp>
-#include <boost/filesystem/fstream.hpp>
+#include "test-common.hpp"
 
-#include <boost/make_shared.hpp>
-#include <boost/test/unit_test.hpp>
-#include <iostream>
-#include <iterator>
-#include <unistd.h>
+#include <ndn-cxx/util/digest.hpp>
+#include <ndn-cxx/util/string-helper.hpp>
 
-_LOG_INIT(Test.ObjectManager);
+#include <fcntl.h>
+#include <thread>
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
 
-using namespace Ndnx;
-using namespace std;
-using namespace boost;
 namespace fs = boost::filesystem;
 
+_LOG_INIT(Test.ObjectManager);
+
+typedef std::tuple<ConstBufferPtr, size_t, size_t, bool, ConstBufferPtr> Published;
+
+static void
+writeRandomFile(const fs::path& file, size_t size)
+{
+  fs::create_directories(file.parent_path());
+  fs::ofstream off(file, std::ios::out | std::ios::binary);
+  for (size_t i = 0; i < size; i++) {
+    off.put(static_cast<char>(rand()));
+  }
+}
+
+static bool
+filesEqual(const fs::path& file1, const fs::path& file2)
+{
+  if (fs::file_size(file1) != fs::file_size(file2)) {
+    return false;
+  }
+
+  fs::ifstream f1(file1, std::ios::in | std::ios::binary);
+  fs::ifstream f2(file2, std::ios::in | std::ios::binary);
+  return std::equal(std::istreambuf_iterator<char>(f1), std::istreambuf_iterator<char>(),
+                    std::istreambuf_iterator<char>(f2));
+}
+
+static std::string
+readFile(const fs::path& file)
+{
+  fs::ifstream iff(file, std::ios::in | std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(iff), std::istreambuf_iterator<char>());
+}
+
+static void
+writeFile(const fs::path& file, const std::string& content)
+{
+  fs::create_directories(file.parent_path());
+  fs::ofstream off(file, std::ios::out | std::ios::binary);
+  off.write(content.data(), content.size());
+}
+
+static uintmax_t
+packSize(const fs::path& folder)
+{
+  uintmax_t size = 0;
+  for (fs::directory_iterator file(folder / ".chronoshare" / "objects");
+       file != fs::directory_iterator(); ++file) {
+    if (file->path().filename().string().compare(0, 5, "pack-") == 0) {
+      size += fs::file_size(file->path());
+    }
+  }
+  return size;
+}
+
+static long
+millisecondsSince(const time::steady_clock::TimePoint& start)
+{
+  return time::duration_cast<time::milliseconds>(time::steady_clock::now() - start).count();
+}
+
+// what Dispatcher does (through FetchManager and ContentServer) to get the published file from
+// sender to receiver, returns number of bytes in fetched content objects
+static size_t
+transferFile(const fs::path& sender, const fs::path& receiver, ObjectManager& receiverManager,
+             const Name& deviceName, const Published& published)
+{
+  const Buffer& hash = *std::get<0>(published);
+  std::string hashStr = toHex(hash);
+  size_t bytes = 0;
+
+  if (!ObjectDb::DoesExist(receiver / ".chronoshare", deviceName, hashStr)) {
+    ObjectDb from(sender / ".chronoshare", hashStr);
+    ObjectDb to(receiver / ".chronoshare", hashStr);
+    for (size_t segment = 0; segment < std::get<1>(published); segment++) {
+      shared_ptr<Data> data = from.fetchSegment(deviceName, segment);
+      BOOST_REQUIRE(data != nullptr);
+      to.saveContentObject(deviceName, segment, *data);
+      bytes += data->wireEncode().size();
+    }
+  }
+
+  if (std::get<3>(published)) {
+    std::vector<ConstBufferPtr> missing;
+    BOOST_REQUIRE(
+      receiverManager.findMissingChunks(deviceName, hash, std::get<2>(published), missing));
+
+    ObjectStorePtr from = ObjectStore::open(sender / ".chronoshare");
+    ObjectStorePtr to = ObjectStore::open(receiver / ".chronoshare");
+    for (const auto& digest : missing) {
+      std::string digestStr = toHex(*digest);
+      ConstBufferPtr wire = from->fetchChunk(digestStr, deviceName);
+      BOOST_REQUIRE(wire != nullptr);
+      to->saveChunk(digestStr, deviceName, Block(wire));
+      bytes += wire->size();
+    }
+  }
+
+  return bytes;
+}
+
+// what Dispatcher does to get the new version of the file when its parent version is available:
+// fetch the manifest, reuse unchanged segments of the parent, and fetch the rest.  Returns number
+// of bytes in fetched content objects
+static size_t
+transferChangedSegments(const fs::path& sender, const fs::path& receiver,
+                        ObjectManager& receiverManager, const Name& deviceName,
+                        const Published& published, const Published& parent)
+{
+  const Buffer& hash = *std::get<0>(published);
+  const Buffer& manifestHash = *std::get<4>(published);
+  std::string hashStr = toHex(hash);
+  size_t bytes = 0;
+
+  {
+    ObjectDb from(sender / ".chronoshare", toHex(manifestHash));
+    ObjectDb to(receiver / ".chronoshare", toHex(manifestHash));
+    for (size_t segment = 0; segment < ObjectManager::manifestSegments(std::get<1>(published));
+         segment++) {
+      shared_ptr<Data> data = from.fetchSegment(deviceName, segment);
+      BOOST_REQUIRE(data != nullptr);
+      to.saveContentObject(deviceName, segment, *data);
+      bytes += data->wireEncode().size();
+    }
+  }
+
+  ObjectDb from(sender / ".chronoshare", hashStr);
+  ObjectDb to(receiver / ".chronoshare", hashStr);
+  std::vector<sqlite3_int64> missing;
+  BOOST_REQUIRE(receiverManager.reuseParentSegments(to, deviceName, hash, std::get<1>(published),
+                                                    manifestHash, deviceName,
+                                                    *std::get<0>(parent), missing));
+  for (sqlite3_int64 segment : missing) {
+    shared_ptr<Data> data = from.fetchSegment(deviceName, segment);
+    BOOST_REQUIRE(data != nullptr);
+    to.saveContentObject(deviceName, segment, *data);
+    bytes += data->wireEncode().size();
+  }
+
+  return bytes;
+}
+
 BOOST_AUTO_TEST_SUITE(TestObjectManager)
 
 BOOST_AUTO_TEST_CASE(ObjectManagerTest)
@@ -45,28 +186,617 @@ BOOST_AUTO_TEST_CASE(ObjectManagerTest)
   _LOG_DEBUG("tmpdir: " << tmpdir);
   Name deviceName("/device");
 
-  CcnxWrapperPtr ccnx = make_shared<CcnxWrapper>();
-  ObjectManager manager(ccnx, tmpdir, "test-chronoshare");
+  ObjectManager manager(tmpdir, "test-chronoshare");
 
-  tuple<HashPtr, int> hash_semgents =
-    manager.localFileToObjects(fs::path("test") / "test-object-manager.cc", deviceName);
+  writeRandomFile(tmpdir / "file", 2500);
+  Published hashSegments = manager.localFileToObjects(tmpdir / "file", deviceName);
 
-  BOOST_CHECK_EQUAL(hash_semgents.get<1>(), 3);
+  BOOST_CHECK_EQUAL(std::get<1>(hashSegments), 3);
+  BOOST_CHECK_EQUAL(std::get<2>(hashSegments), 1024);
 
-  bool ok = manager.objectsToLocalFile(deviceName, *hash_semgents.get<0>(), tmpdir / "test.cc");
+  {
+    ObjectDb db(tmpdir / ".chronoshare", toHex(*std::get<0>(hashSegments)));
+    shared_ptr<Data> data = db.fetchSegment(deviceName, 2);
+    BOOST_REQUIRE(data != nullptr);
+    BOOST_CHECK_EQUAL(data->getName(),
+                      Name(deviceName)
+                        .append("test-chronoshare")
+                        .append("file")
+                        .appendImplicitSha256Digest(std::get<0>(hashSegments))
+                        .appendNumber(2));
+    BOOST_CHECK_EQUAL(data->getContent().value_size(), 2500 - 2 * 1024);
+  }
+
+  bool ok = manager.objectsToLocalFile(deviceName, *std::get<0>(hashSegments), tmpdir / "test",
+                                       std::get<2>(hashSegments));
   BOOST_CHECK_EQUAL(ok, true);
+  BOOST_CHECK(filesEqual(tmpdir / "file", tmpdir / "test"));
+
+  // empty file has one empty segment
+  writeFile(tmpdir / "empty", "");
+  Published empty = manager.localFileToObjects(tmpdir / "empty", deviceName);
+  BOOST_CHECK_EQUAL(std::get<1>(empty), 1);
+  BOOST_CHECK(manager.objectsToLocalFile(deviceName, *std::get<0>(empty), tmpdir / "restored-empty",
+                                         std::get<2>(empty)));
+  BOOST_CHECK_EQUAL(fs::file_size(tmpdir / "restored-empty"), 0);
+
+  fs::remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(SegmentSize)
+{
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  Name deviceName("/device");
+
+  ObjectManager manager(tmpdir, "test-chronoshare");
+
+  BOOST_CHECK_EQUAL(manager.chooseSegmentSize(0), 1024);
+  BOOST_CHECK_EQUAL(manager.chooseSegmentSize(64 * 1024), 1024);
+  BOOST_CHECK_EQUAL(manager.chooseSegmentSize(64 * 1025), 2048);
+  BOOST_CHECK_EQUAL(manager.chooseSegmentSize(1024 * 1024 * 1024), ObjectManager::MAX_SEGMENT_SIZE);
+
+  writeRandomFile(tmpdir / "big", 200 * 1024 + 7);
+  Published hashSegments = manager.localFileToObjects(tmpdir / "big", deviceName);
+  BOOST_CHECK_EQUAL(std::get<2>(hashSegments), 4096);
+  BOOST_CHECK_EQUAL(std::get<1>(hashSegments), 51);
+
+  BOOST_CHECK(manager.objectsToLocalFile(deviceName, *std::get<0>(hashSegments),
+                                         tmpdir / "restored", std::get<2>(hashSegments)));
+  BOOST_CHECK(filesEqual(tmpdir / "big", tmpdir / "restored"));
+
+  // the same file is not published again
+  Published same = manager.localFileToObjects(tmpdir / "big", deviceName,
+                                              std::get<0>(hashSegments).get());
+  BOOST_CHECK(*std::get<0>(same) == *std::get<0>(hashSegments));
+  BOOST_CHECK_EQUAL(std::get<1>(same), 0);
+
+  // segments do not match the size recorded in the action
+  BOOST_CHECK(!manager.objectsToLocalFile(deviceName, *std::get<0>(hashSegments), tmpdir / "wrong",
+                                          1024));
+  BOOST_CHECK(!fs::exists(tmpdir / "wrong"));
+
+  // fixed segment size
+  manager.setSegmentSizeLimits(1024, 1024);
+  BOOST_CHECK_EQUAL(manager.chooseSegmentSize(1024 * 1024 * 1024), 1024);
+  BOOST_CHECK_THROW(manager.setSegmentSizeLimits(2048, 1024), ObjectManager::Error);
+
+  fs::remove_all(tmpdir);
+}
+
+// Benchmarks are disabled by default, run them explicitly, e.g.,
+//   ./build/unit-tests -t TestObjectManager/SegmentSizeBenchmark
+BOOST_AUTO_TEST_CASE(SegmentSizeBenchmark, *boost::unit_test::disabled())
+{
+  const size_t FILE_SIZE = 8 * 1024 * 1024;
+  const size_t SEGMENT_SIZES[] = {1024, 2048, 4096, ObjectManager::MAX_SEGMENT_SIZE};
+  Name deviceName("/device");
+
+  for (size_t segmentSize : SEGMENT_SIZES) {
+    fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+    writeRandomFile(tmpdir / "file", FILE_SIZE);
+
+    ObjectManager manager(tmpdir, "test-chronoshare");
+    manager.setSegmentSizeLimits(segmentSize, segmentSize);
+
+    auto start = time::steady_clock::now();
+    Published hashSegments = manager.localFileToObjects(tmpdir / "file", deviceName);
+    long chunkTime = millisecondsSince(start);
+
+    // what ContentServer does for every Interest
+    start = time::steady_clock::now();
+    {
+      ObjectDb db(tmpdir / ".chronoshare", toHex(*std::get<0>(hashSegments)));
+      for (size_t segment = 0; segment < std::get<1>(hashSegments); segment++) {
+        BOOST_REQUIRE(db.fetchSegment(deviceName, segment) != nullptr);
+      }
+    }
+    long serveTime = millisecondsSince(start);
+
+    // the last step of fetching, after all segments have been received
+    start = time::steady_clock::now();
+    BOOST_CHECK(manager.objectsToLocalFile(deviceName, *std::get<0>(hashSegments),
+                                           tmpdir / "restored", std::get<2>(hashSegments)));
+    long assembleTime = millisecondsSince(start);
+
+    BOOST_CHECK(filesEqual(tmpdir / "file", tmpdir / "restored"));
+    BOOST_TEST_MESSAGE(FILE_SIZE / 1024 << " KiB file, segment size " << segmentSize << ": "
+                       << std::get<1>(hashSegments) << " segments (Interests to fetch), chunk "
+                       << chunkTime << "ms, serve " << serveTime << "ms, assemble "
+                       << assembleTime << "ms");
+
+    fs::remove_all(tmpdir);
+  }
+}
+
+// write the file to disk and evict it from the page cache
+static void
+dropFromCache(const fs::path& file)
+{
+  int fd = ::open(file.c_str(), O_RDONLY);
+  BOOST_REQUIRE(fd >= 0);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+BOOST_AUTO_TEST_CASE(PublishThroughputBenchmark, *boost::unit_test::disabled())
+{
+  // the first file is read once, the second one is bigger than MAX_BUFFERED_FILE_SIZE and is
+  // read again to cut the segments
+  const size_t FILE_SIZES[] = {16 * 1024 * 1024, 64 * 1024 * 1024};
+  Name deviceName("/device");
+
+  for (size_t fileSize : FILE_SIZES) {
+    fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+    writeRandomFile(tmpdir / "file", fileSize);
+    double megabytes = fileSize / 1024.0 / 1024.0;
+
+    dropFromCache(tmpdir / "file");
+    auto start = time::steady_clock::now();
+    ConstBufferPtr hash;
+    {
+      fs::ifstream iff(tmpdir / "file", std::ios::in | std::ios::binary);
+      util::Sha256 digest(iff);
+      hash = digest.computeDigest();
+    }
+    long hashTime = millisecondsSince(start);
+    BOOST_TEST_MESSAGE(fileSize / 1024 / 1024 << " MiB file, hashing only: "
+                       << megabytes * 1000 / std::max<long>(hashTime, 1) << " MiB/s (cold cache)");
+
+    for (int chunking = 0; chunking < 2; chunking++) {
+      for (int cold = 1; cold >= 0; cold--) {
+        fs::path folder = tmpdir / std::to_string(chunking * 2 + cold);
+        ObjectManager manager(folder, "test-chronoshare");
+        manager.setContentDefinedChunking(chunking != 0);
+
+        if (cold) {
+          dropFromCache(tmpdir / "file");
+        }
+        start = time::steady_clock::now();
+        Published published = manager.localFileToObjects(tmpdir / "file", deviceName);
+        long publishTime = millisecondsSince(start);
+
+        BOOST_CHECK(*std::get<0>(published) == *hash);
+        BOOST_CHECK(manager.objectsToLocalFile(deviceName, *std::get<0>(published),
+                                               folder / "restored", std::get<2>(published),
+                                               std::get<3>(published)));
+        BOOST_CHECK(filesEqual(tmpdir / "file", folder / "restored"));
+
+        BOOST_TEST_MESSAGE(fileSize / 1024 / 1024 << " MiB file, "
+                           << (chunking ? "chunked" : "fixed segments") << ", "
+                           << (cold ? "cold" : "warm") << " cache: published "
+                           << std::get<1>(published) << " segments at "
+                           << megabytes * 1000 / std::max<long>(publishTime, 1) << " MiB/s");
+      }
+    }
+
+    fs::remove_all(tmpdir);
+  }
+}
 
+BOOST_AUTO_TEST_CASE(SigningThreadsBenchmark, *boost::unit_test::disabled())
+{
+  const size_t FILE_SIZE = 2 * 1024 * 1024;
+  const size_t THREADS[] = {1, 2, 4, 8};
+  Name deviceName("/device");
+
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  writeRandomFile(tmpdir / "file", FILE_SIZE);
+
+  for (size_t nThreads : THREADS) {
+    fs::path folder = tmpdir / std::to_string(nThreads);
+    ObjectManager manager(folder, "test-chronoshare");
+    // one signature per KiB
+    manager.setSegmentSizeLimits(1024, 1024);
+    manager.setSigningThreads(nThreads);
+
+    auto start = time::steady_clock::now();
+    Published published = manager.localFileToObjects(tmpdir / "file", deviceName);
+    long publishTime = millisecondsSince(start);
+
+    // segments are saved in order, whatever thread signed them
+    BOOST_CHECK(manager.objectsToLocalFile(deviceName, *std::get<0>(published),
+                                           folder / "restored", std::get<2>(published)));
+    BOOST_CHECK(filesEqual(tmpdir / "file", folder / "restored"));
+
+    size_t signatures = std::get<1>(published);
+    BOOST_TEST_MESSAGE(nThreads << " signing threads (" << std::thread::hardware_concurrency()
+                       << " cores): " << signatures << " signatures at "
+                       << signatures * 1000 / std::max<long>(publishTime, 1) << " per second");
+  }
+
+  fs::remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(ReuseParentSegments)
+{
+  fs::path sender = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  fs::path receiver = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  Name deviceName("/device");
+
+  ObjectManager manager(sender, "test-chronoshare");
+  ObjectManager receiverManager(receiver, "test-chronoshare");
+
+  // no manifest for signed segments, they cannot be rebuilt by the receiver
+  writeRandomFile(sender / "signed", 100000);
+  Published signedFile = manager.localFileToObjects(sender / "signed", deviceName);
+  BOOST_CHECK_GT(std::get<1>(signedFile), 1);
+  BOOST_CHECK(std::get<4>(signedFile) == nullptr);
+
+  manager.setDigestSegments(true);
+  writeRandomFile(sender / "v1", 1024 * 1024);
+  Published v1 = manager.localFileToObjects(sender / "v1", deviceName);
+  BOOST_REQUIRE(std::get<4>(v1) != nullptr);
+  BOOST_CHECK_EQUAL(std::get<2>(v1), ObjectManager::MAX_SEGMENT_SIZE);
+  BOOST_CHECK_EQUAL(ObjectManager::manifestSegments(std::get<1>(v1)), 1);
+  BOOST_CHECK_GT(transferFile(sender, receiver, receiverManager, deviceName, v1), 1024 * 1024);
+
+  // append: only the last segment of the parent and the new segments are fetched
+  std::string content = readFile(sender / "v1");
+  content.append(20000, 'a');
+  writeFile(sender / "v2", content);
+  Published v2 = manager.localFileToObjects(sender / "v2", deviceName);
+
+  size_t bytes = transferChangedSegments(sender, receiver, receiverManager, deviceName, v2, v1);
+  BOOST_CHECK_LT(bytes, 4 * ObjectManager::MAX_SEGMENT_SIZE + 4096);
+  BOOST_CHECK(receiverManager.objectsToLocalFile(deviceName, *std::get<0>(v2), receiver / "v2",
+                                                 std::get<2>(v2)));
+  BOOST_CHECK(filesEqual(sender / "v2", receiver / "v2"));
+
+  // reused segments are the packets served by the publisher, not signed by the receiver
   {
-    fs::ifstream origFile(fs::path("test") / "test-object-manager.cc");
-    fs::ifstream newFile(tmpdir / "test.cc");
+    ObjectDb from(sender / ".chronoshare", toHex(*std::get<0>(v2)));
+    ObjectDb to(receiver / ".chronoshare", toHex(*std::get<0>(v2)));
+    for (size_t segment = 0; segment < std::get<1>(v2); segment++) {
+      shared_ptr<Data> published = from.fetchSegment(deviceName, segment);
+      shared_ptr<Data> reused = to.fetchSegment(deviceName, segment);
+      BOOST_REQUIRE(published != nullptr && reused != nullptr);
+      BOOST_CHECK_EQUAL(reused->getSignature().getType(), tlv::DigestSha256);
+      BOOST_CHECK(reused->wireEncode() == published->wireEncode());
+    }
+  }
 
-    istream_iterator<char> eof, origFileI(origFile), newFileI(newFile);
+  // edit in the middle
+  content.replace(500000, 100, std::string(100, 'x'));
+  writeFile(sender / "v3", content);
+  Published v3 = manager.localFileToObjects(sender / "v3", deviceName);
 
-    BOOST_CHECK_EQUAL_COLLECTIONS(origFileI, eof, newFileI, eof);
+  bytes = transferChangedSegments(sender, receiver, receiverManager, deviceName, v3, v2);
+  BOOST_CHECK_LT(bytes, 2 * ObjectManager::MAX_SEGMENT_SIZE + 4096);
+  BOOST_CHECK(receiverManager.objectsToLocalFile(deviceName, *std::get<0>(v3), receiver / "v3",
+                                                 std::get<2>(v3)));
+  BOOST_CHECK(filesEqual(sender / "v3", receiver / "v3"));
+
+  // manifest must have a digest for every segment
+  {
+    ObjectDb db(receiver / ".chronoshare", toHex(*std::get<0>(v3)));
+    std::vector<sqlite3_int64> missing;
+    BOOST_CHECK(!receiverManager.reuseParentSegments(db, deviceName, *std::get<0>(v3),
+                                                     std::get<1>(v3), *std::get<4>(v1),
+                                                     deviceName, *std::get<0>(v2), missing));
   }
 
-  remove_all(tmpdir);
+  fs::remove_all(sender);
+  fs::remove_all(receiver);
 }
 
+// Transfer of the new versions of a large file with and without reusing segments of the parent
+// version
+BOOST_AUTO_TEST_CASE(DeltaSyncBenchmark, *boost::unit_test::disabled())
+{
+  const size_t FILE_SIZE = 16 * 1024 * 1024;
+  const int VERSIONS = 10;
+  const char* EDITS[] = {"append 64 KiB", "overwrite 100 bytes", "insert 100 bytes"};
+  Name deviceName("/device");
+
+  for (int edit = 0; edit < 3; edit++) {
+    srand(1);
+    fs::path sender = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+    fs::path fullReceiver = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+    fs::path deltaReceiver = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+
+    ObjectManager manager(sender, "test-chronoshare");
+    ObjectManager fullManager(fullReceiver, "test-chronoshare");
+    ObjectManager deltaManager(deltaReceiver, "test-chronoshare");
+    // only digest segments can be reused
+    manager.setDigestSegments(true);
+
+    writeRandomFile(sender / "file", FILE_SIZE);
+    std::string content = readFile(sender / "file");
+    Published parent = manager.localFileToObjects(sender / "file", deviceName);
+    transferFile(sender, fullReceiver, fullManager, deviceName, parent);
+    transferFile(sender, deltaReceiver, deltaManager, deviceName, parent);
+
+    size_t fullBytes = 0;
+    size_t deltaBytes = 0;
+    for (int version = 1; version <= VERSIONS; version++) {
+      size_t pos = rand() % content.size();
+      switch (edit) {
+      case 0:
+        content.append(64 * 1024, 'a');
+        break;
+      case 1:
+        content.replace(pos, 100, std::string(100, 'o'));
+        break;
+      default:
+        content.insert(pos, std::string(100, 'i'));
+        break;
+      }
+      writeFile(sender / "file", content);
+
+      Published published = manager.localFileToObjects(sender / "file", deviceName);
+      fullBytes += transferFile(sender, fullReceiver, fullManager, deviceName, published);
+      deltaBytes += transferChangedSegments(sender, deltaReceiver, deltaManager, deviceName,
+                                            published, parent);
+
+      BOOST_CHECK(deltaManager.objectsToLocalFile(deviceName, *std::get<0>(published),
+                                                  deltaReceiver / "file", std::get<2>(published)));
+      parent = published;
+    }
+    BOOST_CHECK(filesEqual(sender / "file", deltaReceiver / "file"));
+
+    BOOST_TEST_MESSAGE(VERSIONS << " versions of a " << FILE_SIZE / 1024 / 1024 << " MiB file, "
+                       << EDITS[edit] << " each: transferred " << fullBytes / 1024
+                       << " KiB fetching all segments, " << deltaBytes / 1024
+                       << " KiB fetching only changed segments and manifests");
+
+    fs::remove_all(sender);
+    fs::remove_all(fullReceiver);
+    fs::remove_all(deltaReceiver);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ContentDefinedChunking)
+{
+  fs::path sender = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  fs::path receiver = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  Name deviceName("/device");
+
+  ObjectManager manager(sender, "test-chronoshare");
+  ObjectManager receiverManager(receiver, "test-chronoshare");
+  manager.setContentDefinedChunking(true);
+
+  // files that fit into one chunk are not chunked
+  writeRandomFile(sender / "small", 1000);
+  Published small = manager.localFileToObjects(sender / "small", deviceName);
+  BOOST_CHECK_EQUAL(std::get<3>(small), false);
+
+  writeRandomFile(sender / "v1", 512 * 1024);
+  Published v1 = manager.localFileToObjects(sender / "v1", deviceName);
+  BOOST_CHECK_EQUAL(std::get<3>(v1), true);
+  BOOST_CHECK(manager.objectsToLocalFile(deviceName, *std::get<0>(v1), sender / "restored-v1",
+                                         std::get<2>(v1), true));
+  BOOST_CHECK(filesEqual(sender / "v1", sender / "restored-v1"));
+
+  // one byte inserted near the beginning: only chunks around the edit are stored again
+  std::string content = readFile(sender / "v1");
+  content.insert(10, 1, 'x');
+  writeFile(sender / "v2", content);
+
+  uintmax_t sizeBefore = packSize(sender);
+  Published v2 = manager.localFileToObjects(sender / "v2", deviceName);
+  BOOST_CHECK_LT(packSize(sender) - sizeBefore, 32 * 1024);
+  BOOST_CHECK(manager.objectsToLocalFile(deviceName, *std::get<0>(v2), sender / "restored-v2",
+                                         std::get<2>(v2), true));
+  BOOST_CHECK(filesEqual(sender / "v2", sender / "restored-v2"));
+
+  // receiver gets all chunks of the first version, and only new chunks of the second one
+  std::vector<ConstBufferPtr> missing;
+  BOOST_CHECK(!receiverManager.findMissingChunks(deviceName, *std::get<0>(v1), std::get<2>(v1),
+                                                 missing));
+
+  size_t bytes = transferFile(sender, receiver, receiverManager, deviceName, v1);
+  BOOST_CHECK_GT(bytes, 512 * 1024);
+  BOOST_CHECK(receiverManager.objectsToLocalFile(deviceName, *std::get<0>(v1), receiver / "v1",
+                                                 std::get<2>(v1), true));
+  BOOST_CHECK(filesEqual(sender / "v1", receiver / "v1"));
+
+  bytes = transferFile(sender, receiver, receiverManager, deviceName, v2);
+  BOOST_CHECK_LT(bytes, 32 * 1024);
+  BOOST_CHECK(receiverManager.objectsToLocalFile(deviceName, *std::get<0>(v2), receiver / "v2",
+                                                 std::get<2>(v2), true));
+  BOOST_CHECK(filesEqual(sender / "v2", receiver / "v2"));
+
+  fs::remove_all(sender);
+  fs::remove_all(receiver);
+}
+
+// Text document edited by a mix of small inserts, deletes, overwrites and appends (the kind of
+// changes made by editors and logs), published after every edit
+BOOST_AUTO_TEST_CASE(EditTraceBenchmark, *boost::unit_test::disabled())
+{
+  const size_t DOCUMENT_SIZE = 4 * 1024 * 1024;
+  const int EDITS = 50;
+  const char* WORDS[] = {"the", "file", "is", "shared", "over", "named", "data", "network",
+                         "and", "every", "device", "keeps", "a", "copy", "of", "folder"};
+  const int WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+  Name deviceName("/device");
+
+  for (int chunked = 0; chunked <= 1; chunked++) {
+    srand(1);
+    std::string document;
+    while (document.size() < DOCUMENT_SIZE) {
+      document += WORDS[rand() % WORD_COUNT];
+      document += (rand() % 12 == 0) ? '\n' : ' ';
+    }
+
+    fs::path sender = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+    fs::path receiver = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+
+    ObjectManager manager(sender, "test-chronoshare");
+    ObjectManager receiverManager(receiver, "test-chronoshare");
+    manager.setContentDefinedChunking(chunked != 0);
+
+    uintmax_t logicalBytes = 0;
+    size_t initialBytes = 0;
+    size_t editBytes = 0;
+    long publishTime = 0;
+
+    for (int version = 0; version <= EDITS; version++) {
+      if (version > 0) {
+        size_t pos = rand() % document.size();
+        switch (rand() % 4) {
+        case 0:
+          document.insert(pos, std::string(1 + rand() % 200, 'i'));
+          break;
+        case 1:
+          document.erase(pos, 1 + rand() % 500);
+          break;
+        case 2:
+          document.replace(pos, 10, std::string(10, 'o'));
+          break;
+        default:
+          document.append(std::string(1000 + rand() % 5000, 'a'));
+          break;
+        }
+      }
+      writeFile(sender / "document.txt", document);
+      logicalBytes += document.size();
+
+      auto start = time::steady_clock::now();
+      Published published = manager.localFileToObjects(sender / "document.txt", deviceName);
+      publishTime += millisecondsSince(start);
+
+      size_t bytes = transferFile(sender, receiver, receiverManager, deviceName, published);
+      (version == 0 ? initialBytes : editBytes) += bytes;
+
+      BOOST_CHECK(receiverManager.objectsToLocalFile(deviceName, *std::get<0>(published),
+                                                     receiver / "document.txt",
+                                                     std::get<2>(published),
+                                                     std::get<3>(published)));
+    }
+    BOOST_CHECK(filesEqual(sender / "document.txt", receiver / "document.txt"));
+
+    uintmax_t storedBytes = packSize(sender);
+    BOOST_TEST_MESSAGE((chunked ? "content-defined chunks" : "fixed segments")
+                       << ": " << EDITS << " edits of a " << DOCUMENT_SIZE / 1024
+                       << " KiB document, stored " << storedBytes / 1024 << " KiB for "
+                       << logicalBytes / 1024 << " KiB of versions (dedup ratio "
+                       << static_cast<double>(logicalBytes) / storedBytes << "), transferred "
+                       << initialBytes / 1024 << " KiB for the first version and "
+                       << editBytes / 1024 << " KiB for the edits, publish "
+                       << publishTime << "ms");
+
+    fs::remove_all(sender);
+    fs::remove_all(receiver);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(DigestSegments)
+{
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  Name deviceName("/device");
+
+  ObjectManager manager(tmpdir, "test-chronoshare");
+  manager.setSegmentSizeLimits(1024, 1024);
+  manager.setDigestSegments(true);
+  writeRandomFile(tmpdir / "file", 10000);
+  Published published = manager.localFileToObjects(tmpdir / "file", deviceName);
+  BOOST_REQUIRE_EQUAL(std::get<1>(published), 10);
+  BOOST_REQUIRE(std::get<4>(published) != nullptr);
+
+  // file segments carry only a digest, the manifest is signed by the publisher
+  ObjectDb db(tmpdir / ".chronoshare", toHex(*std::get<0>(published)));
+  for (size_t segment = 0; segment < std::get<1>(published); segment++) {
+    shared_ptr<Data> data = db.fetchSegment(deviceName, segment);
+    BOOST_REQUIRE(data != nullptr);
+    BOOST_CHECK_EQUAL(data->getSignature().getType(), tlv::DigestSha256);
+  }
+  ObjectDb manifestDb(tmpdir / ".chronoshare", toHex(*std::get<4>(published)));
+  shared_ptr<Data> manifest = manifestDb.fetchSegment(deviceName, 0);
+  BOOST_REQUIRE(manifest != nullptr);
+  BOOST_CHECK_NE(manifest->getSignature().getType(), tlv::DigestSha256);
+
+  std::string digests;
+  BOOST_REQUIRE(manager.readManifest(deviceName, *std::get<4>(published), std::get<1>(published),
+                                     digests));
+  for (size_t segment = 0; segment < std::get<1>(published); segment++) {
+    BOOST_CHECK(ObjectManager::matchesManifest(digests, segment,
+                                               db.fetchSegment(deviceName, segment)->getContent()));
+  }
+  shared_ptr<Data> first = db.fetchSegment(deviceName, 0);
+  BOOST_CHECK(!ObjectManager::matchesManifest(digests, 1, first->getContent()));
+  BOOST_CHECK(!ObjectManager::matchesManifest(digests, std::get<1>(published),
+                                              first->getContent()));
+
+  // manifest of another file does not match
+  BOOST_CHECK(!manager.readManifest(deviceName, *std::get<0>(published), std::get<1>(published),
+                                    digests));
+
+  fs::remove_all(tmpdir);
+}
+
+// Publishing with a signature on every 1 KiB segment and with digest segments verified by a
+// signed manifest
+BOOST_AUTO_TEST_CASE(DigestSegmentsBenchmark, *boost::unit_test::disabled())
+{
+  const size_t FILE_SIZE = 2 * 1024 * 1024;
+  Name deviceName("/device");
+
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  writeRandomFile(tmpdir / "file", FILE_SIZE);
+
+  for (int digestSegments = 0; digestSegments <= 1; digestSegments++) {
+    fs::path sender = tmpdir / (digestSegments ? "digest" : "signed");
+    fs::path receiver = tmpdir / (digestSegments ? "digest-receiver" : "signed-receiver");
+    ObjectManager manager(sender, "test-chronoshare");
+    ObjectManager receiverManager(receiver, "test-chronoshare");
+    manager.setSegmentSizeLimits(1024, 1024);
+    manager.setDigestSegments(digestSegments != 0);
+
+    auto start = time::steady_clock::now();
+    Published published = manager.localFileToObjects(tmpdir / "file", deviceName);
+    long publishTime = millisecondsSince(start);
+    BOOST_REQUIRE_EQUAL(std::get<4>(published) != nullptr, digestSegments != 0);
+
+    transferFile(sender, receiver, receiverManager, deviceName, published);
+    BOOST_CHECK(receiverManager.objectsToLocalFile(deviceName, *std::get<0>(published),
+                                                   receiver / "file", std::get<2>(published)));
+    BOOST_CHECK(filesEqual(tmpdir / "file", receiver / "file"));
+
+    if (digestSegments) {
+      // receiver verifies every segment against the manifest
+      {
+        std::string manifestHashStr = toHex(*std::get<4>(published));
+        ObjectDb manifestFrom(sender / ".chronoshare", manifestHashStr);
+        ObjectDb manifestTo(receiver / ".chronoshare", manifestHashStr);
+        for (size_t segment = 0;
+             segment < ObjectManager::manifestSegments(std::get<1>(published)); segment++) {
+          manifestTo.saveContentObject(deviceName, segment,
+                                       *manifestFrom.fetchSegment(deviceName, segment));
+        }
+      }
+
+      std::string digests;
+      BOOST_REQUIRE(receiverManager.readManifest(deviceName, *std::get<4>(published),
+                                                 std::get<1>(published), digests));
+      ObjectDb db(receiver / ".chronoshare", toHex(*std::get<0>(published)));
+      for (size_t segment = 0; segment < std::get<1>(published); segment++) {
+        shared_ptr<Data> data = db.fetchSegment(deviceName, segment);
+        BOOST_REQUIRE(data != nullptr);
+        BOOST_CHECK(ObjectManager::matchesManifest(digests, segment, data->getContent()));
+      }
+
+      shared_ptr<Data> first = db.fetchSegment(deviceName, 0);
+      Buffer corrupt(first->getContent().value_begin(), first->getContent().value_end());
+      corrupt[0] ^= 1;
+      Block corruptContent = makeBinaryBlock(tlv::Content, corrupt.data(), corrupt.size());
+      BOOST_CHECK(!ObjectManager::matchesManifest(digests, 0, corruptContent));
+      BOOST_CHECK(!ObjectManager::matchesManifest(digests, std::get<1>(published),
+                                                  corruptContent));
+    }
+
+    BOOST_TEST_MESSAGE((digestSegments ? "digest segments" : "signed segments")
+                       << ": published " << std::get<1>(published) << " segments of a "
+                       << FILE_SIZE / 1024 << " KiB file in " << publishTime << "ms, stored "
+                       << packSize(sender) / 1024 << " KiB");
+  }
+
+  fs::remove_all(tmpdir);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,343 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "object-db.hpp"
+#include "object-store.hpp"
+
+#include "test-common.hpp"
+
+#include <ndn-cxx/util/digest.hpp>
+#include <ndn-cxx/util/string-helper.hpp>
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+namespace fs = boost::filesystem;
+
+_LOG_INIT(Test.ObjectStore);
+
+static shared_ptr<Data>
+makeSegment(const Name& deviceName, sqlite3_int64 segment, size_t size, uint8_t fill)
+{
+  shared_ptr<Data> data = makeData(Name(deviceName).appendSegment(segment));
+  std::vector<uint8_t> content(size, fill);
+  data->setContent(content.data(), content.size());
+  return signData(data);
+}
+
+BOOST_AUTO_TEST_SUITE(TestObjectStore)
+
+BOOST_AUTO_TEST_CASE(SaveAndFetch)
+{
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  Name deviceName("/device");
+  std::string hash = "2ff304769cdb0125ac039e6fe7575f8576dceffc62618a431715aaf6eea2bf1c";
+
+  {
+    ObjectDb db(tmpdir, hash);
+    for (int i = 0; i < 2000; i++) {
+      db.saveContentObject(deviceName, i, *makeSegment(deviceName, i, 100 + i % 7, i));
+    }
+
+    // not visible until the handle is closed
+    BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, deviceName, hash), false);
+  }
+  BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, deviceName, hash), true);
+  BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, Name("/other-device"), hash), false);
+
+  ObjectDb db(tmpdir, hash);
+  for (int i = 0; i < 2000; i++) {
+    shared_ptr<Data> segment = db.fetchSegment(deviceName, i);
+    BOOST_REQUIRE(segment != nullptr);
+    BOOST_CHECK_EQUAL(segment->getName(), Name(deviceName).appendSegment(i));
+    BOOST_CHECK_EQUAL(segment->getContent().value_size(), 100 + i % 7);
+    BOOST_CHECK_EQUAL(segment->getContent().value()[0], static_cast<uint8_t>(i));
+  }
+  BOOST_CHECK(db.fetchSegment(deviceName, 2000) == nullptr);
+
+  fs::remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(CompletenessPerDevice)
+{
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  Name device1("/device1");
+  Name device2("/device2");
+  std::string hash = "2ff304769cdb0125ac039e6fe7575f8576dceffc62618a431715aaf6eea2bf1c";
+
+  ObjectStorePtr store = ObjectStore::open(tmpdir);
+  BOOST_CHECK(store == ObjectStore::open(tmpdir));
+
+  // partial fetch of the same file from another device is left in place
+  store->saveContentObject(hash, device2, 0, makeSegment(device2, 0, 10, 'b')->wireEncode());
+
+  {
+    ObjectDb db(tmpdir, hash);
+    db.saveContentObject(device1, 0, *makeSegment(device1, 0, 10, 'a'));
+    db.saveContentObject(device1, 1, *makeSegment(device1, 1, 10, 'a'));
+  }
+  BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, device1, hash), true);
+  BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, device2, hash), false);
+
+  // segments have to be contiguous from 0
+  store->saveContentObject(hash, device2, 2, makeSegment(device2, 2, 10, 'b')->wireEncode());
+  store->markComplete(hash, device2);
+  BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, device2, hash), false);
+
+  store->saveContentObject(hash, device2, 1, makeSegment(device2, 1, 10, 'b')->wireEncode());
+  store->markComplete(hash, device2);
+  BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, device2, hash), true);
+
+  fs::remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(MigrateObjectDb)
+{
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  fs::create_directories(tmpdir / "objects" / "ab");
+
+  // database in the format of the previous ObjectDb version
+  sqlite3* db;
+  sqlite3_open((tmpdir / "objects" / "ab" / "cdef").c_str(), &db);
+  sqlite3_exec(db, "CREATE TABLE File (device_name BLOB, segment INTEGER, content_object BLOB);",
+               0, 0, 0);
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO File VALUES (?, ?, ?)", -1, &stmt, 0);
+  Block deviceName = Name("/device").wireEncode();
+  Block segment = makeSegment(Name("/device"), 0, 3, 'a')->wireEncode();
+  sqlite3_bind_blob(stmt, 1, deviceName.wire(), deviceName.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, 0);
+  sqlite3_bind_blob(stmt, 3, segment.wire(), segment.size(), SQLITE_STATIC);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  BOOST_CHECK_EQUAL(ObjectDb::DoesExist(tmpdir, Name("/device"), "abcdef"), true);
+  BOOST_CHECK_EQUAL(fs::exists(tmpdir / "objects" / "ab"), false);
+
+  shared_ptr<Data> data = ObjectDb(tmpdir, "abcdef").fetchSegment(Name("/device"), 0);
+  BOOST_REQUIRE(data != nullptr);
+  BOOST_CHECK(data->wireEncode() == segment);
+
+  fs::remove_all(tmpdir);
+}
+
+BOOST_AUTO_TEST_CASE(Chunks)
+{
+  fs::path tmpdir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  Name deviceName("/device");
+  std::string digest = "2ff304769cdb0125ac039e6fe7575f8576dceffc62618a431715aaf6eea2bf1c";
+
+  {
+    ObjectStorePtr store = ObjectStore::open(tmpdir);
+    BOOST_CHECK_EQUAL(store->doesChunkExist(digest), false);
+
+    // chunks are complete when saved
+    Block chunk = makeSegment(deviceName, 0, 4000, 'c')->wireEncode();
+    store->saveChunk(digest, deviceName, chunk);
+    BOOST_CHECK_EQUAL(store->doesChunkExist(digest, deviceName), true);
+    BOOST_CHECK_EQUAL(store->doesChunkExist(digest, Name("/other-device")), false);
+    BOOST_CHECK_EQUAL(store->doesChunkExist(digest), true);
+
+    // chunk is stored only once per device
+    store->saveChunk(digest, deviceName, chunk);
+    store->flush();
+    BOOST_CHECK_LT(fs::file_size(tmpdir / "objects" / "pack-0"), 8000);
+
+    // chunks do not clash with segments of a file with the same hash
+    ObjectDb(tmpdir, digest).saveContentObject(deviceName, 0, *makeSegment(deviceName, 0, 10, 's'));
+  }
+
+  ObjectStorePtr store = ObjectStore::open(tmpdir);
+  ConstBufferPtr chunk = store->fetchChunk(digest);
+  BOOST_REQUIRE(chunk != nullptr);
+  BOOST_CHECK_EQUAL(Data(Block(chunk)).getContent().value_size(), 4000);
+  BOOST_CHECK(store->fetchChunk(digest, deviceName) != nullptr);
+  BOOST_CHECK(store->fetchChunk(digest, Name("/other-device")) == nullptr);
+
+  shared_ptr<Data> segment = ObjectDb(tmpdir, digest).fetchSegment(deviceName, 0);
+  BOOST_REQUIRE(segment != nullptr);
+  BOOST_CHECK_EQUAL(segment->getContent().value_size(), 10);
+
+  fs::remove_all(tmpdir);
+}
+
+/**
+ * @brief Per-file database in the format of the previous ObjectDb version
+ *
+ * Saves are done in one transaction per file, as the previous ObjectDb did between
+ * willStartSave and didStopSave.
+ */
+class PerFileObjectDb : boost::noncopyable
+{
+public:
+  PerFileObjectDb(const fs::path& folder, const std::string& hash)
+  {
+    fs::path dir = folder / "objects" / hash.substr(0, 2);
+    fs::create_directories(dir);
+    sqlite3_open((dir / hash.substr(2)).c_str(), &m_db);
+    sqlite3_exec(m_db, "CREATE TABLE IF NOT EXISTS File (device_name BLOB NOT NULL, "
+                       "  segment INTEGER, content_object BLOB, "
+                       "  PRIMARY KEY (device_name, segment));"
+                       "BEGIN TRANSACTION;", 0, 0, 0);
+  }
+
+  ~PerFileObjectDb()
+  {
+    sqlite3_exec(m_db, "END TRANSACTION", 0, 0, 0);
+    sqlite3_close(m_db);
+  }
+
+  void
+  save(const Block& deviceName, sqlite3_int64 segment, const Block& data)
+  {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(m_db, "INSERT INTO File VALUES (?, ?, ?)", -1, &stmt, 0);
+    sqlite3_bind_blob(stmt, 1, deviceName.wire(), deviceName.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, segment);
+    sqlite3_bind_blob(stmt, 3, data.wire(), data.size(), SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+  }
+
+  size_t
+  fetch(const Block& deviceName, sqlite3_int64 segment)
+  {
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(m_db, "SELECT content_object FROM File WHERE device_name=? AND segment=?",
+                       -1, &stmt, 0);
+    sqlite3_bind_blob(stmt, 1, deviceName.wire(), deviceName.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, segment);
+    size_t size = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      size = Buffer(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0)).size();
+    }
+    sqlite3_finalize(stmt);
+    return size;
+  }
+
+private:
+  sqlite3* m_db;
+};
+
+static uintmax_t
+getDiskUsage(const fs::path& dir, size_t& nFiles)
+{
+  uintmax_t size = 0;
+  nFiles = 0;
+  for (fs::recursive_directory_iterator file(dir), end; file != end; ++file) {
+    if (fs::is_regular_file(file->path())) {
+      size += fs::file_size(file->path());
+      ++nFiles;
+    }
+  }
+  return size;
+}
+
+// Benchmarks are disabled by default, run them explicitly, e.g.,
+//   ./build/unit-tests -t TestObjectStore/PackStoreBenchmark
+BOOST_AUTO_TEST_CASE(PackStoreBenchmark, *boost::unit_test::disabled())
+{
+  const int N_FILES = 500;
+  const int N_SEGMENTS = 8;
+  const int N_READS = 10000;
+
+  Name deviceName("/device");
+  Block deviceNameWire = deviceName.wireEncode();
+  std::vector<std::string> hashes;
+  std::vector<Block> segments;
+  for (int i = 0; i < N_FILES; i++) {
+    std::string value = std::to_string(i);
+    hashes.push_back(toHex(*util::Sha256::computeDigest(reinterpret_cast<const uint8_t*>(
+                                                          value.data()), value.size()), false));
+  }
+  for (int i = 0; i < N_SEGMENTS; i++) {
+    segments.push_back(makeSegment(deviceName, i, 1024, i)->wireEncode());
+  }
+
+  fs::path perFileDir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+  fs::path packDir = fs::unique_path(fs::temp_directory_path() / "%%%%-%%%%-%%%%-%%%%");
+
+  auto start = time::steady_clock::now();
+  for (const auto& hash : hashes) {
+    PerFileObjectDb db(perFileDir, hash);
+    for (int i = 0; i < N_SEGMENTS; i++) {
+      db.save(deviceNameWire, i, segments[i]);
+    }
+  }
+  auto perFileIngest = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+
+  ObjectStorePtr store = ObjectStore::open(packDir);
+  start = time::steady_clock::now();
+  for (const auto& hash : hashes) {
+    for (int i = 0; i < N_SEGMENTS; i++) {
+      store->saveContentObject(hash, deviceName, i, segments[i]);
+    }
+    store->markComplete(hash, deviceName);
+  }
+  store->flush();
+  auto packIngest = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+
+  // handles of the per-file databases are kept open, as ContentServer cached them
+  std::map<std::string, unique_ptr<PerFileObjectDb>> handles;
+  for (const auto& hash : hashes) {
+    handles[hash].reset(new PerFileObjectDb(perFileDir, hash));
+  }
+  size_t perFileBytes = 0;
+  start = time::steady_clock::now();
+  for (int i = 0; i < N_READS; i++) {
+    perFileBytes += handles[hashes[i * 7919 % N_FILES]]->fetch(deviceNameWire, i % N_SEGMENTS);
+  }
+  auto perFileReads = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+  handles.clear();
+
+  size_t packBytes = 0;
+  start = time::steady_clock::now();
+  for (int i = 0; i < N_READS; i++) {
+    ConstBufferPtr segment = store->fetchSegment(hashes[i * 7919 % N_FILES], deviceName,
+                                                 i % N_SEGMENTS);
+    packBytes += segment != nullptr ? segment->size() : 0;
+  }
+  auto packReads = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+  BOOST_CHECK_EQUAL(perFileBytes, packBytes);
+
+  size_t perFileFiles = 0;
+  size_t packFiles = 0;
+  uintmax_t perFileSize = getDiskUsage(perFileDir, perFileFiles);
+  uintmax_t packSize = getDiskUsage(packDir, packFiles);
+
+  BOOST_TEST_MESSAGE("per-file ObjectDb: ingest " << perFileIngest.count() / N_FILES
+                     << "us per file, read " << perFileReads.count() * 1000 / N_READS
+                     << "ns per segment, " << perFileFiles << " files, " << perFileSize
+                     << " bytes");
+  BOOST_TEST_MESSAGE("pack store: ingest " << packIngest.count() / N_FILES
+                     << "us per file, read " << packReads.count() * 1000 / N_READS
+                     << "ns per segment, " << packFiles << " files, " << packSize << " bytes");
+
+  fs::remove_all(perFileDir);
+  fs::remove_all(packDir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
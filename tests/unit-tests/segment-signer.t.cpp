@@ -0,0 +1,114 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "segment-signer.hpp"
+
+#include "test-common.hpp"
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+class SegmentSignerFixture
+{
+public:
+  SegmentSignerFixture()
+    : content(100 * 10)
+    , segments(100)
+  {
+    for (size_t i = 0; i < content.size(); i++) {
+      content[i] = static_cast<uint8_t>(i);
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+      segments[i].name = Name("/file/segment").appendSegment(i);
+      segments[i].buf = &content[i * 10];
+      segments[i].size = 10;
+    }
+  }
+
+  void
+  check(size_t nThreads)
+  {
+    SegmentSigner signer(nThreads, 3, signingWithSha256());
+    BOOST_CHECK_EQUAL(signer.getThreadCount(), nThreads);
+
+    std::vector<size_t> saved;
+    signer.sign(segments, [&] (size_t index, SegmentSigner::Segment& segment) {
+        saved.push_back(index);
+        BOOST_REQUIRE(segment.data != nullptr);
+        BOOST_CHECK_EQUAL(segment.data->getName(), segments[index].name);
+        BOOST_CHECK_EQUAL_COLLECTIONS(segment.data->getContent().value_begin(),
+                                      segment.data->getContent().value_end(),
+                                      segment.buf, segment.buf + segment.size);
+        BOOST_CHECK_EQUAL(segment.data->getSignature().getType(), tlv::DigestSha256);
+      });
+
+    BOOST_REQUIRE_EQUAL(saved.size(), segments.size());
+    for (size_t i = 0; i < segments.size(); i++) {
+      BOOST_CHECK_EQUAL(saved[i], i);
+      // released after it was saved
+      BOOST_CHECK(segments[i].data == nullptr);
+    }
+  }
+
+public:
+  std::vector<uint8_t> content;
+  std::vector<SegmentSigner::Segment> segments;
+};
+
+BOOST_FIXTURE_TEST_SUITE(TestSegmentSigner, SegmentSignerFixture)
+
+BOOST_AUTO_TEST_CASE(CallingThread)
+{
+  check(1);
+}
+
+BOOST_AUTO_TEST_CASE(ThreadPool)
+{
+  check(4);
+  // the signer can be reused for the next file
+  check(4);
+}
+
+BOOST_AUTO_TEST_CASE(SaveFails)
+{
+  SegmentSigner signer(4, 3, signingWithSha256());
+
+  size_t nSaved = 0;
+  BOOST_CHECK_THROW(signer.sign(segments, [&] (size_t index, SegmentSigner::Segment&) {
+                        if (index == 10) {
+                          BOOST_THROW_EXCEPTION(std::runtime_error("save failed"));
+                        }
+                        nSaved++;
+                      }),
+                    std::runtime_error);
+  BOOST_CHECK_EQUAL(nSaved, 10);
+
+  // the pool still signs after a failure
+  nSaved = 0;
+  signer.sign(segments, [&] (size_t, SegmentSigner::Segment&) { nSaved++; });
+  BOOST_CHECK_EQUAL(nSaved, segments.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
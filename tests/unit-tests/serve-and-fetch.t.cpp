@@ -131,7 +131,7 @@ BOOST_AUTO_TEST_CASE(TestServeAndFetch)
   _LOG_DEBUG("At time " << start << ", publish local file to database, this is extremely slow ...");
   // publish file to db
   ObjectManager om(ndnx_serve, root, APPNAME);
-  tuple<HashPtr, size_t> pub = om.localFileToObjects(filePath, deviceName);
+  tuple<HashPtr, size_t, size_t, bool, HashPtr> pub = om.localFileToObjects(filePath, deviceName);
   time_t end = time(NULL);
   _LOG_DEBUG("At time " << end << ", publish finally finished, used " << end - start
                         << " seconds ...");
@@ -123,6 +123,59 @@ BOOST_AUTO_TEST_CASE(TwoNodes)
   BOOST_CHECK_EQUAL(log2->LookupLocator(user2), loc2);
 }
 
+BOOST_AUTO_TEST_CASE(ReplyCache)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH) / "SyncCoreReplyCacheTest";
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  Name user1("/shuai");
+  Name loc1("/locator1");
+  Name syncPrefix("/broadcast/arslan");
+
+  Face& c1 = forwarder.addFace();
+  auto log1 = make_shared<SyncLog>(tmpdir.string(), user1);
+  auto core1 = make_shared<SyncCore>(c1, log1, user1, loc1, syncPrefix, bind(&callback, _1));
+
+  Face& c2 = forwarder.addFace();
+
+  advanceClocks(time::milliseconds(10), 100);
+
+  ConstBufferPtr oldDigest = core1->root();
+  core1->updateLocalState(1);
+  advanceClocks(time::milliseconds(10), 10);
+  BOOST_CHECK_EQUAL(core1->replyCacheMisses(), 1);
+
+  Name staleName(syncPrefix);
+  staleName.appendImplicitSha256Digest(oldDigest);
+
+  int nReplies = 0;
+  auto expressStale = [&] {
+    c2.expressInterest(Interest(staleName),
+                       [&] (const Interest&, const Data&) { ++nReplies; },
+                       [] (const Interest&, const lp::Nack&) {},
+                       [] (const Interest&) {});
+    advanceClocks(time::milliseconds(10), 10);
+  };
+
+  // several peers with the same stale digest get the same signed reply
+  for (int i = 0; i < 3; i++) {
+    expressStale();
+  }
+  BOOST_CHECK_EQUAL(nReplies, 3);
+  BOOST_CHECK_EQUAL(core1->replyCacheHits(), 3);
+  BOOST_CHECK_EQUAL(core1->replyCacheMisses(), 1);
+
+  // new root digest invalidates cached replies
+  core1->updateLocalState(2);
+  advanceClocks(time::milliseconds(10), 10);
+  expressStale();
+  BOOST_CHECK_EQUAL(nReplies, 4);
+  BOOST_CHECK_EQUAL(core1->replyCacheHits(), 3);
+  BOOST_CHECK_EQUAL(core1->replyCacheMisses(), 3);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 } // namespace tests
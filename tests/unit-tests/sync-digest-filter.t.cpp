@@ -0,0 +1,112 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+#include "sync-digest-filter.hpp"
+#include "sync-log.hpp"
+
+#include "test-common.hpp"
+
+#include <ndn-cxx/util/digest.hpp>
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+namespace fs = boost::filesystem;
+
+static ConstBufferPtr
+makeDigest(int i)
+{
+  std::string value = std::to_string(i);
+  return util::Sha256::computeDigest(reinterpret_cast<const uint8_t*>(value.data()), value.size());
+}
+
+BOOST_AUTO_TEST_SUITE(TestSyncDigestFilter)
+
+BOOST_AUTO_TEST_CASE(Basic)
+{
+  SyncDigestFilter filter(1000);
+  BOOST_CHECK_EQUAL(filter.capacity(), 1000);
+  BOOST_CHECK(!filter.mayContain(*makeDigest(0)));
+
+  for (int i = 0; i < 1000; i++) {
+    filter.insert(*makeDigest(i));
+  }
+  BOOST_CHECK_EQUAL(filter.size(), 1000);
+
+  // no false negatives
+  for (int i = 0; i < 1000; i++) {
+    BOOST_CHECK(filter.mayContain(*makeDigest(i)));
+  }
+
+  int nFalsePositives = 0;
+  for (int i = 1000; i < 11000; i++) {
+    if (filter.mayContain(*makeDigest(i))) {
+      nFalsePositives++;
+    }
+  }
+  BOOST_CHECK_LT(nFalsePositives, 300);
+
+  // digest of the empty state
+  filter.insert(Buffer(1));
+  BOOST_CHECK(filter.mayContain(Buffer(1)));
+
+  filter.reset(10);
+  BOOST_CHECK_EQUAL(filter.size(), 0);
+  BOOST_CHECK(!filter.mayContain(*makeDigest(0)));
+}
+
+BOOST_AUTO_TEST_CASE(SyncLogLookup)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  std::vector<ConstBufferPtr> digests;
+  {
+    SyncLog db(tmpdir, Name("/local"));
+    db.SetStateCacheSize(0);
+    for (int i = 1; i <= 2000; i++) {
+      db.UpdateDeviceSeqNo(Name("/device"), i);
+      digests.push_back(db.RememberStateInStateLog());
+    }
+
+    // the filter has been rebuilt with a larger capacity on the way
+    for (const auto& digest : digests) {
+      BOOST_CHECK_GT(db.LookupSyncLog(*digest), 0);
+    }
+    BOOST_CHECK_EQUAL(db.LookupSyncLog(*makeDigest(0)), 0);
+  }
+
+  // the filter is rebuilt from the database
+  SyncLog db(tmpdir, Name("/local"));
+  db.SetStateCacheSize(0);
+  for (const auto& digest : digests) {
+    BOOST_CHECK_GT(db.LookupSyncLog(*digest), 0);
+  }
+  BOOST_CHECK_EQUAL(db.LookupSyncLog(*makeDigest(0)), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
@@ -0,0 +1,129 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/**
+ * Copyright (c) 2013-2017, Regents of the University of California.
+ *
+ * This file is part of ChronoShare, a decentralized file sharing application over NDN.
+ *
+ * ChronoShare is free software: you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * ChronoShare is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received copies of the GNU General Public License along with
+ * ChronoShare, e.g., in COPYING.md file.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * See AUTHORS.md for complete list of ChronoShare authors and contributors.
+ */
+
+
+#include "sync-digest-tree.hpp"
+
+#include "test-common.hpp"
+
+#include <ndn-cxx/util/digest.hpp>
+
+namespace ndn {
+namespace chronoshare {
+namespace tests {
+
+static Buffer
+makeDeviceName(int i)
+{
+  Block wire = Name("/device").appendNumber(i).wireEncode();
+  return Buffer(wire.wire(), wire.size());
+}
+
+BOOST_AUTO_TEST_SUITE(TestSyncDigestTree)
+
+BOOST_AUTO_TEST_CASE(Basic)
+{
+  SyncDigestTree tree;
+  BOOST_CHECK_EQUAL(tree.getRoot()->size(), 1);
+  BOOST_CHECK_EQUAL(tree.getRoot()->at(0), 0);
+
+  // a single device is the root
+  tree.update(makeDeviceName(1), 5);
+  int64_t seqNo = 5;
+  util::Sha256 leaf;
+  leaf.update(makeDeviceName(1).buf(), makeDeviceName(1).size());
+  leaf.update(reinterpret_cast<const uint8_t*>(&seqNo), sizeof(seqNo));
+  BOOST_CHECK_EQUAL(toHex(*tree.getRoot()), toHex(*leaf.computeDigest()));
+
+  tree.update(makeDeviceName(2), 1);
+  BOOST_CHECK_EQUAL(tree.size(), 2);
+  ConstBufferPtr root = tree.getRoot();
+  tree.update(makeDeviceName(2), 2);
+  BOOST_CHECK_NE(toHex(*tree.getRoot()), toHex(*root));
+  tree.update(makeDeviceName(2), 1);
+  BOOST_CHECK_EQUAL(toHex(*tree.getRoot()), toHex(*root));
+}
+
+BOOST_AUTO_TEST_CASE(IncrementalUpdates)
+{
+  SyncDigestTree tree;
+  std::map<int, int64_t> state;
+  for (int i = 0; i < 1000; i++) {
+    int device = i * 7919 % 37;
+    state[device] = i;
+    tree.update(makeDeviceName(device), i);
+
+    if (i % 10 == 0) {
+      // the same state gives the same root regardless of the order of updates
+      SyncDigestTree fresh;
+      for (auto node = state.rbegin(); node != state.rend(); ++node) {
+        fresh.update(makeDeviceName(node->first), node->second);
+      }
+      BOOST_CHECK_EQUAL(toHex(*tree.getRoot()), toHex(*fresh.getRoot()));
+    }
+  }
+  BOOST_CHECK_EQUAL(tree.size(), 37);
+}
+
+// Benchmarks are disabled by default, run them explicitly, e.g.,
+//   ./build/unit-tests -t TestSyncDigestTree/UpdateBenchmark
+BOOST_AUTO_TEST_CASE(UpdateBenchmark, *boost::unit_test::disabled())
+{
+  // compares updating one device with hashing the whole state, as SyncLog did before the tree
+  const int N_UPDATES = 1000;
+  for (int nDevices : {10, 1000, 10000}) {
+    SyncDigestTree tree;
+    std::map<Buffer, int64_t> state;
+    for (int i = 0; i < nDevices; i++) {
+      tree.update(makeDeviceName(i), 1);
+      state[makeDeviceName(i)] = 1;
+    }
+    tree.getRoot();
+
+    auto start = time::steady_clock::now();
+    for (int i = 0; i < N_UPDATES; i++) {
+      tree.update(makeDeviceName(i * 7919 % nDevices), i + 2);
+      tree.getRoot();
+    }
+    auto treeTime = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+
+    start = time::steady_clock::now();
+    for (int i = 0; i < N_UPDATES; i++) {
+      state[makeDeviceName(i * 7919 % nDevices)] = i + 2;
+      util::Sha256 digest;
+      for (const auto& node : state) {
+        digest.update(node.first.buf(), node.first.size());
+        digest.update(reinterpret_cast<const uint8_t*>(&node.second), sizeof(node.second));
+      }
+      digest.computeDigest();
+    }
+    auto fullTime = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+
+    BOOST_CHECK_EQUAL(tree.size(), nDevices);
+    BOOST_TEST_MESSAGE(nDevices << " devices: tree " << treeTime.count() / N_UPDATES
+                       << "us, full hash " << fullTime.count() / N_UPDATES << "us per update");
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace tests
+} // namespace chronoshare
+} // namespace ndn
@@ -22,12 +22,43 @@
 
 #include "test-common.hpp"
 
+#include <future>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
 namespace ndn {
 namespace chronoshare {
 namespace tests {
 
 namespace fs = boost::filesystem;
 
+class SyncLogWithSqlDigest : public SyncLog
+{
+public:
+  using SyncLog::SyncLog;
+
+  std::string
+  calculateDigestInSql()
+  {
+    // SyncNodes is updated by the writer thread
+    waitForWrites();
+
+    Statement stmt(*this, "SELECT hash(device_name, seq_no) "
+                          "  FROM (SELECT * FROM SyncNodes ORDER BY device_name)");
+    sqlite3_step(stmt);
+    return toHex(reinterpret_cast<const uint8_t*>(sqlite3_column_blob(stmt, 0)),
+                 sqlite3_column_bytes(stmt, 0));
+  }
+
+  void
+  execute(const std::string& sql)
+  {
+    waitForWrites();
+    BOOST_REQUIRE_EQUAL(sqlite3_exec(m_db, sql.c_str(), NULL, NULL, NULL), SQLITE_OK);
+  }
+};
+
 BOOST_FIXTURE_TEST_SUITE(TestSyncLog, IdentityManagementTimeFixture)
 
 BOOST_AUTO_TEST_CASE(BasicDatabaseTest)
@@ -99,10 +130,10 @@ BOOST_AUTO_TEST_CASE(BasicDatabaseTest)
   db.UpdateDeviceSeqNo(Name("/shuai"), 1);
   hash = db.RememberStateInStateLog();
   BOOST_CHECK_EQUAL(toHex(*hash),
-                    "602FF1878FC394B90E4A0E90C7409EA4B8EE8AA40169801D62F838470551DB7C");
+                    "55640BF6B63534C20803CCC4854E8AD84D978409EAA24156E4B0BD8071499FDC");
 
   msg = db.FindStateDifferences("00",
-                                "602FF1878FC394B90E4A0E90C7409EA4B8EE8AA40169801D62F838470551DB7C");
+                                "55640BF6B63534C20803CCC4854E8AD84D978409EAA24156E4B0BD8071499FDC");
   BOOST_CHECK_EQUAL(msg->state_size(), 2);
   BOOST_CHECK_EQUAL(msg->state(0).type(), SyncState::UPDATE);
   BOOST_CHECK_EQUAL(msg->state(0).seq(), 2);
@@ -111,6 +142,504 @@ BOOST_AUTO_TEST_CASE(BasicDatabaseTest)
   BOOST_CHECK_EQUAL(msg->state(1).seq(), 1);
 }
 
+BOOST_AUTO_TEST_CASE(DevicesAfterRestart)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  ConstBufferPtr oldHash;
+  ConstBufferPtr newHash;
+  {
+    SyncLog db(tmpdir, Name("/lijing"));
+    oldHash = db.RememberStateInStateLog();
+    db.UpdateDeviceSeqNo(Name("/shuai"), 5);
+    db.UpdateLocator(Name("/shuai"), Name("/hawaii"));
+    newHash = db.RememberStateInStateLog();
+  }
+
+  // names and locators are restored into memory
+  SyncLog db(tmpdir, Name("/lijing"));
+  BOOST_CHECK_EQUAL(db.LookupLocator(Name("/shuai")), Name("/hawaii"));
+  BOOST_CHECK_EQUAL(db.LookupLocator(Name("/unknown")), Name());
+
+  SyncStateMsgPtr msg = db.FindStateDifferences(*oldHash, *newHash);
+  BOOST_REQUIRE_EQUAL(msg->state_size(), 1);
+  BOOST_CHECK_EQUAL(Name(Block(reinterpret_cast<const uint8_t*>(msg->state(0).name().data()),
+                               msg->state(0).name().size())),
+                    Name("/shuai"));
+  BOOST_CHECK_EQUAL(Name(Block(reinterpret_cast<const uint8_t*>(msg->state(0).locator().data()),
+                               msg->state(0).locator().size())),
+                    Name("/hawaii"));
+  BOOST_CHECK_EQUAL(msg->state(0).seq(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(ExistingDevices)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  {
+    SyncLog db(tmpdir, Name("/lijing"));
+    db.UpdateLocalSeqNo(3);
+    db.RememberStateInStateLog();
+  }
+
+  sqlite3* raw = nullptr;
+  BOOST_REQUIRE_EQUAL(sqlite3_open((tmpdir / ".chronoshare" / "sync-log.db").c_str(), &raw),
+                      SQLITE_OK);
+  // SyncNodes were updated by this trigger in previous versions
+  BOOST_REQUIRE_EQUAL(sqlite3_exec(raw, "CREATE TRIGGER SyncNodesUpdater_trigger "
+                                        "  BEFORE INSERT ON SyncNodes FOR EACH ROW "
+                                        "  BEGIN SELECT RAISE(IGNORE); END;",
+                                   NULL, NULL, NULL),
+                      SQLITE_OK);
+  sqlite3_close(raw);
+
+  {
+    SyncLogWithSqlDigest db(tmpdir, Name("/lijing"));
+    BOOST_CHECK_EQUAL(db.SeqNo(Name("/lijing")), 3);
+    db.UpdateDeviceSeqNo(Name("/shuai"), 1);
+    BOOST_CHECK_EQUAL(toHex(*db.RememberStateInStateLog()), db.calculateDigestInSql());
+  }
+
+  BOOST_REQUIRE_EQUAL(sqlite3_open((tmpdir / ".chronoshare" / "sync-log.db").c_str(), &raw),
+                      SQLITE_OK);
+  sqlite3_stmt* stmt = nullptr;
+  sqlite3_prepare_v2(raw, "SELECT (SELECT COUNT(*) FROM sqlite_master "
+                          "         WHERE name='SyncNodesUpdater_trigger'), "
+                          "       COUNT(*), COUNT(DISTINCT device_name) FROM SyncNodes",
+                     -1, &stmt, 0);
+  BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+  BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 0), 0);
+  BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 1), 2);
+  BOOST_CHECK_EQUAL(sqlite3_column_int(stmt, 2), 2);
+  sqlite3_finalize(stmt);
+  sqlite3_close(raw);
+}
+
+BOOST_AUTO_TEST_CASE(FailedWrites)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  ConstBufferPtr firstHash;
+  ConstBufferPtr lastHash;
+  {
+    SyncLogWithSqlDigest db(tmpdir, Name("/lijing"));
+    db.UpdateDeviceSeqNo(Name("/shuai"), 1);
+    firstHash = db.RememberStateInStateLog();
+
+    db.execute("CREATE TABLE FailWrites (x);"
+               "INSERT INTO FailWrites VALUES (1);"
+               "CREATE TRIGGER FailSyncLog BEFORE INSERT ON SyncLog "
+               "  WHEN EXISTS (SELECT * FROM FailWrites) "
+               "  BEGIN SELECT RAISE(ABORT, 'injected failure'); END;"
+               "CREATE TRIGGER FailSyncNodes BEFORE UPDATE ON SyncNodes "
+               "  WHEN EXISTS (SELECT * FROM FailWrites) "
+               "  BEGIN SELECT RAISE(ABORT, 'injected failure'); END;");
+
+    db.UpdateDeviceSeqNo(Name("/shuai"), 2);
+    db.UpdateLocator(Name("/shuai"), Name("/hawaii"));
+    ConstBufferPtr lostHash = db.RememberStateInStateLog();
+    db.waitForWrites();
+    // the state could not be recorded
+    BOOST_CHECK_EQUAL(db.LookupSyncLog(*lostHash), 0);
+
+    db.execute("DELETE FROM FailWrites");
+    db.UpdateDeviceSeqNo(Name("/alex"), 1);
+    lastHash = db.RememberStateInStateLog();
+
+    // the failed seq_no update has been written with the next one
+    BOOST_CHECK_EQUAL(toHex(*lastHash), db.calculateDigestInSql());
+    BOOST_CHECK_GT(db.LookupSyncLog(*lastHash), 0);
+  }
+
+  SyncLog db(tmpdir, Name("/lijing"));
+  BOOST_CHECK_EQUAL(db.LookupLocator(Name("/shuai")), Name("/hawaii"));
+
+  // the state after the lost one is restored with both changes
+  SyncStateMsgPtr msg = db.FindStateDifferences(*firstHash, *lastHash);
+  BOOST_CHECK_EQUAL(msg->state_size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(IncrementalDigest)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  {
+    SyncLogWithSqlDigest db(tmpdir, Name("/local"));
+    for (int i = 0; i < 1000; i++) {
+      db.UpdateDeviceSeqNo(Name("/device").appendNumber(i * 7919 % 1000), i % 13 + 1);
+      if (i % 100 == 0) {
+        BOOST_CHECK_EQUAL(toHex(*db.RememberStateInStateLog()), db.calculateDigestInSql());
+      }
+    }
+    db.UpdateDeviceSeqNo(Name("/device").appendNumber(1), 1); // does not decrease seq_no
+    db.UpdateLocalSeqNo(10);
+    // local seq_no is written into SyncNodes together with the state
+    std::string digest = toHex(*db.RememberStateInStateLog());
+    BOOST_CHECK_EQUAL(digest, db.calculateDigestInSql());
+  }
+
+  // state is restored from the database
+  SyncLogWithSqlDigest db(tmpdir, Name("/local"));
+  BOOST_CHECK_EQUAL(toHex(*db.RememberStateInStateLog()), db.calculateDigestInSql());
+  BOOST_CHECK_EQUAL(db.LogSize(), 11);
+}
+
+BOOST_AUTO_TEST_CASE(DeltaEncodedStates)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  SyncLog db(tmpdir, Name("/local"));
+
+  // enough states to cross several checkpoints
+  std::vector<ConstBufferPtr> digests;
+  std::vector<std::map<Name, sqlite3_int64>> states;
+  std::map<Name, sqlite3_int64> state;
+  state[Name("/local")] = 0;
+  for (int i = 0; i < 250; i++) {
+    Name device = Name("/device").appendNumber(i % 10);
+    state[device] = i / 10 + 1;
+    db.UpdateDeviceSeqNo(device, i / 10 + 1);
+    digests.push_back(db.RememberStateInStateLog());
+    states.push_back(state);
+  }
+
+  std::vector<std::pair<int, int>> pairs = {{0, 249}, {37, 151}, {151, 37}, {99, 100}, {200, 200}};
+  for (const auto& pair : pairs) {
+    SyncStateMsgPtr msg = db.FindStateDifferences(*digests[pair.first], *digests[pair.second], true);
+
+    std::map<Name, sqlite3_int64> diff;
+    for (int i = 0; i < msg->state_size(); i++) {
+      BOOST_REQUIRE_EQUAL(msg->state(i).type(), SyncState::UPDATE);
+      Name device(Block(reinterpret_cast<const uint8_t*>(msg->state(i).name().data()),
+                        msg->state(i).name().size()));
+      BOOST_CHECK_EQUAL(msg->state(i).old_seq(), states[pair.first][device]);
+      diff[device] = msg->state(i).seq();
+    }
+
+    std::map<Name, sqlite3_int64> expected;
+    for (const auto& node : states[pair.second]) {
+      if (states[pair.first][node.first] != node.second) {
+        expected[node.first] = node.second;
+      }
+    }
+    BOOST_CHECK(diff == expected);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(Compaction)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  SyncLog db(tmpdir, Name("/local"));
+
+  SyncLog::RetentionPolicy policy;
+  policy.maxStates = 50;
+  policy.maxAge = time::seconds::zero();
+  db.SetRetentionPolicy(policy);
+
+  std::vector<ConstBufferPtr> digests;
+  for (int i = 0; i < 250; i++) {
+    db.UpdateDeviceSeqNo(Name("/device").appendNumber(i % 10), i / 10 + 1);
+    digests.push_back(db.RememberStateInStateLog());
+  }
+  BOOST_CHECK_EQUAL(db.LogSize(), 250);
+
+  int nSteps = 0;
+  while (db.Compact(30)) {
+    nSteps++;
+  }
+  BOOST_CHECK_EQUAL(nSteps, 6);
+  BOOST_CHECK_EQUAL(db.LogSize(), 50);
+  BOOST_CHECK(!db.Compact(30));
+
+  // removed states are unknown (peers will use RECOVER)
+  BOOST_CHECK_EQUAL(db.LookupSyncLog(*digests[199]), 0);
+  BOOST_CHECK_GT(db.LookupSyncLog(*digests[200]), 0);
+
+  // the oldest remaining state has been made a checkpoint, so diffs are still complete
+  SyncStateMsgPtr msg = db.FindStateDifferences(*digests[200], *digests[249]);
+  BOOST_CHECK_EQUAL(msg->state_size(), 10);
+
+  msg = db.FindStateDifferences(Buffer(), *digests[200]);
+  BOOST_CHECK_EQUAL(msg->state_size(), 11);
+  for (int i = 0; i < msg->state_size(); i++) {
+    BOOST_CHECK_EQUAL(msg->state(i).type(), SyncState::UPDATE);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(CompactionFailure)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  SyncLogWithSqlDigest db(tmpdir, Name("/local"));
+
+  SyncLog::RetentionPolicy policy;
+  policy.maxStates = 50;
+  policy.maxAge = time::seconds::zero();
+  db.SetRetentionPolicy(policy);
+
+  std::vector<ConstBufferPtr> digests;
+  for (int i = 0; i < 100; i++) {
+    db.UpdateDeviceSeqNo(Name("/device").appendNumber(i % 10), i / 10 + 1);
+    digests.push_back(db.RememberStateInStateLog());
+  }
+
+  db.execute("CREATE TRIGGER FailCompaction BEFORE DELETE ON SyncLog "
+             "  BEGIN SELECT RAISE(ABORT, 'injected failure'); END;");
+  BOOST_CHECK_THROW(db.Compact(100), DbHelper::Error);
+  BOOST_CHECK_EQUAL(db.LogSize(), 100);
+
+  // the checkpoint made for the compaction has been rolled back together with it
+  db.SetStateCacheSize(0);
+  SyncStateMsgPtr msg = db.FindStateDifferences(*digests[49], *digests[50]);
+  BOOST_CHECK_EQUAL(msg->state_size(), 1);
+
+  db.execute("DROP TRIGGER FailCompaction");
+  BOOST_CHECK(!db.Compact(100));
+  BOOST_CHECK_EQUAL(db.LogSize(), 50);
+  msg = db.FindStateDifferences(*digests[50], *digests[99]);
+  BOOST_CHECK_EQUAL(msg->state_size(), 10);
+}
+
+BOOST_AUTO_TEST_CASE(CompactionWithUpdates)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  SyncLog db(tmpdir, Name("/local"));
+  // lookups of states go through the digest filter
+  db.SetStateCacheSize(0);
+
+  SyncLog::RetentionPolicy policy;
+  policy.maxStates = 1000;
+  policy.maxAge = time::seconds::zero();
+  db.SetRetentionPolicy(policy);
+
+  std::vector<ConstBufferPtr> digests;
+  for (int i = 0; i < 2000; i++) {
+    db.UpdateDeviceSeqNo(Name("/device").appendNumber(i % 10), i / 10 + 1);
+    digests.push_back(db.RememberStateInStateLog());
+  }
+
+  // states recorded during the compaction and the rebuild of the digest filter stay known
+  auto updates = std::async(std::launch::async, [&] {
+    std::vector<ConstBufferPtr> newDigests;
+    for (int i = 2000; i < 4000; i++) {
+      db.UpdateDeviceSeqNo(Name("/device").appendNumber(i % 10), i / 10 + 1);
+      newDigests.push_back(db.RememberStateInStateLog());
+    }
+    return newDigests;
+  });
+  while (db.Compact(10)) {
+  }
+  for (const auto& digest : updates.get()) {
+    digests.push_back(digest);
+  }
+  db.waitForWrites();
+
+  BOOST_CHECK_EQUAL(db.LookupSyncLog(*digests.front()), 0);
+  int nUnknown = 0;
+  for (size_t i = 3000; i < digests.size(); i++) {
+    if (db.LookupSyncLog(*digests[i]) == 0) {
+      nUnknown++;
+    }
+  }
+  BOOST_CHECK_EQUAL(nUnknown, 0);
+}
+
+// Benchmarks are disabled by default, run them explicitly, e.g.,
+//   ./build/unit-tests -t TestSyncLog/StateDifferencesBenchmark
+BOOST_AUTO_TEST_CASE(StateDifferencesBenchmark, *boost::unit_test::disabled())
+{
+  // compares restoring states from the database with the in-memory state cache
+  for (int nDevices : {10, 100, 500}) {
+    fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+    if (exists(tmpdir)) {
+      remove_all(tmpdir);
+    }
+
+    SyncLog db(tmpdir, Name("/local"));
+    for (int i = 0; i < nDevices; i++) {
+      db.UpdateDeviceSeqNo(Name("/device").appendNumber(i), 1);
+    }
+
+    std::vector<ConstBufferPtr> digests;
+    for (int i = 0; i < 150; i++) {
+      db.UpdateDeviceSeqNo(Name("/device").appendNumber(i * 7 % nDevices), i + 2);
+      digests.push_back(db.RememberStateInStateLog());
+    }
+
+    auto runDiffs = [&] (std::vector<std::string>& results) {
+      auto start = time::steady_clock::now();
+      for (size_t i = 0; i < digests.size(); i++) {
+        SyncStateMsgPtr msg = db.FindStateDifferences(*digests[i * 31 % digests.size()],
+                                                      *digests.back(), true);
+        results.push_back(msg->SerializeAsString());
+      }
+      return time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+    };
+
+    std::vector<std::string> sqlResults;
+    db.SetStateCacheSize(0);
+    time::microseconds sqlTime = runDiffs(sqlResults);
+
+    std::vector<std::string> cachedResults;
+    db.SetStateCacheSize(1000);
+    runDiffs(cachedResults); // warm up
+    cachedResults.clear();
+    time::microseconds cachedTime = runDiffs(cachedResults);
+
+    BOOST_CHECK(sqlResults == cachedResults);
+    BOOST_TEST_MESSAGE(nDevices << " devices: database " << sqlTime.count() << "us, cache "
+                       << cachedTime.count() << "us for " << digests.size() << " diffs");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(LocalSeqNoBlocks)
+{
+  fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+  if (exists(tmpdir)) {
+    remove_all(tmpdir);
+  }
+
+  {
+    SyncLog db(tmpdir, Name("/local"));
+    db.SetLocalSeqNoBlockSize(10);
+    for (int i = 1; i <= 15; i++) {
+      BOOST_CHECK_EQUAL(db.GetNextLocalSeqNo(), i);
+    }
+  }
+
+  // unused seq_nos are given back on clean shutdown
+  {
+    SyncLog db(tmpdir, Name("/local"));
+    BOOST_CHECK_EQUAL(db.SeqNo(Name("/local")), 15);
+    BOOST_CHECK_EQUAL(db.GetNextLocalSeqNo(), 16);
+  }
+
+  // the process is terminated without destroying SyncLog
+  pid_t pid = fork();
+  BOOST_REQUIRE(pid >= 0);
+  if (pid == 0) {
+    SyncLog* db = new SyncLog(tmpdir, Name("/local"));
+    db->SetLocalSeqNoBlockSize(10);
+    for (int i = 17; i <= 25; i++) {
+      db->GetNextLocalSeqNo();
+    }
+    _exit(0);
+  }
+  int status = 0;
+  BOOST_REQUIRE_EQUAL(waitpid(pid, &status, 0), pid);
+  BOOST_REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // seq_nos 17..26 might have been published, so none of them are reused
+  SyncLog db(tmpdir, Name("/local"));
+  BOOST_CHECK_EQUAL(db.SeqNo(Name("/local")), 26);
+  BOOST_CHECK_EQUAL(db.GetNextLocalSeqNo(), 27);
+}
+
+BOOST_AUTO_TEST_CASE(LocalSeqNoBenchmark, *boost::unit_test::disabled())
+{
+  const int N_UPDATES = 10000;
+
+  for (size_t blockSize : {1, 100}) {
+    fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+    if (exists(tmpdir)) {
+      remove_all(tmpdir);
+    }
+
+    SyncLog db(tmpdir, Name("/local"));
+    db.SetLocalSeqNoBlockSize(blockSize);
+
+    auto start = time::steady_clock::now();
+    for (int i = 0; i < N_UPDATES; i++) {
+      db.GetNextLocalSeqNo();
+    }
+    db.waitForWrites();
+    auto time = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+
+    BOOST_CHECK_EQUAL(db.SeqNo(Name("/local")), N_UPDATES);
+    BOOST_TEST_MESSAGE(N_UPDATES << " local seq_nos, block size " << blockSize << ": "
+                       << time.count() / N_UPDATES << "us per seq_no");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(DeltaEncodedStatesBenchmark, *boost::unit_test::disabled())
+{
+  // compares storing every state in full, as before delta encoding, with the default interval
+  const int N_DEVICES = 100;
+  const int N_STATES = 2000;
+  const int N_DIFFS = 500;
+
+  for (int interval : {1, 100}) {
+    fs::path tmpdir = fs::unique_path(UNIT_TEST_CONFIG_PATH);
+    if (exists(tmpdir)) {
+      remove_all(tmpdir);
+    }
+
+    time::microseconds diffTime;
+    {
+      SyncLog db(tmpdir, Name("/local"));
+      db.SetCheckpointInterval(interval);
+      db.SetStateCacheSize(0);
+
+      std::vector<ConstBufferPtr> digests;
+      for (int i = 0; i < N_STATES; i++) {
+        db.UpdateDeviceSeqNo(Name("/device").appendNumber(i % N_DEVICES), i / N_DEVICES + 1);
+        digests.push_back(db.RememberStateInStateLog());
+      }
+      db.waitForWrites();
+
+      auto start = time::steady_clock::now();
+      for (int i = 0; i < N_DIFFS; i++) {
+        // peers are usually a few states behind
+        int newState = N_STATES - 1 - i % 50;
+        int oldState = std::max(0, newState - 1 - i * 7 % 200);
+        db.FindStateDifferences(*digests[oldState], *digests[newState]);
+      }
+      diffTime = time::duration_cast<time::microseconds>(time::steady_clock::now() - start);
+    }
+
+    sqlite3* raw = nullptr;
+    sqlite3_open((tmpdir / ".chronoshare" / "sync-log.db").c_str(), &raw);
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(raw, "SELECT (SELECT count(*) FROM SyncStateNodes), "
+                            "       (SELECT page_count FROM pragma_page_count()) * "
+                            "       (SELECT page_size FROM pragma_page_size())",
+                       -1, &stmt, 0);
+    BOOST_REQUIRE_EQUAL(sqlite3_step(stmt), SQLITE_ROW);
+    BOOST_TEST_MESSAGE(N_STATES << " states of " << N_DEVICES << " devices, checkpoint interval "
+                       << interval << ": " << sqlite3_column_int64(stmt, 0) << " rows, "
+                       << sqlite3_column_int64(stmt, 1) << " bytes, "
+                       << diffTime.count() / N_DIFFS << "us per diff");
+    sqlite3_finalize(stmt);
+    sqlite3_close(raw);
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 } // namespace tests